@@ -16,6 +16,7 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -24,10 +25,16 @@
 #include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 #include <fcntl.h>
 #include <stdint.h>
 #include <gtk/gtk.h>
 #include "panalyzer.h"
+#include "pantrigger.h"
+#include "pancount.h"
+#include "panuser.h"
+#include "panclient.h"
 
 GtkEntry *Status[4];
 GtkWidget *DrawingArea;
@@ -43,15 +50,26 @@ typedef struct sigdata_s *sigdata_p;
 
 int num_samples;
 sigdata_p sigdata;
-uint32_t *tracedata;
 int sigcnt;
+pantrans_t *glitchdata;		// levels is the channels that glitched on sample
+int glitchcnt;
+panregion_t regions[PAN_MAX_REGIONS];
+pangap_t *gaps;
+panseg_t *segs;
+uint32_t *counts;
+int num_counts;
+sigdata_p seg_sigdata[PAN_MAX_SEGMENTS];
+int seg_sigcnt[PAN_MAX_SEGMENTS];
+int cur_seg;
 int zoom_down;
 int zooming;
 int cursor1;
 int cursor2;
 int trigger_position = 0;
-int buffer_size = 10000;
+int buffer_ms = 10;
 int run_mode = 0;
+int user_backend = 0;		// Capture with panuser.h rather than the driver
+int from_user = 0;			// The capture shown came from panuser.h
 
 panctl_t panctl;
 panctl_t prev_panctl = DEF_PANCTL;
@@ -93,6 +111,8 @@ static int surface_width;
 static void error_dialog(const char *fmt, ...);
 static void do_draw(GtkWidget *widget);
 static void prepopulate_data(void);
+static void free_capture(void);
+static void set_num_records(void);
 
 static int
 sam2pix(view_t *view, int sample)
@@ -125,14 +145,20 @@ static void set_status(int entry, const char *fmt, ...)
     gtk_entry_set_text(Status[entry], str);
 }
 
+// Microseconds per sample in the capture being displayed
+static double sample_period(void)
+{
+	return 1000000.0 / PAN_SAMPLE_RATE(&prev_panctl);
+}
+
 static void update_delta(void)
 {
-	int delta = abs(cursor2 - cursor1);
+	double delta = abs(cursor2 - cursor1) * sample_period();
 
 	if (delta > 1000)
-		set_status(2, "delta %.3fms", (float)delta/1000);
+		set_status(2, "delta %.3fms", delta/1000);
 	else
-		set_status(2, "delta %dus", delta);
+		set_status(2, "delta %gus", delta);
 }
 
 static void
@@ -416,12 +442,7 @@ static void error_dialog(const char *fmt, ...)
 
 static void prepopulate_data(void)
 {
-	if (tracedata)
-		free(tracedata);
-	if (sigdata)
-		free(sigdata);
-	tracedata = NULL;
-	sigdata = NULL;
+	free_capture();
 
 	memcpy(&panctl, &def_panctl, sizeof(panctl));
 	memcpy(&prev_panctl, &def_panctl, sizeof(panctl));
@@ -462,6 +483,153 @@ static void do_draw_trigger(GtkWidget *widget, cairo_t *cr, view_p view,
 	cairo_set_source_rgb(cr, 0, 0, 0);
 }
 
+// Shade the samples the driver had to fill in while interrupts were enabled
+static void do_draw_gaps(cairo_t *cr, view_p view)
+{
+	int top = view->top;
+	int bot = top + sizeof(channels) * view->spacing;
+	int i, x1, x2;
+
+	cairo_set_source_rgb(cr, 0.85, 0.85, 0.85);
+	for (i = 0; i < prev_panctl.num_gaps; i++) {
+		if (gaps[i].sample + gaps[i].missed < view->first_sample || gaps[i].sample > view->last_sample)
+			continue;
+		x1 = sam2pix(view, gaps[i].sample < view->first_sample ? view->first_sample : gaps[i].sample);
+		x2 = sam2pix(view, gaps[i].sample + gaps[i].missed > view->last_sample ?
+				view->last_sample : gaps[i].sample + gaps[i].missed);
+		// Keep even the shortest gap visible
+		cairo_rectangle(cr, x1, top, x2 > x1 ? x2 - x1 : 1, bot - top + view->tails);
+		cairo_fill(cr);
+	}
+	cairo_set_source_rgb(cr, 0, 0, 0);
+}
+
+// Tint the dual rate regions that only kept 1 in decimate samples
+static void do_draw_regions(cairo_t *cr, view_p view)
+{
+	int top = view->top;
+	int bot = top + sizeof(channels) * view->spacing;
+	int i, x1, x2;
+	uint32_t end;
+
+	cairo_set_source_rgb(cr, 0.92, 0.92, 1.0);
+	for (i = 0; i < prev_panctl.num_regions; i++) {
+		end = regions[i].sample + regions[i].samples * regions[i].step;
+		if (regions[i].step == 1 || end < view->first_sample || regions[i].sample > view->last_sample)
+			continue;
+		x1 = sam2pix(view, regions[i].sample < view->first_sample ? view->first_sample : regions[i].sample);
+		x2 = sam2pix(view, end > view->last_sample ? view->last_sample : end);
+		cairo_rectangle(cr, x1, top, x2 > x1 ? x2 - x1 : 1, bot - top + view->tails);
+		cairo_fill(cr);
+	}
+	cairo_set_source_rgb(cr, 0, 0, 0);
+}
+
+// One box per segment under the preview, with the one being shown in red
+static void do_draw_segments(cairo_t *cr)
+{
+	int y = preview.top + sizeof(channels) * preview.spacing + preview.tails + 2;
+	int width = surface_width - preview.left_margin - preview.right_margin;
+	int i, x1, x2;
+
+	for (i = 0; i < prev_panctl.segments_filled; i++) {
+		x1 = preview.left_margin + width * i / prev_panctl.segments_filled;
+		x2 = preview.left_margin + width * (i + 1) / prev_panctl.segments_filled - 1;
+		if (i == cur_seg)
+			cairo_set_source_rgb(cr, 1.0, 0.25, 0.25);
+		else
+			cairo_set_source_rgb(cr, 0.75, 0.75, 0.75);
+		cairo_rectangle(cr, x1, y, x2 > x1 ? x2 - x1 : 1, 3);
+		cairo_fill(cr);
+	}
+	cairo_set_source_rgb(cr, 0, 0, 0);
+}
+
+/*
+ * In counter mode each channel's trace is a graph of its rising edges per
+ * second, a step per gate window, scaled to its busiest window; the peak
+ * rate is written under the trace in the main view.
+ */
+static void do_draw_counts(cairo_t *cr, view_p view)
+{
+	int words = PAN_COUNT_BYTES(pan_count_channels(prev_panctl.channel_mask)) / sizeof(uint32_t);
+	double rate = prev_panctl.achieved_rate ? prev_panctl.achieved_rate : PAN_SAMPLE_RATE(&prev_panctl);
+	int chan, idx, i, x1, x2, y, started;
+	pancount_t *r;
+	pancount_ch_t *ch;
+	double hz, peak;
+	char txt[32];
+
+	cairo_set_font_size(cr, 8);
+	for (chan = 0; chan < sizeof(channels); chan++) {
+		int logic0 = view->top + (chan+1) * view->spacing;
+
+		if (!(prev_panctl.channel_mask & (1 << channels[chan])))
+			continue;
+		idx = pan_count_channels(prev_panctl.channel_mask & ((1 << channels[chan]) - 1));
+		peak = 0;
+		for (i = 0; i < num_counts; i++) {
+			r = (pancount_t *)(counts + i * words);
+			ch = (pancount_ch_t *)(r + 1);
+			hz = r->samples ? ch[idx].rising * rate / r->samples : 0;
+			if (hz > peak)
+				peak = hz;
+		}
+		started = 0;
+		for (i = 0; i < num_counts; i++) {
+			r = (pancount_t *)(counts + i * words);
+			ch = (pancount_ch_t *)(r + 1);
+			if (r->sample + r->samples < view->first_sample || r->sample > view->last_sample)
+				continue;
+			x1 = sam2pix(view, r->sample < view->first_sample ? view->first_sample : r->sample);
+			x2 = sam2pix(view, r->sample + r->samples > view->last_sample ?
+					view->last_sample : r->sample + r->samples);
+			hz = r->samples ? ch[idx].rising * rate / r->samples : 0;
+			y = logic0 - (peak > 0 ? (int)(view->trace_height * hz / peak + 0.5) : 0);
+			if (started)
+				cairo_line_to(cr, x1 + 0.5, y + 0.5);
+			else
+				cairo_move_to(cr, x1 + 0.5, y + 0.5);
+			cairo_line_to(cr, x2 + 0.5, y + 0.5);
+			started = 1;
+		}
+		cairo_stroke(cr);
+		if (view == &mainview) {
+			if (peak >= 1000)
+				sprintf(txt, "%.3fKHz peak", peak / 1000);
+			else
+				sprintf(txt, "%.1fHz peak", peak);
+			cairo_move_to(cr, view->left_margin + 2, logic0 + 9);
+			cairo_show_text(cr, txt);
+		}
+	}
+}
+
+// A red tick through each channel that glitched, in glitch mode
+static void do_draw_glitches(cairo_t *cr, view_p view)
+{
+	int i, chan, x;
+
+	cairo_set_source_rgb(cr, 0.9, 0, 0);
+	for (i = 0; i < glitchcnt; i++) {
+		if (glitchdata[i].sample < view->first_sample)
+			continue;
+		if (glitchdata[i].sample > view->last_sample)
+			break;
+		x = sam2pix(view, glitchdata[i].sample);
+		for (chan = 0; chan < sizeof(channels); chan++) {
+			int logic0 = view->top + (chan+1) * view->spacing;
+
+			if (!(glitchdata[i].levels & (1<<channels[chan])))
+				continue;
+			cairo_move_to(cr, x+0.5, logic0 + 2.5);
+			cairo_line_to(cr, x+0.5, logic0 - view->trace_height - 2.5);
+		}
+	}
+	cairo_stroke(cr);
+	cairo_set_source_rgb(cr, 0, 0, 0);
+}
+
 static void do_draw1(GtkWidget *widget, cairo_t *cr, view_p view)
 {
 	int chan;
@@ -471,14 +639,26 @@ static void do_draw1(GtkWidget *widget, cairo_t *cr, view_p view)
 	double xscale = (double)(xmax-xmin)/visible_samples;
 	int trigger_samp;
 
-	if (prev_panctl.trigger_point == 0)
+	// The driver tells us where the trigger actually fired; with no
+	// trigger stages enabled, mark where the capture was split instead
+	if (prev_panctl.trigger_index != PAN_NO_TRIGGER)
+		trigger_samp = prev_panctl.trigger_index;
+	else if (prev_panctl.abort_reason != PAN_ABORT_NONE)
+		trigger_samp = -1;
+	else if (prev_panctl.trigger_point == 0)
 		trigger_samp = prev_panctl.num_samples / 20;
 	else if (prev_panctl.trigger_point == 1)
 		trigger_samp = prev_panctl.num_samples / 2;
 	else
-		trigger_samp = prev_panctl.num_samples * 19 / 20;
+		trigger_samp = prev_panctl.num_samples - prev_panctl.num_samples / 20;
 
+	do_draw_gaps(cr, view);
+	do_draw_regions(cr, view);
 	do_draw_trigger(widget, cr, view, trigger_samp);
+	if (prev_panctl.flags & PAN_FLAG_COUNT) {
+		do_draw_counts(cr, view);
+		return;
+	}
 
 	for (chan = 0; chan < sizeof(channels); chan++) {
 		int logic0 = view->top + (chan+1) * view->spacing;
@@ -538,6 +718,7 @@ static void do_draw1(GtkWidget *widget, cairo_t *cr, view_p view)
 		}
 	}
 	cairo_stroke(cr);
+	do_draw_glitches(cr, view);
 }
 
 static void do_draw(GtkWidget *widget)
@@ -597,7 +778,10 @@ static void do_draw(GtkWidget *widget)
 	mainview.handle2.width = 7;
 	mainview.handle2.height = 7;
 
-	int period = (mainview.last_sample - mainview.first_sample);	// in microseconds
+	double span = (mainview.last_sample - mainview.first_sample) * sample_period();
+	int period = (int)(span + 0.5);	// in microseconds
+	if (period < 1)
+		period = 1;
 	int ideal_steps = (surface_width-20) / 30;
 	int best_inc = 1;
 	int i = 1;
@@ -619,7 +803,7 @@ static void do_draw(GtkWidget *widget)
 	} while (n > ideal_steps / 2);
 	int xmin = mainview.left_margin;
 	int xmax = surface_width - mainview.right_margin;
-	double xscale = (double)(xmax-xmin)/period;
+	double xscale = (double)(xmax-xmin)/span;
 	cairo_set_source_rgb(cr, 1.0, 0.75, 0.75);
 	for (i = 0; i < period; i += best_inc) {
 		int x = (int)(xscale * i + mainview.left_margin + 0.5);
@@ -636,6 +820,7 @@ static void do_draw(GtkWidget *widget)
 	update_delta();
 
 	do_draw1(widget, cr, &preview);
+	do_draw_segments(cr);
 	do_draw1(widget, cr, &mainview);
 
 //  cairo_path_extents(cr,&x1,&y1,&x2,&y2);
@@ -660,12 +845,590 @@ void do_zoom(GtkWidget *widget, gpointer data) {
 	do_draw(DrawingArea);
 }
 
+/*
+ * Say how well the capture went, so it's obvious when the samples can't
+ * be trusted: the rate actually achieved, and whether any were late or
+ * the trigger never fired.
+ */
+static void show_stats(void)
+{
+	double rate = panctl.achieved_rate;
+	const char *src = from_user ? user_realtime ? "User " : "User, not RT, " : "";
+
+	if (rate >= 1000000)
+		set_status(0, "%s%.3fMHz in %.1fms", src, rate / 1000000, panctl.elapsed_us / 1000.0);
+	else
+		set_status(0, "%s%.1fKHz in %.1fms", src, rate / 1000, panctl.elapsed_us / 1000.0);
+
+	if (panctl.segments_filled && segs[cur_seg].trigger_sample != PAN_NO_TRIGGER)
+		set_status(1, "Segment %d/%u at %.3fms", cur_seg + 1, panctl.segments_filled,
+				segs[cur_seg].trigger_us / 1000.0);
+	else if (panctl.segments_filled)
+		set_status(1, "Segment %d/%u, no trigger", cur_seg + 1, panctl.segments_filled);
+	else if (panctl.abort_reason == PAN_ABORT_TIMEOUT)
+		set_status(1, "No trigger, %u late", panctl.overruns);
+	else if (panctl.abort_reason == PAN_ABORT_CANCELLED)
+		set_status(1, "Cancelled, %u late", panctl.overruns);
+	else if (panctl.flags & PAN_FLAG_EVENTS)
+		set_status(1, "%u records, %u edges missed", panctl.num_records, panctl.overruns);
+	else if (panctl.flags & PAN_FLAG_GLITCH)
+		set_status(1, "%d glitches, %u samples late", glitchcnt, panctl.overruns);
+	else if (panctl.flags & PAN_FLAG_DUAL_RATE)
+		set_status(1, "%u of %u samples kept, %u late", panctl.num_records, panctl.num_samples,
+				panctl.overruns);
+	else if (panctl.num_gaps)
+		set_status(1, "%u gaps, %uus max", panctl.num_gaps, panctl.max_irq_off_us);
+	else if (panctl.max_late_ns)
+		set_status(1, "%u late, %.2fus max", panctl.overruns, panctl.max_late_ns / 1000.0);
+	else if (panctl.overruns)
+		set_status(1, "%u samples late", panctl.overruns);
+	else
+		set_status(1, "No samples late");
+}
+
+// Samples in each segment, or in the whole capture without segments
+static int segment_samples(const panctl_t *p)
+{
+	return p->segments_filled ? p->num_samples / p->num_segments : p->num_samples;
+}
+
+// Display segment n; the rest of the drawing code only ever sees one
+static void use_segment(int n)
+{
+	cur_seg = n;
+	sigdata = seg_sigdata[n];
+	sigcnt = seg_sigcnt[n];
+	prev_panctl.trigger_index = segs[n].trigger_index;
+}
+
+static void show_capture(GtkWidget *widget)
+{
+	int n = segment_samples(&panctl);
+
+	// If we changed the buffer size since the last capture, reset zoom
+	// and cursor positions
+	if (n != prev_panctl.num_samples) {
+		preview.first_sample = mainview.first_sample = 0;
+		preview.last_sample = mainview.last_sample = n;
+		cursor1 = n/50;
+		cursor2 = n - cursor1;
+	}
+	memcpy(&prev_panctl, &panctl, sizeof(panctl));
+	prev_panctl.num_samples = n;
+	if (panctl.segments_filled)
+		use_segment(0);
+	show_stats();
+	do_draw(widget);
+}
+
+void do_segment(GtkWidget *widget, gpointer data) {
+	int n = cur_seg + (int)(long)data;
+
+	if (n < 0 || n >= prev_panctl.segments_filled)
+		return;
+	use_segment(n);
+	show_stats();
+	do_draw(DrawingArea);
+}
+
+static void free_capture(void)
+{
+	int i;
+
+	if (prev_panctl.segments_filled) {
+		for (i = 0; i < prev_panctl.segments_filled; i++)
+			free(seg_sigdata[i]);
+	} else if (sigdata) {
+		free(sigdata);
+	}
+	if (gaps)
+		free(gaps);
+	if (segs)
+		free(segs);
+	if (counts)
+		free(counts);
+	if (glitchdata)
+		free(glitchdata);
+	sigdata = NULL;
+	gaps = NULL;
+	segs = NULL;
+	counts = NULL;
+	num_counts = 0;
+	glitchdata = NULL;
+	glitchcnt = 0;
+	prev_panctl.segments_filled = 0;
+	prev_panctl.num_regions = 0;
+}
+
+static pangap_t *alloc_gaps(void)
+{
+	gaps = (pangap_t *)malloc(sizeof(pangap_t) * (panctl.num_gaps + 1));
+	if (gaps == NULL) {
+		error_dialog("Failed to malloc gaps: %s", strerror(errno));
+		gtk_main_quit();
+	}
+
+	return gaps;
+}
+
+// Gap records follow transition data directly, as it is a multiple of 4 bytes
+static int read_gaps(int fd)
+{
+	int siz = panctl.num_gaps * sizeof(pangap_t);
+	int cnt = siz;
+	char *p;
+	int res;
+
+	p = (char *)alloc_gaps();
+	while (cnt) {
+		res = read(fd, p, cnt);
+		if (res > 0) {
+			cnt -= res;
+			p += res;
+		} else {
+			error_dialog("Failed to read gaps (read %d of %d): %s",
+					siz - cnt, siz, res ? strerror(errno) : "short read");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Transition mode data is already in sigdata format, so read it straight in
+static int load_transitions(int fd)
+{
+	int siz = panctl.num_records * sizeof(sigdata_t);
+	int cnt = siz;
+	char *p;
+	int res;
+
+	sigdata = (sigdata_p)malloc(sizeof(sigdata_t)*(panctl.num_records+2));
+	if (sigdata == NULL) {
+		error_dialog("Failed to malloc sigdata: %s", strerror(errno));
+		gtk_main_quit();
+	}
+	p = (char *)sigdata;
+	while (cnt) {
+		res = read(fd, p, cnt);
+		if (res > 0) {
+			cnt -= res;
+			p += res;
+		} else {
+			error_dialog("Failed to read transitions (read %d of %d): %s",
+					siz - cnt, siz, res ? strerror(errno) : "short read");
+			return -1;
+		}
+	}
+	sigcnt = panctl.num_records;
+	if (sigcnt == 0) {
+		sigdata[0].sample = 0;
+		sigdata[0].levels = 0;
+		sigcnt = 1;
+	}
+	sigdata[sigcnt].sample = panctl.num_samples;
+	sigdata[sigcnt].levels = sigdata[sigcnt-1].levels;
+
+	return read_gaps(fd);
+}
+
+// Counter mode data is a record per gate window, for do_draw_counts()
+static int load_counts(int fd)
+{
+	int siz = panctl.num_records * PAN_COUNT_BYTES(pan_count_channels(panctl.channel_mask));
+	int cnt = siz;
+	char *p;
+	int res;
+
+	counts = (uint32_t *)malloc(siz + 1);
+	sigdata = (sigdata_p)malloc(sizeof(sigdata_t)*2);
+	if (counts == NULL || sigdata == NULL) {
+		error_dialog("Failed to malloc counts: %s", strerror(errno));
+		gtk_main_quit();
+	}
+	p = (char *)counts;
+	while (cnt) {
+		res = read(fd, p, cnt);
+		if (res > 0) {
+			cnt -= res;
+			p += res;
+		} else {
+			error_dialog("Failed to read counts (read %d of %d): %s",
+					siz - cnt, siz, res ? strerror(errno) : "short read");
+			return -1;
+		}
+	}
+	num_counts = panctl.num_records;
+	// Nothing to draw as levels, but the rest of the code expects some
+	sigcnt = 1;
+	sigdata[0].sample = 0;
+	sigdata[0].levels = 0;
+	sigdata[1].sample = panctl.num_samples;
+	sigdata[1].levels = 0;
+
+	return read_gaps(fd);
+}
+
+/*
+ * Map the sample data rather than read()ing a copy of it.  For the device
+ * this is the driver's ring buffer, with the oldest sample at
+ * first_data_index; a trace file holds the header followed by what read()
+ * returned.  Falls back to read() if the data can't be mapped.
+ */
+static const uint8_t *map_samples(int fd, size_t siz, uint32_t *first, void **map, size_t *map_len)
+{
+	struct stat st;
+	uint8_t *data, *p;
+	size_t cnt;
+	int res;
+	int bits = panctl.flags & PAN_FLAG_PACKED ? pan_pack_bits(panctl.channel_mask) : 32;
+
+	if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode)) {
+		*map_len = siz;
+		*map = mmap(NULL, *map_len, PROT_READ, MAP_SHARED, fd, 0);
+		if (*map != MAP_FAILED) {
+			*first = panctl.first_data_index;
+			return (uint8_t *)*map;
+		}
+	} else if (fstat(fd, &st) == 0 && st.st_size >= sizeof(panctl) + siz) {
+		*map_len = sizeof(panctl) + siz;
+		*map = mmap(NULL, *map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (*map != MAP_FAILED) {
+			*first = pan_read_first(bits, panctl.first_data_index);
+			return (uint8_t *)*map + sizeof(panctl);
+		}
+	}
+
+	// read() returns the samples in order, give or take a nibble
+	*map = NULL;
+	*first = pan_read_first(bits, panctl.first_data_index);
+	data = (uint8_t *)malloc(siz);
+	if (data == NULL) {
+		error_dialog("Failed to malloc tracedata: %s", strerror(errno));
+		gtk_main_quit();
+	}
+	for (p = data, cnt = siz; cnt; ) {
+		res = read(fd, p, cnt);
+		if (res > 0) {
+			cnt -= res;
+			p += res;
+		} else {
+			error_dialog("Failed to read tracedata (read %d of %d): %s",
+					(int)(siz - cnt), (int)siz, res ? strerror(errno) : "short read");
+			free(data);
+			return NULL;
+		}
+	}
+
+	return data;
+}
+
+static void unmap_samples(const uint8_t *data, void *map, size_t map_len)
+{
+	if (map)
+		munmap(map, map_len);
+	else
+		free((void *)data);
+}
+
+/*
+ * Decode the len sample ring starting at sample base of data, oldest at
+ * first, in to sigdata.
+ */
+static void decode_ring(const uint8_t *data, int bits, const uint32_t *scatter, uint32_t mask,
+		int base, int len, int first)
+{
+	uint32_t levels;
+	int i, n, size;
+
+	// Big captures mostly don't change on every sample, so grow it as needed
+	size = len < 65536 ? len + 1 : 65536;
+	sigdata = (sigdata_p)malloc(sizeof(sigdata_t)*size);
+	if (sigdata == NULL) {
+		error_dialog("Failed to malloc sigdata: %s", strerror(errno));
+		gtk_main_quit();
+	}
+	sigcnt = 0;
+	for (i = 0, n = first; i < len; i++) {
+		levels = pan_unpack(data, bits, scatter, mask, base + n);
+		if (i == 0 || levels != sigdata[sigcnt-1].levels) {
+			if (sigcnt + 1 == size) {
+				size = size * 2 > len + 1 ? len + 1 : size * 2;
+				sigdata = (sigdata_p)realloc(sigdata, sizeof(sigdata_t)*size);
+				if (sigdata == NULL) {
+					error_dialog("Failed to realloc sigdata: %s", strerror(errno));
+					gtk_main_quit();
+				}
+			}
+			sigdata[sigcnt].sample = i;
+			sigdata[sigcnt++].levels = levels;
+		}
+		if (++n == len)
+			n = 0;
+	}
+	sigdata[sigcnt].sample = i;
+	sigdata[sigcnt].levels = sigdata[sigcnt-1].levels;
+}
+
+// In glitch mode, find the glitches from the latch bytes in to glitchdata; see pan_glitch_decode()
+static void decode_glitches(const uint32_t *data, const uint8_t *latches, const uint32_t *scatter,
+		uint32_t mask, int len, int first)
+{
+	glitchdata = (pantrans_t *)malloc(sizeof(pantrans_t)*(len+1));
+	if (glitchdata == NULL) {
+		error_dialog("Failed to malloc glitchdata: %s", strerror(errno));
+		gtk_main_quit();
+	}
+	glitchcnt = pan_glitch_decode(data, latches, scatter, mask, len, first, glitchdata);
+}
+
+/*
+ * In dual rate mode, decode the regions' samples in to sigdata, each at its
+ * full rate sample number, so the time axis stays linear.
+ */
+static void decode_regions(const uint32_t *data, uint32_t mask)
+{
+	uint32_t levels, j;
+	int i;
+
+	sigdata = (sigdata_p)malloc(sizeof(sigdata_t)*(panctl.num_records+1));
+	if (sigdata == NULL) {
+		error_dialog("Failed to malloc sigdata: %s", strerror(errno));
+		gtk_main_quit();
+	}
+	sigcnt = 0;
+	for (i = 0; i < panctl.num_regions; i++) {
+		for (j = 0; j < regions[i].samples; j++) {
+			levels = data[regions[i].index + j] & mask;
+			if (sigcnt == 0 || levels != sigdata[sigcnt-1].levels) {
+				sigdata[sigcnt].sample = regions[i].sample + j * regions[i].step;
+				sigdata[sigcnt++].levels = levels;
+			}
+		}
+	}
+	sigdata[sigcnt].sample = panctl.num_samples;
+	sigdata[sigcnt].levels = sigcnt ? sigdata[sigcnt-1].levels : 0;
+}
+
+// Decode samples, packed or not, straight from the ring(s) in to sigdata
+static int load_samples(int fd)
+{
+	int bits = panctl.flags & PAN_FLAG_PACKED ? pan_pack_bits(panctl.channel_mask) : 32;
+	size_t siz = (size_t)panctl.num_samples * bits / 8;
+	size_t total = siz;
+	const uint8_t *data;
+	void *map;
+	size_t map_len;
+	uint32_t scatter[256];
+	uint32_t mask = 0, first;
+	int i, len;
+
+	if (panctl.flags & PAN_FLAG_DUAL_RATE)
+		siz = total = (size_t)panctl.num_records * 4;
+	if (panctl.num_gaps)
+		total = PAN_GAP_OFFSET(siz) + panctl.num_gaps * sizeof(pangap_t);
+	else if (panctl.segments_filled)
+		total = PAN_GAP_OFFSET(siz) + panctl.segments_filled * sizeof(panseg_t);
+	else if (panctl.flags & PAN_FLAG_GLITCH)
+		total = PAN_GAP_OFFSET(siz) + panctl.num_samples;
+	else if (panctl.num_regions)
+		total = PAN_GAP_OFFSET(siz) + panctl.num_regions * sizeof(panregion_t);
+	data = map_samples(fd, total, &first, &map, &map_len);
+	if (data == NULL)
+		return -1;
+	memcpy(alloc_gaps(), data + PAN_GAP_OFFSET(siz), panctl.num_gaps * sizeof(pangap_t));
+
+	pan_scatter_init(scatter, panctl.channel_mask);
+	for (i = 0; i < sizeof(channels); i++)
+		mask |= 1 << channels[i];
+
+	if (panctl.segments_filled) {
+		segs = (panseg_t *)malloc(panctl.segments_filled * sizeof(panseg_t));
+		if (segs == NULL) {
+			error_dialog("Failed to malloc segments: %s", strerror(errno));
+			gtk_main_quit();
+		}
+		memcpy(segs, data + PAN_GAP_OFFSET(siz), panctl.segments_filled * sizeof(panseg_t));
+		len = segment_samples(&panctl);
+		for (i = 0; i < panctl.segments_filled; i++) {
+			decode_ring(data, bits, scatter, mask, i * len, len, segs[i].first_data_index);
+			seg_sigdata[i] = sigdata;
+			seg_sigcnt[i] = sigcnt;
+		}
+	} else if (panctl.flags & PAN_FLAG_DUAL_RATE) {
+		memcpy(regions, data + PAN_GAP_OFFSET(siz), panctl.num_regions * sizeof(panregion_t));
+		decode_regions((const uint32_t *)data, mask);
+	} else {
+		decode_ring(data, bits, scatter, mask, 0, panctl.num_samples, first);
+		if (panctl.flags & PAN_FLAG_GLITCH)
+			decode_glitches((const uint32_t *)data, data + PAN_GAP_OFFSET(siz), scatter, mask,
+					panctl.num_samples, first);
+	}
+	unmap_samples(data, map, map_len);
+
+	return 0;
+}
+
+// Check the header just read from fd, then load the data that follows it
+static void load_capture(GtkWidget *widget, int fd)
+{
+	int res;
+
+	if (panctl.magic != PAN_MAGIC) {
+		error_dialog("Bad magic in data");
+		prepopulate_data();
+		close(fd);
+		do_draw(widget);
+		return;
+	}
+
+	if (panctl.version != PAN_VERSION) {
+		error_dialog("Data is version %d, expected %d", panctl.version, PAN_VERSION);
+		prepopulate_data();
+		close(fd);
+		do_draw(widget);
+		return;
+	}
+
+	free_capture();
+
+	if (panctl.flags & (PAN_FLAG_TRANSITIONS | PAN_FLAG_EVENTS))
+		res = load_transitions(fd);
+	else if (panctl.flags & PAN_FLAG_COUNT)
+		res = load_counts(fd);
+	else
+		res = load_samples(fd);
+	close(fd);
+	if (res < 0) {
+		prepopulate_data();
+		do_draw(widget);
+		return;
+	}
+	show_capture(widget);
+//	do_analyze();
+}
+
+static void capture_failed(int err)
+{
+	if (err == ERANGE)
+		error_dialog("Sample rate too high for this Pi");
+	else if (run_mode == 0)
+		error_dialog("Couldn't read panctl: %s", strerror(err));
+}
+
+// The armed capture, while we wait for the driver to say it is done
+static int armed_fd = -1;
+
+static gboolean capture_ready(GIOChannel *source, GIOCondition condition, gpointer widget)
+{
+	int fd = armed_fd;
+	int res;
+
+	armed_fd = -1;
+	res = pan_client_result(fd);
+	if (res) {
+		capture_failed(-res);
+		close(fd);
+		set_status(1, "Capture failed");
+		return FALSE;
+	}
+	res = pan_client_header(fd, &panctl);
+	if (res == 0 && lseek(fd, sizeof(panctl), SEEK_SET) < 0)
+		res = -errno;
+	if (res) {
+		error_dialog("Couldn't fetch the capture: %s", strerror(-res));
+		close(fd);
+		return FALSE;
+	}
+	load_capture(GTK_WIDGET(widget), fd);
+
+	return FALSE;
+}
+
+// The user space capture, while its thread runs
+static int user_armed;
+
+static gboolean user_ready(GIOChannel *source, GIOCondition condition, gpointer widget)
+{
+	int fd;
+
+	user_armed = 0;
+	fd = pan_user_finish(&panctl);
+	if (fd < 0) {
+		capture_failed(-fd);
+		set_status(1, "Capture failed");
+		return FALSE;
+	}
+	load_capture(GTK_WIDGET(widget), fd);
+
+	return FALSE;
+}
+
+/*
+ * Start the capture thread in panuser.h, reading the levels through
+ * /dev/gpiomem, or whatever PANALYZER_GPIOMEM names, and return to the main
+ * loop, which calls user_ready() when it is done.
+ */
+static void user_run(GtkWidget *widget)
+{
+	GIOChannel *channel;
+	const char *path = getenv("PANALYZER_GPIOMEM");
+	int fd;
+
+	if (path == NULL)
+		path = PAN_USER_GPIOMEM;
+	fd = pan_user_open(path);
+	if (fd < 0) {
+		error_dialog("Couldn't map %s: %s", path, strerror(-fd));
+		return;
+	}
+	fd = pan_user_start(&panctl);
+	if (fd < 0) {
+		capture_failed(-fd);
+		return;
+	}
+	user_armed = 1;
+	channel = g_io_channel_unix_new(fd);
+	g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP, user_ready, widget);
+	g_io_channel_unref(channel);
+	set_status(1, "Waiting for trigger");
+}
+
+/*
+ * Arm the capture and return to the main loop, which calls capture_ready()
+ * when poll() says the driver is done.  Drivers without the ioctls, and
+ * trace.bin, run the capture in the first read() of the header.
+ */
 void do_run(GtkWidget *widget, gpointer data) {
+	GIOChannel *channel;
 	int fd, res;
 
+	if (armed_fd >= 0 || user_armed)
+		return;
+	set_num_records();
+	from_user = user_backend;
+	if (user_backend) {
+		user_run(widget);
+		return;
+	}
+
 #if 1
 	fd = open("/dev/panalyzer", O_RDWR);
 	if (fd >= 0) {
+		res = pan_client_arm(fd, &panctl);
+		if (res < 0) {
+			capture_failed(-res);
+			close(fd);
+			return;
+		}
+		if (res == 0) {
+			armed_fd = fd;
+			channel = g_io_channel_unix_new(fd);
+			g_io_add_watch(channel, G_IO_IN | G_IO_ERR | G_IO_HUP, capture_ready, widget);
+			g_io_channel_unref(channel);
+			set_status(1, "Waiting for trigger");
+			return;
+		}
 		res = write(fd, &panctl, sizeof(panctl));
 		if (res != sizeof(panctl)) {
 			error_dialog("Couldn't write device: %s", strerror(errno));
@@ -693,8 +1456,7 @@ void do_run(GtkWidget *widget, gpointer data) {
 
 	res = read(fd, &panctl, sizeof(panctl));
 	if (res < 0) {
-		if (run_mode == 0)
-			error_dialog("Couldn't read panctl: %s", strerror(errno));
+		capture_failed(errno);
 		close(fd);
 		return;
 	} else 	if (res != sizeof(panctl)) {
@@ -705,94 +1467,121 @@ void do_run(GtkWidget *widget, gpointer data) {
 		return;
 	}
 
-	if (panctl.magic != PAN_MAGIC) {
-		error_dialog("Bad magic in data");
-		prepopulate_data();
-		close(fd);
-		do_draw(widget);
-		return;
-	}
-
-	if (tracedata)
-		free(tracedata);
-	if (sigdata)
-		free(sigdata);
-	tracedata = NULL;
-	sigdata = NULL;
-
-	tracedata = (uint32_t *)malloc(panctl.num_samples * sizeof(uint32_t));
-	if (tracedata == NULL) {
-		error_dialog("Failed to malloc tracedata: %s", strerror(errno));
-		gtk_main_quit();
-	}
+	load_capture(widget, fd);
+}
 
-	char *p = (char *)tracedata;
-	int siz = panctl.num_samples * sizeof(uint32_t);
-	int cnt = siz;
-	while (cnt) {
-		res = read(fd, p, cnt);
-		if (res >= 0) {
-			cnt -= res;
-			p += res;
-		}
-		else {
-			error_dialog("Failed to read tracedata (read %d of %d): %s",
-					siz - cnt, cnt, strerror(errno));
-			prepopulate_data();
-			close(fd);
-			do_draw(widget);
-			return;
-		}
-	}
-	close(fd);
+// Give up waiting for the trigger; the driver returns what it has
+static void cancel_capture(void)
+{
+	if (armed_fd >= 0)
+		pan_client_cancel(armed_fd);
+	if (user_armed)
+		pan_user_cancel();
+}
 
-	// If we changed the buffer size since the last capture, reset zoom
-	// and cursor positions
-	if (panctl.num_samples != prev_panctl.num_samples) {
-		preview.first_sample = mainview.first_sample = 0;
-		preview.last_sample = mainview.last_sample = panctl.num_samples;
-		cursor1 = panctl.num_samples/50;
-		cursor2 = panctl.num_samples - cursor1;
-	}
-	memcpy(&prev_panctl, &panctl, sizeof(panctl));
+/*
+ * The polled loop keeps interrupts off for the whole capture, so the sizes
+ * over PAN_MAX_OFF_CAPTURE_MS are only offered with an engine that doesn't,
+ * or in arm IRQ mode when what follows the trigger is no longer than that.
+ */
+static const int long_buffer_ms[] = { 5000, 10000, 30000, 60000 };
+static GtkWidget *long_buffer_btn[4];
+static GtkWidget *max_off_buffer_btn;
 
-	uint32_t mask = 0;
-	int i;
-	for (i = 0; i < sizeof(channels); i++)
-		mask |= 1 << channels[i];
-	// TODO realloc sigdata as necessary
-	sigdata = (sigdata_p)malloc(sizeof(sigdata_t)*(panctl.num_samples+1));
-	if (sigdata == NULL) {
-		error_dialog("Failed to malloc sigdata: %s", strerror(errno));
-		gtk_main_quit();
-	}
-	sigcnt = 0;
-	sigdata[sigcnt].sample = 0;
-	sigdata[sigcnt].levels = tracedata[0] & mask;
-	for (i = 1; i < panctl.num_samples; i++) {
-//		tracedata[i] ^= (i&1)<<4;
-		if ((tracedata[i] & mask) != sigdata[sigcnt].levels) {
-			sigdata[++sigcnt].sample = i;
-			sigdata[sigcnt].levels = tracedata[i] & mask;
-		}
+static void update_buffer_sizes(void)
+{
+	// Dual rate mode has interrupts off throughout, whatever else is set
+	gboolean dual = (panctl.flags & PAN_FLAG_DUAL_RATE) != 0;
+	gboolean irqs = !dual && (panctl.flags & PAN_FLAGS_IRQS_ON) != 0;
+	gboolean arm_irq = !dual && (panctl.flags & PAN_FLAG_ARM_IRQ) != 0;
+	int i, max_ms = PAN_MAX_OFF_CAPTURE_MS;
+
+	for (i = 0; i < 4; i++) {
+		int post_ms = PAN_POST_TRIGGER(long_buffer_ms[i], panctl.trigger_point);
+		gboolean ok = irqs || (arm_irq && post_ms <= PAN_MAX_OFF_CAPTURE_MS);
+
+		gtk_widget_set_sensitive(long_buffer_btn[i], ok);
+		if (ok)
+			max_ms = long_buffer_ms[i];
 	}
-	sigcnt++;
-	sigdata[sigcnt].sample = i;
-	sigdata[sigcnt].levels = sigdata[sigcnt-1].levels;
-	do_draw(widget);
-//	do_analyze();
+	if (buffer_ms > max_ms)
+		gtk_check_menu_item_set_active(GTK_CHECK_MENU_ITEM(max_off_buffer_btn), TRUE);
 }
 
 void do_run_mode(GtkWidget *widget, gpointer data) {
 	run_mode = (int)(long)data;
 }
 
+void do_capture_mode(GtkWidget *widget, gpointer data) {
+	panctl.flags = (panctl.flags & ~(PAN_FLAG_TRANSITIONS | PAN_FLAG_PACKED | PAN_FLAG_COUNT | PAN_FLAG_EVENTS | PAN_FLAG_GLITCH |
+			PAN_FLAG_DUAL_RATE)) |
+			(int)(long)data;
+	update_buffer_sizes();
+}
+
+void do_gate(GtkWidget *widget, gpointer data) {
+	panctl.gate_ms = (int)(long)data;
+}
+
+void do_decimate(GtkWidget *widget, gpointer data) {
+	panctl.decimate = (int)(long)data;
+}
+
+void do_window(GtkWidget *widget, gpointer data) {
+	panctl.window_samples = (int)(long)data;
+}
+
+void do_user_backend(GtkWidget *widget, gpointer data) {
+	user_backend = gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget));
+}
+
+// For the check items that just set a flag
+void do_flag(GtkWidget *widget, gpointer data) {
+	if (gtk_check_menu_item_get_active(GTK_CHECK_MENU_ITEM(widget)))
+		panctl.flags |= (int)(long)data;
+	else
+		panctl.flags &= ~(int)(long)data;
+	update_buffer_sizes();
+}
+
+void do_segments(GtkWidget *widget, gpointer data) {
+	panctl.num_segments = (int)(long)data;
+}
+
+void do_trigger_timeout(GtkWidget *widget, gpointer data) {
+	panctl.timeout_ms = (int)(long)data;
+}
+
 void do_trigger_position(GtkWidget *widget, gpointer data) {
 	panctl.trigger_point = (int)(long)data;
+	update_buffer_sizes();
+}
+
+static void set_num_samples(void) {
+	panctl.num_samples = (int)((long long)buffer_ms * PAN_SAMPLE_RATE(&panctl) / 1000);
+}
+
+/*
+ * The last capture's header says how many records it had, and in dual rate
+ * mode how many samples they spanned; ask for a full set.
+ */
+static void set_num_records(void) {
+	if (panctl.flags & PAN_FLAG_DUAL_RATE)
+		set_num_samples();
+	if (panctl.flags & PAN_FLAG_COUNT)
+		panctl.num_records = buffer_ms / panctl.gate_ms + 2;
+	else
+		panctl.num_records = DEF_RECORDS;
 }
 
 void do_buffer_size(GtkWidget *widget, gpointer data) {
-	panctl.num_samples = (int)(long)data * 1000;
+	buffer_ms = (int)(long)data;
+	set_num_samples();
+}
+
+void do_sample_rate(GtkWidget *widget, gpointer data) {
+	panctl.sample_rate = (int)(long)data;
+	set_num_samples();
 }
 
 
@@ -824,6 +1613,10 @@ gboolean do_run_button(GtkWidget *widget, GtkWidget *area)
 	if (continuous_mode_active) {
 		continuous_mode_active = FALSE;
 		gtk_tool_button_set_stock_id(GTK_TOOL_BUTTON(widget), GTK_STOCK_GO_FORWARD);
+		cancel_capture();
+	}
+	else if (armed_fd >= 0) {
+		cancel_capture();
 	}
 	else if (run_mode == 1) {
 		continuous_mode_active = TRUE;
@@ -835,15 +1628,25 @@ gboolean do_run_button(GtkWidget *widget, GtkWidget *area)
 	return TRUE;
 }
 
+// Trigger conditions for one channel: level, rising, falling, either edge or glitch
+static const char *trig_level_labels[] = { "0", "1", "\u2191", "\u2193", "\u2195", "\u21af", "-" };
+#define NUM_TRIG_LEVELS	(sizeof(trig_level_labels) / sizeof(trig_level_labels[0]))
+
+static int trig_level(const char *txt) {
+	int i;
+
+	for (i = 0; i < NUM_TRIG_LEVELS - 1; i++)
+		if (!strcmp(txt, trig_level_labels[i]))
+			break;
+	return i;
+}
+
 static void do_level_select(GtkWidget *widget, gpointer data) {
-	const char *levels = "01-";
-	char newtxt[2] = { 0 };
-	const gchar *txt = gtk_button_get_label(GTK_BUTTON(widget));
-	int i = strchr(levels, *txt) - levels;
-	if (++i >= strlen(levels))
+	int i = trig_level(gtk_button_get_label(GTK_BUTTON(widget)));
+
+	if (++i >= NUM_TRIG_LEVELS)
 		i = 0;
-	newtxt[0] = levels[i];
-	gtk_button_set_label(GTK_BUTTON(widget), newtxt);
+	gtk_button_set_label(GTK_BUTTON(widget), trig_level_labels[i]);
 }
 
 static void do_trig_enables(GtkWidget *widget, gpointer data) {
@@ -980,12 +1783,16 @@ void do_trigger_dialog(GtkWidget *widget, gpointer data) {
 		sprintf(txt, "%d", panctl.trigger[t].min_samples);
 		gtk_entry_set_text(GTK_ENTRY(trig_samples[t]), txt);
 		for (i = 0; i < sizeof(channels); i++) {
-			if (panctl.trigger[t].mask & (1 << channels[i])) {
-				if (panctl.trigger[t].value & (1 << channels[i]))
-					gtk_button_set_label(GTK_BUTTON(trig_levels[t][i]), "1");
-				else
-					gtk_button_set_label(GTK_BUTTON(trig_levels[t][i]), "0");
-			}
+			uint32_t bit = 1 << channels[i];
+			int rise = (panctl.trigger[t].rising & bit) != 0;
+			int fall = (panctl.trigger[t].falling & bit) != 0;
+
+			if (panctl.trigger[t].glitch & bit)
+				gtk_button_set_label(GTK_BUTTON(trig_levels[t][i]), trig_level_labels[5]);
+			else if (rise || fall)
+				gtk_button_set_label(GTK_BUTTON(trig_levels[t][i]), trig_level_labels[rise && fall ? 4 : rise ? 2 : 3]);
+			else if (panctl.trigger[t].mask & bit)
+				gtk_button_set_label(GTK_BUTTON(trig_levels[t][i]), trig_level_labels[(panctl.trigger[t].value & bit) != 0]);
 		}
 	}
 
@@ -996,17 +1803,28 @@ void do_trigger_dialog(GtkWidget *widget, gpointer data) {
 		for (t = 0; t < MAX_TRIGGERS; t++) {
 			panctl.trigger[t].enabled = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(trig_enables[t]));
 			panctl.trigger[t].min_samples = atoi(gtk_entry_get_text(GTK_ENTRY(trig_samples[t])));
-			uint32_t mask = 0, value = 0;
+			if (panctl.trigger[t].min_samples == 0)
+				panctl.trigger[t].min_samples = 1;
+			uint32_t mask = 0, value = 0, rising = 0, falling = 0, glitch = 0;
 			for (i = 0; i < sizeof(channels); i++) {
-				const char *txt = gtk_button_get_label(GTK_BUTTON(trig_levels[t][i]));
+				int level = trig_level(gtk_button_get_label(GTK_BUTTON(trig_levels[t][i])));
 
-				if (*txt != '-')
+				if (level < 2)
 					mask |= 1 << channels[i];
-				if (*txt == '1')
+				if (level == 1)
 					value |= 1 << channels[i];
+				if (level == 2 || level == 4)
+					rising |= 1 << channels[i];
+				if (level == 3 || level == 4)
+					falling |= 1 << channels[i];
+				if (level == 5)
+					glitch |= 1 << channels[i];
 			}
 			panctl.trigger[t].mask = mask;
 			panctl.trigger[t].value = value;
+			panctl.trigger[t].rising = rising;
+			panctl.trigger[t].falling = falling;
+			panctl.trigger[t].glitch = glitch;
 		}
 	}
 
@@ -1045,6 +1863,8 @@ main (int   argc,
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "zoom100_btn")), "activate", G_CALLBACK(do_zoom), (gpointer)100);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "zoom50_btn")), "activate", G_CALLBACK(do_zoom), (gpointer)50);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "zoom25_btn")), "activate", G_CALLBACK(do_zoom), (gpointer)25);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "seg_prev_btn")), "activate", G_CALLBACK(do_segment), (gpointer)-1);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "seg_next_btn")), "activate", G_CALLBACK(do_segment), (gpointer)1);
 
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "buf_10ms_btn")), "activate", G_CALLBACK(do_buffer_size), (gpointer)10);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "buf_20ms_btn")), "activate", G_CALLBACK(do_buffer_size), (gpointer)20);
@@ -1054,11 +1874,62 @@ main (int   argc,
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "buf_500ms_btn")), "activate", G_CALLBACK(do_buffer_size), (gpointer)500);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "buf_1000ms_btn")), "activate", G_CALLBACK(do_buffer_size), (gpointer)1000);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "buf_2000ms_btn")), "activate", G_CALLBACK(do_buffer_size), (gpointer)2000);
+  for (i = 0; i < 4; i++) {
+	  char txt[24];
+	  sprintf(txt, "buf_%dms_btn", long_buffer_ms[i]);
+	  long_buffer_btn[i] = GTK_WIDGET(gtk_builder_get_object(builder, txt));
+	  g_signal_connect(long_buffer_btn[i], "activate", G_CALLBACK(do_buffer_size), (gpointer)(long)long_buffer_ms[i]);
+  }
+  max_off_buffer_btn = GTK_WIDGET(gtk_builder_get_object(builder, "buf_2000ms_btn"));
+  update_buffer_sizes();
+
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_samples_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)0);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_transitions_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)PAN_FLAG_TRANSITIONS);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_packed_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)PAN_FLAG_PACKED);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_count_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)PAN_FLAG_COUNT);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_events_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)PAN_FLAG_EVENTS);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_glitch_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)PAN_FLAG_GLITCH);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "mode_dual_btn")), "activate", G_CALLBACK(do_capture_mode), (gpointer)PAN_FLAG_DUAL_RATE);
+
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "gate_1ms_btn")), "activate", G_CALLBACK(do_gate), (gpointer)1);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "gate_10ms_btn")), "activate", G_CALLBACK(do_gate), (gpointer)10);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "gate_100ms_btn")), "activate", G_CALLBACK(do_gate), (gpointer)100);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "gate_1s_btn")), "activate", G_CALLBACK(do_gate), (gpointer)1000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "decimate_10_btn")), "activate", G_CALLBACK(do_decimate), (gpointer)10);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "decimate_100_btn")), "activate", G_CALLBACK(do_decimate), (gpointer)100);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "window_1k_btn")), "activate", G_CALLBACK(do_window), (gpointer)1000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "window_10k_btn")), "activate", G_CALLBACK(do_window), (gpointer)10000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "window_100k_btn")), "activate", G_CALLBACK(do_window), (gpointer)100000);
+
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_10k_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)10000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_100k_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)100000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_250k_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)250000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_500k_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)500000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_1m_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)1000000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_2m_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)2000000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_4m_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)4000000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "rate_5m_btn")), "activate", G_CALLBACK(do_sample_rate), (gpointer)5000000);
+
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "segmented_btn")), "toggled", G_CALLBACK(do_flag), (gpointer)PAN_FLAG_SEGMENTED);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "arm_irq_btn")), "toggled", G_CALLBACK(do_flag), (gpointer)PAN_FLAG_ARM_IRQ);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "fiq_btn")), "toggled", G_CALLBACK(do_flag), (gpointer)PAN_FLAG_FIQ);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "core_btn")), "toggled", G_CALLBACK(do_flag), (gpointer)PAN_FLAG_CORE);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "user_btn")), "toggled", G_CALLBACK(do_user_backend), NULL);
+
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "seg_off_btn")), "activate", G_CALLBACK(do_segments), (gpointer)0);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "seg_4_btn")), "activate", G_CALLBACK(do_segments), (gpointer)4);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "seg_16_btn")), "activate", G_CALLBACK(do_segments), (gpointer)16);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "seg_64_btn")), "activate", G_CALLBACK(do_segments), (gpointer)64);
 
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "trig_start_btn")), "activate", G_CALLBACK(do_trigger_position), (gpointer)0);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "trig_centre_btn")), "activate", G_CALLBACK(do_trigger_position), (gpointer)1);
   g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "trig_end_btn")), "activate", G_CALLBACK(do_trigger_position), (gpointer)2);
 
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "timeout_auto_btn")), "activate", G_CALLBACK(do_trigger_timeout), (gpointer)0);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "timeout_10s_btn")), "activate", G_CALLBACK(do_trigger_timeout), (gpointer)10000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "timeout_1m_btn")), "activate", G_CALLBACK(do_trigger_timeout), (gpointer)60000);
+  g_signal_connect(GTK_WIDGET(gtk_builder_get_object(builder, "timeout_10m_btn")), "activate", G_CALLBACK(do_trigger_timeout), (gpointer)600000);
+
   gtk_widget_show_all (GTK_WIDGET(window));
   gtk_main ();
 
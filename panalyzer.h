@@ -21,7 +21,7 @@
 
 #define MAX_TRIGGERS	4
 #define PAN_MAGIC		0x50414E41
-#define PAN_VERSION		1
+#define PAN_VERSION		10
 
 struct panctl_s {
 	uint32_t	magic;
@@ -36,13 +36,299 @@ struct panctl_s {
 		uint32_t	mask;
 		uint32_t	value;
 		uint32_t	min_samples;
+		uint32_t	rising;			// Channels that must go low to high on this sample
+		uint32_t	falling;		// High to low; a channel in both means either edge
+		uint32_t	glitch;			// Channels that must glitch on this sample, in glitch mode
 	} trigger[MAX_TRIGGERS];
+	uint32_t	flags;
+	uint32_t	num_records;
+	uint32_t	num_segments;		// Split the buffer for back to back triggers, if > 1
+	uint32_t	timeout_ms;			// Give up on the trigger after this, or 0 for the default
+	uint32_t	gate_ms;			// Counter mode window
+	uint32_t	window_samples;		// Dual rate mode: full rate samples around the trigger
+	uint32_t	decimate;			// Dual rate mode: keep 1 in this many outside the window
+	// The rest is filled in by the driver once the capture is done
+	uint32_t	first_data_index;	// Oldest sample in the mmap()ed ring; see pan_read_first()
+	uint32_t	trigger_index;		// Sample the trigger fired on, or PAN_NO_TRIGGER
+	uint32_t	overruns;			// Samples taken a whole period or more late
+	uint32_t	elapsed_us;			// Start of capture to end, including the trigger wait
+	uint32_t	achieved_rate;		// Hz, averaged over the whole capture
+	uint32_t	abort_reason;		// PAN_ABORT_xxx
+	uint32_t	num_gaps;			// pangap_t records following the data
+	uint32_t	max_irq_off_us;		// Longest time interrupts were disabled
+	uint32_t	segments_filled;	// panseg_t records following the data
+	uint32_t	max_late_ns;		// Latest a sample was taken after it was due, polled loops only
+	uint32_t	num_regions;		// panregion_t records following the data
 };
 typedef struct panctl_s panctl_t;
 typedef panctl_t *panctl_p;
 
+#define PAN_NO_TRIGGER		0xffffffff
+
+#define PAN_ABORT_NONE		0
+#define PAN_ABORT_TIMEOUT	1	// Trigger didn't fire; the data is the last num_samples
+#define PAN_ABORT_CANCELLED	2	// PAN_IOC_CANCEL; the data is what we had
+
+#define PAN_FLAG_TRANSITIONS	(1<<0)	// Only store a record when the levels change
+#define PAN_FLAG_PACKED			(1<<1)	// Pack channel_mask bits in to a nibble or byte per sample
+#define PAN_FLAG_SEGMENTED		(1<<2)	// Let interrupts run between short chunks
+#define PAN_FLAG_FIQ			(1<<3)	// Sample from a timer FIQ, with Linux running
+#define PAN_FLAG_DMA_SWEEP		(1<<4)	// pandriver-dma: measure DMA settings, don't capture
+#define PAN_FLAG_STREAM			(1<<5)	// Stream FIQ samples to read() until closed
+#define PAN_FLAG_CORE			(1<<6)	// Sample on a spare CPU, with the others running
+#define PAN_FLAG_ARM_IRQ		(1<<7)	// Let interrupts run until the trigger fires
+#define PAN_FLAG_COUNT			(1<<8)	// Count edges per gate_ms window, rather than store samples
+#define PAN_FLAG_EVENTS			(1<<9)	// Record levels from GPIO edge interrupts, rather than sample
+#define PAN_FLAG_GLITCH			(1<<10)	// Also record which channels had an edge since the last sample
+#define PAN_FLAG_DUAL_RATE		(1<<11)	// Full rate around the trigger, decimated either side
+
+/*
+ * A trigger wait with interrupts disabled freezes the Pi, so timeout_ms is
+ * limited to PAN_MAX_OFF_TIMEOUT_MS past the time it takes to fill the
+ * buffer, unless interrupts run while waiting: PAN_FLAG_SEGMENTED,
+ * PAN_FLAG_ARM_IRQ, the FIQ or the spare core.  With PAN_FLAG_ARM_IRQ the
+ * pre-trigger samples have gaps as in segmented mode, but once the trigger
+ * fires interrupts stay off until the capture is done.
+ */
+#define PAN_MAX_TIMEOUT_MS		600000
+#define PAN_MAX_OFF_TIMEOUT_MS	1000
+
+/*
+ * Likewise the capture itself.  The polled loop runs with interrupts off
+ * throughout, so it only takes up to PAN_MAX_OFF_CAPTURE_MS of samples;
+ * longer captures need one of PAN_FLAGS_IRQS_ON.  PAN_FLAG_ARM_IRQ isn't
+ * one, as interrupts are off after the trigger, but it only limits the
+ * samples after the trigger to PAN_MAX_OFF_CAPTURE_MS.
+ */
+#define PAN_MAX_OFF_CAPTURE_MS	2000
+#define PAN_FLAGS_IRQS_ON		(PAN_FLAG_SEGMENTED | PAN_FLAG_FIQ | \
+								 PAN_FLAG_CORE | PAN_FLAG_EVENTS | PAN_FLAG_STREAM)
+
+/*
+ * In stream mode reading the header starts the FIQ, and after the header
+ * read() and splice() return raw uint32_t samples for as long as the
+ * device is held open, blocking until there are some.  Samples the reader
+ * was too slow for are dropped and counted in overruns; read the header
+ * again (pread() at offset 0) to see the count and elapsed_us so far.
+ */
+
+/*
+ * In packed mode the channel_mask bits of each sample are gathered down in
+ * to consecutive bits, lowest GPIO first.  With up to four channels two
+ * samples share a byte, earliest in the low nibble; otherwise each sample
+ * is a byte.  See pan_pack_bits() in pantrigger.h.
+ */
+
+/*
+ * In transition mode the data is num_records of these, rather than one
+ * uint32_t per sample.  sample is relative to the start of the capture, and
+ * the first record gives the levels at sample 0.
+ */
+struct pantrans_s {
+	uint32_t	sample;
+	uint32_t	levels;
+};
+typedef struct pantrans_s pantrans_t;
+
+/*
+ * In event mode nothing samples the levels.  GPIO edge interrupts on the
+ * channel_mask channels record them instead, with interrupts otherwise
+ * enabled throughout, so slow signals can be watched for as long as you
+ * like for next to nothing.  The data is as in transition mode, with
+ * sample_rate and achieved_rate set to 1MHz so sample is in microseconds.
+ * The capture lasts as long as num_samples would at sample_rate, up to 71
+ * minutes, and keeps the last num_records records; there is no trigger.
+ * overruns counts edges that had gone again by the time the levels were
+ * read.  With PAN_FLAG_STREAM, read() returns pantrans_t records after
+ * the header until the device is closed.
+ */
+
+/*
+ * In glitch mode the GPIO event detect latches are armed for both edges on
+ * the channel_mask channels, and read and cleared with every sample, so a
+ * pulse too short to be sampled still leaves its mark.  The samples are
+ * followed, at PAN_GAP_OFFSET(), by a byte per sample with a bit for each
+ * channel that had an edge since the sample before, gathered as in packed
+ * mode.  Unlike the samples the bytes are oldest first.  A channel with
+ * an edge but the same level as the sample before glitched; see
+ * pan_glitches() in pantrigger.h, which the trigger's glitch channels use
+ * too.  A channel can't have both glitch and edge conditions.  Only the
+ * polled capture loop, with interrupts off throughout, does glitch mode,
+ * for up to 8 channels.
+ */
+
+/*
+ * In counter mode the data is num_records of these, oldest first, one for
+ * each gate_ms window, rather than the samples.  Each is followed by a
+ * pancount_ch_t for every channel in channel_mask, lowest GPIO first, so a
+ * record is PAN_COUNT_BYTES(channels) long.  sample is relative to the
+ * start of the first window, and the last window may be short.  Up to
+ * MAX_CHANNELS channels can be counted.
+ */
+struct pancount_s {
+	uint32_t	sample;
+	uint32_t	samples;
+};
+typedef struct pancount_s pancount_t;
+
+struct pancount_ch_s {
+	uint32_t	rising;
+	uint32_t	falling;
+	uint32_t	high;			// Samples the channel was high for
+};
+typedef struct pancount_ch_s pancount_ch_t;
+
+#define PAN_COUNT_BYTES(channels)	(sizeof(pancount_t) + (channels) * sizeof(pancount_ch_t))
+
+/*
+ * In dual rate mode samples are kept at full rate for window_samples around
+ * the trigger, placed as trigger_point says, and 1 in decimate either side,
+ * so num_samples covers far more time than the buffer holds at full rate.
+ * The data is num_records whole samples, oldest first, and num_samples is
+ * the number of full rate sample times they cover.  After the data come
+ * num_regions of these, one per run of samples at the same rate, in order.
+ * sample is the full rate sample number of the first, on the same scale as
+ * trigger_index, and each stands for step full rate samples.  Only the
+ * polled capture loop, without segments or gaps, does dual rate mode.
+ * Gaps would need their own records, where the regions go, and would
+ * break up the full rate window.  So interrupts are off for the whole
+ * time num_samples covers, and PAN_MAX_OFF_CAPTURE_MS limits it.
+ */
+struct panregion_s {
+	uint32_t	index;			// First sample in the data
+	uint32_t	sample;
+	uint32_t	samples;
+	uint32_t	step;
+};
+typedef struct panregion_s panregion_t;
+
+#define PAN_MAX_REGIONS		3
+#define PAN_MAX_DECIMATE	1000
+
+/*
+ * In segmented mode interrupts are enabled briefly every irq_window_us (a
+ * module parameter), and the samples due while they were enabled are
+ * filled in with the last sample taken, so the time axis stays linear.
+ * Each hole is described by one of these, following the data and padded
+ * to a four byte boundary.  sample is relative to the start of the data,
+ * and us is the time sampling stopped for, from the system timer.
+ */
+struct pangap_s {
+	uint32_t	sample;
+	uint32_t	missed;
+	uint32_t	us;
+};
+typedef struct pangap_s pangap_t;
+
+#define PAN_MAX_GAPS	1024
+
+/*
+ * With num_segments > 1 the buffer is split in to that many equal rings,
+ * each filled by its own trigger straight after the last one completed, so
+ * nothing is missed while user space re-arms.  The data is the rings in
+ * order, each starting at its own first_data_index, followed by one of
+ * these per segment filled; the last may be short of a trigger if the
+ * capture timed out.  Sample and time are from the start of the capture,
+ * which runs without a break across all the segments.
+ */
+struct panseg_s {
+	uint32_t	first_data_index;	// Oldest sample in this segment's ring
+	uint32_t	trigger_index;		// Relative to that, or PAN_NO_TRIGGER
+	uint32_t	trigger_sample;		// Or PAN_NO_TRIGGER
+	uint32_t	trigger_us;
+};
+typedef struct panseg_s panseg_t;
+
+#define PAN_MAX_SEGMENTS	64
+
+/*
+ * With PAN_FLAG_DMA_SWEEP, pandriver-dma.ko returns num_records of these
+ * instead of samples, one for each combination of DMA burst length, wait
+ * states and channel priority it tried.  Each is measured by having the
+ * DMA engine copy the 250MHz ARM counter flat out; the gaps between
+ * copies are in 4ns ticks.
+ */
+struct pandmastat_s {
+	uint32_t	burst;
+	uint32_t	waits;
+	uint32_t	priority;
+	uint32_t	samples;
+	uint32_t	min;
+	uint32_t	p50;
+	uint32_t	p99;
+	uint32_t	p999;
+	uint32_t	max;
+	uint32_t	rate;		// Copies per second
+};
+typedef struct pandmastat_s pandmastat_t;
+
+/*
+ * ioctls, as an alternative to write()ing the header and having the first
+ * read() of it run the capture.  PAN_IOC_ARM starts the capture in the
+ * background and returns at once; poll() says POLLIN when it is done, and
+ * then PAN_IOC_STATUS gives the result, PAN_IOC_GET_HEADER the filled in
+ * header, and the data is read() from just after the header, or mmap()ed,
+ * as usual.  PAN_IOC_CANCEL stops a capture that is waiting for a trigger
+ * and keeps what it has, with abort_reason PAN_ABORT_CANCELLED; a capture
+ * with interrupts disabled throughout can only run to its timeout.
+ * User space needs <sys/ioctl.h> before this file.
+ */
+struct panstatus_s {
+	uint32_t	state;			// PAN_STATE_xxx
+	int32_t		result;			// 0, or -errno if the capture failed
+};
+typedef struct panstatus_s panstatus_t;
+
+#define PAN_STATE_IDLE		0
+#define PAN_STATE_ARMED		1
+#define PAN_STATE_DONE		2
+
+#define PAN_IOC_MAGIC		'P'
+#define PAN_IOC_CONFIGURE	_IOW(PAN_IOC_MAGIC, 1, panctl_t)
+#define PAN_IOC_ARM			_IO(PAN_IOC_MAGIC, 2)
+#define PAN_IOC_STATUS		_IOR(PAN_IOC_MAGIC, 3, panstatus_t)
+#define PAN_IOC_CANCEL		_IO(PAN_IOC_MAGIC, 4)
+#define PAN_IOC_GET_HEADER	_IOR(PAN_IOC_MAGIC, 5, panctl_t)
+
+/*
+ * Each open of the device has its own settings and its own capture, and a
+ * finished capture is shared rather than copied.  PAN_IOC_ATTACH gives
+ * this file the most recent capture any file on the device completed, so a
+ * second reader (a recorder alongside the UI, say) can read() or mmap() it
+ * from offset 0 without capturing again.  ENOENT if there hasn't been one.
+ * Only one capture or stream runs at a time; the others get EBUSY.
+ */
+#define PAN_IOC_ATTACH		_IO(PAN_IOC_MAGIC, 6)
+
+// Offset of the gap or segment records from the start of data_bytes bytes of data
+#define PAN_GAP_OFFSET(data_bytes)	(((data_bytes) + 3) & ~3)
+
+/*
+ * The most num_samples and num_records the drivers accept, which keeps
+ * every buffer size well inside 32 bits.  How much of that a capture can
+ * really have depends on the memory the driver gets; see reserve_mb.
+ */
+#define PAN_MAX_SAMPLES		(1 << 28)
+#define PAN_MAX_RECORDS		(1 << 24)
+
 #define MAX_CHANNELS	8
 
+#define DEF_RECORDS		262144
+#define DEF_GATE_MS		10
+#define DEF_WINDOW		1000
+#define DEF_DECIMATE	100
+
+#define MIN_SAMPLE_RATE	10000
+#define MAX_SAMPLE_RATE	5000000
+#define DEF_SAMPLE_RATE	1000000
+
+// sample_rate is in Hz; older clients send 1, meaning the original fixed 1MHz
+#define PAN_SAMPLE_RATE(p)	((p)->sample_rate > 1 ? (p)->sample_rate : DEF_SAMPLE_RATE)
+
+// Samples after the trigger, of n, for trigger_point; n * 19 / 20 would overflow
+#define PAN_POST_TRIGGER(n, point)	((point) == 0 ? (n) - (n) / 20 : \
+									 (point) == 1 ? (n) / 2 : (n) / 20)
+
 #define DEF_CHANNELS	{ 4,17,18,21 }
 //#define DEF_CHANNELS	{ 5,4,3,2,1,0 }
 
@@ -51,9 +337,14 @@ typedef panctl_t *panctl_p;
 		.magic			= PAN_MAGIC, \
 		.version		= PAN_VERSION, \
 		.channel_mask	= 1<<4|1<<17|1<<18|1<<21, \
-		.sample_rate	= 1, \
+		.sample_rate	= DEF_SAMPLE_RATE, \
 		.num_samples	= 10000, \
 		.trigger_point	= 0, \
+		.num_records	= DEF_RECORDS, \
+		.gate_ms		= DEF_GATE_MS, \
+		.window_samples	= DEF_WINDOW, \
+		.decimate		= DEF_DECIMATE, \
+		.trigger_index	= PAN_NO_TRIGGER, \
 	}
 
 #endif /* PANALYZER_H_ */
@@ -0,0 +1,472 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The per-sample half of the capture engines: storing each sample as whole
+ * words, packed channels, transitions, counts or at dual rates, running the
+ * trigger on it, and moving on through the segments.  Plain C with no
+ * kernel dependencies, so everything a sampling loop does between two reads
+ * of pan_read_level() can be built and run anywhere.  Turning the finished
+ * ring in to what read() returns is left to the driver.
+ */
+
+#ifndef PANCAP_H_
+#define PANCAP_H_
+
+#include "pantrigger.h"
+#include "pancount.h"
+#include "pandual.h"
+
+/*
+ * Sample pacing off a free-running counter of hz: the period in counter
+ * ticks, plus 8 bits of fraction for rates that don't divide hz exactly,
+ * and the count the next sample is due at.
+ */
+struct cap_pace_s {
+	uint32_t	period, period_frac, frac;
+	uint32_t	next;
+};
+
+static inline void cap_pace_init(struct cap_pace_s *p, uint32_t hz, uint32_t rate, uint32_t now)
+{
+	p->period = hz / rate;
+	p->period_frac = ((hz % rate) << 8) / rate;
+	p->frac = 0;
+	p->next = now + p->period;
+}
+
+// Whether the next sample is due at counter value now; wrap safe
+static inline int cap_pace_due(const struct cap_pace_s *p, uint32_t now)
+{
+	return (int32_t)(now - p->next) >= 0;
+}
+
+/*
+ * How late the sample due is, if it is taken at now, counting it in
+ * *overruns if that's a whole period or more.
+ */
+static inline uint32_t cap_pace_late(const struct cap_pace_s *p, uint32_t now, int *overruns)
+{
+	uint32_t late = now - p->next;
+
+	if (late >= p->period)
+		(*overruns)++;
+
+	return late;
+}
+
+// On to the sample after
+static inline void cap_pace_step(struct cap_pace_s *p)
+{
+	p->frac += p->period_frac;
+	p->next += p->period + (p->frac >> 8);
+	p->frac &= 0xff;
+}
+
+/*
+ * Where the capture is storing samples, and how far it has got with the
+ * trigger, so the engines and the gap filling all do it the same way.
+ */
+struct cap_s {
+	const panctl_t	*ctl;
+	uint8_t		(*pack_gather)[256];
+	panseg_t	*segments;
+	uint32_t	*buf_start, *buf_end, *buf_ptr;
+	pantrans_t	*rec_start, *rec_end, *rec_ptr;
+	uint8_t		*pack_start, *pack_end, *pack_ptr;
+	uint8_t		*glitch_start;		// A byte for each word from buf_start, in glitch mode
+	pan_count_t	count;
+	pan_dual_t	dual;
+	uint8_t		pair;
+	int			transitions, counting, dualing, packed, nibbles, glitching, wrapped;
+	uint32_t	mask, levels;
+	uint32_t	sample_count;
+	int			pre_trigger, post_trigger;
+	int			stages, start, state;
+	int32_t		state_samples;
+	uint32_t	prev;				// Last sample the trigger saw, for edges
+	uint32_t	glitches, late;		// See pan_glitches()
+	uint32_t	trigger_count;
+	int			seg, segs;
+	uint32_t	seg_samples;		// The whole buffer, unless there are segments
+	uint32_t	seg_first;			// sample_count when this segment started
+};
+
+// Start waiting for the trigger again, for a new segment
+static void cap_arm(struct cap_s *c)
+{
+	c->post_trigger = PAN_POST_TRIGGER(c->seg_samples, c->ctl->trigger_point);
+	c->pre_trigger = c->seg_samples - c->post_trigger;
+	c->state = c->stages ? c->start : -1;
+	c->state_samples = c->ctl->trigger[0].min_samples;
+	c->trigger_count = PAN_NO_TRIGGER;
+	c->seg_first = c->sample_count;
+}
+
+/*
+ * Start a capture as ctl describes, in to the bytes at buffer, with stages
+ * trigger stages compiled in to t.  pack_gather is for PAN_FLAG_PACKED and
+ * PAN_FLAG_GLITCH, and segments takes a record per segment.
+ */
+static void cap_init(struct cap_s *c, const panctl_t *ctl, const pan_trig_t *t, int stages,
+		uint32_t *buffer, uint32_t bytes, uint8_t pack_gather[4][256], panseg_t *segments)
+{
+	memset(c, 0, sizeof(*c));
+	c->ctl = ctl;
+	c->pack_gather = pack_gather;
+	c->segments = segments;
+	c->segs = ctl->num_segments > 1 ? ctl->num_segments : 1;
+	c->seg_samples = ctl->num_samples / c->segs;
+	c->buf_start = c->buf_ptr = buffer;
+	c->buf_end = buffer + c->seg_samples;
+	c->rec_start = c->rec_ptr = (pantrans_t *)buffer;
+	c->rec_end = c->rec_start + ctl->num_records;
+	c->pack_start = c->pack_ptr = (uint8_t *)buffer;
+	c->pack_end = c->pack_start + bytes;
+	c->transitions = ctl->flags & PAN_FLAG_TRANSITIONS;
+	c->counting = ctl->flags & PAN_FLAG_COUNT;
+	if (c->counting)
+		pan_count_init(&c->count, ctl->channel_mask,
+				pan_count_gate(ctl->gate_ms, PAN_SAMPLE_RATE(ctl)), buffer, ctl->num_records);
+	c->packed = ctl->flags & PAN_FLAG_PACKED;
+	c->nibbles = pan_pack_bits(ctl->channel_mask) == 4;
+	c->glitching = ctl->flags & PAN_FLAG_GLITCH;
+	c->glitch_start = (uint8_t *)(buffer + ctl->num_samples);
+	c->mask = ctl->channel_mask;
+	c->levels = ~c->mask;
+	c->stages = stages;
+	c->start = t->start;
+	cap_arm(c);
+	c->dualing = ctl->flags & PAN_FLAG_DUAL_RATE;
+	if (c->dualing) {
+		pan_dual_init(&c->dual, buffer, ctl->num_records, ctl->window_samples, ctl->decimate,
+				ctl->trigger_point == 0 ? 19 : ctl->trigger_point == 1 ? 10 : 1);
+		c->pre_trigger = pan_dual_pre_samples(&c->dual);
+		c->post_trigger = pan_dual_post_samples(&c->dual);
+	}
+}
+
+/*
+ * In glitch mode, store the event latches read just before sample, ahead
+ * of storing the sample itself.
+ */
+static inline void cap_latch(struct cap_s *c, uint32_t sample, uint32_t events)
+{
+	uint32_t changed = sample ^ c->prev;
+
+	c->glitches = pan_glitches(events, changed, c->late);
+	c->late = changed & ~events;
+	c->glitch_start[c->buf_ptr - c->buf_start] = pan_gather(c->pack_gather, events);
+}
+
+static inline void cap_store(struct cap_s *c, uint32_t sample)
+{
+	if (c->transitions) {
+		if ((sample & c->mask) != c->levels) {
+			c->levels = sample & c->mask;
+			c->rec_ptr->sample = c->sample_count;
+			c->rec_ptr->levels = c->levels;
+			if (++c->rec_ptr == c->rec_end) {
+				c->rec_ptr = c->rec_start;
+				c->wrapped = 1;
+			}
+		}
+	} else if (c->counting) {
+		pan_count_sample(&c->count, sample);
+	} else if (c->dualing) {
+		pan_dual_store(&c->dual, sample);
+	} else if (c->packed) {
+		if (c->nibbles) {
+			c->pair = (c->pair >> 4) | (pan_gather(c->pack_gather, sample) << 4);
+			if (c->sample_count & 1) {
+				*c->pack_ptr++ = c->pair;
+				if (c->pack_ptr == c->pack_end)
+					c->pack_ptr = c->pack_start;
+			}
+		} else {
+			*c->pack_ptr++ = pan_gather(c->pack_gather, sample);
+			if (c->pack_ptr == c->pack_end)
+				c->pack_ptr = c->pack_start;
+		}
+	} else {
+		*c->buf_ptr++ = sample;
+		if (c->buf_ptr == c->buf_end)
+			c->buf_ptr = c->buf_start;
+	}
+	c->sample_count++;
+}
+
+// The oldest sample still in the current segment's ring
+static uint32_t cap_oldest(struct cap_s *c)
+{
+	return c->sample_count - c->seg_first > c->seg_samples ?
+			c->sample_count - c->seg_samples : c->seg_first;
+}
+
+static void seg_record(struct cap_s *c)
+{
+	panseg_t *s = &c->segments[c->seg];
+	uint32_t oldest = cap_oldest(c);
+
+	s->first_data_index = c->buf_ptr - c->buf_start;
+	s->trigger_sample = c->trigger_count;
+	if (c->trigger_count != PAN_NO_TRIGGER && c->trigger_count >= oldest)
+		s->trigger_index = c->trigger_count - oldest;
+	else
+		s->trigger_index = PAN_NO_TRIGGER;
+	s->trigger_us = 0;
+}
+
+/*
+ * The current segment is complete; record it and move on to the next one,
+ * re-arming the trigger without a break in the sampling.  Returns 1 when
+ * that was the last segment, so the capture is done.
+ */
+static int cap_next(struct cap_s *c)
+{
+	if (c->segs == 1)
+		return 1;
+	seg_record(c);
+	if (++c->seg == c->segs)
+		return 1;
+	c->buf_start = c->buf_ptr = c->buf_end;
+	c->buf_end += c->seg_samples;
+	cap_arm(c);
+
+	return 0;
+}
+
+/*
+ * Once a segmented capture is done, record the segment it stopped in, if
+ * it stopped short of the last, and fill in the header from the records.
+ * The segments' trigger times are left to the caller.
+ */
+static void cap_seg_finish(struct cap_s *c, panctl_t *p)
+{
+	if (c->seg < c->segs) {
+		seg_record(c);
+		c->seg++;
+	}
+	p->first_data_index = 0;
+	p->trigger_index = c->segments[0].trigger_index;
+	p->segments_filled = c->seg;
+}
+
+// Past the pre-trigger samples and still waiting for the trigger
+static inline int cap_waiting(struct cap_s *c)
+{
+	return c->pre_trigger <= 0 && c->state >= 0;
+}
+
+// Run the trigger on the sample just stored; returns 1 when we're done
+static inline int cap_trigger(struct cap_s *c, const pan_trig_t *t, uint32_t sample)
+{
+	if (c->pre_trigger > 0) {
+		// With no trigger stages, the window is where the pre-trigger samples end
+		if (--c->pre_trigger == 0 && c->state < 0 && c->dualing)
+			pan_dual_trigger(&c->dual);
+	} else if (c->state < 0) {
+		if (--c->post_trigger <= 0)
+			return cap_next(c);
+	} else {
+		uint32_t changed = sample ^ c->prev;
+
+		if (c->glitching)
+			changed = pan_trig_changes(t, changed, c->glitches);
+		c->state = pan_trig_step(t, c->state, &c->state_samples, sample, changed);
+		if (c->state == PAN_TRIG_FIRED) {
+			c->state = -1;
+			c->trigger_count = c->sample_count - 1;
+			if (c->dualing)
+				pan_dual_trigger(&c->dual);
+		}
+	}
+	c->prev = sample;
+
+	return 0;
+}
+
+/*
+ * Store n copies of sample for samples we missed, without running the
+ * trigger on them.  Returns 1 if that completes the capture.
+ */
+static int cap_fill(struct cap_s *c, uint32_t sample, uint32_t n)
+{
+	while (n--) {
+		cap_store(c, sample);
+		if (c->pre_trigger > 0)
+			c->pre_trigger--;
+		else if (c->state < 0 && --c->post_trigger <= 0 && cap_next(c))
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * The holes where interrupts ran, num of them in gaps, oldest first.
+ * Forget those entirely before sample oldest, which the ring has already
+ * overwritten, and make room for at least one more.
+ */
+static void cap_gap_forget(pangap_t *gaps, uint32_t *num, uint32_t oldest)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < *num; i++)
+		if (gaps[i].sample + gaps[i].missed > oldest)
+			gaps[n++] = gaps[i];
+	if (n == PAN_MAX_GAPS)
+		memmove(gaps, gaps + 1, --n * sizeof(pangap_t));
+	*num = n;
+}
+
+// There must be room, from cap_gap_forget()
+static void cap_gap_add(pangap_t *gaps, uint32_t *num, uint32_t sample, uint32_t missed,
+		uint32_t us)
+{
+	gaps[*num].sample = sample;
+	gaps[*num].missed = missed;
+	gaps[(*num)++].us = us;
+}
+
+// Rebase the gaps to start_count, the first sample returned
+static void cap_gap_finish(pangap_t *gaps, uint32_t *num, uint32_t start_count)
+{
+	uint32_t i;
+
+	cap_gap_forget(gaps, num, start_count);
+	for (i = 0; i < *num; i++) {
+		if (gaps[i].sample < start_count) {
+			gaps[i].missed -= start_count - gaps[i].sample;
+			gaps[i].sample = start_count;
+		}
+		gaps[i].sample -= start_count;
+	}
+}
+
+/*
+ * Where the oldest sample is in the packed ring, once the capture is done.
+ * With nibbles and an odd number of samples the last one is still in pair,
+ * so it goes in the low half of the next byte, over the oldest.
+ */
+static uint32_t cap_pack_finish(struct cap_s *c)
+{
+	uint32_t first = c->pack_ptr - c->pack_start;
+
+	if (!c->nibbles)
+		return first;
+	if (c->sample_count & 1) {
+		*c->pack_ptr = (*c->pack_ptr & 0xf0) | (c->pair >> 4);
+		return first * 2 + 1;
+	}
+
+	return first * 2;
+}
+
+/*
+ * Fill in what the header says about how the capture went, other than the
+ * times, once start_count is the number of the first sample returned.
+ */
+static void cap_report(const struct cap_s *c, panctl_t *p, uint32_t start_count, int overruns,
+		int abort_reason)
+{
+	if (c->trigger_count != PAN_NO_TRIGGER && c->trigger_count >= start_count)
+		p->trigger_index = c->trigger_count - start_count;
+	else
+		p->trigger_index = PAN_NO_TRIGGER;
+	p->overruns = overruns;
+	p->abort_reason = abort_reason;
+}
+
+static void cap_trans_reverse(pantrans_t *rec, uint32_t n)
+{
+	pantrans_t tmp;
+	uint32_t i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = rec[i];
+		rec[i] = rec[n - 1 - i];
+		rec[n - 1 - i] = tmp;
+	}
+}
+
+/*
+ * Turn the ring of size transition records at rec, with the next one due
+ * at next, in to a list covering the last *samples of total samples, with
+ * sample numbers relative to the start of that window.  If the ring
+ * overflowed the window starts at the oldest record we still have, and
+ * *samples is reduced to match.  Returns the number of records.
+ */
+static uint32_t cap_trans_finish(pantrans_t *rec, uint32_t size, uint32_t next, int wrapped,
+		uint32_t total, uint32_t *samples)
+{
+	uint32_t count = wrapped ? size : next;
+	uint32_t start = total > *samples ? total - *samples : 0;
+	uint32_t i, skip;
+
+	if (wrapped && next) {
+		cap_trans_reverse(rec, next);
+		cap_trans_reverse(rec + next, count - next);
+		cap_trans_reverse(rec, count);
+	}
+
+	for (skip = 0; skip + 1 < count && rec[skip + 1].sample <= start; skip++)
+		;
+	if (count) {
+		if (rec[skip].sample > start)
+			start = rec[skip].sample;
+		rec[skip].sample = start;
+	}
+	for (i = skip; i < count; i++) {
+		rec[i - skip].sample = rec[i].sample - start;
+		rec[i - skip].levels = rec[i].levels;
+	}
+	*samples = total - start;
+
+	return count - skip;
+}
+
+static void cap_glitch_reverse(uint8_t *g, uint32_t n)
+{
+	uint8_t tmp;
+	uint32_t i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = g[i];
+		g[i] = g[n - 1 - i];
+		g[n - 1 - i] = tmp;
+	}
+}
+
+/*
+ * Put the glitch mode latch bytes oldest first, after the ring of
+ * num_samples whose oldest is at first, so they line up with the samples
+ * once those are read from there.
+ */
+static void cap_glitch_finish(struct cap_s *c, uint32_t first, uint32_t num_samples)
+{
+	uint8_t *g = c->glitch_start;
+
+	if (first) {
+		cap_glitch_reverse(g, first);
+		cap_glitch_reverse(g + first, num_samples - first);
+		cap_glitch_reverse(g, num_samples);
+	}
+}
+
+#endif /* PANCAP_H_ */
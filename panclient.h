@@ -0,0 +1,80 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The UI's side of the ioctl control API in panalyzer.h: configure and arm
+ * a capture, and once poll() says it is done, fetch its result and header.
+ * Plain C without GTK, so it can be run against a stub device; define
+ * pan_ioctl() before including this to use something other than ioctl().
+ */
+
+#ifndef PANCLIENT_H_
+#define PANCLIENT_H_
+
+#include <errno.h>
+#include <sys/ioctl.h>
+#include "panalyzer.h"
+
+#ifndef pan_ioctl
+#define pan_ioctl(fd, req, arg)	ioctl(fd, req, arg)
+#endif
+
+/*
+ * Configure fd with ctl and arm it.  Returns 0 once armed, 1 if the driver
+ * has no ioctls, so the header has to be written and read instead, or
+ * -errno.
+ */
+static inline int pan_client_arm(int fd, panctl_t *ctl)
+{
+	if (pan_ioctl(fd, PAN_IOC_CONFIGURE, ctl) < 0)
+		return errno == ENOTTY ? 1 : -errno;
+	if (pan_ioctl(fd, PAN_IOC_ARM, NULL) < 0)
+		return -errno;
+
+	return 0;
+}
+
+// Stop waiting for the trigger; the capture finishes with what it has
+static inline void pan_client_cancel(int fd)
+{
+	pan_ioctl(fd, PAN_IOC_CANCEL, NULL);
+}
+
+// Once poll() says fd is ready, the capture's result: 0, or -errno
+static inline int pan_client_result(int fd)
+{
+	panstatus_t st;
+
+	if (pan_ioctl(fd, PAN_IOC_STATUS, &st) < 0)
+		return -errno;
+	if (st.state == PAN_STATE_ARMED)
+		return -EBUSY;
+
+	return st.result;
+}
+
+// The finished capture's header in ctl; 0, or -errno
+static inline int pan_client_header(int fd, panctl_t *ctl)
+{
+	if (pan_ioctl(fd, PAN_IOC_GET_HEADER, ctl) < 0)
+		return -errno;
+
+	return 0;
+}
+
+#endif /* PANCLIENT_H_ */
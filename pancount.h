@@ -0,0 +1,199 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Counter mode: edge counts and high time per channel, accumulated over
+ * gate windows and written out as one record per window, in place of the
+ * samples.  Plain C with no kernel dependencies.
+ *
+ * Nothing is done per channel unless a channel changed, so a sample with
+ * no edges costs a compare.  High time comes from the edges too: a channel
+ * going high takes the sample number off its total and going low adds it
+ * back, and a channel still high when the window closes adds the end.
+ */
+
+#ifndef PANCOUNT_H_
+#define PANCOUNT_H_
+
+struct pan_count_s {
+	uint32_t	bit[MAX_CHANNELS];	// Each channel's GPIO, lowest first
+	int			channels;
+	uint32_t	mask;
+	uint32_t	gate;				// Samples per window
+	uint32_t	left;				// Samples to the end of this one
+	uint32_t	n;					// Samples so far
+	uint32_t	start;				// Sample this window started on
+	uint32_t	prev;
+	uint32_t	rising[MAX_CHANNELS];
+	uint32_t	falling[MAX_CHANNELS];
+	uint32_t	high[MAX_CHANNELS];
+	uint32_t	*rec_start, *rec_end, *rec_ptr;
+	uint32_t	rec_words;
+	int			wrapped;
+};
+typedef struct pan_count_s pan_count_t;
+
+static inline int pan_count_channels(uint32_t mask)
+{
+	int n = 0;
+
+	for (; mask; mask &= mask - 1)
+		n++;
+
+	return n;
+}
+
+// Samples in gate_ms at rate Hz, in 32 bits; 0 if that doesn't fit
+static inline uint32_t pan_count_gate(uint32_t gate_ms, uint32_t rate)
+{
+	uint32_t s = gate_ms / 1000, ms = gate_ms % 1000;
+
+	if (s >= 0xffffffff / rate)
+		return 0;
+
+	return s * rate + ms * (rate / 1000) + ms * (rate % 1000) / 1000;
+}
+
+/*
+ * Count the channels in mask over windows of gate samples, in to a ring of
+ * records at buffer.  Returns -1 if there are too many channels.
+ */
+static inline int pan_count_init(pan_count_t *pc, uint32_t mask, uint32_t gate,
+		uint32_t *buffer, uint32_t records)
+{
+	uint32_t m;
+
+	memset(pc, 0, sizeof(*pc));
+	if (pan_count_channels(mask) > MAX_CHANNELS)
+		return -1;
+	for (m = mask; m; m &= m - 1)
+		pc->bit[pc->channels++] = m & ~(m - 1);
+	pc->mask = mask;
+	pc->gate = pc->left = gate;
+	pc->rec_words = PAN_COUNT_BYTES(pc->channels) / sizeof(uint32_t);
+	pc->rec_start = pc->rec_ptr = buffer;
+	pc->rec_end = buffer + records * pc->rec_words;
+
+	return 0;
+}
+
+static inline void pan_count_edges(pan_count_t *pc, uint32_t sample, uint32_t changed)
+{
+	int i;
+
+	for (i = 0; i < pc->channels; i++) {
+		if (!(changed & pc->bit[i]))
+			continue;
+		if (sample & pc->bit[i]) {
+			// The levels at sample 0 aren't an edge
+			if (pc->n)
+				pc->rising[i]++;
+			pc->high[i] -= pc->n;
+		} else {
+			pc->falling[i]++;
+			pc->high[i] += pc->n;
+		}
+	}
+}
+
+// Write the record for the window ending before sample n, and start another
+static inline void pan_count_close(pan_count_t *pc)
+{
+	pancount_t *r = (pancount_t *)pc->rec_ptr;
+	pancount_ch_t *ch = (pancount_ch_t *)(r + 1);
+	int i;
+
+	r->sample = pc->start;
+	r->samples = pc->n - pc->start;
+	for (i = 0; i < pc->channels; i++) {
+		ch[i].rising = pc->rising[i];
+		ch[i].falling = pc->falling[i];
+		ch[i].high = pc->high[i] + (pc->prev & pc->bit[i] ? pc->n : 0);
+		pc->rising[i] = pc->falling[i] = 0;
+		pc->high[i] = pc->prev & pc->bit[i] ? -pc->n : 0;
+	}
+	pc->rec_ptr += pc->rec_words;
+	if (pc->rec_ptr == pc->rec_end) {
+		pc->rec_ptr = pc->rec_start;
+		pc->wrapped = 1;
+	}
+	pc->start = pc->n;
+	pc->left = pc->gate;
+}
+
+static inline void pan_count_sample(pan_count_t *pc, uint32_t sample)
+{
+	uint32_t changed = (sample ^ pc->prev) & pc->mask;
+
+	if (changed)
+		pan_count_edges(pc, sample, changed);
+	pc->prev = sample;
+	pc->n++;
+	if (--pc->left == 0)
+		pan_count_close(pc);
+}
+
+static inline void pan_count_reverse(uint32_t *w, uint32_t n)
+{
+	uint32_t tmp, i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = w[i];
+		w[i] = w[n - 1 - i];
+		w[n - 1 - i] = tmp;
+	}
+}
+
+/*
+ * Close the last, partial window, and turn the ring in to a list at the
+ * start of the buffer, oldest first, leaving out windows that ended before
+ * sample first.  Sample numbers become relative to the first window kept,
+ * whose start is returned in *start.  Returns the number of windows.
+ */
+static inline uint32_t pan_count_finish(pan_count_t *pc, uint32_t first, uint32_t *start)
+{
+	uint32_t *rec = pc->rec_start;
+	uint32_t next, count, skip, i;
+	pancount_t *r;
+
+	if (pc->n != pc->start)
+		pan_count_close(pc);
+	next = (pc->rec_ptr - pc->rec_start) / pc->rec_words;
+	count = pc->wrapped ? (pc->rec_end - pc->rec_start) / pc->rec_words : next;
+	if (pc->wrapped && next) {
+		pan_count_reverse(rec, next * pc->rec_words);
+		pan_count_reverse(rec + next * pc->rec_words, (count - next) * pc->rec_words);
+		pan_count_reverse(rec, count * pc->rec_words);
+	}
+
+	for (skip = 0; skip < count; skip++) {
+		r = (pancount_t *)(rec + skip * pc->rec_words);
+		if (r->sample + r->samples > first)
+			break;
+	}
+	count -= skip;
+	if (skip && count)
+		memmove(rec, rec + skip * pc->rec_words, count * pc->rec_words * sizeof(uint32_t));
+	*start = count ? ((pancount_t *)rec)->sample : pc->n;
+	for (i = 0; i < count; i++)
+		((pancount_t *)(rec + i * pc->rec_words))->sample -= *start;
+
+	return count;
+}
+
+#endif /* PANCOUNT_H_ */
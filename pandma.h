@@ -0,0 +1,145 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * DMA control block chains for pandriver-dma.c.  This is plain C with no
+ * kernel dependencies, so the chains can be checked anywhere.
+ *
+ * Each sample takes two control blocks.  The first writes a dummy word to
+ * the PWM FIFO, and as it waits for the PWM DREQ it is what sets the pace;
+ * the second copies GPLEV0 in to the next slot of the sample ring.  The
+ * last block links back to the first, so the DMA engine runs round the
+ * ring until it is stopped, with no CPU involvement.  The PWM serialiser
+ * takes one FIFO word every range cycles of PAN_DMA_PWM_CLK.
+ */
+
+#ifndef PANDMA_H_
+#define PANDMA_H_
+
+// Same layout as struct bcm2708_dma_cb; must be 32 byte aligned
+struct pan_dma_cb_s {
+	uint32_t	info;
+	uint32_t	src;
+	uint32_t	dst;
+	uint32_t	length;
+	uint32_t	stride;
+	uint32_t	next;
+	uint32_t	pad[2];
+};
+typedef struct pan_dma_cb_s pan_dma_cb_t;
+
+#define PAN_DMA_TI_WAIT_RESP		(1<<3)
+#define PAN_DMA_TI_D_INC			(1<<4)
+#define PAN_DMA_TI_D_WIDTH			(1<<5)
+#define PAN_DMA_TI_D_DREQ			(1<<6)
+#define PAN_DMA_TI_BURST(x)			((x)<<12)
+#define PAN_DMA_TI_PERMAP(x)		((x)<<16)
+#define PAN_DMA_TI_WAITS(x)			((x)<<21)
+#define PAN_DMA_TI_NO_WIDE_BURSTS	(1<<26)
+
+#define PAN_DMA_PERMAP_PWM		5
+
+// Bus addresses
+#define PAN_DMA_GPLEV0			0x7e200034
+#define PAN_DMA_ARM_COUNTER		0x7e00b420
+#define PAN_DMA_PWM_FIFO		0x7e20c018
+
+#define PAN_DMA_CBS_PER_SAMPLE	2
+
+// PLLD (500MHz) divided by 5
+#define PAN_DMA_PWM_CLK			100000000
+#define PAN_DMA_PWM_DIVI		5
+
+/*
+ * Build the chain for a ring of samples words at data_bus, in cb, which is
+ * at cb_bus.  cb needs room for samples * PAN_DMA_CBS_PER_SAMPLE blocks.
+ * ti is ORed in to every block, for the burst length and wait states.
+ * Returns the number of blocks, or -1 if samples isn't a power of two.
+ */
+static inline int pan_dma_build(pan_dma_cb_t *cb, uint32_t cb_bus, uint32_t data_bus,
+		uint32_t samples, uint32_t ti)
+{
+	uint32_t i, n = samples * PAN_DMA_CBS_PER_SAMPLE;
+
+	if (samples == 0 || (samples & (samples - 1)))
+		return -1;
+
+	memset(cb, 0, n * sizeof(pan_dma_cb_t));
+	for (i = 0; i < n; i += PAN_DMA_CBS_PER_SAMPLE) {
+		cb[i].info = ti | PAN_DMA_TI_NO_WIDE_BURSTS | PAN_DMA_TI_WAIT_RESP |
+				PAN_DMA_TI_D_DREQ | PAN_DMA_TI_PERMAP(PAN_DMA_PERMAP_PWM);
+		cb[i].src = data_bus;				// Any word will do
+		cb[i].dst = PAN_DMA_PWM_FIFO;
+		cb[i].length = sizeof(uint32_t);
+		cb[i].next = cb_bus + (i + 1) * sizeof(pan_dma_cb_t);
+
+		cb[i+1].info = ti | PAN_DMA_TI_NO_WIDE_BURSTS | PAN_DMA_TI_WAIT_RESP;
+		cb[i+1].src = PAN_DMA_GPLEV0;
+		cb[i+1].dst = data_bus + i / PAN_DMA_CBS_PER_SAMPLE * sizeof(uint32_t);
+		cb[i+1].length = sizeof(uint32_t);
+		cb[i+1].next = cb_bus + (i + 2) % n * sizeof(pan_dma_cb_t);
+	}
+
+	return n;
+}
+
+/*
+ * A single block that copies the 250MHz ARM counter flat out in to
+ * samples words at data_bus, for measuring what the engine can do with a
+ * given burst length and wait states.
+ */
+static inline void pan_dma_build_stamps(pan_dma_cb_t *cb, uint32_t data_bus, uint32_t samples, uint32_t ti)
+{
+	memset(cb, 0, sizeof(pan_dma_cb_t));
+	cb->info = ti | PAN_DMA_TI_D_INC | PAN_DMA_TI_D_WIDTH;
+	cb->src = PAN_DMA_ARM_COUNTER;
+	cb->dst = data_bus;
+	cb->length = samples * sizeof(uint32_t);
+}
+
+// PWM range for a sample rate; returns the rate that range really gives
+static inline uint32_t pan_dma_pace(uint32_t rate, uint32_t *range)
+{
+	*range = (PAN_DMA_PWM_CLK + rate / 2) / rate;
+
+	return PAN_DMA_PWM_CLK / *range;
+}
+
+// Ring slot the DMA engine is working on, from its CONBLK_AD register
+static inline uint32_t pan_dma_index(uint32_t conblk_ad, uint32_t cb_bus)
+{
+	return (conblk_ad - cb_bus) / (sizeof(pan_dma_cb_t) * PAN_DMA_CBS_PER_SAMPLE);
+}
+
+/*
+ * Samples the DMA engine has taken since it was at slot last, given it is
+ * now at slot idx and about due samples should have been taken in that
+ * time.  The slot only tells us where we are in the ring, so the time is
+ * used to count whole laps of it, if the reader was held up that long.
+ */
+static inline uint32_t pan_dma_advance(uint32_t last, uint32_t idx, uint32_t due, uint32_t samples)
+{
+	uint32_t d = (idx - last) & (samples - 1);
+
+	if (due > d)
+		d += (due - d + samples / 2) / samples * samples;
+
+	return d;
+}
+
+#endif /* PANDMA_H_ */
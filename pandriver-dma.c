@@ -37,6 +37,15 @@
  * ================================================================
  */
 
+/*
+ * This is an alternative to pandriver.ko, using the same device and the
+ * same panctl_t read protocol; load one or the other.  The DMA engine
+ * takes the samples, paced by the PWM DREQ, so interrupts stay enabled
+ * and the Pi stays usable.  Only whole word samples are supported.  The
+ * PWM is taken over for the duration of a capture, so analogue audio
+ * can't be used at the same time.
+ */
+
 /* TODO:
  *  - Ensure relevant GPIO pins are inputs
  */
@@ -47,12 +56,24 @@
 #include <linux/io.h>
 #include <linux/vmalloc.h>
 #include <linux/cdev.h>
-#include <linux/scatterlist.h>
 #include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/moduleparam.h>
+#include <linux/math64.h>
+#include <linux/dma-mapping.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
 #include <mach/platform.h>
 #include <asm/uaccess.h>
 #include <mach/dma.h>
 #include "panalyzer.h"
+#include "pantrigger.h"
+#include "panregs.h"
+#include "pandma.h"
+#include "panhist.h"
+#include "panreserve.h"
 
 static int dev_open(struct inode *, struct file *);
 static int dev_close(struct inode *, struct file *);
@@ -63,6 +84,7 @@ static loff_t dev_llseek(struct file *flip, loff_t off, int whence);
 static panctl_t def_panctl = DEF_PANCTL;
 
 static panctl_t panctl;
+static pan_trig_t trig;
 
 static struct file_operations fops = 
 {
@@ -75,106 +97,439 @@ static struct file_operations fops =
 
 static uint32_t *buffer;
 static uint32_t first_data_index;
-static volatile uint32_t *data;
-static volatile uint32_t *ticker;
-static volatile uint32_t *armtick;
+
+/*
+ * Each open file has its own settings and capture.  There is one DMA
+ * channel and ring, so capture() and sweep() work on panctl and buffer
+ * on behalf of one session at a time, under dma_lock, which also covers
+ * the reserve.
+ */
+struct session_s {
+	panctl_t	panctl;
+	uint32_t	*buffer;
+	uint32_t	first_data_index;
+};
+
+static DEFINE_MUTEX(dma_lock);
 static volatile uint32_t *dmactl;
+static volatile uint32_t *pwm;
+static volatile uint32_t *pwmclk;
+static int dma_chan;
+static int dma_irq;
 static dev_t devno;
 static struct cdev my_cdev;
 static int my_major;
-//static uint32_t foo, bar;
+
+/*
+ * The DMA engine fills a ring of dma_ring samples, and the reader copies
+ * them out in to the capture buffer and runs the trigger.  The ring and
+ * its control blocks have to be DMA coherent, which limits how big it can
+ * be; the reader has to get round to it before the ring laps.
+ */
+static int dma_ring = 16384;
+module_param(dma_ring, int, 0444);
+MODULE_PARM_DESC(dma_ring, "Samples in the DMA ring, a power of two");
+
+/*
+ * Burst length, wait states and channel priority for captures; use
+ * PAN_FLAG_DMA_SWEEP to measure what suits a board.
+ */
+static int dma_burst = 0;
+module_param(dma_burst, int, 0644);
+MODULE_PARM_DESC(dma_burst, "DMA burst length (0-15)");
+
+static int dma_waits = 0;
+module_param(dma_waits, int, 0644);
+MODULE_PARM_DESC(dma_waits, "DMA wait states per transfer (0-31)");
+
+static int dma_priority = 15;
+module_param(dma_priority, int, 0644);
+MODULE_PARM_DESC(dma_priority, "DMA channel priority (0-15)");
+
+static pan_dma_cb_t *dma_cbs;
+static dma_addr_t dma_cbs_bus;
+static uint32_t *dma_data;
+static dma_addr_t dma_data_bus;
+
+#define ARM_TICK_HZ			250000000
+
+#define DMA_CS				0
+#define DMA_CONBLK_AD		1
+#define DMA_DEBUG			8
+#define DMA_CS_ACTIVE		(1<<0)
+#define DMA_CS_END			(1<<1)
+#define DMA_CS_INT			(1<<2)
+#define DMA_CS_PRIORITY(x)	((x)<<16)
+#define DMA_CS_PANIC(x)		((x)<<20)
+#define DMA_CS_RESET		(1<<31)
+
+#define PWM_CTL				0
+#define PWM_DMAC			2
+#define PWM_RNG1			4
+#define PWM_CTL_PWEN1		(1<<0)
+#define PWM_CTL_MODE1		(1<<1)
+#define PWM_CTL_USEF1		(1<<5)
+#define PWM_CTL_CLRF1		(1<<6)
+#define PWM_DMAC_ENAB		(1<<31)
+#define PWM_DMAC_PANIC(x)	((x)<<8)
+#define PWM_DMAC_DREQ(x)	(x)
+
+#define CM_PWMCTL			0
+#define CM_PWMDIV			1
+#define CM_PASSWD			0x5a000000
+#define CM_ENAB				(1<<4)
+#define CM_BUSY				(1<<7)
+#define CM_SRC_PLLD			6
+
+// Start the PWM serialiser taking a FIFO word every range clocks
+static void pwm_start(uint32_t range)
+{
+	pwm[PWM_CTL] = 0;
+	pwmclk[CM_PWMCTL] = CM_PASSWD | CM_SRC_PLLD;
+	while (pwmclk[CM_PWMCTL] & CM_BUSY)
+		udelay(1);
+	pwmclk[CM_PWMDIV] = CM_PASSWD | (PAN_DMA_PWM_DIVI << 12);
+	pwmclk[CM_PWMCTL] = CM_PASSWD | CM_ENAB | CM_SRC_PLLD;
+	udelay(10);
+	pwm[PWM_RNG1] = range;
+	pwm[PWM_CTL] = PWM_CTL_CLRF1;
+	udelay(10);
+	pwm[PWM_DMAC] = PWM_DMAC_ENAB | PWM_DMAC_PANIC(15) | PWM_DMAC_DREQ(15);
+	pwm[PWM_CTL] = PWM_CTL_USEF1 | PWM_CTL_MODE1 | PWM_CTL_PWEN1;
+}
+
+static void pwm_stop(void)
+{
+	pwm[PWM_CTL] = 0;
+	pwm[PWM_DMAC] = 0;
+	pwmclk[CM_PWMCTL] = CM_PASSWD | CM_SRC_PLLD;
+}
+
+static void dma_start(int priority)
+{
+	dmactl[DMA_CS] = DMA_CS_RESET;
+	udelay(10); // Give it chance to reset...
+	dmactl[DMA_CS] = DMA_CS_INT | DMA_CS_END;
+	dmactl[DMA_CONBLK_AD] = dma_cbs_bus;
+	dmactl[DMA_DEBUG] = 7; // clear debug error flags
+	dmactl[DMA_CS] = DMA_CS_PANIC(15) | DMA_CS_PRIORITY(priority) | DMA_CS_ACTIVE;
+}
+
+static void dma_stop(void)
+{
+	dmactl[DMA_CS] = 0;
+	udelay(10);
+	dmactl[DMA_CS] = DMA_CS_RESET;
+}
+
+static int dma_alloc_ring(void)
+{
+	if (dma_ring < 1024 || (dma_ring & (dma_ring - 1))) {
+		printk(KERN_WARNING "Panalyzer: dma_ring must be a power of two, at least 1024\n");
+		return -EINVAL;
+	}
+	dma_cbs = dma_alloc_coherent(NULL, dma_ring * PAN_DMA_CBS_PER_SAMPLE * sizeof(pan_dma_cb_t),
+			&dma_cbs_bus, GFP_KERNEL);
+	dma_data = dma_alloc_coherent(NULL, dma_ring * sizeof(uint32_t), &dma_data_bus, GFP_KERNEL);
+	if (dma_cbs == NULL || dma_data == NULL) {
+		printk(KERN_WARNING "Panalyzer: can't allocate a DMA ring of %d samples\n", dma_ring);
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void dma_free_ring(void)
+{
+	if (dma_cbs)
+		dma_free_coherent(NULL, dma_ring * PAN_DMA_CBS_PER_SAMPLE * sizeof(pan_dma_cb_t),
+				dma_cbs, dma_cbs_bus);
+	if (dma_data)
+		dma_free_coherent(NULL, dma_ring * sizeof(uint32_t), dma_data, dma_data_bus);
+	dma_cbs = NULL;
+	dma_data = NULL;
+}
+
+/*
+ * As in pandriver.c, the capture buffer can come out of a physically
+ * contiguous reserved-memory region rather than vmalloc, so a capture can
+ * be as big as the block, shared out between the open files' captures.
+ * The DMA engine only ever writes the coherent ring, and the CPU copies
+ * from there, so the block is mapped cached and needs no syncing.
+ */
+static int reserve_mb;
+module_param(reserve_mb, int, 0444);
+MODULE_PARM_DESC(reserve_mb, "Capture memory to use from the reserved-memory region, in MB");
+
+static uint8_t *reserve_buf;
+static pan_reserve_t reserve;
+
+static void reserve_init(void)
+{
+	struct device_node *np;
+	struct reserved_mem *rmem = NULL;
+
+	if (reserve_mb <= 0)
+		return;
+	np = of_find_compatible_node(NULL, NULL, PAN_RESERVE_COMPATIBLE);
+	if (np) {
+		rmem = of_reserved_mem_lookup(np);
+		of_node_put(np);
+	}
+	if (rmem && reserve_mb <= 1024 && rmem->size >= (phys_addr_t)reserve_mb << 20)
+		reserve_buf = memremap(rmem->base, reserve_mb << 20, MEMREMAP_WB);
+	if (reserve_buf == NULL) {
+		printk(KERN_WARNING "Panalyzer: no %dMB " PAN_RESERVE_COMPATIBLE " region, using vmalloc\n",
+				reserve_mb);
+		return;
+	}
+	pan_reserve_init(&reserve, reserve_mb << 20, PAGE_SIZE);
+}
+
+static void reserve_free(void)
+{
+	if (reserve_buf)
+		memunmap(reserve_buf);
+	reserve_buf = NULL;
+}
+
+// Cleared, so a capture that stops short doesn't hand out stale memory
+static uint32_t *buffer_alloc(uint32_t bytes)
+{
+	uint32_t offset, got;
+
+	if (reserve_buf && pan_reserve_get(&reserve, bytes, &offset, &got) == 0) {
+		memset(reserve_buf + offset, 0, got);
+		return (uint32_t *)(reserve_buf + offset);
+	}
+
+	return (uint32_t *)vzalloc(bytes);
+}
+
+static void buffer_free(uint32_t *buf)
+{
+	if (reserve_buf && (uint8_t *)buf >= reserve_buf && (uint8_t *)buf < reserve_buf + reserve.size)
+		pan_reserve_put(&reserve, (uint8_t *)buf - reserve_buf);
+	else
+		vfree(buf);
+}
 
 static int capture(void)
 {
-	uint32_t start_time, end_time, abort_time, t = 0, t1;
-	uint32_t start_tick, end_tick;
+	uint32_t start_time, end_time, start_tick, end_tick, abort_ms;
+	uint32_t rate, range, t, last_tick, idx, last_idx, n, lost;
+	unsigned long abort_jiffies;
 	uint32_t *buf_start = buffer;
 	uint32_t *buf_end   = buffer + panctl.num_samples;
 	uint32_t *buf_ptr = buf_start;
-	uint32_t sample;
+	uint32_t tail = 0;
+	uint32_t sample = 0;
+	uint32_t sample_count = 0;
+	uint32_t trigger_count = PAN_NO_TRIGGER;
+	uint32_t start_count;
 	int post_trigger_samples;
 	int pre_trigger_samples;
-	int state = 0, last_state, state_samples = panctl.trigger[0].min_samples;
+	int state;
+	int32_t state_samples = panctl.trigger[0].min_samples;
 	int overruns = 0;
+	int abort_reason = PAN_ABORT_NONE;
+	int res, done = 0;
 
-	for (last_state = 0; last_state < MAX_TRIGGERS && panctl.trigger[last_state].enabled; last_state++)
-		;
-	if (--last_state < 0)
-		state = -1;
+	res = pan_trig_compile(&trig, &panctl);
+	if (res < 0) {
+		printk(KERN_INFO "Trigger stages use more than %d channels or %d samples\n",
+				PAN_TRIG_MAX_BITS, PAN_TRIG_MAX_SAMPLES);
+		return -EINVAL;
+	}
+	// Glitch conditions need the event latches, which the DMA doesn't read
+	if (trig.glitches)
+		return -EINVAL;
+	state = res ? trig.start : -1;
 
-	if (panctl.trigger_point == 0)
-		post_trigger_samples = panctl.num_samples * 19 / 20;
-	else if (panctl.trigger_point == 1)
-		post_trigger_samples = panctl.num_samples / 2;
-	else
-		post_trigger_samples = panctl.num_samples / 20;
-	pre_trigger_samples = panctl.num_samples - post_trigger_samples;
+	rate = PAN_SAMPLE_RATE(&panctl);
+	if (rate < MIN_SAMPLE_RATE || rate > MAX_SAMPLE_RATE)
+		return -EINVAL;
+	rate = pan_dma_pace(rate, &range);
 
-	local_irq_disable();
-	local_fiq_disable();
-	start_time = *ticker;
-	start_tick = armtick[8];
-	t = start_time;
-	abort_time = start_time + (panctl.num_samples > 500000 ? panctl.num_samples * 2 : 1000000);
-#ifdef RUN_FLATOUT
-	armtick[2] = 1<<9;
-	while (buf_ptr != buf_end) {
-		volatile uint32_t x = *ticker;
-		*buf_ptr++ = armtick[8];
+	if (pan_dma_build(dma_cbs, dma_cbs_bus, dma_data_bus, dma_ring,
+			PAN_DMA_TI_BURST(dma_burst & 15) | PAN_DMA_TI_WAITS(dma_waits & 31)) < 0)
+		return -EINVAL;
+
+	// Give up waiting for a trigger after timeout_ms, else 1s or twice the
+	// capture length; interrupts are enabled throughout, so no need for a cap
+	abort_ms = panctl.timeout_ms;
+	if (abort_ms == 0) {
+		abort_ms = panctl.num_samples / (rate / 1000);
+		abort_ms = abort_ms > 500 ? abort_ms * 2 : 1000;
 	}
-#else
+
+	post_trigger_samples = PAN_POST_TRIGGER(panctl.num_samples, panctl.trigger_point);
+	pre_trigger_samples = panctl.num_samples - post_trigger_samples;
+
+	pwm_start(range);
+	start_time = pan_read_us();
+	start_tick = last_tick = pan_read_tick();
+	abort_jiffies = jiffies + msecs_to_jiffies(abort_ms);
+	last_idx = 0;
+	dma_start(dma_priority & 15);
 	for (;;) {
-		do { t1 = *ticker; } while (t1 == t);
-		sample = *ticker;
-		overruns += t1 - t - 1;
-		t = t1;
-		*buf_ptr++ = sample;
-		if (buf_ptr == buf_end)
-			buf_ptr = buf_start;
-		if (pre_trigger_samples > 0) {
-			pre_trigger_samples--;
-		} else if (state < 0) {
-			if (--post_trigger_samples <= 0)
-				break;
-		} else if (t1 == abort_time) {
-			local_irq_enable();
-			printk(KERN_INFO "Aborted, state %d, mask %08x, value %08x, sample %08x, state_samples %d\n",
-					state, panctl.trigger[state].mask, panctl.trigger[state].value, sample, state_samples);
-			return -EINTR;
-		} else {
-recheck:
-			// TODO: Not convinced this logic is correct..
-			if (state_samples == 0) {
-				if (state == last_state) {
+		t = pan_read_tick();
+		idx = pan_dma_index(dmactl[DMA_CONBLK_AD], dma_cbs_bus);
+		n = pan_dma_advance(last_idx, idx, div_u64((uint64_t)(t - last_tick) * rate, ARM_TICK_HZ), dma_ring);
+		last_idx = idx;
+		last_tick = t;
+		// Leave a quarter of the ring as slack, as the DMA engine keeps going
+		lost = n > dma_ring * 3 / 4 ? n - dma_ring * 3 / 4 : 0;
+		tail += lost;
+		overruns += lost;
+		n -= lost;
+		// Fill in what we lost with the last sample, so the time axis is right
+		while (lost-- && !done) {
+			*buf_ptr++ = sample;
+			if (buf_ptr == buf_end)
+				buf_ptr = buf_start;
+			sample_count++;
+			if (pre_trigger_samples > 0)
+				pre_trigger_samples--;
+			else if (state < 0 && --post_trigger_samples <= 0)
+				done = 1;
+		}
+		while (n-- && !done) {
+			uint32_t prev = sample;
+
+			sample = dma_data[tail++ & (dma_ring - 1)];
+			*buf_ptr++ = sample;
+			if (buf_ptr == buf_end)
+				buf_ptr = buf_start;
+			sample_count++;
+			if (pre_trigger_samples > 0) {
+				pre_trigger_samples--;
+			} else if (state < 0) {
+				if (--post_trigger_samples <= 0)
+					done = 1;
+			} else {
+				state = pan_trig_step(&trig, state, &state_samples, sample, sample ^ prev);
+				if (state == PAN_TRIG_FIRED) {
 					state = -1;
-					continue;
-				} else if ((panctl.trigger[state+1].mask & sample) == panctl.trigger[state+1].value) {
-					state++;
-					state_samples = panctl.trigger[state].min_samples - 1;
-					goto recheck;
+					trigger_count = sample_count - 1;
 				}
-			} else {
-				state_samples--;
-			}
-			if ((panctl.trigger[state].mask & sample) != panctl.trigger[state].value) {
-				state = 0;
-				state_samples = panctl.trigger[state].min_samples;
 			}
 		}
+		if (done)
+			break;
+		if (pre_trigger_samples <= 0 && state >= 0 && time_after(jiffies, abort_jiffies)) {
+			abort_reason = PAN_ABORT_TIMEOUT;
+			break;
+		}
+		if (signal_pending(current)) {
+			dma_stop();
+			pwm_stop();
+			return -EINTR;
+		}
+		usleep_range(200, 500);
 	}
-#endif
-	end_time = *ticker;
-	end_tick = armtick[8];
-	local_fiq_enable();
-	local_irq_enable();
+	dma_stop();
+	pwm_stop();
+	end_time = pan_read_us();
+	end_tick = pan_read_tick();
+
 	first_data_index = buf_ptr - buf_start;
+	panctl.first_data_index = first_data_index;
+	start_count = sample_count > panctl.num_samples ? sample_count - panctl.num_samples : 0;
+	if (trigger_count != PAN_NO_TRIGGER && trigger_count >= start_count)
+		panctl.trigger_index = trigger_count - start_count;
+	else
+		panctl.trigger_index = PAN_NO_TRIGGER;
+	panctl.overruns = overruns;
+	panctl.elapsed_us = end_time - start_time;
+	panctl.achieved_rate = end_tick == start_tick ? 0 :
+			div_u64((uint64_t)sample_count * ARM_TICK_HZ, end_tick - start_tick);
+	panctl.abort_reason = abort_reason;
+	panctl.num_gaps = 0;
+	panctl.max_irq_off_us = 0;
+	panctl.segments_filled = 0;
+
+	printk(KERN_INFO "%d samples at %uHz by DMA in %dus (%u ticks), %d lost\n",
+			panctl.num_samples, rate, end_time - start_time, end_tick - start_tick, overruns);
+
+	return 0;
+}
+
+static const uint8_t sweep_bursts[] = { 0, 3, 7, 15 };
+static const uint8_t sweep_waits[] = { 0, 4, 8, 16, 31 };
+static const uint8_t sweep_priorities[] = { 0, 8, 15 };
+
+#define SWEEP_RESULTS	(sizeof(sweep_bursts) * sizeof(sweep_waits) * sizeof(sweep_priorities))
+
+static pan_hist_t hist;
 
-//	printk(KERN_INFO "%d samples in %dus, %d overruns\n", panctl.num_samples, end_time - start_time, overruns);
-	printk(KERN_INFO "%d samples in %dus\n", end_tick - start_tick, end_time - start_time);
+// Time one setting; returns -EIO if the DMA engine never finishes
+static int sweep_one(pandmastat_t *st)
+{
+	int i;
+
+	pan_dma_build_stamps(dma_cbs, dma_data_bus, dma_ring,
+			PAN_DMA_TI_BURST(st->burst) | PAN_DMA_TI_WAITS(st->waits));
+	dma_start(st->priority);
+	for (i = 0; i < 100 && !(dmactl[DMA_CS] & DMA_CS_END); i++)
+		mdelay(1);
+	dma_stop();
+	if (i == 100)
+		return -EIO;
+
+	pan_hist_init(&hist);
+	pan_hist_add_stamps(&hist, dma_data, dma_ring);
+	st->samples = hist.count;
+	st->min = hist.min;
+	st->p50 = pan_hist_percentile(&hist, 500);
+	st->p99 = pan_hist_percentile(&hist, 990);
+	st->p999 = pan_hist_percentile(&hist, 999);
+	st->max = hist.max;
+	st->rate = dma_data[dma_ring - 1] == dma_data[0] ? 0 :
+			div_u64((uint64_t)(dma_ring - 1) * ARM_TICK_HZ, dma_data[dma_ring - 1] - dma_data[0]);
 
 	return 0;
 }
 
+/*
+ * Instead of capturing, try every combination of burst length, wait
+ * states and priority and return a pandmastat_t for each.
+ */
+static int sweep(void)
+{
+	pandmastat_t *st = (pandmastat_t *)buffer;
+	int b, w, p, res;
+
+	for (b = 0; b < sizeof(sweep_bursts); b++) {
+		for (w = 0; w < sizeof(sweep_waits); w++) {
+			for (p = 0; p < sizeof(sweep_priorities); p++, st++) {
+				st->burst = sweep_bursts[b];
+				st->waits = sweep_waits[w];
+				st->priority = sweep_priorities[p];
+				res = sweep_one(st);
+				if (res)
+					return res;
+				printk(KERN_INFO "burst %2u waits %2u priority %2u: min %u p50 %u p99 %u p99.9 %u max %u, %uHz\n",
+						st->burst, st->waits, st->priority, st->min, st->p50,
+						st->p99, st->p999, st->max, st->rate);
+			}
+		}
+	}
+	panctl.num_records = SWEEP_RESULTS;
+	first_data_index = 0;
+
+	return 0;
+}
+
+// Bytes of data following the header
+static uint32_t data_bytes(const panctl_t *p)
+{
+	if (p->flags & PAN_FLAG_DMA_SWEEP)
+		return p->num_records * sizeof(pandmastat_t);
+	else
+		return p->num_samples * sizeof(uint32_t);
+}
+
 int init_module(void)
 {
 	int res;
@@ -195,10 +550,27 @@ int init_module(void)
 		return res;
 	}
 
-	data = (uint32_t *)ioremap(0x20200034, 4);
-	ticker = (uint32_t *)ioremap(0x20003004, 4);
-	armtick = (uint32_t *)ioremap(0x2000b400, 0x24);
-	dmactl = (uint32_t *)ioremap(DMA_BASE, 0x24);
+	res = dma_alloc_ring();
+	if (res == 0) {
+		res = bcm_dma_chan_alloc(BCM_DMA_FEATURE_FAST, (void __iomem **)&dmactl, &dma_irq);
+		if (res < 0)
+			printk(KERN_WARNING "Panalyzer: Can't get a DMA channel\n");
+	}
+	if (res < 0) {
+		dma_free_ring();
+		cdev_del(&my_cdev);
+		unregister_chrdev_region(devno, 1);
+		return res;
+	}
+	dma_chan = res;
+	reserve_init();
+
+	pan_regs.st_clo = (uint32_t *)ioremap(0x20003004, 4);
+	pan_regs.arm_timer = (uint32_t *)ioremap(0x2000b400, PAN_ARM_TIMER_SIZE);
+	pwm = (uint32_t *)ioremap(0x2020c000, 0x28);
+	pwmclk = (uint32_t *)ioremap(0x201010a0, 8);
+
+	pan_regs.arm_timer[PAN_ARM_CONTROL] = PAN_ARM_FREE_ENABLE;
 
 	return 0;
 }
@@ -206,9 +578,13 @@ int init_module(void)
 
 void cleanup_module(void)
 {
-	iounmap(data);
-	iounmap(ticker);
-	iounmap(armtick);
+	iounmap(pan_regs.st_clo);
+	iounmap(pan_regs.arm_timer);
+	iounmap(pwm);
+	iounmap(pwmclk);
+	bcm_dma_chan_free(dma_chan);
+	dma_free_ring();
+	reserve_free();
 	cdev_del(&my_cdev);
 	unregister_chrdev_region(devno, 1);
 }
@@ -216,89 +592,98 @@ void cleanup_module(void)
 
 static int dev_open(struct inode *inod,struct file *fil)
 {
-	memcpy(&panctl, &def_panctl, sizeof(panctl));
+	struct session_s *s;
+
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (s == NULL)
+		return -ENOMEM;
+	memcpy(&s->panctl, &def_panctl, sizeof(s->panctl));
+	s->buffer = NULL;
+	s->first_data_index = 0;
+	fil->private_data = s;
 
 	return 0;
 }
 
-static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
+// Capture, or sweep, for s, waiting for any other session's to finish
+static int session_capture(struct session_s *s)
 {
-	if (panctl.magic != PAN_MAGIC)
-		return -EINVAL;
+	uint32_t bytes;
+	int res, i;
 
-#define BUF_ORDER	10
-#define NUM_CBS		1
-#define BCM2708_DMA_END	(1<<1)	// Why is this not in mach/dma.h ?
+	if (s->panctl.version != PAN_VERSION)
+		return -EINVAL;
+	if (s->panctl.flags & PAN_FLAG_DMA_SWEEP) {
+		bytes = SWEEP_RESULTS * sizeof(pandmastat_t);
+	} else {
+		// Only whole samples; the other capture modes are in pandriver.c
+		if (s->panctl.num_samples == 0 || s->panctl.num_samples > PAN_MAX_SAMPLES ||
+				s->panctl.num_segments > 1 || s->panctl.timeout_ms > PAN_MAX_TIMEOUT_MS ||
+				(s->panctl.flags & (PAN_FLAG_TRANSITIONS | PAN_FLAG_PACKED | PAN_FLAG_COUNT |
+				PAN_FLAG_EVENTS | PAN_FLAG_GLITCH | PAN_FLAG_DUAL_RATE)))
+			return -EINVAL;
+		// A trigger stage is met on at least the sample it is entered on
+		for (i = 0; i < MAX_TRIGGERS; i++) {
+			if (s->panctl.trigger[i].min_samples == 0)
+				s->panctl.trigger[i].min_samples = 1;
+			else if (s->panctl.trigger[i].enabled &&
+					s->panctl.trigger[i].min_samples > PAN_TRIG_MAX_SAMPLES)
+				return -EINVAL;
+		}
+		bytes = s->panctl.num_samples * sizeof(uint32_t);
+	}
 
+	if (mutex_lock_interruptible(&dma_lock))
+		return -EINTR;
+	memcpy(&panctl, &s->panctl, sizeof(panctl));
+	buffer = buffer_alloc(bytes);
 	if (buffer == NULL) {
-		struct bcm2708_dma_cb *cb;
-		uint32_t min, max;
-		int i;
-		int *histogram;
-
-		buffer = (uint32_t *)__get_free_pages(GFP_KERNEL, BUF_ORDER);	// order 10 = 4MB, 1M samples, about 50ms ?
-		if (buffer == NULL) {
-			printk(KERN_ALERT "alloc_pages failed\n");
-			return -EFAULT;
-		}
-		memset(buffer, 0, 0x1000 << BUF_ORDER);
-		cb = (struct bcm2708_dma_cb *)(buffer + (0x1000 << BUF_ORDER >> 2)) - NUM_CBS;
-		printk(KERN_INFO "Buffer address %p, cb address %p\n", buffer, cb);
-//		return -EFAULT;
-		cb->info   = BCM2708_DMA_D_INC
-				| BCM2708_DMA_BURST(15)
-				| BCM2708_DMA_D_WIDTH
-				| BCM2708_DMA_WAITS(8);
-		cb->src    = 0x7e00b420;	// Free running 250MHz counter
-		cb->dst    = (uint32_t)buffer & 0x7fffffff;	// Hmmm...
-		cb->length = (0x1000 << BUF_ORDER) - sizeof(struct bcm2708_dma_cb) * NUM_CBS;
-		cb->stride = 0;
-		cb->next   = 0;
-
-		armtick[2] = 1<<9;			// Start free-running counter
-
-		dmactl[0] = BCM2708_DMA_RESET;
-		udelay(10); // Give it chance to reset...
-		dmactl[0] = BCM2708_DMA_INT | BCM2708_DMA_END;
-		dmactl[1] = (uint32_t)cb & 0x7fffffff; // Hmmm...
-		dmactl[8] = 7; // clear debug error flags
-		dmactl[0] = 0x00ff0001;	// go, max priority
-		mdelay(100);
-		min = 0xffffffff;
-		max = 0;
-		histogram = (int *)vmalloc(sizeof(int) * 250);	// 250 * 4ns = 1us...
-		memset(histogram, 0, sizeof(int)*250);
-		for (i = 0; i < (((0x1000 << BUF_ORDER) - sizeof(struct bcm2708_dma_cb) * NUM_CBS) >> 2) - 1; i++) {
-			uint32_t d = buffer[i+1] - buffer[i];
-			if (d < min)
-				min = d;
-			if (d > max)
-				max = d;
-			if (d > 100)
-				printk(KERN_INFO "found %d at index %d\n", d, i);
-			if (d >= 250)
-				d = 249;
-			histogram[d]++;
-		}
-		printk(KERN_INFO "min %d, max %d\n", min, max);
-		for (i = min; i <= max && i < 250; i++)
-			printk(KERN_INFO "%4d: %6d\n", i, histogram[i]);
-		vfree(histogram);
+		printk(KERN_ALERT "vmalloc failed\n");
+		res = -EFAULT;
+	} else {
+		res = (panctl.flags & PAN_FLAG_DMA_SWEEP) ? sweep() : capture();
+	}
+	if (res == 0) {
+		memcpy(&s->panctl, &panctl, sizeof(s->panctl));
+		s->buffer = buffer;
+		s->first_data_index = first_data_index;
+	} else if (buffer) {
+		buffer_free(buffer);
 	}
+	buffer = NULL;
+	mutex_unlock(&dma_lock);
+
+	return res;
+}
+
+static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
+{
+	struct session_s *s = filp->private_data;
+	int res;
+
+	if (s->panctl.magic != PAN_MAGIC)
+		return -EINVAL;
 
-	if (*f_pos >= sizeof(panctl_t) + panctl.num_samples * sizeof(uint32_t))
+	if (s->buffer == NULL) {
+		res = session_capture(s);
+		if (res)
+			return res;
+	}
+
+	if (*f_pos >= sizeof(panctl_t) + data_bytes(&s->panctl))
 		return 0;
+
 	if (*f_pos < sizeof(panctl_t)) {
 		count = sizeof(panctl_t) - *f_pos;
 //		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, (char *)&panctl + *f_pos);
-		if (copy_to_user(buf, (char *)&panctl + *f_pos, count))
+		if (copy_to_user(buf, (char *)&s->panctl + *f_pos, count))
 			return -EFAULT;
 	}
 	else {
-		char *start = (char *)buffer;
-		char *data_start = start + first_data_index * sizeof(uint32_t);
-		char *end = start + panctl.num_samples * sizeof(uint32_t);
-		int index = *f_pos - sizeof(panctl);
+		char *start = (char *)s->buffer;
+		char *data_start = start + s->first_data_index * sizeof(uint32_t);
+		char *end = start + data_bytes(&s->panctl);
+		int index = *f_pos - sizeof(panctl_t);
 		char *p = data_start + index;
 
 		if (p >= end) {
@@ -309,7 +694,7 @@ static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
 			count = end - p;
 		}
 
-//		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, (char *)buffer + *f_pos);
+//		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, p);
 		if(copy_to_user(buf, p, count))
 			return -EFAULT;
 	}
@@ -320,12 +705,15 @@ static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
 
 static ssize_t dev_write(struct file *filp,const char *buf,size_t count,loff_t *f_pos)
 {
-	if (*f_pos >= sizeof(panctl))
+	struct session_s *s = filp->private_data;
+
+	if (*f_pos >= sizeof(s->panctl))
 		return 0;
-	count = sizeof(panctl) - *f_pos;
-	if (copy_from_user((char *)&panctl + *f_pos, buf, count))
+	if (count > sizeof(s->panctl) - *f_pos)
+		count = sizeof(s->panctl) - *f_pos;
+	if (copy_from_user((char *)&s->panctl + *f_pos, buf, count))
 		return -EFAULT;
-	if (panctl.magic != PAN_MAGIC)
+	if (s->panctl.magic != PAN_MAGIC)
 		return -EINVAL;
 	*f_pos += count;
 
@@ -334,7 +722,9 @@ static ssize_t dev_write(struct file *filp,const char *buf,size_t count,loff_t *
 
 static loff_t dev_llseek(struct file *filp, loff_t off, int whence)
 {
-	if (whence == SEEK_SET && off >= 0 && off < sizeof(panctl) + panctl.num_samples * sizeof(uint32_t)) {
+	struct session_s *s = filp->private_data;
+
+	if (whence == SEEK_SET && off >= 0 && off < sizeof(s->panctl) + data_bytes(&s->panctl)) {
 		filp->f_pos = off;
 		return off;
 	} else {
@@ -344,8 +734,14 @@ static loff_t dev_llseek(struct file *filp, loff_t off, int whence)
 
 static int dev_close(struct inode *inod,struct file *fil)
 {
-	free_pages((unsigned long)buffer, BUF_ORDER);
-	buffer = NULL;
+	struct session_s *s = fil->private_data;
+
+	if (s->buffer) {
+		mutex_lock(&dma_lock);
+		buffer_free(s->buffer);
+		mutex_unlock(&dma_lock);
+	}
+	kfree(s);
 
 	return 0;
 }
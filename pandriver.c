@@ -48,20 +48,67 @@
 #include <linux/fs.h>
 #include <linux/io.h>
 #include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/math64.h>
 #include <linux/cdev.h>
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/delay.h>
+#include <linux/sched.h>
+#include <linux/stringify.h>
+#include <linux/wait.h>
+#include <linux/timer.h>
+#include <linux/poll.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#include <linux/ioctl.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/interrupt.h>
+#include <linux/of.h>
+#include <linux/of_reserved_mem.h>
+#include <linux/gpio.h>
 #include <mach/platform.h>
 #include <asm/uaccess.h>
+#include <asm/fiq.h>
 #include "panalyzer.h"
+#include "pantrigger.h"
+#include "panregs.h"
+#include "pancap.h"
+// The spare core engine fills the ring from another CPU
+#define pan_ring_wmb()	smp_wmb()
+#define pan_ring_rmb()	smp_rmb()
+#include "panring.h"
+#include "panevent.h"
+#include "panhist.h"
+#include "panreserve.h"
+#include "panpool.h"
+// Mappings drop their capture references without pan_lock
+#define pan_ref_t				atomic_t
+#define pan_ref_init(r, n)		atomic_set(r, n)
+#define pan_ref_inc(r)			atomic_inc(r)
+#define pan_ref_dec_and_test(r)	atomic_dec_and_test(r)
+#include "panshare.h"
 
 static int dev_open(struct inode *, struct file *);
 static int dev_close(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
 static loff_t dev_llseek(struct file *flip, loff_t off, int whence);
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma);
+static unsigned int dev_poll(struct file *filp, poll_table *wait);
+static long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+static ssize_t dev_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+		size_t len, unsigned int flags);
 
 static panctl_t def_panctl = DEF_PANCTL;
 
 static panctl_t panctl;
+static pan_trig_t trig;
+static uint8_t pack_gather[4][256];
 
 static struct file_operations fops = 
 {
@@ -69,110 +116,1579 @@ static struct file_operations fops =
 	.read = dev_read,
 	.write = dev_write,
 	.llseek = dev_llseek,
+	.mmap = dev_mmap,
+	.poll = dev_poll,
+	.unlocked_ioctl = dev_ioctl,
+	.splice_read = dev_splice_read,
 	.release = dev_close,
 };
 
 static uint32_t *buffer;
-static uint32_t first_data_index;
-static volatile uint32_t *data;
-static volatile uint32_t *ticker;
-static volatile uint32_t *armtick;
+static uint32_t buffer_size;
 static dev_t devno;
 static struct cdev my_cdev;
 static int my_major;
 //static uint32_t foo, bar;
 
+// Capture buffers kept for reuse; see panpool.h
+static pan_pool_t pool;
+
+// Captures can be freed by whichever file or mapping lets go of them last
+static DEFINE_MUTEX(pool_lock);
+
+static int pool_max = 2;
+module_param(pool_max, int, 0644);
+MODULE_PARM_DESC(pool_max, "Capture buffers to keep for reuse (0-8)");
+
+static unsigned int pool_allocs;
+module_param(pool_allocs, uint, 0444);
+MODULE_PARM_DESC(pool_allocs, "Capture buffers allocated");
+
+static unsigned int pool_reuses;
+module_param(pool_reuses, uint, 0444);
+MODULE_PARM_DESC(pool_reuses, "Capture buffers reused from the pool");
+
+/*
+ * Optionally, captures come out of one large physically contiguous block
+ * instead, so the sampling loop isn't taking TLB misses on scattered
+ * vmalloc pages, and a capture can be as big as the block.  The block is
+ * a no-map reserved-memory region in the device tree, compatible with
+ * PAN_RESERVE_COMPATIBLE, which the kernel keeps for us from boot.  It is
+ * mapped cached with memremap() rather than coherent, as only the CPU ever
+ * touches it, and having its own mapping it can be in highmem.  A capture
+ * that doesn't fit in what is free of it falls back to vmalloc.
+ */
+static int reserve_mb;
+module_param(reserve_mb, int, 0444);
+MODULE_PARM_DESC(reserve_mb, "Capture memory to use from the reserved-memory region, in MB");
+
+static unsigned int reserve_fallbacks;
+module_param(reserve_fallbacks, uint, 0444);
+MODULE_PARM_DESC(reserve_fallbacks, "Captures that didn't fit in the reserved memory");
+
+static phys_addr_t reserve_base;
+static uint8_t *reserve_buf;
+static pan_reserve_t reserve;
+
+static int in_reserve(const void *buf)
+{
+	return reserve_buf && (const uint8_t *)buf >= reserve_buf &&
+			(const uint8_t *)buf < reserve_buf + reserve.size;
+}
+
+static unsigned long reserve_pfn(const void *buf)
+{
+	return PHYS_PFN(reserve_base + ((const uint8_t *)buf - reserve_buf));
+}
+
+// Called with pool_lock held
+static void *reserve_get(uint32_t size, uint32_t *got)
+{
+	uint32_t offset;
+
+	if (reserve_buf == NULL)
+		return NULL;
+	if (pan_reserve_get(&reserve, size, &offset, got) < 0) {
+		reserve_fallbacks++;
+		printk(KERN_INFO "Panalyzer: %u bytes won't fit in the reserve (%u free)\n",
+				size, pan_reserve_largest(&reserve));
+		return NULL;
+	}
+
+	return reserve_buf + offset;
+}
+
+// Without the reserve the driver carries on with vmalloc
+static void reserve_init(void)
+{
+	struct device_node *np;
+	struct reserved_mem *rmem = NULL;
+
+	if (reserve_mb <= 0)
+		return;
+	np = of_find_compatible_node(NULL, NULL, PAN_RESERVE_COMPATIBLE);
+	if (np) {
+		rmem = of_reserved_mem_lookup(np);
+		of_node_put(np);
+	}
+	if (rmem && reserve_mb <= 1024 && rmem->size >= (phys_addr_t)reserve_mb << 20)
+		reserve_buf = memremap(rmem->base, reserve_mb << 20, MEMREMAP_WB);
+	if (reserve_buf == NULL) {
+		printk(KERN_WARNING "Panalyzer: no %dMB " PAN_RESERVE_COMPATIBLE " region, using vmalloc\n",
+				reserve_mb);
+		return;
+	}
+	reserve_base = rmem->base;
+	memset(reserve_buf, 0, reserve_mb << 20);
+	pan_reserve_init(&reserve, reserve_mb << 20, PAGE_SIZE);
+}
+
+static void reserve_free(void)
+{
+	if (reserve_buf)
+		memunmap(reserve_buf);
+	reserve_buf = NULL;
+}
+
+/*
+ * Get a buffer of at least size bytes, from the reserve if there is one,
+ * or else preferring the smallest pooled one
+ */
+static void *pool_get(uint32_t size, uint32_t *got)
+{
+	void *buf;
+
+	mutex_lock(&pool_lock);
+	// The reserve is already mapped, so there are no pages to fault in
+	buf = reserve_get(size, got);
+	if (buf) {
+		mutex_unlock(&pool_lock);
+		return buf;
+	}
+	buf = pan_pool_get(&pool, size, got);
+	if (buf) {
+		pool_reuses++;
+		mutex_unlock(&pool_lock);
+		return buf;
+	}
+	mutex_unlock(&pool_lock);
+
+	// vmalloc_user() so the buffer can be mmap()ed; it also clears it,
+	// so the pages are all touched now rather than from the capture loop
+	size = PAGE_ALIGN(size);
+	buf = vmalloc_user(size);
+	if (buf == NULL)
+		return NULL;
+	*got = size;
+	pool_allocs++;
+
+	return buf;
+}
+
+static void pool_put(void *buf, uint32_t size)
+{
+	if (buf == NULL)
+		return;
+	mutex_lock(&pool_lock);
+	if (in_reserve(buf)) {
+		pan_reserve_put(&reserve, (uint8_t *)buf - reserve_buf);
+		mutex_unlock(&pool_lock);
+		return;
+	}
+	if (pan_pool_put(&pool, buf, size, pool_max) < 0) {
+		mutex_unlock(&pool_lock);
+		vfree(buf);
+		return;
+	}
+	mutex_unlock(&pool_lock);
+}
+
+static void pool_drain(void)
+{
+	void *buf;
+
+	while ((buf = pan_pool_drain(&pool)) != NULL)
+		vfree(buf);
+}
+
+static int irq_window_us = 2000;
+module_param(irq_window_us, int, 0644);
+MODULE_PARM_DESC(irq_window_us,
+		"Longest interrupts are disabled for in segmented mode (100-10000us)");
+
+/*
+ * Each open file is a session, with its own settings and the capture it
+ * reads.  PAN_IOC_ARM runs a session's capture from a work item, so the
+ * caller can get on with other things and poll() for it to finish.
+ */
+struct session_s {
+	panctl_t			panctl;		// Settings, as the client wrote them
+	pan_capture_t		*cap;		// What read() and mmap() see, if anything; see panshare.h
+	int					state;		// PAN_STATE_xxx of its PAN_IOC_ARM
+	int					result;
+};
+
+/*
+ * There is only one set of hardware, so the capture engines work on
+ * panctl and buffer on behalf of the session in cap_owner.  pan_lock
+ * covers cap_owner and last_capture, and setting cap_cancel, which only
+ * ever stops the capture cap_owner is running and is cleared for each new
+ * owner.
+ */
+static DEFINE_MUTEX(pan_lock);
+static struct session_s *cap_owner;
+static pan_capture_t *last_capture;
+static volatile int cap_cancel;
+static DECLARE_WAIT_QUEUE_HEAD(done_wait_q);
+
+static void capture_put(pan_capture_t *c)
+{
+	if (pan_capture_put(c)) {
+		pool_put(c->buffer, c->buffer_size);
+		kfree(c);
+	}
+}
+
+// Give the hardware to s, if no other session is capturing or streaming
+static int hw_claim(struct session_s *s)
+{
+	int res = 0;
+
+	mutex_lock(&pan_lock);
+	if (cap_owner) {
+		res = -EBUSY;
+	} else {
+		cap_owner = s;
+		cap_cancel = 0;
+	}
+	mutex_unlock(&pan_lock);
+
+	return res;
+}
+
+static void hw_release(void)
+{
+	mutex_lock(&pan_lock);
+	cap_owner = NULL;
+	mutex_unlock(&pan_lock);
+}
+
+static pangap_t gaps[PAN_MAX_GAPS];
+static panseg_t segments[PAN_MAX_SEGMENTS];
+
+#define ARM_TICK_HZ			250000000
+#define ARM_TICK_NS			4
+#define CALIBRATE_SAMPLES	256
+
+static uint32_t calibrate_buf[CALIBRATE_SAMPLES];
+
+// ARM ticks between letting interrupts in, from irq_window_us
+static uint32_t window_ticks(void)
+{
+	if (irq_window_us < 100)
+		irq_window_us = 100;
+	else if (irq_window_us > 10000)
+		irq_window_us = 10000;
+
+	return irq_window_us * (ARM_TICK_HZ / 1000000);
+}
+
+/*
+ * How long to wait for the trigger: timeout_ms, else 1s or twice the
+ * capture.  With interrupts off it is only up to PAN_MAX_OFF_TIMEOUT_MS
+ * more than filling the buffer takes.
+ */
+static uint32_t trigger_timeout_ms(uint32_t rate, int irqs_off)
+{
+	uint32_t ms = panctl.timeout_ms;
+	uint32_t fill_ms = panctl.num_samples / (rate / 1000);
+
+	if (ms == 0)
+		ms = fill_ms > 500 ? fill_ms * 2 : 1000;
+	if (irqs_off && ms > fill_ms + PAN_MAX_OFF_TIMEOUT_MS) {
+		ms = fill_ms + PAN_MAX_OFF_TIMEOUT_MS;
+		if (panctl.timeout_ms)
+			printk(KERN_INFO "Panalyzer: trigger timeout cut to %ums with interrupts off; "
+					"let them run until the trigger for longer\n", ms);
+	}
+
+	return ms;
+}
+
+// ARM ticks to the next timeout check, which must fit in 31 bits
+#define MAX_ABORT_STEP_US	8000000
+
+static inline uint32_t abort_ticks(uint32_t us)
+{
+	if (us > MAX_ABORT_STEP_US)
+		us = MAX_ABORT_STEP_US;
+
+	return us * (ARM_TICK_HZ / 1000000);
+}
+
+/*
+ * Run the body of the capture loop flat out for a few hundred samples, so
+ * we know how many ARM ticks it needs per sample and can refuse rates it
+ * can't sustain.
+ */
+static uint32_t calibrate(void)
+{
+	uint32_t start_tick, end_tick, t1, sample, prev = 0, events = 0;
+	int32_t state_samples = 1;
+	int glitch = panctl.flags & PAN_FLAG_GLITCH;
+	int i;
+
+	local_irq_disable();
+	local_fiq_disable();
+	start_tick = pan_read_tick();
+	for (i = 0; i < CALIBRATE_SAMPLES; i++) {
+		t1 = pan_read_tick();
+		if (glitch) {
+			events = pan_read_events() & panctl.channel_mask;
+			pan_clear_events(events);
+			events = pan_gather(pack_gather, events);
+		}
+		sample = pan_read_level();
+		calibrate_buf[i] = sample ^ t1 ^ events;
+		pan_trig_step(&trig, 0, &state_samples, sample, sample ^ prev);
+		prev = sample;
+	}
+	end_tick = pan_read_tick();
+	local_fiq_enable();
+	local_irq_enable();
+
+	return (end_tick - start_tick) / CALIBRATE_SAMPLES;
+}
+
+// Bytes of buffer used by n samples, or n records in transition, event or counter mode
+static uint32_t sample_bytes(const panctl_t *p, uint32_t n)
+{
+	if (p->flags & (PAN_FLAG_TRANSITIONS | PAN_FLAG_EVENTS))
+		return n * sizeof(pantrans_t);
+	else if (p->flags & PAN_FLAG_COUNT)
+		return n * PAN_COUNT_BYTES(pan_count_channels(p->channel_mask));
+	else if (p->flags & PAN_FLAG_PACKED)
+		return n * pan_pack_bits(p->channel_mask) / 8;
+	else
+		return n * sizeof(uint32_t);
+}
+
+static uint32_t data_bytes(const panctl_t *p)
+{
+	if (p->flags & (PAN_FLAG_TRANSITIONS | PAN_FLAG_EVENTS | PAN_FLAG_COUNT | PAN_FLAG_DUAL_RATE))
+		return sample_bytes(p, p->num_records);
+	else
+		return sample_bytes(p, p->num_samples);
+}
+
+// Bytes to allocate, leaving room for gap or segment records
+static uint32_t alloc_bytes(void)
+{
+	if (panctl.flags & (PAN_FLAG_SEGMENTED | PAN_FLAG_ARM_IRQ | PAN_FLAG_FIQ | PAN_FLAG_CORE))
+		return PAN_GAP_OFFSET(data_bytes(&panctl)) + PAN_MAX_GAPS * sizeof(pangap_t);
+	else if (panctl.num_segments > 1)
+		return PAN_GAP_OFFSET(data_bytes(&panctl)) + panctl.num_segments * sizeof(panseg_t);
+	else if (panctl.flags & PAN_FLAG_GLITCH)
+		return PAN_GAP_OFFSET(data_bytes(&panctl)) + panctl.num_samples;
+	else if (panctl.flags & PAN_FLAG_DUAL_RATE)
+		return PAN_GAP_OFFSET(data_bytes(&panctl)) + PAN_MAX_REGIONS * sizeof(panregion_t);
+	else
+		return data_bytes(&panctl);
+}
+
+// Bytes following the header in read() and mmap(): the data, then the gaps, glitches or regions
+static uint32_t stream_bytes(const panctl_t *p)
+{
+	if (p->num_gaps)
+		return PAN_GAP_OFFSET(data_bytes(p)) + p->num_gaps * sizeof(pangap_t);
+	else if (p->segments_filled)
+		return PAN_GAP_OFFSET(data_bytes(p)) + p->segments_filled * sizeof(panseg_t);
+	else if (p->flags & PAN_FLAG_GLITCH)
+		return PAN_GAP_OFFSET(data_bytes(p)) + p->num_samples;
+	else if (p->num_regions)
+		return PAN_GAP_OFFSET(data_bytes(p)) + p->num_regions * sizeof(panregion_t);
+	else
+		return data_bytes(p);
+}
+
+// How long n samples take; 0 if that's more than 32 bits of microseconds
+static uint32_t samples_us(uint32_t n)
+{
+	uint64_t us = div_u64((uint64_t)n * 1000000, PAN_SAMPLE_RATE(&panctl));
+
+	return us > 0xffffffff ? 0 : us;
+}
+
+static uint32_t capture_duration_us(void)
+{
+	return samples_us(panctl.num_samples);
+}
+
+// Sanity check the settings before allocating a buffer and capturing
+static int check_panctl(void)
+{
+	uint32_t edges = 0, glitches = 0, us;
+	int i;
+
+	if (panctl.magic != PAN_MAGIC)
+		return -EINVAL;
+	// The data follows the header, so the client must agree on its size
+	if (panctl.version != PAN_VERSION)
+		return -EINVAL;
+	if ((panctl.flags & PAN_FLAG_TRANSITIONS) && (panctl.flags & PAN_FLAG_PACKED))
+		return -EINVAL;
+	// The engines are exclusive, and segmented and arm IRQ modes are for capture()
+	if ((panctl.flags & PAN_FLAG_CORE) &&
+			(panctl.flags & (PAN_FLAG_FIQ | PAN_FLAG_STREAM | PAN_FLAG_SEGMENTED |
+			PAN_FLAG_ARM_IRQ)))
+		return -EINVAL;
+	if (panctl.timeout_ms > PAN_MAX_TIMEOUT_MS)
+		return -EINVAL;
+	// Streaming always uses the FIQ, and returns whole samples, unless it is events
+	if ((panctl.flags & PAN_FLAG_STREAM) &&
+			(panctl.flags & ~(PAN_FLAG_STREAM | PAN_FLAG_FIQ | PAN_FLAG_EVENTS)))
+		return -EINVAL;
+	if (panctl.flags & PAN_FLAG_EVENTS) {
+		if (panctl.flags & ~(PAN_FLAG_EVENTS | PAN_FLAG_STREAM))
+			return -EINVAL;
+		if (panctl.channel_mask == 0 || capture_duration_us() == 0)
+			return -EINVAL;
+		if (!(panctl.flags & PAN_FLAG_STREAM) && panctl.num_records == 0)
+			return -EINVAL;
+	}
+	if ((panctl.flags & PAN_FLAG_TRANSITIONS) && panctl.num_records == 0)
+		return -EINVAL;
+	// Glitch mode is whole samples from the polled loop, with interrupts off throughout
+	if (panctl.flags & PAN_FLAG_GLITCH) {
+		if (panctl.flags & ~PAN_FLAG_GLITCH)
+			return -EINVAL;
+		if (pan_gather_init(pack_gather, panctl.channel_mask, 8) < 0)
+			return -EINVAL;
+	}
+	for (i = 0; i < MAX_TRIGGERS && panctl.trigger[i].enabled; i++) {
+		edges |= panctl.trigger[i].rising | panctl.trigger[i].falling;
+		glitches |= panctl.trigger[i].glitch;
+		// A stage is met on at least the sample it is entered on
+		if (panctl.trigger[i].min_samples == 0)
+			panctl.trigger[i].min_samples = 1;
+		else if (panctl.trigger[i].min_samples > PAN_TRIG_MAX_SAMPLES)
+			return -EINVAL;
+	}
+	// Dual rate mode is whole samples from the polled loop, without gaps, so
+	// it is limited to PAN_MAX_OFF_CAPTURE_MS below
+	if (panctl.flags & PAN_FLAG_DUAL_RATE) {
+		if (panctl.flags & ~PAN_FLAG_DUAL_RATE)
+			return -EINVAL;
+		if (panctl.decimate < 2 || panctl.decimate > PAN_MAX_DECIMATE)
+			return -EINVAL;
+		if (panctl.window_samples < 100 || panctl.window_samples >= panctl.num_samples)
+			return -EINVAL;
+		panctl.num_records = pan_dual_words(panctl.num_samples, panctl.window_samples,
+				panctl.decimate);
+	}
+	// Glitch conditions need the latches, and share the edge bits
+	if (glitches && (!(panctl.flags & PAN_FLAG_GLITCH) || (glitches & edges)))
+		return -EINVAL;
+	if (panctl.flags & PAN_FLAG_COUNT) {
+		if (panctl.flags & (PAN_FLAG_TRANSITIONS | PAN_FLAG_PACKED))
+			return -EINVAL;
+		if (panctl.num_records == 0 || pan_count_channels(panctl.channel_mask) > MAX_CHANNELS)
+			return -EINVAL;
+		if (pan_count_gate(panctl.gate_ms, PAN_SAMPLE_RATE(&panctl)) == 0)
+			return -EINVAL;
+	}
+	if (panctl.flags & PAN_FLAG_PACKED) {
+		if (pan_gather_init(pack_gather, panctl.channel_mask, 8) < 0)
+			return -EINVAL;
+		// Nibble packing stores samples in pairs
+		if (pan_pack_bits(panctl.channel_mask) == 4)
+			panctl.num_samples &= ~1;
+	}
+	// Segments are whole word rings, filled by the polled capture loop
+	if (panctl.num_segments > 1) {
+		if (panctl.num_segments > PAN_MAX_SEGMENTS || panctl.flags)
+			return -EINVAL;
+		panctl.num_samples -= panctl.num_samples % panctl.num_segments;
+		if (panctl.num_samples / panctl.num_segments < 100)
+			return -EINVAL;
+	}
+	if (panctl.num_samples == 0 || panctl.num_samples > PAN_MAX_SAMPLES ||
+			panctl.num_records > PAN_MAX_RECORDS)
+		return -EINVAL;
+	// Only the engines that let interrupts run can capture for longer, and
+	// arm IRQ mode only lets them run until the trigger
+	us = capture_duration_us();
+	if ((panctl.flags & PAN_FLAG_ARM_IRQ) && !(panctl.flags & PAN_FLAGS_IRQS_ON) && us)
+		us = samples_us(PAN_POST_TRIGGER(panctl.num_samples, panctl.trigger_point));
+	if (!(panctl.flags & PAN_FLAGS_IRQS_ON) && (us == 0 || us > PAN_MAX_OFF_CAPTURE_MS * 1000))
+		return -EINVAL;
+	panctl.num_gaps = 0;
+	panctl.segments_filled = 0;
+	panctl.max_late_ns = 0;
+	panctl.num_regions = 0;
+
+	return 0;
+}
+
+// Turn the transition ring in to a list; see cap_trans_finish()
+static void trans_fixup(uint32_t next, int wrapped, uint32_t total)
+{
+	panctl.num_records = cap_trans_finish((pantrans_t *)buffer, panctl.num_records, next, wrapped,
+			total, &panctl.num_samples);
+	panctl.first_data_index = 0;
+}
+
+/*
+ * Turn the ring of counter records in to a list, as for transitions, and
+ * move *start_count to the start of the first window kept.
+ */
+static void count_fixup(struct cap_s *c, uint32_t *start_count)
+{
+	panctl.num_records = pan_count_finish(&c->count, *start_count, start_count);
+	panctl.num_samples = c->sample_count - *start_count;
+	panctl.first_data_index = 0;
+}
+
+/*
+ * Pack the dual rate areas in to a list with the region records after it,
+ * and move *start_count to the oldest sample kept.
+ */
+static void dual_fixup(struct cap_s *c, uint32_t *start_count)
+{
+	panregion_t regions[PAN_MAX_REGIONS];
+	uint32_t words, span;
+
+	panctl.num_regions = pan_dual_finish(&c->dual, regions, start_count, &words, &span);
+	panctl.num_records = words;
+	panctl.num_samples = span;
+	panctl.first_data_index = 0;
+	memcpy((char *)buffer + PAN_GAP_OFFSET(data_bytes(&panctl)), regions,
+			panctl.num_regions * sizeof(panregion_t));
+}
+
+// The gap records; see cap_gap_forget() and the rest
+static void gap_forget(uint32_t oldest)
+{
+	cap_gap_forget(gaps, &panctl.num_gaps, oldest);
+}
+
+static void gap_add(uint32_t sample, uint32_t missed, uint32_t us)
+{
+	cap_gap_add(gaps, &panctl.num_gaps, sample, missed, us);
+}
+
+// Rebase the gaps to the start of the data, and put them after it
+static void gap_fixup(uint32_t start_count)
+{
+	cap_gap_finish(gaps, &panctl.num_gaps, start_count);
+	memcpy((char *)buffer + PAN_GAP_OFFSET(data_bytes(&panctl)), gaps,
+			panctl.num_gaps * sizeof(pangap_t));
+}
+
+/*
+ * Finish the segment records, with their trigger times, and put them after
+ * the data.  The rings are returned as they are, in order.
+ */
+static void seg_fixup(struct cap_s *c)
+{
+	uint32_t i;
+
+	cap_seg_finish(c, &panctl);
+	for (i = 0; i < c->seg; i++)
+		if (segments[i].trigger_sample != PAN_NO_TRIGGER && panctl.achieved_rate)
+			segments[i].trigger_us = div_u64((uint64_t)segments[i].trigger_sample * 1000000,
+					panctl.achieved_rate);
+	memcpy((char *)buffer + PAN_GAP_OFFSET(data_bytes(&panctl)), segments,
+			c->seg * sizeof(panseg_t));
+}
+
+// Compile the trigger and check the rate; returns the number of trigger stages
+static int capture_prepare(uint32_t *rate)
+{
+	int res;
+
+	// Compile the trigger stages while interrupts are still enabled
+	res = pan_trig_compile(&trig, &panctl);
+	if (res < 0) {
+		printk(KERN_INFO "Trigger stages use more than %d channels or %d samples\n",
+				PAN_TRIG_MAX_BITS, PAN_TRIG_MAX_SAMPLES);
+		return -EINVAL;
+	}
+
+	*rate = PAN_SAMPLE_RATE(&panctl);
+	if (*rate < MIN_SAMPLE_RATE || *rate > MAX_SAMPLE_RATE)
+		return -EINVAL;
+
+	return res;
+}
+
+// Turn the ring in to the data read() returns, and fill in the header
+static void capture_done(struct cap_s *c, uint32_t elapsed_us, uint32_t ticks,
+		int overruns, int abort_reason, uint32_t max_off_us, uint32_t max_late)
+{
+	uint32_t start_count;
+
+	// Sample number, counting from the first one captured, of the first
+	// sample in the data we return
+	start_count = cap_oldest(c);
+
+	if (c->transitions) {
+		trans_fixup(c->rec_ptr - c->rec_start, c->wrapped, c->sample_count);
+		// An overflowed ring starts later
+		start_count = c->sample_count - panctl.num_samples;
+	} else if (c->counting)
+		count_fixup(c, &start_count);
+	else if (c->dualing)
+		dual_fixup(c, &start_count);
+	else if (c->packed)
+		panctl.first_data_index = cap_pack_finish(c);
+	else
+		panctl.first_data_index = c->buf_ptr - c->buf_start;
+	if (c->glitching)
+		cap_glitch_finish(c, panctl.first_data_index, panctl.num_samples);
+
+	cap_report(c, &panctl, start_count, overruns, abort_reason);
+	gap_fixup(start_count);
+	panctl.elapsed_us = elapsed_us;
+	panctl.achieved_rate = ticks ? div_u64((uint64_t)c->sample_count * ARM_TICK_HZ, ticks) : 0;
+	panctl.max_irq_off_us = max_off_us;
+	panctl.max_late_ns = max_late * ARM_TICK_NS;
+	if (c->segs > 1)
+		seg_fixup(c);
+}
+
+static uint32_t saved_gpren0, saved_gpfen0;
+
+/*
+ * Have the event detect latches catch both edges on the capture channels,
+ * with interrupts disabled, so the GPIO interrupt handler never sees them.
+ */
+static void glitch_arm(void)
+{
+	saved_gpren0 = *pan_regs.gpren0;
+	saved_gpfen0 = *pan_regs.gpfen0;
+	*pan_regs.gpren0 = saved_gpren0 | panctl.channel_mask;
+	*pan_regs.gpfen0 = saved_gpfen0 | panctl.channel_mask;
+	pan_clear_events(panctl.channel_mask);
+}
+
+// Put the edge detects back, and clear what we latched for channels nobody else uses
+static void glitch_disarm(void)
+{
+	*pan_regs.gpren0 = saved_gpren0;
+	*pan_regs.gpfen0 = saved_gpfen0;
+	pan_clear_events(panctl.channel_mask & ~(saved_gpren0 | saved_gpfen0));
+}
+
 static int capture(void)
 {
-	uint32_t start_time, end_time, abort_time, t = 0, t1;
-	uint32_t start_tick, end_tick;
-	uint32_t *buf_start = buffer;
-	uint32_t *buf_end   = buffer + panctl.num_samples;
-	uint32_t *buf_ptr = buf_start;
-	uint32_t sample;
-	int post_trigger_samples;
-	int pre_trigger_samples;
-	int state = 0, last_state, state_samples = panctl.trigger[0].min_samples;
+	uint32_t start_time, end_time, abort_tick, abort_us, t1;
+	uint32_t start_tick, end_tick;
+	uint32_t rate, cost;
+	uint32_t chunk_time, chunk_end, chunk_ticks, gap_time, off_us, waited_us, missed;
+	uint32_t max_off_us = 0, late, max_late = 0;
+	int res;
+	struct cap_s cap;
+	struct cap_pace_s pace;
+	int segmented = panctl.flags & PAN_FLAG_SEGMENTED;
+	int arm_irq = panctl.flags & PAN_FLAG_ARM_IRQ;
+	int glitch = panctl.flags & PAN_FLAG_GLITCH;
+	uint32_t sample, events = 0;
+	int overruns = 0;
+	int abort_reason = PAN_ABORT_NONE;
+
+	res = capture_prepare(&rate);
+	if (res < 0)
+		return res;
+	cap_init(&cap, &panctl, &trig, res, buffer, data_bytes(&panctl), pack_gather, segments);
+
+	cost = calibrate();
+	if (cost + cost / 8 > ARM_TICK_HZ / rate) {
+		printk(KERN_INFO "Panalyzer: can't sustain %uHz, loop takes %u ticks per sample "
+				"(max about %uHz)\n",
+				rate, cost, ARM_TICK_HZ / (cost + cost / 8));
+		return -ERANGE;
+	}
+
+	// Unless interrupts run while we wait, the Pi is frozen until we give up
+	abort_us = trigger_timeout_ms(rate, !segmented && !arm_irq) * 1000;
+
+	chunk_ticks = window_ticks();
+
+	local_irq_disable();
+	local_fiq_disable();
+	if (glitch)
+		glitch_arm();
+	start_time = chunk_time = pan_read_us();
+	start_tick = pan_read_tick();
+	abort_tick = start_tick + abort_ticks(abort_us);
+	chunk_end = start_tick + chunk_ticks;
+	cap_pace_init(&pace, ARM_TICK_HZ, rate, start_tick);
+#ifdef RUN_FLATOUT
+	pan_regs.arm_timer[PAN_ARM_CONTROL] = PAN_ARM_FREE_ENABLE;
+	while (cap.buf_ptr != cap.buf_end) {
+		volatile uint32_t x = pan_read_us();
+		*cap.buf_ptr++ = pan_read_tick();
+	}
+#else
+	for (;;) {
+		do { t1 = pan_read_tick(); } while (!cap_pace_due(&pace, t1));
+		// The latches first; see pan_glitches()
+		if (glitch) {
+			events = pan_read_events() & cap.mask;
+			pan_clear_events(events);
+		}
+		sample = pan_read_level();
+		late = cap_pace_late(&pace, t1, &overruns);
+		if (late > max_late)
+			max_late = late;
+		cap_pace_step(&pace);
+		if (glitch)
+			cap_latch(&cap, sample, events);
+		cap_store(&cap, sample);
+		if (cap_waiting(&cap) && (int32_t)(t1 - abort_tick) >= 0) {
+			// Return what we have, and let the client decide what to do
+			abort_reason = PAN_ABORT_TIMEOUT;
+			break;
+		}
+		if (cap_trigger(&cap, &trig, sample))
+			break;
+		// With arm_irq, interrupts stay off once the trigger has fired
+		if ((segmented || (arm_irq && cap.state >= 0)) && (int32_t)(t1 - chunk_end) >= 0) {
+			// Let any pending interrupts run, then fill in the samples we
+			// missed with the last one and record the hole
+			gap_time = pan_read_us();
+			off_us = gap_time - chunk_time;
+			if (off_us > max_off_us)
+				max_off_us = off_us;
+			local_fiq_enable();
+			local_irq_enable();
+			gap_forget(cap_oldest(&cap));
+			local_irq_disable();
+			local_fiq_disable();
+			// The window starts now, counting the catching up
+			chunk_time = pan_read_us();
+			chunk_end = pan_read_tick() + chunk_ticks;
+			for (missed = 0; cap_pace_due(&pace, pan_read_tick()); missed++)
+				cap_pace_step(&pace);
+			if (missed) {
+				gap_add(cap.sample_count, missed, pan_read_us() - gap_time);
+				if (cap_fill(&cap, sample, missed))
+					break;
+			}
+			// Long timeouts are checked in steps the counter can hold
+			waited_us = chunk_time - start_time;
+			abort_tick = chunk_end - chunk_ticks +
+					abort_ticks(waited_us < abort_us ? abort_us - waited_us : 0);
+			if (cap_cancel) {
+				abort_reason = PAN_ABORT_CANCELLED;
+				break;
+			}
+		}
+	}
+#endif
+	end_time = pan_read_us();
+	end_tick = pan_read_tick();
+	if (glitch)
+		glitch_disarm();
+	local_fiq_enable();
+	local_irq_enable();
+	off_us = end_time - chunk_time;
+	if (off_us > max_off_us)
+		max_off_us = off_us;
+	if (abort_reason == PAN_ABORT_TIMEOUT)
+		printk(KERN_INFO "Aborted, state %d, mask %08x, value %08x, sample %08x, "
+				"state_samples %d\n", cap.state,
+				panctl.trigger[cap.state % PAN_TRIG_IDLE].mask,
+				panctl.trigger[cap.state % PAN_TRIG_IDLE].value,
+				sample, cap.state_samples);
+	capture_done(&cap, end_time - start_time, end_tick - start_tick, overruns, abort_reason,
+			max_off_us, max_late);
+
+	printk(KERN_INFO "%d samples at %uHz (%uHz achieved) in %dus (%u ticks), %d late, "
+			"%d gaps, %uus max IRQs off\n",
+			panctl.num_samples, rate, panctl.achieved_rate, end_time - start_time,
+			end_tick - start_tick, overruns, panctl.num_gaps, max_off_us);
+
+	return 0;
+}
+
+/*
+ * FIQ engine.  The ARM timer interrupt is routed to the FIQ, and the
+ * handler below takes one sample each time it fires, so Linux keeps
+ * running during the capture and it can be as long as memory allows.  The
+ * samples go in to a panring.h ring, and capture_ring() moves them in to
+ * the capture buffer and runs the trigger in process context.
+ *
+ * The FIQ can arrive in any context and can't take a fault, so the
+ * handler is copied to the vector page and only touches the statically
+ * mapped peripherals and lowmem.  Its banked registers are set up by
+ * fiq_start(): r8 GPLEV0, r9 samples written, r10 next ring slot, r11 ARM
+ * timer, r12 scratch, r13 where to publish r9 for the consumer.
+ */
+extern unsigned char pan_fiq_start[], pan_fiq_end[];
+
+asm(
+"	.text\n"
+"	.global	pan_fiq_start\n"
+"pan_fiq_start:\n"
+"	str	r8, [r11, #0x0c]\n"				// Any write clears the timer interrupt
+"	ldr	r12, [r8]\n"
+"	str	r12, [r10], #4\n"
+"	add	r9, r9, #1\n"
+"	str	r9, [r13]\n"
+"	movs	r12, r9, lsl #(32 - " __stringify(PAN_RING_BITS) ")\n"
+"	subnes	pc, lr, #4\n"
+"	sub	r10, r10, #(4 << " __stringify(PAN_RING_BITS) ")\n"
+"	subs	pc, lr, #4\n"
+"	.global	pan_fiq_end\n"
+"pan_fiq_end:\n"
+);
+
+#define FIQ_CONTROL			0x0c		// In the ARM interrupt controller
+#define FIQ_ENABLE			(1<<7)
+#define FIQ_SRC_ARM_TIMER	64
+#define ARM_TIMER_PREDIV	0x7d		// Reset value of the pre-divider
+#define FIQ_CAL_PERIOD		1000		// Calibrate at 250KHz
+#define FIQ_CAL_TICKS		(ARM_TICK_HZ / 1000)
+
+static struct fiq_handler fiq_handler = {
+	.name = "panalyzer",
+};
+
+static uint32_t *fiq_ring;				// From __get_free_pages(), so in lowmem
+static uint32_t *fiq_head;
+
+static unsigned int fiq_cost;
+module_param(fiq_cost, uint, 0444);
+MODULE_PARM_DESC(fiq_cost, "ARM ticks per FIQ sample, measured on first use");
+
+static unsigned int fiq_max_rate;
+module_param(fiq_max_rate, uint, 0444);
+MODULE_PARM_DESC(fiq_max_rate, "FIQ sample rate that would leave no time for Linux");
+
+static int fiq_start(uint32_t period)
+{
+	struct pt_regs regs;
+	int res;
+
+	res = claim_fiq(&fiq_handler);
+	if (res)
+		return res;
+
+	*fiq_head = 0;
+	memset(&regs, 0, sizeof(regs));
+	regs.ARM_r8 = (long)__io_address(GPIO_BASE + PAN_GPLEV0_OFFSET);
+	regs.ARM_r9 = 0;
+	regs.ARM_r10 = (long)fiq_ring;
+	regs.ARM_fp = (long)__io_address(ARMCTRL_TIMER0_1_BASE);
+	regs.ARM_sp = (long)fiq_head;
+	set_fiq_handler(pan_fiq_start, pan_fiq_end - pan_fiq_start);
+	set_fiq_regs(&regs);
+
+	// Run the timer at 250MHz, like the free-running counter
+	pan_regs.arm_timer[PAN_ARM_PREDIV] = 0;
+	pan_regs.arm_timer[PAN_ARM_LOAD] = period - 1;
+	pan_regs.arm_timer[PAN_ARM_RELOAD] = period - 1;
+	pan_regs.arm_timer[PAN_ARM_IRQ_CLEAR] = 0;
+	pan_regs.arm_timer[PAN_ARM_CONTROL] = PAN_ARM_FREE_ENABLE | PAN_ARM_TIMER_ENABLE |
+			PAN_ARM_IRQ_ENABLE | PAN_ARM_32BIT;
+	*(volatile uint32_t *)__io_address(ARMCTRL_IC_BASE + FIQ_CONTROL) =
+			FIQ_ENABLE | FIQ_SRC_ARM_TIMER;
+
+	return 0;
+}
+
+static void fiq_stop(void)
+{
+	*(volatile uint32_t *)__io_address(ARMCTRL_IC_BASE + FIQ_CONTROL) = 0;
+	pan_regs.arm_timer[PAN_ARM_CONTROL] = PAN_ARM_FREE_ENABLE;
+	pan_regs.arm_timer[PAN_ARM_IRQ_CLEAR] = 0;
+	pan_regs.arm_timer[PAN_ARM_PREDIV] = ARM_TIMER_PREDIV;
+	release_fiq(&fiq_handler);
+}
+
+/*
+ * Work out what each FIQ sample costs by spinning on the ARM counter with
+ * interrupts off, first alone and then with the FIQ running, and adding
+ * up the time stolen from the loop.
+ */
+static int fiq_calibrate(void)
+{
+	uint32_t t, last, end, gap, base = 0, stolen = 0, count;
+	int res;
+
+	if (fiq_cost)
+		return 0;
+
+	local_irq_disable();
+	last = pan_read_tick();
+	end = last + FIQ_CAL_TICKS;
+	while ((int32_t)(last - end) < 0) {
+		t = pan_read_tick();
+		if (t - last > base)
+			base = t - last;
+		last = t;
+	}
+	local_irq_enable();
+
+	res = fiq_start(FIQ_CAL_PERIOD);
+	if (res)
+		return res;
+	local_irq_disable();
+	count = *fiq_head;
+	last = pan_read_tick();
+	end = last + FIQ_CAL_TICKS;
+	while ((int32_t)(last - end) < 0) {
+		t = pan_read_tick();
+		gap = t - last;
+		if (gap > base)
+			stolen += gap - base;
+		last = t;
+	}
+	count = *fiq_head - count;
+	local_irq_enable();
+	fiq_stop();
+
+	if (count == 0) {
+		printk(KERN_WARNING "Panalyzer: FIQ didn't fire\n");
+		return -EIO;
+	}
+	fiq_cost = stolen / count ? : 1;
+	fiq_max_rate = ARM_TICK_HZ / fiq_cost;
+	printk(KERN_INFO "Panalyzer: FIQ sample takes %u ticks, so at most %uHz\n",
+			fiq_cost, fiq_max_rate);
+
+	return 0;
+}
+
+// The ring is shared by the FIQ and spare core engines
+static int ring_alloc(void)
+{
+	if (fiq_head == NULL) {
+		fiq_head = kmalloc(sizeof(uint32_t), GFP_KERNEL);
+		if (fiq_head == NULL)
+			return -ENOMEM;
+	}
+	// Set last, so the ring is only there once it can be used
+	if (fiq_ring == NULL) {
+		fiq_ring = (uint32_t *)__get_free_pages(GFP_KERNEL,
+				get_order(PAN_RING_SAMPLES * sizeof(uint32_t)));
+		if (fiq_ring == NULL)
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+// Get the ring, and check the FIQ can keep up with period
+static int fiq_prepare(uint32_t rate, uint32_t period)
+{
+	int res;
+
+	res = ring_alloc();
+	if (res)
+		return res;
+	res = fiq_calibrate();
+	if (res)
+		return res;
+	// Leave at least half the CPU for Linux
+	if (fiq_cost * 2 > period) {
+		printk(KERN_INFO "Panalyzer: can't sustain %uHz with the FIQ, max about %uHz\n",
+				rate, fiq_max_rate / 2);
+		return -ERANGE;
+	}
+
+	return 0;
+}
+
+/*
+ * Spare core engine, for SoCs with more than one CPU.  A kthread bound to
+ * capture_cpu polls the ARM counter like capture() does, and puts the
+ * samples in the ring the FIQ uses, so the other CPUs carry on as normal.
+ * Boot with isolcpus= for the best results, so nothing else runs there.
+ *
+ * Interrupts are only disabled on that CPU, and are let in every
+ * irq_window_us so the other CPUs aren't held up waiting on IPIs.  The
+ * thread offers to reschedule then too, or a long capture trips the soft
+ * lockup and RCU stall detectors.  Samples due meanwhile are filled in
+ * with the last one and counted as late, and the longest window is kept.
+ * How late each real sample was taken goes in a histogram.
+ */
+static int capture_cpu = -1;
+module_param(capture_cpu, int, 0644);
+MODULE_PARM_DESC(capture_cpu, "CPU for the spare core engine, -1 for the last one");
+
+static unsigned int core_jitter_p99;
+module_param(core_jitter_p99, uint, 0444);
+MODULE_PARM_DESC(core_jitter_p99,
+		"99th percentile lateness of spare core samples in the last capture (ns)");
+
+static unsigned int core_jitter_max;
+module_param(core_jitter_max, uint, 0444);
+MODULE_PARM_DESC(core_jitter_max, "Worst lateness of a spare core sample in the last capture (ns)");
+
+static struct task_struct *core_task;
+static int core_cpu;
+static uint32_t core_rate, core_chunk_ticks;
+static uint32_t core_late;
+static uint32_t core_window_max;	// Longest time out of the loop, in ticks
+static pan_hist_t core_hist;
+
+static int core_thread(void *arg)
+{
+	struct cap_pace_s pace;
+	uint32_t t, chunk_end, sample, out;
+
+	local_irq_disable();
+	cap_pace_init(&pace, ARM_TICK_HZ, core_rate, pan_read_tick());
+	chunk_end = pace.next + core_chunk_ticks;
+	for (;;) {
+		do { t = pan_read_tick(); } while (!cap_pace_due(&pace, t));
+		sample = pan_read_level();
+		pan_ring_put(fiq_ring, fiq_head, sample);
+		pan_hist_add(&core_hist, t - pace.next);
+		if (t - pace.next >= pace.period)
+			core_late++;
+		cap_pace_step(&pace);
+		if ((int32_t)(t - chunk_end) >= 0) {
+			local_irq_enable();
+			if (kthread_should_stop())
+				break;
+			cond_resched();
+			local_irq_disable();
+			out = pan_read_tick() - t;
+			if (out > core_window_max)
+				core_window_max = out;
+			while (cap_pace_due(&pace, pan_read_tick())) {
+				pan_ring_put(fiq_ring, fiq_head, sample);
+				core_late++;
+				cap_pace_step(&pace);
+			}
+			chunk_end = pan_read_tick() + core_chunk_ticks;
+		}
+	}
+
+	return 0;
+}
+
+// Find the spare CPU, get the ring, and check the loop can keep up
+static int core_prepare(uint32_t rate, uint32_t period)
+{
+	uint32_t cost;
+	int res;
+
+	core_cpu = capture_cpu < 0 ? num_online_cpus() - 1 : capture_cpu;
+	if (num_online_cpus() < 2 || core_cpu >= nr_cpu_ids || !cpu_online(core_cpu)) {
+		printk(KERN_INFO "Panalyzer: no spare CPU for the capture\n");
+		return -ENODEV;
+	}
+	res = ring_alloc();
+	if (res)
+		return res;
+	cost = calibrate();
+	if (cost + cost / 8 > period) {
+		printk(KERN_INFO "Panalyzer: can't sustain %uHz, loop takes %u ticks per sample "
+				"(max about %uHz)\n",
+				rate, cost, ARM_TICK_HZ / (cost + cost / 8));
+		return -ERANGE;
+	}
+
+	return 0;
+}
+
+static int core_start(uint32_t rate)
+{
+	*fiq_head = 0;
+	core_rate = rate;
+	core_chunk_ticks = window_ticks();
+	core_late = 0;
+	core_window_max = 0;
+	pan_hist_init(&core_hist);
+
+	core_task = kthread_create(core_thread, NULL, "panalyzer/%d", core_cpu);
+	if (IS_ERR(core_task))
+		return PTR_ERR(core_task);
+	kthread_bind(core_task, core_cpu);
+	wake_up_process(core_task);
+
+	return 0;
+}
+
+// Returns the samples that were late or filled in
+static uint32_t core_stop(void)
+{
+	kthread_stop(core_task);
+	core_jitter_p99 = pan_hist_percentile(&core_hist, 990) * ARM_TICK_NS;
+	core_jitter_max = core_hist.max * ARM_TICK_NS;
+	printk(KERN_INFO "Panalyzer: CPU %d took samples late by %uns median, %uns 99th percentile, "
+			"%uns max; %u late, %uus longest out of the loop\n",
+			core_cpu, pan_hist_percentile(&core_hist, 500) * ARM_TICK_NS,
+			core_jitter_p99, core_jitter_max, core_late,
+			core_window_max / (ARM_TICK_HZ / 1000000));
+
+	return core_late;
+}
+
+static uint32_t ring_stop(int core)
+{
+	if (core)
+		return core_stop();
+	fiq_stop();
+
+	return 0;
+}
+
+/*
+ * Take samples from the ring as the FIQ, or the spare core, puts them
+ * there, and run the trigger on them in process context.
+ */
+static int capture_ring(int core)
+{
+	uint32_t start_time, end_time, start_tick, end_tick, abort_ms;
+	uint32_t rate, period, n, lost, start;
+	unsigned long abort_jiffies;
+	struct cap_s cap;
+	pan_ring_t ring;
+	uint32_t sample = 0;
 	int overruns = 0;
+	int abort_reason = PAN_ABORT_NONE;
+	int res, done = 0;
 
-	for (last_state = 0; last_state < MAX_TRIGGERS && panctl.trigger[last_state].enabled; last_state++)
-		;
-	if (--last_state < 0)
-		state = -1;
+	res = capture_prepare(&rate);
+	if (res < 0)
+		return res;
+	cap_init(&cap, &panctl, &trig, res, buffer, data_bytes(&panctl), pack_gather, segments);
+	period = ARM_TICK_HZ / rate;
+	res = core ? core_prepare(rate, period) : fiq_prepare(rate, period);
+	if (res)
+		return res;
 
-	if (panctl.trigger_point == 0)
-		post_trigger_samples = panctl.num_samples * 19 / 20;
-	else if (panctl.trigger_point == 1)
-		post_trigger_samples = panctl.num_samples / 2;
-	else
-		post_trigger_samples = panctl.num_samples / 20;
-	pre_trigger_samples = panctl.num_samples - post_trigger_samples;
+	// There's no need for a cap as Linux keeps running
+	abort_ms = trigger_timeout_ms(rate, 0);
 
-	local_irq_disable();
-	local_fiq_disable();
-	start_time = *ticker;
-	start_tick = armtick[8];
-	t = start_time;
-	abort_time = start_time + (panctl.num_samples > 500000 ? panctl.num_samples * 2 : 1000000);
-#ifdef RUN_FLATOUT
-	armtick[2] = 1<<9;
-	while (buf_ptr != buf_end) {
-		volatile uint32_t x = *ticker;
-		*buf_ptr++ = armtick[8];
-	}
-#else
+	ring.head = fiq_head;
+	ring.data = fiq_ring;
+	ring.tail = 0;
+	start_time = pan_read_us();
+	start_tick = pan_read_tick();
+	abort_jiffies = jiffies + msecs_to_jiffies(abort_ms);
+	res = core ? core_start(rate) : fiq_start(period);
+	if (res)
+		return res;
 	for (;;) {
-		do { t1 = *ticker; } while (t1 == t);
-		sample = *data;
-		overruns += t1 - t - 1;
-		t = t1;
-		*buf_ptr++ = sample;
-		if (buf_ptr == buf_end)
-			buf_ptr = buf_start;
-		if (pre_trigger_samples > 0) {
-			pre_trigger_samples--;
-		} else if (state < 0) {
-			if (--post_trigger_samples <= 0)
-				break;
-		} else if (t1 == abort_time) {
-			local_irq_enable();
-			printk(KERN_INFO "Aborted, state %d, mask %08x, value %08x, sample %08x, state_samples %d\n",
-					state, panctl.trigger[state].mask, panctl.trigger[state].value, sample, state_samples);
+		n = pan_ring_avail(&ring, &lost);
+		if (lost) {
+			gap_forget(cap_oldest(&cap));
+			gap_add(cap.sample_count, lost, div_u64((uint64_t)lost * 1000000, rate));
+			overruns += lost;
+			done = cap_fill(&cap, sample, lost);
+		}
+		start = ring.tail;
+		while (n-- && !done) {
+			sample = pan_ring_get(&ring);
+			cap_store(&cap, sample);
+			done = cap_trigger(&cap, &trig, sample);
+		}
+		overruns += pan_ring_overwritten(&ring, start, ring.tail - start);
+		if (done)
+			break;
+		if (cap_waiting(&cap) && time_after(jiffies, abort_jiffies)) {
+			abort_reason = PAN_ABORT_TIMEOUT;
+			break;
+		}
+		if (cap_cancel) {
+			abort_reason = PAN_ABORT_CANCELLED;
+			break;
+		}
+		if (signal_pending(current)) {
+			ring_stop(core);
 			return -EINTR;
-		} else {
-recheck:
-			// TODO: Not convinced this logic is correct..
-			if (state_samples == 0) {
-				if (state == last_state) {
-					state = -1;
-					continue;
-				} else if ((panctl.trigger[state+1].mask & sample) == panctl.trigger[state+1].value) {
-					state++;
-					state_samples = panctl.trigger[state].min_samples - 1;
-					goto recheck;
-				}
-			} else {
-				state_samples--;
-			}
-			if ((panctl.trigger[state].mask & sample) != panctl.trigger[state].value) {
-				state = 0;
-				state_samples = panctl.trigger[state].min_samples;
-			}
 		}
+		// The ring lasts about 10ms at 5MHz
+		usleep_range(500, 1000);
 	}
-#endif
-	end_time = *ticker;
-	end_tick = armtick[8];
-	local_fiq_enable();
-	local_irq_enable();
-	first_data_index = buf_ptr - buf_start;
+	overruns += ring_stop(core);
+	end_time = pan_read_us();
+	end_tick = pan_read_tick();
+
+	capture_done(&cap, end_time - start_time, end_tick - start_tick, overruns, abort_reason, 0, 0);
+
+	printk(KERN_INFO "%d samples at %uHz (%uHz achieved) by %s in %dus, %d lost or late\n",
+			panctl.num_samples, rate, panctl.achieved_rate, core ? "spare core" : "FIQ",
+			end_time - start_time, overruns);
+
+	return 0;
+}
+
+/*
+ * Event mode: no sampling loop, just an interrupt on each edge of each
+ * channel, which reads the levels in to the events ring.
+ */
+static pan_event_t events;
+static pantrans_t *event_ring;		// For streaming; a capture uses its buffer
+static DECLARE_WAIT_QUEUE_HEAD(event_wait_q);
+
+static irqreturn_t event_irq(int irq, void *dev_id)
+{
+	pan_event_put(&events, pan_read_us(), pan_read_level());
+	wake_up_interruptible(&event_wait_q);
+
+	return IRQ_HANDLED;
+}
+
+static void event_irqs_free(uint32_t mask)
+{
+	int gpio;
+
+	for (gpio = 0; gpio < 32; gpio++)
+		if (mask & (1u << gpio))
+			free_irq(gpio_to_irq(gpio), &events);
+}
+
+// Interrupts on both edges of every channel, or none at all
+static int event_irqs_request(uint32_t mask)
+{
+	int gpio, res;
+
+	for (gpio = 0; gpio < 32; gpio++) {
+		if (!(mask & (1u << gpio)))
+			continue;
+		res = request_irq(gpio_to_irq(gpio), event_irq, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
+				"panalyzer", &events);
+		if (res) {
+			printk(KERN_INFO "Panalyzer: can't have the interrupt for GPIO %d\n", gpio);
+			event_irqs_free(mask & ((1u << gpio) - 1));
+			return res;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Sleep while the interrupts fill the buffer, which is then turned in to
+ * transition mode data.  The first record has the levels from just before
+ * the interrupts were requested, so a change while they are being set up
+ * only shows at the next edge.
+ */
+static int capture_events(void)
+{
+	uint32_t start_time, end_time, duration_us;
+	int abort_reason = PAN_ABORT_NONE;
+	int res;
+
+	duration_us = capture_duration_us();
+	start_time = pan_read_us();
+	pan_event_init(&events, (pantrans_t *)buffer, panctl.num_records, panctl.channel_mask,
+			start_time, pan_read_level());
+	res = event_irqs_request(panctl.channel_mask);
+	if (res)
+		return res;
+	while (pan_read_us() - start_time < duration_us) {
+		if (cap_cancel) {
+			abort_reason = PAN_ABORT_CANCELLED;
+			break;
+		}
+		if (signal_pending(current)) {
+			event_irqs_free(panctl.channel_mask);
+			return -EINTR;
+		}
+		msleep(10);
+	}
+	event_irqs_free(panctl.channel_mask);
+	end_time = pan_read_us();
+
+	panctl.num_samples = end_time - start_time;
+	trans_fixup(events.next, pan_event_wrapped(&events), end_time - start_time);
+	panctl.sample_rate = 1000000;
+	panctl.achieved_rate = 1000000;
+	panctl.trigger_index = PAN_NO_TRIGGER;
+	panctl.overruns = events.missed;
+	panctl.elapsed_us = end_time - start_time;
+	panctl.abort_reason = abort_reason;
+	panctl.max_irq_off_us = 0;
+
+	printk(KERN_INFO "%u events in %uus, %u edges missed\n",
+			panctl.num_records, panctl.elapsed_us, events.missed);
+
+	return 0;
+}
+
+// Get a buffer and run the capture panctl asks for
+static int run_capture(void)
+{
+	int res;
+
+	res = check_panctl();
+	if (res)
+		return res;
+	buffer = (uint32_t *)pool_get(alloc_bytes(), &buffer_size);
+	if (buffer == NULL) {
+		printk(KERN_ALERT "vmalloc failed\n");
+		return -EFAULT;
+	}
+
+	if (panctl.flags & PAN_FLAG_EVENTS)
+		res = capture_events();
+	else if (panctl.flags & PAN_FLAG_FIQ)
+		res = capture_ring(0);
+	else if (panctl.flags & PAN_FLAG_CORE)
+		res = capture_ring(1);
+	else
+		res = capture();
+	if (res) {
+		pool_put(buffer, buffer_size);
+		buffer = NULL;
+	}
+
+	return res;
+}
+
+/*
+ * Run the capture s asks for, with the hardware claimed, and make it both
+ * what s reads and what PAN_IOC_ATTACH finds.  Releases the hardware.
+ */
+static int session_capture(struct session_s *s)
+{
+	pan_capture_t *c, *old;
+	int res;
+
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (c == NULL) {
+		hw_release();
+		return -ENOMEM;
+	}
+	memcpy(&panctl, &s->panctl, sizeof(panctl));
+	res = run_capture();
+	if (res) {
+		kfree(c);
+		hw_release();
+		return res;
+	}
+	pan_capture_init(c, &panctl, buffer, buffer_size);
+	buffer = NULL;
+
+	capture_put(s->cap);
+	s->cap = c;
+	mutex_lock(&pan_lock);
+	old = pan_capture_swap(&last_capture, c);
+	cap_owner = NULL;
+	mutex_unlock(&pan_lock);
+	capture_put(old);
+
+	return 0;
+}
+
+static void capture_work(struct work_struct *work)
+{
+	struct session_s *s = cap_owner;
+
+	s->result = session_capture(s);
+	s->state = PAN_STATE_DONE;
+	wake_up_interruptible(&done_wait_q);
+}
+
+static DECLARE_WORK(cap_work, capture_work);
+
+/*
+ * Stream mode.  The FIQ runs until the device is closed, and read() and
+ * splice() take samples straight from its ring.  The FIQ can't wake
+ * anyone, so a timer looks at the ring every tick and wakes readers if
+ * there is anything there.  A reader that blocks can be a tick late, so
+ * rates the ring doesn't last two ticks at are refused.
+ */
+static int live;
+static pan_ring_t live_ring;
+static uint32_t live_start_time;
+static struct timer_list live_timer;
+static DECLARE_WAIT_QUEUE_HEAD(live_wait_q);
+
+// Streaming holds the hardware for as long as the session that started it
+static int session_live(struct session_s *s)
+{
+	return live && cap_owner == s;
+}
+
+static unsigned int live_lost;
+module_param(live_lost, uint, 0444);
+MODULE_PARM_DESC(live_lost, "Samples dropped in stream mode because the reader was too slow");
+
+static int live_ready(void)
+{
+	if (panctl.flags & PAN_FLAG_EVENTS)
+		return events.head != events.tail;
+	return *live_ring.head != live_ring.tail;
+}
+
+static void live_tick(unsigned long arg)
+{
+	if (live_ready())
+		wake_up_interruptible(&live_wait_q);
+	mod_timer(&live_timer, jiffies + 1);
+}
+
+// Streaming events: the interrupts fill event_ring and wake the reader
+static int event_stream_start(void)
+{
+	int res;
+
+	if (event_ring == NULL) {
+		event_ring = kmalloc(PAN_EVENT_RECORDS * sizeof(pantrans_t), GFP_KERNEL);
+		if (event_ring == NULL)
+			return -ENOMEM;
+	}
+	live_start_time = pan_read_us();
+	pan_event_init(&events, event_ring, PAN_EVENT_RECORDS, panctl.channel_mask,
+			live_start_time, pan_read_level());
+	panctl.first_data_index = 0;
+	panctl.trigger_index = PAN_NO_TRIGGER;
+	panctl.overruns = 0;
+	panctl.elapsed_us = 0;
+	panctl.sample_rate = 1000000;
+	panctl.achieved_rate = 1000000;
+	panctl.abort_reason = PAN_ABORT_NONE;
+	res = event_irqs_request(panctl.channel_mask);
+	if (res)
+		return res;
+	live = 1;
+	printk(KERN_INFO "Panalyzer: streaming events\n");
+
+	return 0;
+}
+
+static int live_start(void)
+{
+	uint32_t rate, period;
+	int res;
+
+	if (panctl.flags & PAN_FLAG_EVENTS)
+		return event_stream_start();
+	rate = PAN_SAMPLE_RATE(&panctl);
+	if (rate < MIN_SAMPLE_RATE || rate > MAX_SAMPLE_RATE)
+		return -EINVAL;
+	// live_tick() only looks at the ring once a tick
+	if (rate > PAN_RING_MAX_RATE(HZ)) {
+		printk(KERN_INFO "Panalyzer: can't stream %uHz, the ring only lasts a tick up to %uHz\n",
+				rate, PAN_RING_MAX_RATE(HZ));
+		return -ERANGE;
+	}
+	period = ARM_TICK_HZ / rate;
+	res = fiq_prepare(rate, period);
+	if (res)
+		return res;
 
-//	printk(KERN_INFO "%d samples in %dus, %d overruns\n", panctl.num_samples, end_time - start_time, overruns);
-	printk(KERN_INFO "%d samples in %dus\n", end_tick - start_tick, end_time - start_time);
+	live_ring.head = fiq_head;
+	live_ring.data = fiq_ring;
+	live_ring.tail = 0;
+	panctl.first_data_index = 0;
+	panctl.trigger_index = PAN_NO_TRIGGER;
+	panctl.overruns = 0;
+	panctl.elapsed_us = 0;
+	panctl.achieved_rate = ARM_TICK_HZ / period;
+	panctl.abort_reason = PAN_ABORT_NONE;
+	live_start_time = pan_read_us();
+	res = fiq_start(period);
+	if (res)
+		return res;
+	live = 1;
+	setup_timer(&live_timer, live_tick, 0);
+	mod_timer(&live_timer, jiffies + 1);
+	printk(KERN_INFO "Panalyzer: streaming at %uHz\n", panctl.achieved_rate);
 
 	return 0;
 }
 
+static void live_stop(void)
+{
+	if (panctl.flags & PAN_FLAG_EVENTS) {
+		event_irqs_free(panctl.channel_mask);
+		live = 0;
+		printk(KERN_INFO "Panalyzer: streamed %u events in %uus, %u edges missed, %u dropped\n",
+				events.head, pan_read_us() - live_start_time, events.missed, events.dropped);
+		return;
+	}
+	del_timer_sync(&live_timer);
+	fiq_stop();
+	live = 0;
+	printk(KERN_INFO "Panalyzer: streamed %u samples in %uus, %u dropped\n",
+			live_ring.tail, pan_read_us() - live_start_time, panctl.overruns);
+}
+
+/*
+ * Wait for samples; returns how many there are.  Anything the reader fell
+ * too far behind for is skipped and counted here.
+ */
+static int live_wait(int nonblock)
+{
+	uint32_t n, lost;
+
+	for (;;) {
+		n = pan_ring_avail(&live_ring, &lost);
+		if (lost) {
+			panctl.overruns += lost;
+			live_lost += lost;
+		}
+		if (n)
+			return n;
+		if (nonblock)
+			return -EAGAIN;
+		if (wait_event_interruptible(live_wait_q, live_ready()))
+			return -ERESTARTSYS;
+	}
+}
+
+// Count what the FIQ may have overwritten while we copied from start
+static void live_check(uint32_t start)
+{
+	uint32_t n = pan_ring_overwritten(&live_ring, start, live_ring.tail - start);
+
+	panctl.overruns += n;
+	live_lost += n;
+}
+
+static ssize_t live_read(struct file *filp, char *buf, size_t count)
+{
+	uint32_t run, start;
+	ssize_t done = 0;
+	int n;
+
+	if (count < sizeof(uint32_t))
+		return -EINVAL;
+	n = live_wait(filp->f_flags & O_NONBLOCK);
+	if (n < 0)
+		return n;
+	if (n > count / sizeof(uint32_t))
+		n = count / sizeof(uint32_t);
+	start = live_ring.tail;
+	while (n) {
+		run = pan_ring_run(&live_ring, n);
+		if (copy_to_user(buf + done, live_ring.data + (live_ring.tail & PAN_RING_MASK),
+				run * sizeof(uint32_t)))
+			return -EFAULT;
+		live_ring.tail += run;
+		done += run * sizeof(uint32_t);
+		n -= run;
+	}
+	live_check(start);
+
+	return done;
+}
+
+static ssize_t event_read(struct file *filp, char *buf, size_t count)
+{
+	uint32_t n, lost;
+	ssize_t done = 0;
+
+	if (count < sizeof(pantrans_t))
+		return -EINVAL;
+	// Until something is copied out that wasn't overwritten while we copied it
+	while (done == 0) {
+		n = pan_event_avail(&events, &lost);
+		live_lost += lost;
+		if (n == 0) {
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			if (wait_event_interruptible(event_wait_q, live_ready()))
+				return -ERESTARTSYS;
+			continue;
+		}
+		if (n > count / sizeof(pantrans_t))
+			n = count / sizeof(pantrans_t);
+		while (n--) {
+			if (copy_to_user(buf + done, pan_event_get(&events), sizeof(pantrans_t)))
+				return -EFAULT;
+			// The next one goes over it
+			if (pan_event_stale(&events))
+				live_lost++;
+			else
+				done += sizeof(pantrans_t);
+		}
+	}
+
+	return done;
+}
+
 int init_module(void)
 {
 	int res;
@@ -193,9 +1709,16 @@ int init_module(void)
 		return res;
 	}
 
-	data = (uint32_t *)ioremap(0x20200034, 4);
-	ticker = (uint32_t *)ioremap(0x20003004, 4);
-	armtick = (uint32_t *)ioremap(0x2000b400, 0x24);
+	// From mach/platform.h, so the same source builds for multi-core SoCs
+	pan_regs.gplev0 = (uint32_t *)ioremap(GPIO_BASE + PAN_GPLEV0_OFFSET, 4);
+	pan_regs.gpeds0 = (uint32_t *)ioremap(GPIO_BASE + PAN_GPEDS0_OFFSET, 4);
+	pan_regs.gpren0 = (uint32_t *)ioremap(GPIO_BASE + PAN_GPREN0_OFFSET, 4);
+	pan_regs.gpfen0 = (uint32_t *)ioremap(GPIO_BASE + PAN_GPFEN0_OFFSET, 4);
+	pan_regs.st_clo = (uint32_t *)ioremap(ST_BASE + PAN_ST_CLO_OFFSET, 4);
+	pan_regs.arm_timer = (uint32_t *)ioremap(ARMCTRL_TIMER0_1_BASE, PAN_ARM_TIMER_SIZE);
+
+	pan_regs.arm_timer[PAN_ARM_CONTROL] = PAN_ARM_FREE_ENABLE;
+	reserve_init();
 
 	return 0;
 }
@@ -203,9 +1726,19 @@ int init_module(void)
 
 void cleanup_module(void)
 {
-	iounmap(data);
-	iounmap(ticker);
-	iounmap(armtick);
+	iounmap(pan_regs.gplev0);
+	iounmap(pan_regs.gpeds0);
+	iounmap(pan_regs.gpren0);
+	iounmap(pan_regs.gpfen0);
+	iounmap(pan_regs.st_clo);
+	iounmap(pan_regs.arm_timer);
+	capture_put(last_capture);
+	pool_drain();
+	reserve_free();
+	kfree(event_ring);
+	if (fiq_ring)
+		free_pages((unsigned long)fiq_ring, get_order(PAN_RING_SAMPLES * sizeof(uint32_t)));
+	kfree(fiq_head);
 	cdev_del(&my_cdev);
 	unregister_chrdev_region(devno, 1);
 }
@@ -213,47 +1746,98 @@ void cleanup_module(void)
 
 static int dev_open(struct inode *inod,struct file *fil)
 {
-	memcpy(&panctl, &def_panctl, sizeof(panctl));
+	struct session_s *s;
+
+	s = kmalloc(sizeof(*s), GFP_KERNEL);
+	if (s == NULL)
+		return -ENOMEM;
+	memcpy(&s->panctl, &def_panctl, sizeof(s->panctl));
+	s->cap = NULL;
+	s->state = PAN_STATE_IDLE;
+	s->result = 0;
+	fil->private_data = s;
 
 	return 0;
 }
 
 static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
 {
+	struct session_s *s = filp->private_data;
+	pan_capture_t *c;
 	int res;
 
-	if (panctl.magic != PAN_MAGIC)
+	if (s->panctl.magic != PAN_MAGIC)
 		return -EINVAL;
 
-	if (buffer == NULL) {
-		buffer = (uint32_t *)vmalloc(panctl.num_samples * sizeof(uint32_t *));
-		if (buffer == NULL) {
-			printk(KERN_ALERT "vmalloc failed\n");
-			return -EFAULT;
-		}
-		memset(buffer, 0, panctl.num_samples * sizeof(uint32_t *));
+	// Reading the header of an armed capture waits for it to finish
+	if (s->state == PAN_STATE_ARMED) {
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(done_wait_q, s->state != PAN_STATE_ARMED))
+			return -ERESTARTSYS;
+	}
+	if (s->state == PAN_STATE_DONE && s->result)
+		return s->result;
 
-		res = capture();
+	if (s->cap == NULL && !session_live(s)) {
+		res = hw_claim(s);
+		if (res)
+			return res;
+		if (s->panctl.flags & PAN_FLAG_STREAM) {
+			memcpy(&panctl, &s->panctl, sizeof(panctl));
+			res = check_panctl();
+			if (res == 0)
+				res = live_start();
+			if (res)
+				hw_release();
+		} else {
+			res = session_capture(s);
+		}
 		if (res)
 			return res;
 	}
+	if (session_live(s)) {
+		if (*f_pos >= sizeof(panctl_t)) {
+			if (panctl.flags & PAN_FLAG_EVENTS)
+				res = event_read(filp, buf, count);
+			else
+				res = live_read(filp, buf, count);
+			if (res > 0)
+				*f_pos += res;
+			return res;
+		}
+		panctl.elapsed_us = pan_read_us() - live_start_time;
+		if (panctl.flags & PAN_FLAG_EVENTS)
+			panctl.overruns = events.missed + events.dropped;
+		count = sizeof(panctl_t) - *f_pos;
+		if (copy_to_user(buf, (char *)&panctl + *f_pos, count))
+			return -EFAULT;
+		*f_pos += count;
+		return count;
+	}
 
-	if (*f_pos >= sizeof(panctl_t) + panctl.num_samples * sizeof(uint32_t))
+	c = s->cap;
+	if (*f_pos >= sizeof(panctl_t) + stream_bytes(&c->hdr))
 		return 0;
 	if (*f_pos < sizeof(panctl_t)) {
 		count = sizeof(panctl_t) - *f_pos;
-//		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, (char *)&panctl + *f_pos);
-		if (copy_to_user(buf, (char *)&panctl + *f_pos, count))
+//		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, (char *)&c->hdr + *f_pos);
+		if (copy_to_user(buf, (char *)&c->hdr + *f_pos, count))
 			return -EFAULT;
 	}
 	else {
-		char *start = (char *)buffer;
-		char *data_start = start + first_data_index * sizeof(uint32_t);
-		char *end = start + panctl.num_samples * sizeof(uint32_t);
-		int index = *f_pos - sizeof(panctl);
+		char *start = (char *)c->buffer;
+		char *data_start = start + sample_bytes(&c->hdr, c->hdr.first_data_index);
+		char *end = start + data_bytes(&c->hdr);
+		int index = *f_pos - sizeof(panctl_t);
 		char *p = data_start + index;
 
-		if (p >= end) {
+		if (index >= end - start) {
+			// The gap records are after the ring, in order
+			p = start + index;
+			if (count > stream_bytes(&c->hdr) - index)
+				count = stream_bytes(&c->hdr) - index;
+		} else if (p >= end) {
 			p -= end - start;
 			if (count > data_start - p)
 				count = data_start - p;
@@ -261,7 +1845,7 @@ static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
 			count = end - p;
 		}
 
-//		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, (char *)buffer + *f_pos);
+//		printk(KERN_INFO "READ: returning %x bytes from %p\n", count, p);
 		if(copy_to_user(buf, p, count))
 			return -EFAULT;
 	}
@@ -272,13 +1856,22 @@ static ssize_t dev_read(struct file *filp,char *buf,size_t count,loff_t *f_pos)
 
 static ssize_t dev_write(struct file *filp,const char *buf,size_t count,loff_t *f_pos)
 {
-	if (*f_pos >= sizeof(panctl))
+	struct session_s *s = filp->private_data;
+
+	if (s->state == PAN_STATE_ARMED || session_live(s))
+		return -EBUSY;
+	if (*f_pos >= sizeof(panctl_t))
 		return 0;
-	count = sizeof(panctl) - *f_pos;
-	if (copy_from_user((char *)&panctl + *f_pos, buf, count))
+	if (count > sizeof(panctl_t) - *f_pos)
+		count = sizeof(panctl_t) - *f_pos;
+	if (copy_from_user((char *)&s->panctl + *f_pos, buf, count))
 		return -EFAULT;
-	if (panctl.magic != PAN_MAGIC)
+	if (s->panctl.magic != PAN_MAGIC)
 		return -EINVAL;
+	// New settings need a new capture
+	capture_put(s->cap);
+	s->cap = NULL;
+	s->state = PAN_STATE_IDLE;
 	*f_pos += count;
 
 	return count;
@@ -286,7 +1879,10 @@ static ssize_t dev_write(struct file *filp,const char *buf,size_t count,loff_t *
 
 static loff_t dev_llseek(struct file *filp, loff_t off, int whence)
 {
-	if (whence == SEEK_SET && off >= 0 && off < sizeof(panctl) + panctl.num_samples * sizeof(uint32_t)) {
+	struct session_s *s = filp->private_data;
+	const panctl_t *p = s->cap ? &s->cap->hdr : &s->panctl;
+
+	if (whence == SEEK_SET && off >= 0 && off < sizeof(panctl_t) + stream_bytes(p)) {
 		filp->f_pos = off;
 		return off;
 	} else {
@@ -294,10 +1890,246 @@ static loff_t dev_llseek(struct file *filp, loff_t off, int whence)
 	}
 }
 
+static void capture_vma_open(struct vm_area_struct *vma)
+{
+	pan_capture_get(vma->vm_private_data);
+}
+
+static void capture_vma_close(struct vm_area_struct *vma)
+{
+	capture_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct capture_vm_ops = {
+	.open = capture_vma_open,
+	.close = capture_vma_close,
+};
+
+/*
+ * Map the capture buffer read-only, so the UI can decode the ring in place
+ * starting at first_data_index, rather than read() copying it out.  The
+ * capture has to have been run by reading the header first, or attached.
+ * The mapping keeps its own reference, so it stays valid whatever the file
+ * goes on to do.
+ */
+static int dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct session_s *s = filp->private_data;
+	pan_capture_t *c = s->cap;
+	int res;
+
+	if (s->state == PAN_STATE_ARMED)
+		return -EBUSY;
+	if (c == NULL)
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	if (vma->vm_pgoff != 0 || vma->vm_end - vma->vm_start > c->buffer_size)
+		return -EINVAL;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	if (in_reserve(c->buffer))
+		res = remap_pfn_range(vma, vma->vm_start, reserve_pfn(c->buffer),
+				vma->vm_end - vma->vm_start, vma->vm_page_prot);
+	else
+		res = remap_vmalloc_range(vma, c->buffer, 0);
+	if (res)
+		return res;
+	vma->vm_private_data = pan_capture_get(c);
+	vma->vm_ops = &capture_vm_ops;
+
+	return 0;
+}
+
+// Readable once an armed capture is done, or stream mode has samples
+static unsigned int dev_poll(struct file *filp, poll_table *wait)
+{
+	struct session_s *s = filp->private_data;
+
+	if (session_live(s)) {
+		poll_wait(filp, panctl.flags & PAN_FLAG_EVENTS ? &event_wait_q : &live_wait_q, wait);
+		return live_ready() ? POLLIN | POLLRDNORM : 0;
+	}
+	poll_wait(filp, &done_wait_q, wait);
+
+	return s->state == PAN_STATE_ARMED ? 0 : POLLIN | POLLRDNORM;
+}
+
+// Stop an armed capture, and wait for it to tidy up
+static void cap_stop(struct session_s *s)
+{
+	if (s->state != PAN_STATE_ARMED)
+		return;
+	mutex_lock(&pan_lock);
+	if (cap_owner == s)
+		cap_cancel = 1;
+	mutex_unlock(&pan_lock);
+	flush_work(&cap_work);
+}
+
+static long dev_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct session_s *s = filp->private_data;
+	pan_capture_t *c;
+	panstatus_t st;
+	int res;
+
+	switch (cmd) {
+	case PAN_IOC_CONFIGURE:
+		if (s->state == PAN_STATE_ARMED || session_live(s))
+			return -EBUSY;
+		if (copy_from_user(&s->panctl, (void *)arg, sizeof(panctl_t)))
+			return -EFAULT;
+		if (s->panctl.magic != PAN_MAGIC)
+			return -EINVAL;
+		capture_put(s->cap);
+		s->cap = NULL;
+		s->state = PAN_STATE_IDLE;
+		return 0;
+	case PAN_IOC_ARM:
+		if (s->state == PAN_STATE_ARMED || session_live(s))
+			return -EBUSY;
+		if (s->panctl.magic != PAN_MAGIC || (s->panctl.flags & PAN_FLAG_STREAM))
+			return -EINVAL;
+		res = hw_claim(s);
+		if (res)
+			return res;
+		// Arming again takes a fresh capture with the same settings
+		capture_put(s->cap);
+		s->cap = NULL;
+		s->result = 0;
+		s->state = PAN_STATE_ARMED;
+		schedule_work(&cap_work);
+		return 0;
+	case PAN_IOC_STATUS:
+		st.state = s->state;
+		st.result = s->result;
+		if (copy_to_user((void *)arg, &st, sizeof(st)))
+			return -EFAULT;
+		return 0;
+	case PAN_IOC_CANCEL:
+		cap_stop(s);
+		return 0;
+	case PAN_IOC_GET_HEADER:
+		if (s->state == PAN_STATE_ARMED)
+			return -EBUSY;
+		if (copy_to_user((void *)arg, s->cap ? &s->cap->hdr : &s->panctl, sizeof(panctl_t)))
+			return -EFAULT;
+		return 0;
+	case PAN_IOC_ATTACH:
+		if (s->state == PAN_STATE_ARMED || session_live(s))
+			return -EBUSY;
+		mutex_lock(&pan_lock);
+		c = last_capture ? pan_capture_get(last_capture) : NULL;
+		mutex_unlock(&pan_lock);
+		if (c == NULL)
+			return -ENOENT;
+		capture_put(s->cap);
+		s->cap = c;
+		s->state = PAN_STATE_IDLE;
+		filp->f_pos = 0;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+static void live_spd_release(struct splice_pipe_desc *spd, unsigned int i)
+{
+	__free_page(spd->pages[i]);
+}
+
+// The pages are ours alone, so they can be freed or stolen like any other
+static const struct pipe_buf_operations live_pipe_buf_ops = {
+	.can_merge = 0,
+	.map = generic_pipe_buf_map,
+	.unmap = generic_pipe_buf_unmap,
+	.confirm = generic_pipe_buf_confirm,
+	.release = generic_pipe_buf_release,
+	.steal = generic_pipe_buf_steal,
+	.get = generic_pipe_buf_get,
+};
+
+/*
+ * Stream mode samples are copied out of the FIQ ring in to fresh pages and
+ * handed to the pipe, so splice() to a file never goes through user space.
+ * The ring itself can't be spliced, as the FIQ would overwrite it while
+ * the pages were still in the pipe.
+ */
+static ssize_t dev_splice_read(struct file *filp, loff_t *ppos, struct pipe_inode_info *pipe,
+		size_t len, unsigned int flags)
+{
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.flags = flags,
+		.ops = &live_pipe_buf_ops,
+		.spd_release = live_spd_release,
+	};
+	uint32_t run, done, start;
+	uint32_t *p;
+	ssize_t res;
+	int n;
+
+	if (!session_live(filp->private_data) || (panctl.flags & PAN_FLAG_EVENTS) ||
+			*ppos < sizeof(panctl_t))
+		return -EINVAL;
+	n = live_wait((filp->f_flags & O_NONBLOCK) || (flags & SPLICE_F_NONBLOCK));
+	if (n < 0)
+		return n;
+	if (n > len / sizeof(uint32_t))
+		n = len / sizeof(uint32_t);
+	start = live_ring.tail;
+	for (spd.nr_pages = 0; n && spd.nr_pages < PIPE_DEF_BUFFERS; spd.nr_pages++) {
+		pages[spd.nr_pages] = alloc_page(GFP_KERNEL);
+		if (pages[spd.nr_pages] == NULL)
+			break;
+		p = page_address(pages[spd.nr_pages]);
+		for (done = 0; n && done < PAGE_SIZE / sizeof(uint32_t); done += run, n -= run) {
+			run = pan_ring_run(&live_ring, n);
+			if (run > PAGE_SIZE / sizeof(uint32_t) - done)
+				run = PAGE_SIZE / sizeof(uint32_t) - done;
+			memcpy(p + done, live_ring.data + (live_ring.tail & PAN_RING_MASK),
+					run * sizeof(uint32_t));
+			live_ring.tail += run;
+		}
+		partial[spd.nr_pages].offset = 0;
+		partial[spd.nr_pages].len = done * sizeof(uint32_t);
+	}
+	live_check(start);
+	if (spd.nr_pages == 0)
+		return -ENOMEM;
+
+	done = 0;
+	for (n = 0; n < spd.nr_pages; n++)
+		done += partial[n].len;
+	res = splice_to_pipe(pipe, &spd);
+	// Whatever the pipe didn't take has left the ring, so it is lost
+	if (res < (ssize_t)done) {
+		n = (done - (res > 0 ? res : 0)) / sizeof(uint32_t);
+		panctl.overruns += n;
+		live_lost += n;
+	}
+	if (res > 0)
+		*ppos += res;
+
+	return res;
+}
+
 static int dev_close(struct inode *inod,struct file *fil)
 {
-	vfree(buffer);
-	buffer = NULL;
+	struct session_s *s = fil->private_data;
+
+	if (session_live(s)) {
+		live_stop();
+		hw_release();
+	}
+	cap_stop(s);
+	capture_put(s->cap);
+	kfree(s);
 
 	return 0;
 }
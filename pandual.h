@@ -0,0 +1,201 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Dual rate mode: every sample at full rate in a window around the trigger,
+ * and only every decimate'th one either side of it.  Plain C with no kernel
+ * dependencies.
+ *
+ * The buffer is split in to four, sized by trigger_point as the whole
+ * buffer is otherwise:
+ *
+ *   [decimated ring][full rate ring][full rate, after][decimated, after]
+ *
+ * Until the trigger, each sample goes in the full rate ring, and every
+ * decimate'th one in the decimated ring as well.  After it, the full rate
+ * area is filled, and then every decimate'th sample goes in the last
+ * area.  The decimated ring overlaps the full rate one in time, so
+ * pan_dual_finish() drops its newest samples.  It then packs the data in
+ * to a list, oldest first, with a panregion_t describing each area.
+ */
+
+#ifndef PANDUAL_H_
+#define PANDUAL_H_
+
+struct pan_dual_s {
+	uint32_t	decimate;
+	uint32_t	left;				// Samples to the next decimated one
+	uint32_t	n;					// Samples so far
+	uint32_t	n_pre;				// Samples before the window after the trigger
+	int			post;				// Past the trigger
+	uint32_t	*buf;
+	uint32_t	d_pre, w_pre, w_post, d_post;	// Words in each area
+	uint32_t	d_count;			// Decimated samples before the trigger
+	uint32_t	f_next;				// Where the next one goes in the full rate ring
+	uint32_t	fp, dp;				// Samples in the areas after the trigger
+};
+typedef struct pan_dual_s pan_dual_t;
+
+// Buffer words for num_samples at full rate, with window of them around the trigger
+static inline uint32_t pan_dual_words(uint32_t num_samples, uint32_t window, uint32_t decimate)
+{
+	return window + (num_samples - window) / decimate;
+}
+
+/*
+ * Start filling words of buffer, with window full rate samples.  post_20ths
+ * of the window, and of the rest, are for after the trigger.
+ */
+static inline void pan_dual_init(pan_dual_t *d, uint32_t *buffer, uint32_t words, uint32_t window,
+		uint32_t decimate, uint32_t post_20ths)
+{
+	uint32_t dec = words - window;
+
+	memset(d, 0, sizeof(*d));
+	d->decimate = d->left = decimate;
+	d->buf = buffer;
+	d->w_post = window * post_20ths / 20;
+	d->w_pre = window - d->w_post;
+	d->d_post = dec * post_20ths / 20;
+	d->d_pre = dec - d->d_post;
+}
+
+// Full rate samples to see before and after the trigger, to fill the areas
+static inline uint32_t pan_dual_pre_samples(const pan_dual_t *d)
+{
+	return d->w_pre + d->d_pre * d->decimate;
+}
+
+static inline uint32_t pan_dual_post_samples(const pan_dual_t *d)
+{
+	return d->w_post + d->d_post * d->decimate;
+}
+
+static inline void pan_dual_store(pan_dual_t *d, uint32_t sample)
+{
+	uint32_t *f = d->buf + d->d_pre;
+
+	if (!d->post) {
+		f[d->f_next] = sample;
+		if (++d->f_next == d->w_pre)
+			d->f_next = 0;
+		if (--d->left == 0) {
+			d->left = d->decimate;
+			if (d->d_pre)
+				d->buf[d->d_count % d->d_pre] = sample;
+			d->d_count++;
+		}
+	} else if (d->fp < d->w_post) {
+		f[d->w_pre + d->fp++] = sample;
+	} else if (--d->left == 0) {
+		d->left = d->decimate;
+		if (d->dp < d->d_post)
+			f[d->w_pre + d->w_post + d->dp++] = sample;
+	}
+	d->n++;
+}
+
+// The trigger has fired; the samples from now on are after it
+static inline void pan_dual_trigger(pan_dual_t *d)
+{
+	d->post = 1;
+	d->n_pre = d->n;
+	// The first decimated sample is the one straight after the window
+	d->left = 1;
+}
+
+static inline void pan_dual_reverse(uint32_t *w, uint32_t n)
+{
+	uint32_t tmp, i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = w[i];
+		w[i] = w[n - 1 - i];
+		w[n - 1 - i] = tmp;
+	}
+}
+
+// Rotate the n word ring at w so the word at first comes first
+static inline void pan_dual_rotate(uint32_t *w, uint32_t n, uint32_t first)
+{
+	if (first) {
+		pan_dual_reverse(w, first);
+		pan_dual_reverse(w + first, n - first);
+		pan_dual_reverse(w, n);
+	}
+}
+
+static inline int pan_dual_region(panregion_t *r, uint32_t index, uint32_t sample,
+		uint32_t samples, uint32_t step)
+{
+	if (samples == 0)
+		return 0;
+	r->index = index;
+	r->sample = sample;
+	r->samples = samples;
+	r->step = step;
+
+	return 1;
+}
+
+/*
+ * Pack the areas in to a list at the start of the buffer, oldest first,
+ * and describe each in regions, which has room for PAN_MAX_REGIONS.  Sample
+ * numbers become relative to the oldest sample kept, whose number is
+ * returned in *start.  Returns the number of regions, with the words used
+ * in *words and the samples they cover in *span.
+ */
+static inline int pan_dual_finish(pan_dual_t *d, panregion_t *regions, uint32_t *start,
+		uint32_t *words, uint32_t *span)
+{
+	uint32_t *f = d->buf + d->d_pre;
+	uint32_t n_pre = d->post ? d->n_pre : d->n;
+	uint32_t f_count = n_pre < d->w_pre ? n_pre : d->w_pre;
+	uint32_t f_first = n_pre - f_count;
+	uint32_t d_first = d->d_count > d->d_pre ? d->d_count - d->d_pre : 0;
+	uint32_t d_end = d->d_count < f_first / d->decimate ? d->d_count : f_first / d->decimate;
+	uint32_t kept = d_end > d_first ? d_end - d_first : 0;
+	uint32_t w = 0, i;
+	int n = 0;
+
+	if (d->d_pre && d->d_count > d->d_pre)
+		pan_dual_rotate(d->buf, d->d_pre, d->d_count % d->d_pre);
+	if (n_pre > d->w_pre)
+		pan_dual_rotate(f, d->w_pre, d->f_next);
+
+	// The decimated samples are the decimate'th, 2 * decimate'th and so on
+	n += pan_dual_region(regions + n, w, (d_first + 1) * d->decimate - 1, kept, d->decimate);
+	w += kept;
+	memmove(d->buf + w, f, f_count * sizeof(uint32_t));
+	memmove(d->buf + w + f_count, f + d->w_pre, d->fp * sizeof(uint32_t));
+	n += pan_dual_region(regions + n, w, f_first, f_count + d->fp, 1);
+	w += f_count + d->fp;
+	memmove(d->buf + w, f + d->w_pre + d->w_post, d->dp * sizeof(uint32_t));
+	n += pan_dual_region(regions + n, w, n_pre + d->w_post, d->dp, d->decimate);
+	w += d->dp;
+
+	*start = n ? regions[0].sample : 0;
+	for (i = 0; i < n; i++)
+		regions[i].sample -= *start;
+	*words = w;
+	*span = n ? regions[n - 1].sample + regions[n - 1].samples * regions[n - 1].step : 0;
+
+	return n;
+}
+
+#endif /* PANDUAL_H_ */
@@ -0,0 +1,136 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Ring of pantrans_t records for event mode, where GPIO edge interrupts
+ * say when to look at the levels rather than a loop sampling them.  Plain
+ * C with no kernel dependencies, so anything can play the interrupt
+ * handler and call pan_event_put().
+ *
+ * The records are in transition mode format, with sample in microseconds
+ * from the start.  It wraps after 71 minutes; records are in order, so a
+ * reader that keeps up can carry the wraps.  There is only ever one
+ * producer, as the GPIO interrupts all come from the one bank handler.
+ * As in panring.h the producer never looks at the consumer, which skips
+ * what it was too slow for; the barriers are panring.h's.
+ */
+
+#ifndef PANEVENT_H_
+#define PANEVENT_H_
+
+#include "panring.h"
+
+// Ring size for streaming; a capture uses its own buffer
+#define PAN_EVENT_RECORDS	4096
+
+struct pan_event_s {
+	pantrans_t			*rec;
+	uint32_t			size;		// Records in rec
+	volatile uint32_t	head;		// Records written, by the producer
+	uint32_t			next;		// Where the next one goes
+	uint32_t			mask;		// Channels with interrupts
+	uint32_t			levels;		// Last written
+	uint32_t			start_us;
+	uint32_t			missed;		// Edges gone again before the levels were read
+	uint32_t			tail;		// Records consumed, when streaming
+	uint32_t			dropped;	// Records the consumer was too slow for
+};
+typedef struct pan_event_s pan_event_t;
+
+static inline void pan_event_put(pan_event_t *e, uint32_t us, uint32_t levels)
+{
+	pantrans_t *r;
+
+	levels &= e->mask;
+	if (levels == e->levels) {
+		e->missed++;
+		return;
+	}
+	e->levels = levels;
+	r = &e->rec[e->next];
+	r->sample = us - e->start_us;
+	r->levels = levels;
+	if (++e->next == e->size)
+		e->next = 0;
+	pan_ring_wmb();
+	e->head = e->head + 1;
+}
+
+/*
+ * Start a ring of size records at rec, at time us, with a first record
+ * giving the levels then, as transition mode does.
+ */
+static inline void pan_event_init(pan_event_t *e, pantrans_t *rec, uint32_t size, uint32_t mask,
+		uint32_t us, uint32_t levels)
+{
+	memset(e, 0, sizeof(*e));
+	e->rec = rec;
+	e->size = size;
+	e->mask = mask;
+	e->start_us = us;
+	e->levels = ~(levels & mask);
+	pan_event_put(e, us, levels);
+}
+
+// Whether the oldest records have been overwritten
+static inline int pan_event_wrapped(const pan_event_t *e)
+{
+	return e->head >= e->size;
+}
+
+/*
+ * Records waiting for the consumer, skipping the tail past any that are,
+ * or may soon be, overwritten; those are added to dropped and returned in
+ * *lost.
+ */
+static inline uint32_t pan_event_avail(pan_event_t *e, uint32_t *lost)
+{
+	uint32_t head = e->head;
+
+	pan_ring_rmb();
+	*lost = 0;
+	if (head - e->tail > e->size - e->size / 4) {
+		*lost = head - e->tail - (e->size - e->size / 4);
+		e->tail += *lost;
+		e->dropped += *lost;
+	}
+
+	return head - e->tail;
+}
+
+static inline const pantrans_t *pan_event_get(pan_event_t *e)
+{
+	return &e->rec[e->tail++ % e->size];
+}
+
+/*
+ * Whether the record pan_event_get() last returned may have been
+ * overwritten since, if the consumer was held up while copying it out.
+ * If so it is added to dropped, and the copy must not be used.
+ */
+static inline int pan_event_stale(pan_event_t *e)
+{
+	pan_ring_rmb();
+	if (e->head - (e->tail - 1) < e->size)
+		return 0;
+	e->dropped++;
+
+	return 1;
+}
+
+#endif /* PANEVENT_H_ */
@@ -0,0 +1,94 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Histogram of the gaps between timestamps, one bucket per ARM tick, for
+ * measuring sampling jitter.  Plain C with no kernel dependencies.  Gaps
+ * too big for the last bucket are counted in it, and only min and max
+ * record their real values.
+ */
+
+#ifndef PANHIST_H_
+#define PANHIST_H_
+
+#define PAN_HIST_BUCKETS	256
+
+// The kernel has no 64-bit division on 32-bit ARM
+#ifdef __KERNEL__
+#define pan_hist_div(n, d)	div_u64(n, d)
+#else
+#define pan_hist_div(n, d)	((n) / (d))
+#endif
+
+struct pan_hist_s {
+	uint32_t	bucket[PAN_HIST_BUCKETS];
+	uint32_t	count;
+	uint32_t	min;
+	uint32_t	max;
+};
+typedef struct pan_hist_s pan_hist_t;
+
+static inline void pan_hist_init(pan_hist_t *h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = ~0;
+}
+
+static inline void pan_hist_add(pan_hist_t *h, uint32_t gap)
+{
+	h->bucket[gap < PAN_HIST_BUCKETS ? gap : PAN_HIST_BUCKETS - 1]++;
+	h->count++;
+	if (gap < h->min)
+		h->min = gap;
+	if (gap > h->max)
+		h->max = gap;
+}
+
+// Add the gaps between n consecutive timestamps, allowing for wrap
+static inline void pan_hist_add_stamps(pan_hist_t *h, const uint32_t *stamp, uint32_t n)
+{
+	uint32_t i;
+
+	for (i = 1; i < n; i++)
+		pan_hist_add(h, stamp[i] - stamp[i-1]);
+}
+
+/*
+ * The smallest gap that at least permille/1000 of the gaps are no bigger
+ * than.  If that lands in the overflow bucket the answer is max.
+ */
+static inline uint32_t pan_hist_percentile(const pan_hist_t *h, uint32_t permille)
+{
+	uint32_t want, seen = 0, i;
+
+	if (h->count == 0)
+		return 0;
+	// Round up, so the 500th permille of 3 gaps is the second
+	want = (uint32_t)pan_hist_div((uint64_t)h->count * permille + 999, 1000);
+	if (want == 0)
+		want = 1;
+	for (i = 0; i < PAN_HIST_BUCKETS - 1; i++) {
+		seen += h->bucket[i];
+		if (seen >= want)
+			return i;
+	}
+
+	return h->max;
+}
+
+#endif /* PANHIST_H_ */
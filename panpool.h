@@ -0,0 +1,101 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The capture buffers the driver keeps across opens, so continuous mode
+ * doesn't vmalloc and clear up to 8MB before every capture.  Plain C with
+ * no kernel dependencies; the driver does the allocating, freeing and
+ * locking, and this only decides what to reuse and what to keep.
+ */
+
+#ifndef PANPOOL_H_
+#define PANPOOL_H_
+
+#define PAN_POOL_SLOTS	8
+
+struct pan_pool_s {
+	struct {
+		void		*buf;
+		uint32_t	size;
+	} slot[PAN_POOL_SLOTS];
+};
+typedef struct pan_pool_s pan_pool_t;
+
+/*
+ * Take the smallest pooled buffer of at least size bytes out of the pool,
+ * with its size in *got.  Returns NULL if none is big enough.
+ */
+static inline void *pan_pool_get(pan_pool_t *p, uint32_t size, uint32_t *got)
+{
+	void *buf;
+	int i, best = -1;
+
+	for (i = 0; i < PAN_POOL_SLOTS; i++) {
+		if (p->slot[i].buf && p->slot[i].size >= size &&
+				(best < 0 || p->slot[i].size < p->slot[best].size))
+			best = i;
+	}
+	if (best < 0)
+		return NULL;
+	buf = p->slot[best].buf;
+	*got = p->slot[best].size;
+	p->slot[best].buf = NULL;
+
+	return buf;
+}
+
+/*
+ * Keep buf, of size bytes, for reuse if fewer than max are pooled already.
+ * Returns -1 if not, and the caller should free it.
+ */
+static inline int pan_pool_put(pan_pool_t *p, void *buf, uint32_t size, int max)
+{
+	int i, used = 0, free_slot = -1;
+
+	for (i = 0; i < PAN_POOL_SLOTS; i++) {
+		if (p->slot[i].buf)
+			used++;
+		else if (free_slot < 0)
+			free_slot = i;
+	}
+	if (free_slot < 0 || used >= max)
+		return -1;
+	p->slot[free_slot].buf = buf;
+	p->slot[free_slot].size = size;
+
+	return 0;
+}
+
+// Take out any pooled buffer, for freeing them all; NULL once it's empty
+static inline void *pan_pool_drain(pan_pool_t *p)
+{
+	void *buf;
+	int i;
+
+	for (i = 0; i < PAN_POOL_SLOTS; i++) {
+		if (p->slot[i].buf) {
+			buf = p->slot[i].buf;
+			p->slot[i].buf = NULL;
+			return buf;
+		}
+	}
+
+	return NULL;
+}
+
+#endif /* PANPOOL_H_ */
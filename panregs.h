@@ -0,0 +1,77 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The few registers the capture engines read in their sampling loops: the
+ * GPIO levels and event detect latches, the 1MHz system timer and the
+ * 250MHz ARM free-running counter.  Plain C with no kernel dependencies.
+ *
+ * The loops only ever get at them through pan_read_level(), pan_read_us(),
+ * pan_read_tick(), pan_read_events() and pan_clear_events().  By default
+ * those go through the pointers in pan_regs, which the driver ioremap()s.
+ * Define all five before including this to read something else instead,
+ * such as a simulated waveform and clocks, so the loops can be timed and
+ * checked without a Pi.
+ */
+
+#ifndef PANREGS_H_
+#define PANREGS_H_
+
+// Offsets from GPIO_BASE and ST_BASE
+#define PAN_GPLEV0_OFFSET		0x34
+#define PAN_GPEDS0_OFFSET		0x40	// Event detect status, write 1 to clear
+#define PAN_GPREN0_OFFSET		0x4c	// Rising edge detect enable
+#define PAN_GPFEN0_OFFSET		0x58	// Falling edge detect enable
+#define PAN_ST_CLO_OFFSET		0x04
+
+// Words from ARMCTRL_TIMER0_1_BASE
+#define PAN_ARM_LOAD			0
+#define PAN_ARM_CONTROL			2
+#define PAN_ARM_IRQ_CLEAR		3
+#define PAN_ARM_RELOAD			6
+#define PAN_ARM_PREDIV			7
+#define PAN_ARM_FREE			8
+#define PAN_ARM_TIMER_SIZE		0x24
+
+// PAN_ARM_CONTROL bits
+#define PAN_ARM_32BIT			(1<<1)
+#define PAN_ARM_IRQ_ENABLE		(1<<5)
+#define PAN_ARM_TIMER_ENABLE	(1<<7)
+#define PAN_ARM_FREE_ENABLE		(1<<9)	// Free-running counter, no prescale
+
+struct pan_regs_s {
+	volatile uint32_t	*gplev0;
+	volatile uint32_t	*gpeds0;
+	volatile uint32_t	*gpren0;
+	volatile uint32_t	*gpfen0;
+	volatile uint32_t	*st_clo;
+	volatile uint32_t	*arm_timer;
+};
+typedef struct pan_regs_s pan_regs_t;
+
+#ifndef pan_read_level
+static pan_regs_t pan_regs;
+
+#define pan_read_level()		(*pan_regs.gplev0)
+#define pan_read_us()			(*pan_regs.st_clo)
+#define pan_read_tick()			(pan_regs.arm_timer[PAN_ARM_FREE])
+#define pan_read_events()		(*pan_regs.gpeds0)
+#define pan_clear_events(ev)	(*pan_regs.gpeds0 = (ev))
+#endif
+
+#endif /* PANREGS_H_ */
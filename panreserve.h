@@ -0,0 +1,122 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Carving capture buffers out of the block of contiguous memory the driver
+ * is given at load.  Plain C with no kernel dependencies; it only deals in
+ * offsets from the start of the block.
+ *
+ * A finished capture keeps its buffer for as long as anything reads or maps
+ * it, so a new capture usually has to fit alongside the last one.  Buffers
+ * are kept in offset order, and each new one goes in the first hole that is
+ * big enough.
+ */
+
+#ifndef PANRESERVE_H_
+#define PANRESERVE_H_
+
+// The device tree reserved-memory node the drivers take the block from
+#define PAN_RESERVE_COMPATIBLE	"panalyzer,capture-memory"
+
+#define PAN_RESERVE_SLOTS	8
+
+struct pan_reserve_s {
+	uint32_t	size;
+	uint32_t	align;				// A power of 2, the page size in the driver
+	int			used;
+	struct {
+		uint32_t	offset;
+		uint32_t	bytes;
+	} buf[PAN_RESERVE_SLOTS];
+};
+typedef struct pan_reserve_s pan_reserve_t;
+
+static inline void pan_reserve_init(pan_reserve_t *r, uint32_t size, uint32_t align)
+{
+	memset(r, 0, sizeof(*r));
+	r->size = size & ~(align - 1);
+	r->align = align;
+}
+
+/*
+ * Find room for bytes, rounded up to the alignment, which is returned in
+ * *got.  Returns its offset in *offset, and -1 if there's no hole big enough.
+ */
+static inline int pan_reserve_get(pan_reserve_t *r, uint32_t bytes, uint32_t *offset, uint32_t *got)
+{
+	uint32_t start = 0, end;
+	int i;
+
+	if (bytes == 0 || bytes > r->size || r->used == PAN_RESERVE_SLOTS)
+		return -1;
+	bytes = (bytes + r->align - 1) & ~(r->align - 1);
+	for (i = 0; i <= r->used; i++) {
+		end = i < r->used ? r->buf[i].offset : r->size;
+		if (end - start >= bytes)
+			break;
+		if (i < r->used)
+			start = r->buf[i].offset + r->buf[i].bytes;
+	}
+	if (i > r->used)
+		return -1;
+	memmove(&r->buf[i + 1], &r->buf[i], (r->used - i) * sizeof(r->buf[0]));
+	r->buf[i].offset = start;
+	r->buf[i].bytes = bytes;
+	r->used++;
+	*offset = start;
+	*got = bytes;
+
+	return 0;
+}
+
+// Give back the buffer at offset; returns -1 if there isn't one
+static inline int pan_reserve_put(pan_reserve_t *r, uint32_t offset)
+{
+	int i;
+
+	for (i = 0; i < r->used; i++) {
+		if (r->buf[i].offset == offset) {
+			r->used--;
+			memmove(&r->buf[i], &r->buf[i + 1], (r->used - i) * sizeof(r->buf[0]));
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+// The biggest buffer pan_reserve_get() would find room for now
+static inline uint32_t pan_reserve_largest(const pan_reserve_t *r)
+{
+	uint32_t start = 0, end, best = 0;
+	int i;
+
+	if (r->used == PAN_RESERVE_SLOTS)
+		return 0;
+	for (i = 0; i <= r->used; i++) {
+		end = i < r->used ? r->buf[i].offset : r->size;
+		if (end - start > best)
+			best = end - start;
+		if (i < r->used)
+			start = r->buf[i].offset + r->buf[i].bytes;
+	}
+
+	return best;
+}
+
+#endif /* PANRESERVE_H_ */
@@ -0,0 +1,120 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Single producer, single consumer ring of raw GPLEV0 samples, for capture
+ * engines where something other than the reader takes the samples (the
+ * FIQ handler in pandriver.c).  Plain C with no kernel dependencies.
+ *
+ * The producer only ever writes the sample and then a free-running count
+ * of samples written; it never looks at the consumer.  The consumer keeps
+ * its own count, so it can tell exactly how many samples it lost if it
+ * fell more than a ring behind.  On one CPU no barriers are needed beyond
+ * the volatile count; if the two sides are on different CPUs, define
+ * pan_ring_wmb() and pan_ring_rmb() before including this, so the count
+ * is never seen ahead of the samples.
+ */
+
+#ifndef PANRING_H_
+#define PANRING_H_
+
+#define PAN_RING_BITS		16
+#define PAN_RING_SAMPLES	(1 << PAN_RING_BITS)
+#define PAN_RING_MASK		(PAN_RING_SAMPLES - 1)
+// The producer keeps running while the consumer reads, so treat the ring as
+// overrun this far short of full, so samples aren't overwritten mid-read
+#define PAN_RING_SLACK		(PAN_RING_SAMPLES / 4)
+
+/*
+ * The fastest rate a consumer woken hz times a second keeps up with, even
+ * if it is a whole tick late.
+ */
+#define PAN_RING_MAX_RATE(hz)	((PAN_RING_SAMPLES - PAN_RING_SLACK) / 2 * (hz))
+
+#ifndef pan_ring_wmb
+#define pan_ring_wmb()
+#define pan_ring_rmb()
+#endif
+
+struct pan_ring_s {
+	volatile uint32_t	*head;		// Samples written, by the producer
+	uint32_t			*data;		// PAN_RING_SAMPLES of them
+	uint32_t			tail;		// Samples consumed
+};
+typedef struct pan_ring_s pan_ring_t;
+
+// For producers written in C; the FIQ handler does the same in assembler
+static inline void pan_ring_put(uint32_t *data, volatile uint32_t *head, uint32_t sample)
+{
+	data[*head & PAN_RING_MASK] = sample;
+	pan_ring_wmb();
+	*head = *head + 1;
+}
+
+/*
+ * Samples waiting for the consumer.  If it has fallen too far behind, skip
+ * the tail forward past the samples that are (or may soon be) overwritten
+ * and return how many were lost in *lost.
+ */
+static inline uint32_t pan_ring_avail(pan_ring_t *r, uint32_t *lost)
+{
+	uint32_t head = *r->head;
+
+	pan_ring_rmb();
+	*lost = 0;
+	if (head - r->tail > PAN_RING_SAMPLES - PAN_RING_SLACK) {
+		*lost = head - r->tail - (PAN_RING_SAMPLES - PAN_RING_SLACK);
+		r->tail += *lost;
+	}
+
+	return head - r->tail;
+}
+
+static inline uint32_t pan_ring_get(pan_ring_t *r)
+{
+	return r->data[r->tail++ & PAN_RING_MASK];
+}
+
+/*
+ * Once the n samples from start have been read, how many at the front of
+ * them the producer may have overwritten meanwhile, if the consumer was
+ * held up for longer than the slack.  They can only be counted as lost.
+ */
+static inline uint32_t pan_ring_overwritten(const pan_ring_t *r, uint32_t start, uint32_t n)
+{
+	uint32_t over;
+
+	pan_ring_rmb();
+	over = *r->head - start;
+	// Sample start's slot is being written once the head reaches start + PAN_RING_SAMPLES
+	if (over < PAN_RING_SAMPLES)
+		return 0;
+	over -= PAN_RING_SAMPLES - 1;
+
+	return over < n ? over : n;
+}
+
+// Of n samples waiting, how many can be copied from the tail before the ring wraps
+static inline uint32_t pan_ring_run(const pan_ring_t *r, uint32_t n)
+{
+	uint32_t room = PAN_RING_SAMPLES - (r->tail & PAN_RING_MASK);
+
+	return n < room ? n : room;
+}
+
+#endif /* PANRING_H_ */
@@ -0,0 +1,87 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Finished captures, shared by the sessions reading them, mappings of
+ * them and the driver's last_capture, rather than copied or captured
+ * again.  Plain C with no kernel dependencies.  References are dropped
+ * from places that can't take the driver's lock (unmapping, for one), so
+ * the count is atomic: the driver defines pan_ref_t and the pan_ref_
+ * macros to use atomic_t before including this, and otherwise they are
+ * GCC atomics.  The driver frees the buffer and the capture once
+ * pan_capture_put() says the last reference has gone.
+ */
+
+#ifndef PANSHARE_H_
+#define PANSHARE_H_
+
+#include "panalyzer.h"
+
+#ifndef pan_ref_inc
+typedef int pan_ref_t;
+#define pan_ref_init(r, n)		__atomic_store_n(r, n, __ATOMIC_RELAXED)
+#define pan_ref_inc(r)			__atomic_add_fetch(r, 1, __ATOMIC_RELAXED)
+#define pan_ref_dec_and_test(r)	(__atomic_sub_fetch(r, 1, __ATOMIC_ACQ_REL) == 0)
+#endif
+
+struct pan_capture_s {
+	pan_ref_t	ref;
+	panctl_t	hdr;				// As the driver filled it in
+	uint32_t	*buffer;
+	uint32_t	buffer_size;
+};
+typedef struct pan_capture_s pan_capture_t;
+
+// The capture of buffer that hdr describes, with one reference, the caller's
+static inline void pan_capture_init(pan_capture_t *c, const panctl_t *hdr, uint32_t *buffer,
+		uint32_t buffer_size)
+{
+	pan_ref_init(&c->ref, 1);
+	memcpy(&c->hdr, hdr, sizeof(*hdr));
+	c->buffer = buffer;
+	c->buffer_size = buffer_size;
+}
+
+static inline pan_capture_t *pan_capture_get(pan_capture_t *c)
+{
+	pan_ref_inc(&c->ref);
+
+	return c;
+}
+
+// Drop a reference to c, if any.  Returns 1 if it was the last, and c must be freed.
+static inline int pan_capture_put(pan_capture_t *c)
+{
+	return c && pan_ref_dec_and_test(&c->ref);
+}
+
+/*
+ * Make *slot hold a new reference to c, or nothing if c is NULL, and
+ * return what it held for the caller to put, once out of any lock that
+ * covers the slot.
+ */
+static inline pan_capture_t *pan_capture_swap(pan_capture_t **slot, pan_capture_t *c)
+{
+	pan_capture_t *old = *slot;
+
+	*slot = c ? pan_capture_get(c) : NULL;
+
+	return old;
+}
+
+#endif /* PANSHARE_H_ */
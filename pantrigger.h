@@ -0,0 +1,364 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Table driven trigger engine, and the bit gathering it shares with packed
+ * sample storage.  This is plain C with no kernel or libc dependencies
+ * beyond memset(), so the driver and user space can share it.
+ *
+ * The trigger stages in panctl_t are compiled, before interrupts are
+ * disabled, in to a flat table indexed by (state, counter == 0, sample bits).
+ * The sample bits are the GPIO bits used by any enabled trigger stage,
+ * gathered down in to a small index with four byte lookups.  If any stage
+ * has edge conditions, the bits that changed since the previous sample
+ * (sample ^ prev) on those channels are gathered as well, above the level
+ * bits, so an edge costs one XOR and four more lookups.  Glitch conditions
+ * use edge bits too, fed from the event latches rather than the XOR; see
+ * pan_trig_changes().  Each table entry gives the next state and either
+ * "decrement the counter" or "load the counter with N", so the capture loop
+ * does one lookup and one counter update per sample.
+ *
+ * The table reproduces the original goto based engine exactly, including
+ * chained stage transitions on a single sample.
+ */
+
+#ifndef PANTRIGGER_H_
+#define PANTRIGGER_H_
+
+#include "panalyzer.h"
+
+// Level and edge bits together; each may have up to 8 on its own
+#define PAN_TRIG_MAX_BITS	10
+#define PAN_TRIG_IDLE		MAX_TRIGGERS
+#define PAN_TRIG_ROWS		((PAN_TRIG_IDLE + 1) * 2)
+#define PAN_TRIG_FIRED		7
+
+// Table entry: bits 0-2 next state, bit 3 keep (decrement) counter,
+// bits 4-31 signed value to load in to the counter
+#define PAN_TRIG_STATE_MASK	0x7
+#define PAN_TRIG_KEEP		(1<<3)
+#define PAN_TRIG_LOAD_SHIFT	4
+#define PAN_TRIG_ENTRY(state, keep, load) \
+	((uint32_t)(state) | ((keep) ? PAN_TRIG_KEEP : 0) | ((uint32_t)(load) << PAN_TRIG_LOAD_SHIFT))
+
+// The largest min_samples the load field holds
+#define PAN_TRIG_MAX_SAMPLES	((1 << (31 - PAN_TRIG_LOAD_SHIFT)) - 1)
+
+/*
+ * Gather tables map the GPIO bits in a mask down to consecutive low bits,
+ * lowest GPIO first, with one lookup per byte of the sample.  The same
+ * mapping is used to pack channel_mask bits in PAN_FLAG_PACKED mode.
+ * Returns the number of bits, or -1 if there are more than max_bits.
+ */
+static inline int pan_gather_init(uint8_t gather[4][256], uint32_t mask, int max_bits)
+{
+	int bit, v, bits = 0;
+
+	memset(gather, 0, 4 * 256);
+	for (bit = 0; bit < 32; bit++) {
+		if (!(mask & (1u << bit)))
+			continue;
+		if (bits == max_bits)
+			return -1;
+		for (v = 0; v < 256; v++)
+			if (v & (1 << (bit & 7)))
+				gather[bit >> 3][v] |= 1 << bits;
+		bits++;
+	}
+
+	return bits;
+}
+
+static inline uint32_t pan_gather(const uint8_t gather[4][256], uint32_t sample)
+{
+	return gather[0][sample & 0xff] |
+			gather[1][(sample >> 8) & 0xff] |
+			gather[2][(sample >> 16) & 0xff] |
+			gather[3][sample >> 24];
+}
+
+// The inverse of pan_gather(), for unpacking PAN_FLAG_PACKED data
+static inline void pan_scatter_init(uint32_t scatter[256], uint32_t mask)
+{
+	int bit, v, bits = 0;
+
+	memset(scatter, 0, 256 * sizeof(uint32_t));
+	for (bit = 0; bit < 32 && bits < 8; bit++) {
+		if (!(mask & (1u << bit)))
+			continue;
+		for (v = 0; v < 256; v++)
+			if (v & (1 << bits))
+				scatter[v] |= 1u << bit;
+		bits++;
+	}
+}
+
+/*
+ * Sample n of data, which holds a nibble or byte per sample if bits is 4
+ * or 8, as PAN_FLAG_PACKED stores them, else whole words.
+ */
+static inline uint32_t pan_unpack(const uint8_t *data, int bits, const uint32_t scatter[256],
+		uint32_t mask, uint32_t n)
+{
+	if (bits == 4)
+		return scatter[(data[n >> 1] >> ((n & 1) * 4)) & 0xf];
+	else if (bits == 8)
+		return scatter[data[n]];
+	else
+		return ((const uint32_t *)data)[n] & mask;
+}
+
+/*
+ * Where the oldest sample is in what read() returns, or a trace file holds.
+ * read() starts at the byte the oldest sample is in, so with nibbles and
+ * an odd first_data_index it is the high half of the first byte, and the
+ * low half is the newest sample.
+ */
+static inline uint32_t pan_read_first(int bits, uint32_t first_data_index)
+{
+	return bits == 4 ? first_data_index & 1 : 0;
+}
+
+// Packed samples are a nibble each for up to four channels, else a byte
+static inline int pan_pack_bits(uint32_t mask)
+{
+	int bits = 0;
+
+	for (; mask; mask &= mask - 1)
+		bits++;
+
+	return bits <= 4 ? 4 : 8;
+}
+
+struct pan_trig_s {
+	int			bits;
+	int			edge_shift;		// Level bits, with the edge bits above them
+	uint32_t	edges;			// Channels with edge or glitch conditions in any stage
+	uint32_t	glitches;		// The glitch ones
+	int			last;
+	int			start;			// 0, or PAN_TRIG_IDLE if stage 0 has edges
+	uint8_t		gather[4][256];
+	uint8_t		edge_gather[4][256];
+	uint32_t	table[PAN_TRIG_ROWS << PAN_TRIG_MAX_BITS];
+};
+typedef struct pan_trig_s pan_trig_t;
+
+/*
+ * The channels that glitched on a sample in glitch mode: their event latch
+ * fired but the level is the same as the sample before.  changed is the
+ * sample XOR the one before.  The latches are read just before the levels,
+ * so an edge in between is a change with no event, and its event turns up
+ * with the next sample; late is changed & ~events from the sample before,
+ * so that isn't taken for a glitch.
+ */
+static inline uint32_t pan_glitches(uint32_t events, uint32_t changed, uint32_t late)
+{
+	return events & ~changed & ~late;
+}
+
+/*
+ * The glitches in a glitch mode capture as read() returns it: len whole
+ * word samples in a ring at data, the oldest at first, and then their
+ * latch bytes, oldest first and gathered as for packing, which scatter
+ * undoes.  For each sample on which any channel glitched, out gets the
+ * sample number, oldest 0, and the channels.  out needs room for len.
+ * Returns how many there were.
+ */
+static inline uint32_t pan_glitch_decode(const uint32_t *data, const uint8_t *latches,
+		const uint32_t scatter[256], uint32_t mask, uint32_t len, uint32_t first, pantrans_t *out)
+{
+	uint32_t levels, prev, events, changed, late = 0, g, i, n, count = 0;
+
+	if (len == 0)
+		return 0;
+	prev = data[first] & mask;
+	for (i = 0, n = first; i < len; i++) {
+		levels = data[n] & mask;
+		events = scatter[latches[i]] & mask;
+		changed = levels ^ prev;
+		g = pan_glitches(events, changed, late);
+		late = changed & ~events;
+		if (g) {
+			out[count].sample = i;
+			out[count++].levels = g;
+		}
+		prev = levels;
+		if (++n == len)
+			n = 0;
+	}
+
+	return count;
+}
+
+// What edge bits see in glitch mode: the glitches on glitch channels, else the changes
+static inline uint32_t pan_trig_changes(const pan_trig_t *t, uint32_t changed, uint32_t glitches)
+{
+	return (changed & ~t->glitches) | (glitches & t->glitches);
+}
+
+static inline uint32_t pan_trig_index(const pan_trig_t *t, uint32_t sample, uint32_t changed)
+{
+	uint32_t idx = pan_gather(t->gather, sample);
+
+	if (t->edges)
+		idx |= pan_gather(t->edge_gather, changed) << t->edge_shift;
+
+	return idx;
+}
+
+/*
+ * Advance the engine by one sample; changed is the sample XOR the one
+ * before it, for edge conditions, or pan_trig_changes() of that in glitch
+ * mode.  Returns the new state, which is PAN_TRIG_FIRED once the last stage
+ * has been satisfied.
+ */
+static inline int pan_trig_step(const pan_trig_t *t, int state, int32_t *count,
+		uint32_t sample, uint32_t changed)
+{
+	uint32_t e = t->table[((state << 1) | (*count == 0)) << t->bits |
+			pan_trig_index(t, sample, changed)];
+
+	*count = ((int32_t)e >> PAN_TRIG_LOAD_SHIFT) +
+			((*count - 1) & -(int32_t)((e & PAN_TRIG_KEEP) >> 3));
+
+	return e & PAN_TRIG_STATE_MASK;
+}
+
+static inline int pan_trig_match(const uint32_t *mask, const uint32_t *value, int stage,
+		uint32_t idx)
+{
+	return (idx & mask[stage]) == value[stage];
+}
+
+/*
+ * Work out one table entry by running the original engine symbolically.
+ * Once a stage transition happens the counter value is known, otherwise it
+ * is just "non-zero" and the entry says to decrement it.  Stages are entered
+ * on the entry match, which includes any edge conditions, and then only
+ * need the hold match, as an edge only lasts one sample.
+ */
+static inline uint32_t pan_trig_resolve(const pan_trig_t *t, const panctl_t *ctl,
+		const uint32_t *entry, const uint32_t *hold, int state, int zero, uint32_t idx)
+{
+	int known = zero;
+	int32_t count = 0;
+
+	// Waiting for the edges stage 0 starts on, with nothing to hold yet
+	if (state == PAN_TRIG_IDLE) {
+		state = -1;
+		known = 1;
+	}
+	for (;;) {
+		if (known && count == 0) {
+			if (state == t->last)
+				return PAN_TRIG_ENTRY(PAN_TRIG_FIRED, 0, 0);
+			if (pan_trig_match(entry, entry + MAX_TRIGGERS, state + 1, idx)) {
+				state++;
+				count = ctl->trigger[state].min_samples - 1;
+				continue;
+			}
+		} else if (known) {
+			count--;
+		}
+		break;
+	}
+	if (state < 0)
+		return PAN_TRIG_ENTRY(PAN_TRIG_IDLE, 0, 0);
+	if (!pan_trig_match(hold, hold + MAX_TRIGGERS, state, idx))
+		return PAN_TRIG_ENTRY(t->start, 0, ctl->trigger[0].min_samples);
+	if (known)
+		return PAN_TRIG_ENTRY(state, 0, count);
+
+	return PAN_TRIG_ENTRY(state, 1, 0);
+}
+
+/*
+ * Compile the trigger stages in ctl.  Returns the number of enabled stages,
+ * or -1 if the stages use more GPIO bits than the table can index or a
+ * min_samples over PAN_TRIG_MAX_SAMPLES.  The engine starts in state
+ * t->start with the counter at stage 0's min_samples.
+ *
+ * A rising edge is "changed and now high", a falling edge "changed and now
+ * low", and a channel in both rising and falling is "changed" either way.
+ * While a stage is held, rising channels must stay high and falling ones
+ * low.  A glitch channel is "glitched", with nothing to hold.  If stage 0
+ * has edges or glitches the engine starts in PAN_TRIG_IDLE, so the first
+ * sample of stage 0 is known to be the one with the edge on.
+ */
+static inline int pan_trig_compile(pan_trig_t *t, const panctl_t *ctl)
+{
+	uint32_t used = 0;
+	// Entry mask and value, then hold mask and value
+	uint32_t entry[2 * MAX_TRIGGERS], hold[2 * MAX_TRIGGERS];
+	int stage, state, zero, edge_bits;
+	uint32_t idx;
+
+	t->edges = 0;
+	t->glitches = 0;
+	for (t->last = 0; t->last < MAX_TRIGGERS && ctl->trigger[t->last].enabled; t->last++) {
+		if (ctl->trigger[t->last].min_samples > PAN_TRIG_MAX_SAMPLES)
+			return -1;
+		used |= ctl->trigger[t->last].mask | ctl->trigger[t->last].rising |
+				ctl->trigger[t->last].falling;
+		t->edges |= ctl->trigger[t->last].rising | ctl->trigger[t->last].falling;
+		t->glitches |= ctl->trigger[t->last].glitch;
+	}
+	t->last--;
+	t->start = t->last >= 0 && (ctl->trigger[0].rising | ctl->trigger[0].falling |
+			ctl->trigger[0].glitch) ? PAN_TRIG_IDLE : 0;
+	t->edges |= t->glitches;
+
+	t->edge_shift = pan_gather_init(t->gather, used, 8);
+	if (t->edge_shift < 0)
+		return -1;
+	edge_bits = pan_gather_init(t->edge_gather, t->edges, 8);
+	if (edge_bits < 0 || t->edge_shift + edge_bits > PAN_TRIG_MAX_BITS)
+		return -1;
+	t->bits = t->edge_shift + edge_bits;
+
+	for (stage = 0; stage <= t->last; stage++) {
+		uint32_t m = ctl->trigger[stage].mask;
+		uint32_t val = ctl->trigger[stage].value;
+		uint32_t rise = ctl->trigger[stage].rising;
+		uint32_t fall = ctl->trigger[stage].falling;
+		uint32_t glitch = ctl->trigger[stage].glitch;
+		uint32_t changed = pan_gather(t->edge_gather, rise | fall | glitch) << t->edge_shift;
+
+		hold[stage] = pan_gather(t->gather, m | (rise ^ fall));
+		hold[MAX_TRIGGERS + stage] = pan_gather(t->gather, (val & m) | (rise & ~fall));
+		// A value bit outside the mask can never match
+		if (val & ~m)
+			hold[MAX_TRIGGERS + stage] = ~0;
+		entry[stage] = hold[stage] | changed;
+		entry[MAX_TRIGGERS + stage] = hold[MAX_TRIGGERS + stage] | changed;
+	}
+
+	// With no stages the table is never used, bar calibrate() timing it
+	for (state = 0; state <= PAN_TRIG_IDLE && t->last >= 0; state++) {
+		if (state > t->last && state != t->start)
+			continue;
+		for (zero = 0; zero < 2; zero++)
+			for (idx = 0; idx < (1u << t->bits); idx++)
+				t->table[((state << 1) | zero) << t->bits | idx] =
+						pan_trig_resolve(t, ctl, entry, hold, state, zero, idx);
+	}
+
+	return t->last + 1;
+}
+
+#endif /* PANTRIGGER_H_ */
@@ -0,0 +1,374 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * User space capture engine, for when pandriver.ko isn't built for the
+ * running kernel.  It runs the polled capture() loop, with the same trigger
+ * and pre-trigger handling from pancap.h, in a SCHED_FIFO thread pinned to
+ * the last CPU, or an ordinary one if there is only one CPU, reading GPLEV0
+ * through /dev/gpiomem.  Any file of at least PAN_USER_GPIO_SIZE bytes can
+ * stand in for /dev/gpiomem, so it runs on any Linux host with something
+ * else writing the levels.
+ *
+ * The system timer is only 1MHz and needs /dev/mem, so samples are paced
+ * off CLOCK_MONOTONIC instead, in nanoseconds.  Nothing stops the kernel
+ * preempting the thread, so expect late samples; they are counted in
+ * overruns and max_late_ns, as the driver does.  Only whole and packed
+ * samples, without segments, are supported.
+ *
+ * The finished capture is laid out as in trace.bin, the header and then the
+ * data oldest first, in a memfd that can be loaded like any other trace.
+ */
+
+#ifndef PANUSER_H_
+#define PANUSER_H_
+
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define PAN_USER_GPIOMEM	"/dev/gpiomem"
+#define PAN_USER_GPIO_SIZE	4096
+#define PAN_USER_CALIBRATE	256
+
+static volatile uint32_t *user_gpio;
+
+static inline uint64_t user_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define pan_read_level()		(user_gpio[PAN_GPLEV0_OFFSET / 4])
+#define pan_read_us()			((uint32_t)(user_ns() / 1000))
+#define pan_read_tick()			((uint32_t)user_ns())
+#define pan_read_events()		(user_gpio[PAN_GPEDS0_OFFSET / 4])
+#define pan_clear_events(ev)	(user_gpio[PAN_GPEDS0_OFFSET / 4] = (ev))
+
+#include "panregs.h"
+#include "pancap.h"
+
+static panctl_t user_panctl;
+static pan_trig_t user_trig;
+static uint8_t user_gather[4][256];
+static int user_fd = -1;				// The memfd the capture goes in to
+static uint8_t *user_map;
+static size_t user_map_len;
+static pthread_t user_thread;
+static int user_done[2] = { -1, -1 };	// Written to when the thread finishes
+static volatile int user_cancel;
+static int user_result;
+static int user_realtime;				// Whether we got SCHED_FIFO
+
+// Map path, normally /dev/gpiomem; returns 0 or -errno
+static int pan_user_open(const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (user_gpio)
+		return 0;
+	fd = open(path, O_RDWR | O_SYNC);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < PAN_USER_GPIO_SIZE) {
+		close(fd);
+		return -EINVAL;
+	}
+	map = mmap(NULL, PAN_USER_GPIO_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -errno;
+	user_gpio = (volatile uint32_t *)map;
+
+	return 0;
+}
+
+static uint32_t user_data_bytes(const panctl_t *p)
+{
+	if (p->flags & PAN_FLAG_PACKED)
+		return p->num_samples * pan_pack_bits(p->channel_mask) / 8;
+	else
+		return p->num_samples * sizeof(uint32_t);
+}
+
+// As check_panctl() in the driver, for the modes we do
+static int user_check(panctl_t *p)
+{
+	uint32_t rate = PAN_SAMPLE_RATE(p);
+	int i;
+
+	if (p->magic != PAN_MAGIC || p->version != PAN_VERSION)
+		return -EINVAL;
+	if ((p->flags & ~PAN_FLAG_PACKED) || p->num_segments > 1)
+		return -EINVAL;
+	if (p->timeout_ms > PAN_MAX_TIMEOUT_MS)
+		return -EINVAL;
+	if (rate < MIN_SAMPLE_RATE || rate > MAX_SAMPLE_RATE)
+		return -EINVAL;
+	if (p->flags & PAN_FLAG_PACKED) {
+		if (pan_gather_init(user_gather, p->channel_mask, 8) < 0)
+			return -EINVAL;
+		if (pan_pack_bits(p->channel_mask) == 4)
+			p->num_samples &= ~1;
+	}
+	if (p->num_samples == 0)
+		return -EINVAL;
+	for (i = 0; i < MAX_TRIGGERS; i++) {
+		if (p->trigger[i].min_samples == 0)
+			p->trigger[i].min_samples = 1;
+		else if (p->trigger[i].enabled && p->trigger[i].min_samples > PAN_TRIG_MAX_SAMPLES)
+			return -EINVAL;
+	}
+	p->num_gaps = 0;
+	p->segments_filled = 0;
+
+	return 0;
+}
+
+// Nanoseconds the loop body takes per sample, flat out
+static uint32_t user_calibrate(void)
+{
+	uint64_t start;
+	uint32_t sample, prev = 0;
+	int32_t state_samples = 1;
+	int i;
+
+	start = user_ns();
+	for (i = 0; i < PAN_USER_CALIBRATE; i++) {
+		(void)user_ns();
+		sample = pan_read_level();
+		pan_trig_step(&user_trig, 0, &state_samples, sample, sample ^ prev);
+		prev = sample;
+	}
+
+	return (user_ns() - start) / PAN_USER_CALIBRATE;
+}
+
+static void user_reverse(uint8_t *b, uint32_t n)
+{
+	uint8_t tmp;
+	uint32_t i;
+
+	for (i = 0; i < n / 2; i++) {
+		tmp = b[i];
+		b[i] = b[n - 1 - i];
+		b[n - 1 - i] = tmp;
+	}
+}
+
+// Rotate the ring so the oldest sample, first bytes in, comes first
+static void user_rotate(uint8_t *data, uint32_t bytes, uint32_t first)
+{
+	if (first) {
+		user_reverse(data, first);
+		user_reverse(data + first, bytes - first);
+		user_reverse(data, bytes);
+	}
+}
+
+// The capture() loop; returns 0 or -errno
+static int user_capture(void)
+{
+	panctl_t *p = &user_panctl;
+	uint64_t start_ns, end_ns, abort_ns, t1, next, late, max_late = 0;
+	uint32_t rate, period, period_frac, frac, cost, ms, first, sample = 0;
+	uint32_t start_count;
+	int overruns = 0;
+	int abort_reason = PAN_ABORT_NONE;
+	struct cap_s cap;
+	int res;
+
+	res = pan_trig_compile(&user_trig, p);
+	if (res < 0 || user_trig.glitches)
+		return -EINVAL;
+	cap_init(&cap, p, &user_trig, res, (uint32_t *)(user_map + sizeof(panctl_t)),
+			user_data_bytes(p), user_gather, NULL);
+
+	rate = PAN_SAMPLE_RATE(p);
+	period = 1000000000 / rate;
+	period_frac = ((1000000000 % rate) << 8) / rate;
+	cost = user_calibrate();
+	if (cost + cost / 8 > period)
+		return -ERANGE;
+
+	// As trigger_timeout_ms(), with no limit as nothing is frozen
+	ms = p->timeout_ms;
+	if (ms == 0) {
+		ms = p->num_samples / (rate / 1000);
+		ms = ms > 500 ? ms * 2 : 1000;
+	}
+
+	start_ns = next = user_ns();
+	abort_ns = start_ns + (uint64_t)ms * 1000000;
+	frac = 0;
+	for (;;) {
+		do { t1 = user_ns(); } while (t1 < next);
+		sample = pan_read_level();
+		late = t1 - next;
+		if (late >= period)
+			overruns++;
+		if (late > max_late)
+			max_late = late;
+		frac += period_frac;
+		next += period + (frac >> 8);
+		frac &= 0xff;
+		cap_store(&cap, sample);
+		if (cap_waiting(&cap)) {
+			if (t1 >= abort_ns) {
+				abort_reason = PAN_ABORT_TIMEOUT;
+				break;
+			}
+			if (user_cancel) {
+				abort_reason = PAN_ABORT_CANCELLED;
+				break;
+			}
+		}
+		if (cap_trigger(&cap, &user_trig, sample))
+			break;
+	}
+	end_ns = user_ns();
+
+	start_count = cap_oldest(&cap);
+	if (cap.packed) {
+		first = cap.pack_ptr - cap.pack_start;
+		// It rotates whole bytes, so an odd last sample in nibble mode is dropped
+		if (cap.nibbles && (cap.sample_count & 1) && start_count)
+			start_count--;
+	} else {
+		first = (cap.buf_ptr - cap.buf_start) * sizeof(uint32_t);
+	}
+	user_rotate(user_map + sizeof(panctl_t), user_data_bytes(p), first);
+	p->first_data_index = 0;
+	cap_report(&cap, p, start_count, overruns, abort_reason);
+	p->elapsed_us = (end_ns - start_ns) / 1000;
+	p->achieved_rate = end_ns > start_ns ?
+			cap.sample_count * 1000000000ULL / (end_ns - start_ns) : 0;
+	p->max_irq_off_us = 0;
+	p->max_late_ns = max_late > 0xffffffff ? 0xffffffff : max_late;
+	memcpy(user_map, p, sizeof(panctl_t));
+
+	return 0;
+}
+
+static void *user_main(void *arg)
+{
+	struct sched_param sp;
+	cpu_set_t cpus;
+	long cpu = sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu > 0 ? cpu : 0, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	// With only one CPU, spinning at SCHED_FIFO would starve everything else
+	user_realtime = 0;
+	if (cpu > 0) {
+		memset(&sp, 0, sizeof(sp));
+		sp.sched_priority = sched_get_priority_max(SCHED_FIFO);
+		user_realtime = pthread_setschedparam(pthread_self(), SCHED_FIFO, &sp) == 0;
+	}
+
+	user_result = user_capture();
+	if (write(user_done[1], "", 1) < 0)
+		user_result = -errno;
+
+	return NULL;
+}
+
+/*
+ * Start a capture as p describes, in the background.  Returns the fd that
+ * becomes readable when it is done, or -errno.
+ */
+static int pan_user_start(const panctl_t *p)
+{
+	int res;
+
+	if (user_gpio == NULL)
+		return -ENODEV;
+	user_panctl = *p;
+	res = user_check(&user_panctl);
+	if (res)
+		return res;
+
+	user_map_len = sizeof(panctl_t) + user_data_bytes(&user_panctl);
+	user_fd = memfd_create("panalyzer", 0);
+	if (user_fd < 0)
+		return -errno;
+	if (ftruncate(user_fd, user_map_len) < 0)
+		goto fail;
+	user_map = (uint8_t *)mmap(NULL, user_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, user_fd, 0);
+	if (user_map == MAP_FAILED)
+		goto fail;
+	if (user_done[0] < 0 && pipe(user_done) < 0)
+		goto fail_unmap;
+	user_cancel = 0;
+	res = pthread_create(&user_thread, NULL, user_main, NULL);
+	if (res) {
+		errno = res;
+		goto fail_unmap;
+	}
+
+	return user_done[0];
+
+fail_unmap:
+	munmap(user_map, user_map_len);
+fail:
+	res = -errno;
+	close(user_fd);
+	user_fd = -1;
+
+	return res;
+}
+
+// Stop waiting for the trigger and keep what we have
+static void pan_user_cancel(void)
+{
+	user_cancel = 1;
+}
+
+/*
+ * Collect the capture once the done fd is readable.  Returns an fd holding
+ * it, positioned just after the header, with the header in *p; or -errno.
+ */
+static int pan_user_finish(panctl_t *p)
+{
+	char c;
+	int fd = user_fd;
+
+	if (read(user_done[0], &c, 1) < 0)
+		return -errno;
+	pthread_join(user_thread, NULL);
+	munmap(user_map, user_map_len);
+	user_fd = -1;
+	if (user_result) {
+		close(fd);
+		return user_result;
+	}
+	if (pread(fd, p, sizeof(*p), 0) != sizeof(*p) || lseek(fd, sizeof(*p), SEEK_SET) < 0) {
+		close(fd);
+		return -EIO;
+	}
+
+	return fd;
+}
+
+#endif /* PANUSER_H_ */
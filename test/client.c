@@ -0,0 +1,370 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The UI's ioctl flow in panclient.h, run against a stub device with the
+ * driver's PAN_IOC_ semantics.  The stub's capture runs in a thread, which
+ * finishes when its trigger time comes, on timeout_ms or when cancelled,
+ * and the end of a socket pair stands in for the device file, readable
+ * once the capture is done, so poll() must block while it is armed and
+ * wake when it finishes.  The header must say how the capture ended, a
+ * cancel must finish the capture before it returns, and the ioctls must be
+ * refused while armed as the driver refuses them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include "panalyzer.h"
+
+static int stub_ioctl(int fd, unsigned long req, void *arg);
+#define pan_ioctl(fd, req, arg)	stub_ioctl(fd, req, arg)
+#include "panclient.h"
+
+// The stub device, for one open file
+static struct {
+	int			fd, ready_fd;	// The client's end of the pair, and ours
+	int			ioctls;			// 0 acts as a driver from before the ioctls
+	panctl_t	panctl;
+	int			state, result;
+	int			fail;			// -errno for the next capture to fail with
+	uint32_t	trigger_ms;		// When the next capture's trigger fires, 0 never
+	int			cancel;
+	uint64_t	armed_ns;
+	pthread_t	thread;
+	int			joinable;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+} dev;
+
+static int failed;
+
+static void fail(const char *what, int n)
+{
+	if (!failed)
+		printf("FAIL: %s, %d\n", what, n);
+	failed = 1;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// As dev_poll(): readable unless armed
+static void stub_ready(int ready)
+{
+	char c = 0;
+
+	if (ready) {
+		if (write(dev.ready_fd, &c, 1) != 1)
+			fail("can't signal", errno);
+	} else if (read(dev.fd, &c, 1) != 1) {
+		fail("wasn't readable", errno);
+	}
+}
+
+// The work item: wait for the trigger, the timeout or a cancel
+static void *stub_capture(void *arg)
+{
+	uint64_t end_ns = dev.armed_ns + (uint64_t)dev.panctl.timeout_ms * 1000000;
+	uint64_t trigger_ns = dev.armed_ns + (uint64_t)dev.trigger_ms * 1000000;
+	struct timespec ts;
+
+	pthread_mutex_lock(&dev.lock);
+	if (dev.trigger_ms && trigger_ns < end_ns)
+		end_ns = trigger_ns;
+	while (!dev.cancel && now_ns() < end_ns && !dev.fail) {
+		ts.tv_sec = end_ns / 1000000000;
+		ts.tv_nsec = end_ns % 1000000000;
+		pthread_cond_timedwait(&dev.wake, &dev.lock, &ts);
+	}
+	dev.result = dev.fail;
+	dev.fail = 0;
+	if (dev.cancel)
+		dev.panctl.abort_reason = PAN_ABORT_CANCELLED;
+	else if (dev.trigger_ms && dev.trigger_ms <= dev.panctl.timeout_ms)
+		dev.panctl.abort_reason = PAN_ABORT_NONE;
+	else
+		dev.panctl.abort_reason = PAN_ABORT_TIMEOUT;
+	dev.panctl.trigger_index = dev.panctl.abort_reason == PAN_ABORT_NONE ?
+			dev.panctl.num_samples / 2 - 1 : PAN_NO_TRIGGER;
+	dev.panctl.elapsed_us = (now_ns() - dev.armed_ns) / 1000;
+	dev.state = PAN_STATE_DONE;
+	stub_ready(1);
+	pthread_mutex_unlock(&dev.lock);
+
+	return NULL;
+}
+
+static void stub_join(void)
+{
+	if (dev.joinable)
+		pthread_join(dev.thread, NULL);
+	dev.joinable = 0;
+}
+
+// As cap_stop(): a cancel waits for the capture to tidy up
+static void stub_stop(void)
+{
+	pthread_mutex_lock(&dev.lock);
+	if (dev.state != PAN_STATE_ARMED) {
+		pthread_mutex_unlock(&dev.lock);
+		return;
+	}
+	dev.cancel = 1;
+	pthread_cond_signal(&dev.wake);
+	pthread_mutex_unlock(&dev.lock);
+	stub_join();
+}
+
+// As dev_ioctl(), on the stub's one file
+static int stub_ioctl(int fd, unsigned long req, void *arg)
+{
+	int res = 0, armed;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -1;
+	}
+	if (!dev.ioctls) {
+		errno = ENOTTY;
+		return -1;
+	}
+	pthread_mutex_lock(&dev.lock);
+	armed = dev.state == PAN_STATE_ARMED;
+	switch (req) {
+	case PAN_IOC_CONFIGURE:
+		if (armed)
+			res = -EBUSY;
+		else if (((panctl_t *)arg)->magic != PAN_MAGIC)
+			res = -EINVAL;
+		else {
+			dev.panctl = *(panctl_t *)arg;
+			dev.state = PAN_STATE_IDLE;
+		}
+		break;
+	case PAN_IOC_ARM:
+		if (armed)
+			res = -EBUSY;
+		else if (dev.panctl.magic != PAN_MAGIC)
+			res = -EINVAL;
+		else {
+			dev.result = 0;
+			dev.cancel = 0;
+			dev.state = PAN_STATE_ARMED;
+			dev.armed_ns = now_ns();
+			stub_ready(0);
+			stub_join();
+			dev.joinable = pthread_create(&dev.thread, NULL, stub_capture, NULL) == 0;
+		}
+		break;
+	case PAN_IOC_STATUS:
+		((panstatus_t *)arg)->state = dev.state;
+		((panstatus_t *)arg)->result = dev.result;
+		break;
+	case PAN_IOC_CANCEL:
+		pthread_mutex_unlock(&dev.lock);
+		stub_stop();
+		return 0;
+	case PAN_IOC_GET_HEADER:
+		if (armed)
+			res = -EBUSY;
+		else
+			*(panctl_t *)arg = dev.panctl;
+		break;
+	default:
+		res = -ENOTTY;
+	}
+	pthread_mutex_unlock(&dev.lock);
+	if (res) {
+		errno = -res;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void stub_open(void)
+{
+	int sv[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+		perror("socketpair");
+		exit(1);
+	}
+	memset(&dev, 0, sizeof(dev));
+	dev.fd = sv[0];
+	dev.ready_fd = sv[1];
+	dev.ioctls = 1;
+	pthread_mutex_init(&dev.lock, NULL);
+	pthread_cond_init(&dev.wake, NULL);
+	stub_ready(1);
+}
+
+static void stub_close(void)
+{
+	stub_stop();
+	stub_join();
+	close(dev.fd);
+	close(dev.ready_fd);
+}
+
+// What poll() says of the device within ms, as the UI's watch would see it
+static int ready_within(int ms)
+{
+	struct pollfd pfd = { .fd = dev.fd, .events = POLLIN };
+
+	return poll(&pfd, 1, ms) == 1 && (pfd.revents & POLLIN);
+}
+
+static void settings(panctl_t *ctl, uint32_t timeout_ms)
+{
+	static panctl_t def = DEF_PANCTL;
+
+	*ctl = def;
+	ctl->num_samples = 100000;
+	ctl->timeout_ms = timeout_ms;
+}
+
+/*
+ * Arm a capture whose trigger fires after trigger_ms, 0 never, and wait for
+ * it as the UI does, cancelling it after cancel_ms if that is set.  The
+ * header must end as abort_reason says, no sooner than it should.
+ */
+static void run(uint32_t timeout_ms, uint32_t trigger_ms, uint32_t cancel_ms, int abort_reason)
+{
+	panctl_t ctl, hdr;
+	panstatus_t st = { 0, 0 };
+	uint32_t end_ms = cancel_ms ? cancel_ms : trigger_ms ? trigger_ms : timeout_ms;
+	uint64_t start;
+	int res;
+
+	stub_open();
+	dev.trigger_ms = trigger_ms;
+	settings(&ctl, timeout_ms);
+	start = now_ns();
+	res = pan_client_arm(dev.fd, &ctl);
+	if (res != 0)
+		fail("arm", res);
+
+	// Armed: nothing to read, and the settings and header are busy
+	if (ready_within(0))
+		fail("ready while armed", 0);
+	if (stub_ioctl(dev.fd, PAN_IOC_STATUS, &st) < 0 || st.state != PAN_STATE_ARMED)
+		fail("status not armed", st.state);
+	if (pan_client_result(dev.fd) != -EBUSY)
+		fail("result while armed", 0);
+	if (pan_client_header(dev.fd, &hdr) != -EBUSY)
+		fail("header while armed", 0);
+	if (pan_client_arm(dev.fd, &ctl) != -EBUSY)
+		fail("armed twice", 0);
+
+	if (cancel_ms) {
+		if (ready_within(cancel_ms))
+			fail("ready before the cancel", 0);
+		pan_client_cancel(dev.fd);
+		// The cancel has finished the capture by the time it returns
+		if (!ready_within(0))
+			fail("not ready after the cancel", 0);
+	} else if (!ready_within(end_ms + 1000)) {
+		fail("poll didn't wake", end_ms);
+	}
+	if ((now_ns() - start) / 1000000 + 1 < end_ms)
+		fail("woke early", (now_ns() - start) / 1000000);
+
+	res = pan_client_result(dev.fd);
+	if (res)
+		fail("result", res);
+	res = pan_client_header(dev.fd, &hdr);
+	if (res)
+		fail("header", res);
+	if (hdr.abort_reason != abort_reason)
+		fail("wrong abort reason", hdr.abort_reason);
+	if ((hdr.trigger_index != PAN_NO_TRIGGER) != (abort_reason == PAN_ABORT_NONE))
+		fail("wrong trigger", hdr.trigger_index);
+	if (hdr.elapsed_us / 1000 + 1 < end_ms || hdr.num_samples != ctl.num_samples)
+		fail("wrong header", hdr.elapsed_us);
+	// A cancel once it's done is harmless
+	pan_client_cancel(dev.fd);
+	if (pan_client_result(dev.fd) || !ready_within(0))
+		fail("cancel after the end", 0);
+	stub_close();
+	printf("timeout %4ums, trigger %3ums, cancel %3ums: abort reason %u after %ums\n",
+			timeout_ms, trigger_ms, cancel_ms, hdr.abort_reason, hdr.elapsed_us / 1000);
+}
+
+// Settings refused, a capture that fails, a driver without the ioctls, and arming again
+static void errors(void)
+{
+	panctl_t ctl;
+	int res;
+
+	stub_open();
+	settings(&ctl, 1000);
+	ctl.magic = 0;
+	if (pan_client_arm(dev.fd, &ctl) != -EINVAL)
+		fail("bad settings armed", 0);
+
+	settings(&ctl, 1000);
+	dev.fail = -ERANGE;
+	if (pan_client_arm(dev.fd, &ctl) != 0 || !ready_within(1000))
+		fail("failing capture didn't finish", 0);
+	res = pan_client_result(dev.fd);
+	if (res != -ERANGE)
+		fail("failure not reported", res);
+
+	// The same settings again, and this time it triggers
+	dev.trigger_ms = 10;
+	if (pan_client_arm(dev.fd, &ctl) != 0 || !ready_within(1000))
+		fail("second capture didn't finish", 0);
+	if (pan_client_result(dev.fd) != 0)
+		fail("failure carried over", 0);
+	stub_close();
+
+	stub_open();
+	dev.ioctls = 0;
+	if (pan_client_arm(dev.fd, &ctl) != 1)
+		fail("no fall back for an old driver", 0);
+	stub_close();
+}
+
+int main(void)
+{
+	run(1000, 50, 0, PAN_ABORT_NONE);
+	run(100, 0, 0, PAN_ABORT_TIMEOUT);
+	run(60000, 0, 50, PAN_ABORT_CANCELLED);
+	run(60000, 500, 50, PAN_ABORT_CANCELLED);
+	errors();
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
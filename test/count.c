@@ -0,0 +1,208 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The counter mode accumulation in pancount.h against brute force counts
+ * over synthetic traces: random channel masks, edge densities from never
+ * to every sample, and gate windows from one sample up, with the record
+ * ring both short enough to wrap and long enough not to, and windows
+ * before a given first sample dropped.  Every record kept must match a
+ * count of the rising and falling edges and high samples in its window.
+ * Then the cost per sample is timed for quiet and busy channels.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "panalyzer.h"
+#include "pancount.h"
+
+#define SAMPLES			20000
+#define MAX_RECORDS		(SAMPLES + 1)
+#define TIMED_SAMPLES	(1 << 22)
+
+static uint32_t trace[SAMPLES];
+static uint32_t records[MAX_RECORDS * PAN_COUNT_BYTES(MAX_CHANNELS) / sizeof(uint32_t)];
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+// Each GPIO toggles with its own odds, from never to every sample
+static void random_trace(uint32_t *t, uint32_t n)
+{
+	uint32_t odds[32], i, sample = random();
+	int b;
+
+	for (b = 0; b < 32; b++)
+		odds[b] = random() % 4 == 0 ? 0 : random() % 4 == 0 ? RAND_MAX : random() % (RAND_MAX / 8);
+	for (i = 0; i < n; i++) {
+		for (b = 0; b < 32; b++)
+			if (odds[b] && (uint32_t)random() <= odds[b])
+				sample ^= 1u << b;
+		t[i] = sample;
+	}
+}
+
+// A window counted the slow way, a sample and a channel at a time
+static void brute(uint32_t start, uint32_t end, uint32_t bit, pancount_ch_t *ch)
+{
+	uint32_t i, prev;
+
+	memset(ch, 0, sizeof(*ch));
+	for (i = start; i < end; i++) {
+		prev = i ? trace[i - 1] & bit : 0;
+		if (trace[i] & bit) {
+			ch->high++;
+			if (!prev && i)
+				ch->rising++;
+		} else if (prev) {
+			ch->falling++;
+		}
+	}
+}
+
+static void run(uint32_t mask, uint32_t gate, uint32_t num_records, uint32_t first)
+{
+	pan_count_t pc;
+	pancount_t *r;
+	pancount_ch_t *ch, want;
+	uint32_t windows, kept, start, expect, w, i, bit;
+	int c;
+
+	if (pan_count_init(&pc, mask, gate, records, num_records) < 0) {
+		fail("refused", mask);
+		return;
+	}
+	for (i = 0; i < SAMPLES; i++)
+		pan_count_sample(&pc, trace[i]);
+	kept = pan_count_finish(&pc, first, &start);
+
+	// The last num_records windows, less any over before first
+	windows = (SAMPLES + gate - 1) / gate;
+	w = windows > num_records ? windows - num_records : 0;
+	while (w < windows && (w + 1) * gate <= first)
+		w++;
+	if (kept != windows - w) {
+		fail("wrong number of windows kept", kept);
+		return;
+	}
+	if (kept && start != w * gate)
+		fail("wrong start", start);
+	for (i = 0; i < kept && !failed; i++, w++) {
+		r = (pancount_t *)(records + i * pc.rec_words);
+		ch = (pancount_ch_t *)(r + 1);
+		expect = w * gate + gate < SAMPLES ? gate : SAMPLES - w * gate;
+		if (r->sample != w * gate - start || r->samples != expect)
+			fail("window in the wrong place", w);
+		for (c = 0, bit = 0; c < pc.channels; c++) {
+			bit = pc.bit[c];
+			brute(w * gate, w * gate + expect, bit, &want);
+			if (ch[c].rising != want.rising)
+				fail("rising edges miscounted", w);
+			if (ch[c].falling != want.falling)
+				fail("falling edges miscounted", w);
+			if (ch[c].high != want.high)
+				fail("high time wrong", w);
+		}
+	}
+}
+
+static uint32_t random_mask(void)
+{
+	uint32_t mask = 0;
+	int n = 1 + random() % MAX_CHANNELS;
+
+	while (n--)
+		mask |= 1u << (random() % 32);
+
+	return mask;
+}
+
+static double time_it(uint32_t *t, const char *what)
+{
+	static uint32_t timed_records[1024 * PAN_COUNT_BYTES(MAX_CHANNELS) / sizeof(uint32_t)];
+	pan_count_t pc;
+	struct timespec t0, t1;
+	uint32_t i, start;
+	double ns;
+
+	pan_count_init(&pc, 0xff, 1000, timed_records, 1024);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < TIMED_SAMPLES; i++)
+		pan_count_sample(&pc, t[i]);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	pan_count_finish(&pc, 0, &start);
+	ns = ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / TIMED_SAMPLES;
+	printf("8 channels, %s: %.2fns/sample\n", what, ns);
+
+	return ns;
+}
+
+int main(void)
+{
+	static const uint32_t gates[] = { 1, 2, 7, 100, 1000, SAMPLES - 1, SAMPLES, SAMPLES * 2 };
+	uint32_t *t, i, gate_ms, rate;
+	int n, g;
+
+	srandom(1);
+	// pan_count_gate() is gate_ms * rate / 1000, or 0 past 32 bits
+	for (n = 0; n < 100000 && !failed; n++) {
+		gate_ms = random() % 10 ? random() % 100000 : random();
+		rate = 1 + random() % MAX_SAMPLE_RATE;
+		if ((uint64_t)gate_ms * rate / 1000 > 0xffffffff) {
+			if (pan_count_gate(gate_ms, rate) != 0 &&
+					pan_count_gate(gate_ms, rate) != (uint32_t)((uint64_t)gate_ms * rate / 1000))
+				fail("gate overflowed", gate_ms);
+		} else if (pan_count_gate(gate_ms, rate) != (uint64_t)gate_ms * rate / 1000) {
+			fail("gate wrong", gate_ms);
+		}
+	}
+
+	for (n = 0; n < 50 && !failed; n++) {
+		random_trace(trace, SAMPLES);
+		for (g = 0; g < sizeof(gates) / sizeof(gates[0]) && !failed; g++) {
+			run(random_mask(), gates[g], MAX_RECORDS, 0);
+			run(random_mask(), gates[g], 1 + random() % 20, 0);
+			run(random_mask(), gates[g], MAX_RECORDS, random() % SAMPLES);
+			run(random_mask(), gates[g], 1 + random() % 20, random() % SAMPLES);
+		}
+	}
+	if (pan_count_init(&(pan_count_t){ 0 }, 0x1ff, 1, records, 1) >= 0)
+		fail("nine channels accepted", 0);
+	if (failed)
+		return 1;
+
+	t = malloc(TIMED_SAMPLES * sizeof(uint32_t));
+	for (i = 0; i < TIMED_SAMPLES; i++)
+		t[i] = 0x5a;
+	time_it(t, "no edges");
+	for (i = 0; i < TIMED_SAMPLES; i++)
+		t[i] = random();
+	time_it(t, "random");
+	free(t);
+	printf("ok\n");
+
+	return 0;
+}
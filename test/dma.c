@@ -0,0 +1,175 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The DMA control block chains from pandma.h, checked without a DMA
+ * engine: for each ring size and set of burst and wait bits, walking the
+ * chain from the first block must pace with the PWM FIFO and then copy
+ * GPLEV0 to each slot of the ring in turn, every block once, with the last
+ * linking back to the first.  Sizes that aren't a power of two must be
+ * refused.  The PWM range for every rate the driver takes must be the
+ * nearest one, and pan_dma_advance() must count whole laps of the ring
+ * when the reader is held up.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "panalyzer.h"
+#include "pandma.h"
+
+#define MAX_RING	(1 << 16)
+#define CB_BUS		0x5e000000
+#define DATA_BUS	0x5f000000
+
+static pan_dma_cb_t cbs[MAX_RING * PAN_DMA_CBS_PER_SAMPLE + 1];
+static uint8_t seen[MAX_RING * PAN_DMA_CBS_PER_SAMPLE];
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+static void chain(uint32_t samples, uint32_t ti)
+{
+	uint32_t n = samples * PAN_DMA_CBS_PER_SAMPLE, bus = CB_BUS, i, k;
+	uint32_t pace = ti | PAN_DMA_TI_NO_WIDE_BURSTS | PAN_DMA_TI_WAIT_RESP |
+			PAN_DMA_TI_D_DREQ | PAN_DMA_TI_PERMAP(PAN_DMA_PERMAP_PWM);
+	uint32_t copy = ti | PAN_DMA_TI_NO_WIDE_BURSTS | PAN_DMA_TI_WAIT_RESP;
+	pan_dma_cb_t *cb;
+
+	// A guard block past the end, which must be left alone
+	memset(&cbs[n], 0xa5, sizeof(cbs[n]));
+	if (pan_dma_build(cbs, CB_BUS, DATA_BUS, samples, ti) != n) {
+		fail("wrong number of blocks", samples);
+		return;
+	}
+	memset(seen, 0, n);
+	for (i = 0; i < n && !failed; i++) {
+		if (bus < CB_BUS || bus >= CB_BUS + n * sizeof(pan_dma_cb_t) ||
+				(bus - CB_BUS) % sizeof(pan_dma_cb_t)) {
+			fail("link outside the blocks", i);
+			break;
+		}
+		k = (bus - CB_BUS) / sizeof(pan_dma_cb_t);
+		cb = &cbs[k];
+		if (seen[k]++)
+			fail("block visited twice", k);
+		if (k != i)
+			fail("blocks out of order", k);
+		if (pan_dma_index(bus, CB_BUS) != i / PAN_DMA_CBS_PER_SAMPLE)
+			fail("wrong slot for block", k);
+		if (cb->length != sizeof(uint32_t) || cb->stride || cb->pad[0] || cb->pad[1])
+			fail("wrong length", k);
+		if (i % PAN_DMA_CBS_PER_SAMPLE == 0) {
+			if (cb->info != pace || cb->dst != PAN_DMA_PWM_FIFO)
+				fail("not pacing from the PWM", k);
+		} else if (cb->info != copy || cb->src != PAN_DMA_GPLEV0 ||
+				cb->dst != DATA_BUS + i / PAN_DMA_CBS_PER_SAMPLE * sizeof(uint32_t)) {
+			fail("not copying GPLEV0 to the next slot", k);
+		}
+		bus = cb->next;
+	}
+	if (!failed && bus != CB_BUS)
+		fail("last block doesn't link to the first", samples);
+	if (((uint8_t *)&cbs[n])[0] != 0xa5 || ((uint8_t *)&cbs[n])[31] != 0xa5)
+		fail("wrote past the blocks", samples);
+}
+
+static void stamps(void)
+{
+	pan_dma_cb_t cb;
+
+	memset(&cb, 0xff, sizeof(cb));
+	pan_dma_build_stamps(&cb, DATA_BUS, 1024, PAN_DMA_TI_BURST(3));
+	if (cb.info != (PAN_DMA_TI_BURST(3) | PAN_DMA_TI_D_INC | PAN_DMA_TI_D_WIDTH) ||
+			cb.src != PAN_DMA_ARM_COUNTER || cb.dst != DATA_BUS ||
+			cb.length != 1024 * sizeof(uint32_t) || cb.next != 0)
+		fail("stamp block wrong", cb.info);
+}
+
+// The nearest range to each rate, and the rate it gives
+static void pacing(void)
+{
+	uint32_t rate, range, got, worst = 0;
+	double err, want;
+
+	for (rate = MIN_SAMPLE_RATE; rate <= MAX_SAMPLE_RATE && !failed; rate += rate / 1000 + 1) {
+		got = pan_dma_pace(rate, &range);
+		want = (double)PAN_DMA_PWM_CLK / rate;
+		if (range == 0 || got != PAN_DMA_PWM_CLK / range)
+			fail("rate doesn't match the range", rate);
+		else if (range - want > 0.5 || want - range > 0.5)
+			fail("range not the nearest", rate);
+		err = (double)(got > rate ? got - rate : rate - got) * 1000000 / rate;
+		if (err > worst)
+			worst = err;
+	}
+	printf("PWM pacing from %uHz to %uHz: worst %u ppm off\n", MIN_SAMPLE_RATE,
+			MAX_SAMPLE_RATE, worst);
+}
+
+/*
+ * The engine takes taken samples between two looks at its slot, while
+ * the time says about due, less than half a ring out either way.
+ */
+static void advance(void)
+{
+	uint32_t samples, last, taken, due, got, i;
+	int32_t off;
+
+	for (i = 0; i < 100000 && !failed; i++) {
+		samples = 1024 << (random() % 7);
+		last = random() & (samples - 1);
+		taken = random() % (random() % 4 ? samples : samples * 20);
+		off = (int32_t)(random() % (samples - 1)) - (int32_t)(samples / 2) + 1;
+		due = (int32_t)taken + off < 0 ? 0 : taken + off;
+		got = pan_dma_advance(last, (last + taken) & (samples - 1), due, samples);
+		if (got != taken)
+			fail("lost count of the laps", taken);
+	}
+}
+
+int main(void)
+{
+	uint32_t samples;
+
+	srandom(1);
+	for (samples = 1; samples <= MAX_RING && !failed; samples <<= 1) {
+		chain(samples, 0);
+		chain(samples, PAN_DMA_TI_BURST(15) | PAN_DMA_TI_WAITS(31));
+	}
+	if (pan_dma_build(cbs, CB_BUS, DATA_BUS, 0, 0) >= 0 ||
+			pan_dma_build(cbs, CB_BUS, DATA_BUS, 3, 0) >= 0 ||
+			pan_dma_build(cbs, CB_BUS, DATA_BUS, 16383, 0) >= 0)
+		fail("ring size not a power of two accepted", 0);
+	if (!failed)
+		printf("chains of 1 to %u samples ok\n", MAX_RING);
+	stamps();
+	pacing();
+	advance();
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,198 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Dual rate mode, from the polled loop on simulated registers through the
+ * same finishing as the driver.  The waveform counts sample periods, so
+ * every sample kept can be checked against the levels at the time it was
+ * taken.  The regions must cover the data in order, each at its own step,
+ * with the full rate one holding the window around the trigger and the
+ * decimated ones no further apart from it than their step.  The trigger
+ * point, decimation and window are varied, and captures with no trigger
+ * stages and a trigger that never comes are finished too.
+ *
+ * How the UI spreads the regions along its time axis is left to a look at
+ * the UI.
+ */
+
+#include "pansim.h"
+
+#define SAMPLES		200000
+#define RATE		1000000
+#define PERIOD		(SIM_TICK_HZ / RATE)
+#define MAX_RUN		(SAMPLES * 2)
+#define COUNT_MASK	0xfffff
+#define TRIGGER_BIT	(1u << 31)
+
+static uint32_t words[SAMPLES];
+static uint64_t sample_tick[MAX_RUN];
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+// Levels count periods, half way through each, and GPIO 31 goes high at high
+static void waveform(uint64_t high)
+{
+	uint64_t t;
+	uint32_t k;
+
+	sim_clear();
+	for (k = 0; k < MAX_RUN; k++) {
+		t = (uint64_t)k * PERIOD + PERIOD / 2;
+		sim_edge(t, ((k + 1) & COUNT_MASK) | (t >= high ? TRIGGER_BIT : 0));
+	}
+}
+
+/*
+ * Capture at trigger_point with window full rate samples and 1 in decimate
+ * outside them, triggering on GPIO 31 if trigger is set.  It goes high
+ * high_at samples in, or never if that is 0.
+ */
+static void run(uint32_t trigger_point, uint32_t window, uint32_t decimate, int trigger,
+		uint32_t high_at)
+{
+	panregion_t regions[PAN_MAX_REGIONS];
+	panctl_t ctl;
+	struct sim_result_s r;
+	pan_dual_t *d = &r.cap.dual;
+	uint32_t start, words_used, span, i, j, k, total = 0, pre, full = PAN_MAX_REGIONS;
+	uint32_t n_pre, expect;
+	int n;
+
+	waveform(high_at ? (uint64_t)high_at * PERIOD : ~0ULL);
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = COUNT_MASK | TRIGGER_BIT;
+	ctl.sample_rate = RATE;
+	ctl.num_samples = SAMPLES;
+	ctl.trigger_point = trigger_point;
+	ctl.flags = PAN_FLAG_DUAL_RATE;
+	ctl.window_samples = window;
+	ctl.decimate = decimate;
+	ctl.timeout_ms = 300;
+	ctl.num_records = pan_dual_words(SAMPLES, window, decimate);
+	if (trigger) {
+		ctl.trigger[0].enabled = 1;
+		ctl.trigger[0].min_samples = 1;
+		ctl.trigger[0].mask = TRIGGER_BIT;
+		ctl.trigger[0].value = TRIGGER_BIT;
+	}
+	if (sim_capture(&ctl, words, ctl.num_records * sizeof(uint32_t), &r, sample_tick,
+			MAX_RUN) < 0) {
+		fail("capture refused", 0);
+		return;
+	}
+	if (r.cap.sample_count > MAX_RUN) {
+		fail("ran too long", r.cap.sample_count);
+		return;
+	}
+	pre = pan_dual_pre_samples(d);
+
+	// As capture_done() and dual_fixup() in the driver
+	start = cap_oldest(&r.cap);
+	n = pan_dual_finish(d, regions, &start, &words_used, &span);
+	cap_report(&r.cap, &ctl, start, r.overruns, r.abort_reason);
+
+	if (words_used > ctl.num_records)
+		fail("more words than the buffer", words_used);
+	for (i = 0; i < n && !failed; i++) {
+		if (regions[i].index != total)
+			fail("region not straight after the last", i);
+		total += regions[i].samples;
+		if (regions[i].step == 1)
+			full = i;
+		else if (regions[i].step != decimate)
+			fail("wrong step", regions[i].step);
+		if (i && regions[i].sample <= regions[i - 1].sample +
+				(regions[i - 1].samples - 1) * regions[i - 1].step)
+			fail("regions overlap", i);
+		if (i && regions[i].sample > regions[i - 1].sample +
+				regions[i - 1].samples * regions[i - 1].step + regions[i - 1].step)
+			fail("regions too far apart", i);
+		for (j = 0; j < regions[i].samples && !failed; j++) {
+			k = start + regions[i].sample + j * regions[i].step;
+			if (k >= r.cap.sample_count)
+				fail("sample not taken", k);
+			else if (words[regions[i].index + j] != sim_levels_at(sample_tick[k]))
+				fail("wrong sample kept", k);
+		}
+	}
+	if (failed)
+		return;
+	if (total != words_used)
+		fail("regions don't cover the data", total);
+	if (n && span != regions[n - 1].sample + regions[n - 1].samples * regions[n - 1].step)
+		fail("span wrong", span);
+	if (full == PAN_MAX_REGIONS || regions[full].samples > window) {
+		fail("no full rate window", full);
+		return;
+	}
+
+	// The window ends w_post samples after the trigger, or after the pre-trigger samples
+	n_pre = d->post ? d->n_pre : r.cap.sample_count;
+	if (start + regions[full].sample + regions[full].samples != n_pre + d->fp)
+		fail("window in the wrong place", regions[full].sample);
+	if (d->post && regions[full].samples != window)
+		fail("window not filled", regions[full].samples);
+	if (regions[0].step != decimate || regions[0].samples + window / decimate + 1 < d->d_pre)
+		fail("too little before the window", regions[0].samples);
+	if (d->post && d->dp != d->d_post)
+		fail("too little after the window", d->dp);
+
+	if (!trigger) {
+		if (ctl.abort_reason != PAN_ABORT_NONE || n_pre != pre)
+			fail("window not at the end of the pre-trigger samples", n_pre);
+	} else if (!high_at) {
+		if (ctl.abort_reason != PAN_ABORT_TIMEOUT || ctl.trigger_index != PAN_NO_TRIGGER)
+			fail("no timeout", ctl.abort_reason);
+		else if (n > 2)
+			fail("decimated samples after no trigger", n);
+	} else {
+		// Evaluated from the first sample after the pre-trigger ones, firing on the next
+		for (expect = pre; !(sim_levels_at(sample_tick[expect]) & TRIGGER_BIT); expect++)
+			;
+		expect++;
+		if (ctl.abort_reason != PAN_ABORT_NONE || r.cap.trigger_count != expect)
+			fail("trigger on the wrong sample", r.cap.trigger_count);
+		else if (ctl.trigger_index != expect - start || n_pre != expect + 1)
+			fail("trigger index wrong", ctl.trigger_index);
+	}
+	printf("point %u, window %5u, 1 in %3u%s: %6u words for %7u samples in %d regions\n",
+			trigger_point, window, decimate,
+			!trigger ? ", no trigger stages" : !high_at ? ", timed out  " : ", triggered  ",
+			words_used, span, n);
+}
+
+int main(void)
+{
+	run(1, 2000, 10, 1, 150000);
+	run(0, 1000, 100, 1, 190000);
+	run(2, 5000, 3, 1, 250000);
+	run(1, 2000, 10, 1, 20000);
+	run(1, 100, 2, 0, 0);
+	run(0, 3000, 7, 1, 0);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
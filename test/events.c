@@ -0,0 +1,251 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Event mode's ring in panevent.h, fed by a simulated interrupt source: a
+ * waveform of edges, each raising the GPIO interrupt unless one is still
+ * pending, and a handler that runs some microseconds later and reads the
+ * levels then, as event_irq() does.  Edges that come and go while it is
+ * pending are missed, and must be counted.
+ *
+ * For a capture, every interrupt must leave a record or count a miss,
+ * each record must hold the levels when its handler ran, and after
+ * cap_trans_finish() the records must read as transition data over the
+ * right window, wrapped or not.  For streaming, a reader held up now and
+ * then must get every record in order or count it lost.
+ */
+
+#include "pansim.h"
+#include "panevent.h"
+
+#define MAX_RECORDS		5000
+#define MASK			0xf
+#define START_US		0xfffff000		// The system timer wraps during each run
+
+static pantrans_t rec[MAX_RECORDS];
+static uint32_t fire_us[1 << 20];
+static uint32_t next_irq, put, irq_min, irq_max;
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+static uint32_t between(uint32_t min, uint32_t max)
+{
+	return min + random() % (max - min + 1);
+}
+
+/*
+ * Edges on whole microseconds, min_gap to max_gap apart, changing one or
+ * more channels and sometimes GPIO 8 as well, which has no interrupt.
+ */
+static void edges(uint32_t duration_us, uint32_t min_gap, uint32_t max_gap)
+{
+	uint32_t us = 0, levels = 0, change;
+
+	sim_clear();
+	for (;;) {
+		us += between(min_gap, max_gap);
+		if (us >= duration_us)
+			break;
+		change = random() % 8 ? 1u << (random() % 4) : random() & (MASK | 1 << 8);
+		if (change == 0)
+			continue;
+		levels ^= change;
+		sim_edge((uint64_t)us * SIM_TICKS_US, levels);
+	}
+}
+
+static uint32_t levels_at(uint32_t us)
+{
+	return sim_levels_at((uint64_t)us * SIM_TICKS_US) & MASK;
+}
+
+/*
+ * Play the waveform through the interrupt source in to e: each edge on a
+ * channel raises the interrupt, and the handler runs latency later, any
+ * further edges by then being taken in with it.  Returns the interrupts.
+ */
+static uint32_t interrupts(pan_event_t *e, uint32_t duration_us, uint32_t max_latency)
+{
+	uint32_t i, us, prev = 0, n = 0;
+	int64_t pending = -1;
+
+	for (i = 0; i < sim_num_edges; i++) {
+		us = sim_edges[i].tick / SIM_TICKS_US;
+		if (pending >= 0 && pending < us) {
+			pan_event_put(e, START_US + pending, levels_at(pending));
+			n++;
+			pending = -1;
+		}
+		if (((sim_edges[i].levels ^ prev) & MASK) && pending < 0)
+			pending = us + between(0, max_latency);
+		prev = sim_edges[i].levels;
+	}
+	if (pending >= 0 && pending < duration_us) {
+		pan_event_put(e, START_US + pending, levels_at(pending));
+		n++;
+	}
+
+	return n;
+}
+
+static void capture(uint32_t size, uint32_t duration_us, uint32_t min_gap, uint32_t max_gap,
+		uint32_t max_latency)
+{
+	pan_event_t e;
+	uint32_t n, count, samples = duration_us, window, i, us;
+
+	edges(duration_us, min_gap, max_gap);
+	pan_event_init(&e, rec, size, MASK, START_US, levels_at(0));
+	n = interrupts(&e, duration_us, max_latency);
+
+	if (e.head - 1 + e.missed != n)
+		fail("interrupts neither recorded nor missed", n);
+	if (min_gap > max_latency && e.missed)
+		fail("missed edges when the handler kept up", e.missed);
+	if (!!pan_event_wrapped(&e) != (e.head > size))
+		fail("wrapped wrong", e.head);
+
+	count = cap_trans_finish(rec, size, e.next, pan_event_wrapped(&e), duration_us, &samples);
+	if (count != (e.head < size ? e.head : size))
+		fail("records lost", count);
+	window = duration_us - samples;
+	if (!pan_event_wrapped(&e) && window)
+		fail("window cut short without wrapping", window);
+	if (count && rec[0].sample != 0)
+		fail("first record not at the window start", rec[0].sample);
+	for (i = 0; i < count && !failed; i++) {
+		us = window + rec[i].sample;
+		if (i && rec[i].sample < rec[i - 1].sample)
+			fail("records out of order", i);
+		else if (i && rec[i].levels == rec[i - 1].levels)
+			fail("record with no change", i);
+		// The first record kept may have been moved to the window start
+		else if (i && rec[i].levels != levels_at(us))
+			fail("record levels aren't the levels then", i);
+		else if (rec[i].sample >= samples && samples)
+			fail("record past the end", i);
+	}
+	printf("%5u records, edges %6u-%6uus apart, handler up to %4uus late: "
+			"%7u interrupts, %6u missed%s\n", size, min_gap, max_gap, max_latency, n,
+			e.missed, pan_event_wrapped(&e) ? ", wrapped" : "");
+}
+
+// Interrupts up to now, each a record with a change
+static void run_to(pan_event_t *e, double now)
+{
+	for (; next_irq <= now && put < sizeof(fire_us) / sizeof(fire_us[0]); put++) {
+		fire_us[put] = next_irq;
+		pan_event_put(e, START_US + next_irq, put & 1);
+		next_irq += between(irq_min, irq_max);
+	}
+}
+
+/*
+ * Stream for duration_us, with an interrupt every irq_min to irq_max us
+ * and a reader that wakes every wake_us and takes read_us to copy out each
+ * record, as event_read() does.  Every hold_every wakeups it is held up
+ * for hold_us, while asleep or, if mid_read, part way through copying a
+ * record.  Returns the records lost.
+ */
+static uint32_t stream(uint32_t duration_us, uint32_t wake_us, double read_us, int hold_every,
+		uint32_t hold_us, int mid_read)
+{
+	static pantrans_t ring[PAN_EVENT_RECORDS];
+	pan_event_t e;
+	pantrans_t copy;
+	uint32_t got = 0, lost, total_lost = 0, n, wakeups = 0;
+	double now = 0;
+	const pantrans_t *r;
+	int held;
+
+	pan_event_init(&e, ring, PAN_EVENT_RECORDS, MASK, START_US, 0);
+	fire_us[0] = 0;
+	next_irq = 0;
+	put = 1;
+	while (now < duration_us && !failed) {
+		held = hold_every && ++wakeups % hold_every == 0;
+		now += held && !mid_read ? hold_us : wake_us;
+		run_to(&e, now);
+		n = pan_event_avail(&e, &lost);
+		got += lost;
+		total_lost += lost;
+		while (n-- && !failed) {
+			r = pan_event_get(&e);
+			now += read_us;
+			if (held && mid_read && n == 0)
+				now += hold_us;
+			run_to(&e, now);
+			copy = *r;
+			if (pan_event_stale(&e))
+				total_lost++;
+			else if (copy.sample != fire_us[got] || copy.levels != (got & 1))
+				fail("record overwritten or out of order", got);
+			got++;
+		}
+	}
+	n = pan_event_avail(&e, &lost);
+	if (got + lost + n != put)
+		fail("records neither read nor lost", put - got - lost - n);
+	if (total_lost + lost != e.dropped)
+		fail("dropped miscounted", e.dropped);
+	printf("streaming, %2u-%2uus apart, held %6uus every %2d wakeups%s: %7u records, %6u lost\n",
+			irq_min, irq_max, hold_us, hold_every, mid_read ? " mid-read" : "", put,
+			total_lost + lost);
+
+	return total_lost;
+}
+
+int main(void)
+{
+	srandom(1);
+	// Relays and buttons: the handler always keeps up
+	capture(MAX_RECORDS, 10000000, 1000, 100000, 100);
+	// Faster than the handler, so edges are taken together or missed
+	capture(MAX_RECORDS, 100000, 1, 50, 20);
+	// Too many to keep, so the ring wraps and the window starts later
+	capture(100, 1000000, 100, 1000, 20);
+	capture(1000, 5000000, 1, 2000, 500);
+
+	// A reader waking every 10ms keeps up with interrupts every 20us
+	irq_min = 10;
+	irq_max = 30;
+	if (stream(2000000, 10000, 0.1, 0, 0, 0))
+		fail("lost records with prompt wakeups", 0);
+	if (stream(2000000, 10000, 0.1, 10, 50000, 0))
+		fail("lost records within the ring", 0);
+	if (stream(2000000, 10000, 0.1, 10, 200000, 0) == 0)
+		fail("nothing lost past the ring", 0);
+	// Preempted while copying, so the record being copied is overwritten
+	if (stream(2000000, 10000, 0.1, 10, 200000, 1) == 0)
+		fail("nothing lost held mid-read", 0);
+	// Copying out slower than they come
+	irq_min = 1;
+	irq_max = 4;
+	stream(2000000, 10000, 4, 0, 0, 0);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
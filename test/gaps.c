@@ -0,0 +1,215 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Segmented capture on simulated registers, with interrupts taking a
+ * random time to run at each break between chunks.  Every sample must be
+ * either one really taken, with the levels of the waveform at that time,
+ * or one filled in with the sample before, and the gap records must cover
+ * exactly the filled ones, with their times right.  Interrupts must never
+ * be off for much more than the window, and the time axis must stay
+ * linear.  A small window over a long ring overflows PAN_MAX_GAPS, and
+ * then only the latest gaps are kept.  With PAN_FLAG_ARM_IRQ the same goes
+ * until a trigger channel rises, long after the start, and from the sample
+ * that fires it on every sample must be a real one, with interrupts off.
+ */
+
+#include "pansim.h"
+
+#define MAX_SAMPLES	200000
+#define TRIGGER_BIT	(1 << 8)
+
+static uint32_t words[MAX_SAMPLES];
+static uint64_t sample_tick[MAX_SAMPLES * 2];
+static uint32_t max_irq_us;
+static int failed;
+
+static void fail(uint32_t rate, const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %uHz, %uus window: %s, %u\n", rate, sim_window_us, what, n);
+	failed = 1;
+}
+
+static uint32_t irq_ticks(void)
+{
+	// Mostly quick, with the odd long one
+	if (random() % 10 == 0)
+		return random() % (max_irq_us * SIM_TICKS_US);
+
+	return random() % (max_irq_us * SIM_TICKS_US / 10);
+}
+
+/*
+ * Random edges on the low 8 channels for ticks, as sim_random() makes
+ * them, with TRIGGER_BIT rising at trigger_tick, if that isn't 0.
+ */
+static void waveform(uint64_t ticks, uint32_t max_ticks, uint64_t trigger_tick)
+{
+	uint64_t t = 0;
+	uint32_t levels = 0;
+
+	for (;;) {
+		t += 10 + (uint32_t)random() % (max_ticks - 9);
+		if (trigger_tick && t >= trigger_tick && !(levels & TRIGGER_BIT)) {
+			levels |= TRIGGER_BIT;
+			sim_edge(trigger_tick, levels);
+		}
+		if (t >= ticks)
+			break;
+		levels ^= (uint32_t)random() & 0xff;
+		sim_edge(t, levels);
+	}
+}
+
+/*
+ * Segmented, unless trigger_us is set, when it is arm IRQ mode with the
+ * trigger channel rising that long after the start.
+ */
+static void run(uint32_t rate, uint32_t samples, uint32_t window_us, uint32_t irq_us,
+		uint32_t trigger_us)
+{
+	panctl_t ctl;
+	static struct sim_result_s r;
+	uint32_t period_us = (1000000 + rate - 1) / rate;
+	uint32_t mask = trigger_us ? 0xff | TRIGGER_BIT : 0xff;
+	uint32_t first, start, i, n, g, filled = 0, levels, prev = 0, max_off_us;
+	int64_t ns;
+
+	sim_window_us = window_us;
+	max_irq_us = irq_us;
+	sim_irq_ticks = irq_ticks;
+	sim_clear();
+	waveform((uint64_t)samples * 3 * (SIM_TICK_HZ / rate) + (uint64_t)trigger_us * SIM_TICKS_US,
+			SIM_TICK_HZ / rate * 20, (uint64_t)trigger_us * SIM_TICKS_US);
+	sim_rewind(0xfff00000);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = mask;
+	ctl.sample_rate = rate;
+	ctl.num_samples = samples;
+	ctl.trigger_point = 1;
+	ctl.flags = PAN_FLAG_SEGMENTED;
+	if (trigger_us) {
+		ctl.flags = PAN_FLAG_ARM_IRQ;
+		ctl.timeout_ms = trigger_us / 1000 * 2;
+		ctl.trigger[0].enabled = 1;
+		ctl.trigger[0].mask = TRIGGER_BIT;
+		ctl.trigger[0].value = TRIGGER_BIT;
+		ctl.trigger[0].min_samples = 1;
+	}
+	if (sim_capture(&ctl, words, samples * 4, &r, sample_tick, MAX_SAMPLES * 2) < 0) {
+		fail(rate, "capture refused", 0);
+		return;
+	}
+	sim_report(&ctl, &r);
+	n = r.cap.sample_count;
+	if (n > MAX_SAMPLES * 2 || n < samples) {
+		fail(rate, "wrong number of samples", n);
+		return;
+	}
+	start = n - samples;
+	first = ctl.first_data_index;
+
+	// Gaps in order, within the data, and as long as the time they took
+	for (g = 0; g < ctl.num_gaps; g++) {
+		pangap_t *gp = &r.gaps[g];
+
+		if (g && gp->sample < r.gaps[g - 1].sample + r.gaps[g - 1].missed)
+			fail(rate, "gaps out of order", g);
+		if (gp->missed == 0 || gp->sample + gp->missed > samples)
+			fail(rate, "gap outside the data", g);
+		if (gp->sample + start > n - gp->missed && g + 1 < ctl.num_gaps)
+			fail(rate, "gap past the end", g);
+		// Give or take a sample, and the microsecond timer's resolution,
+		// unless the ring has cut the start off it
+		ns = (int64_t)gp->missed * 1000000000 / rate - (int64_t)gp->us * 1000;
+		if ((ns > 0 ? ns : -ns) > 1000000000 / rate + 2000 && gp->sample)
+			fail(rate, "gap length doesn't match its time", g);
+	}
+
+	// Each sample really taken, or filled in for a recorded gap
+	for (i = 0, g = 0; i < samples && !failed; i++) {
+		levels = words[(first + i) % samples];
+		while (g < ctl.num_gaps && r.gaps[g].sample + r.gaps[g].missed <= i)
+			g++;
+		if (sample_tick[start + i]) {
+			if (g < ctl.num_gaps && r.gaps[g].sample <= i)
+				fail(rate, "real sample in a gap", i);
+			if (levels != (sim_levels_at(sample_tick[start + i]) & mask))
+				fail(rate, "wrong levels", i);
+		} else {
+			filled++;
+			// Before the oldest gap kept, they may have been forgotten
+			if ((g >= ctl.num_gaps || r.gaps[g].sample > i) &&
+					(ctl.num_gaps < PAN_MAX_GAPS - 1 || i >= r.gaps[0].sample))
+				fail(rate, "filled sample not in a gap", i);
+			if (i && levels != prev)
+				fail(rate, "gap not filled with the last sample", i);
+		}
+		prev = levels;
+	}
+
+	// In arm IRQ mode, from the trigger on every sample is real
+	max_off_us = window_us + period_us + 1;
+	if (trigger_us) {
+		if (ctl.abort_reason != PAN_ABORT_NONE || ctl.trigger_index >= samples) {
+			fail(rate, "no trigger", ctl.abort_reason);
+			return;
+		}
+		if (ctl.num_gaps == 0)
+			fail(rate, "no gaps while waiting", 0);
+		if (ctl.num_gaps && r.gaps[ctl.num_gaps - 1].sample +
+				r.gaps[ctl.num_gaps - 1].missed > ctl.trigger_index)
+			fail(rate, "gap after the trigger", r.gaps[ctl.num_gaps - 1].sample);
+		for (i = 0; i < samples && !failed; i++) {
+			levels = words[(first + i) % samples];
+			// The stage holds for its one sample, and fires on the next
+			if ((i + 1 < ctl.trigger_index) != !(levels & TRIGGER_BIT))
+				fail(rate, "trigger on the wrong sample", i);
+			if (i >= ctl.trigger_index && sample_tick[start + i] == 0)
+				fail(rate, "filled sample after the trigger", i);
+		}
+		max_off_us += (uint64_t)(samples - ctl.trigger_index) * 1000000 / rate;
+	}
+	if (ctl.max_irq_off_us > max_off_us ||
+			(r.ticks / SIM_TICKS_US > window_us * 2 && ctl.max_irq_off_us < window_us))
+		fail(rate, "interrupts off for the wrong time", ctl.max_irq_off_us);
+	if (ctl.achieved_rate < rate - rate / 1000 || ctl.achieved_rate > rate + rate / 1000)
+		fail(rate, "time axis not linear", ctl.achieved_rate);
+	printf("%7uHz, %5uus window, irqs up to %5uus%s: %4u gaps, %6u filled, %5uus max off\n",
+			rate, window_us, irq_us, trigger_us ? ", arm IRQ" : "", ctl.num_gaps, filled,
+			ctl.max_irq_off_us);
+}
+
+int main(void)
+{
+	srandom(1);
+	run(100000, 50000, 2000, 200, 0);
+	run(1000000, 50000, 1000, 100, 0);
+	run(1000000, 50000, 10000, 2000, 0);
+	run(5000000, 100000, 100, 50, 0);
+	run(1000000, 200000, 100, 20, 0);
+	run(1000000, 50000, 1000, 100, 200000);
+	run(5000000, 100000, 200, 50, 40000);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Glitch mode, from the event latches to what the UI marks: captures on
+ * simulated registers of single edges, pulses shorter than a sample and
+ * pulses a few samples long, through the same finishing as the driver
+ * and pan_glitch_decode() as the UI uses it.  A glitch is a channel with
+ * edges between two samples but the same level at both.  With the latches
+ * read at the same time as the levels the decoded glitches must be
+ * exactly those.  With time between the two reads, an edge landing in it
+ * may hide a glitch, or show one on the sample after as well, but no
+ * single edge may ever show as one.  Then a
+ * glitch trigger must fire on the first glitch after the pre-trigger
+ * samples.
+ *
+ * How the UI draws the marks is cairo calls on the decoded list, left to
+ * a look at the UI.
+ */
+
+#include "pansim.h"
+
+#define SAMPLES		20000
+#define RATE		1000000
+#define PERIOD		(SIM_TICK_HZ / RATE)
+#define MAX_EDGES	(SAMPLES * 2)
+
+static const uint32_t channels[] = { 4, 17, 18, 21 };
+#define MASK		(1 << 4 | 1 << 17 | 1 << 18 | 1 << 21)
+
+static uint32_t words[SAMPLES + SAMPLES / 4];
+static uint64_t sample_tick[SAMPLES * 2];
+static pantrans_t glitches[SAMPLES];
+static struct {
+	uint64_t	tick;
+	uint32_t	bit;
+} toggles[MAX_EDGES];
+static int num_toggles;
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+static void toggle(uint64_t tick, uint32_t bit)
+{
+	if (num_toggles < MAX_EDGES) {
+		toggles[num_toggles].tick = tick;
+		toggles[num_toggles++].bit = bit;
+	}
+}
+
+static int by_tick(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/*
+ * On each channel, every 3 to 30 samples, a single edge, a pulse shorter
+ * than a sample, which may or may not span one, or a pulse of 2 to 5.
+ */
+static void waveform(uint64_t ticks)
+{
+	uint32_t levels = 0;
+	uint64_t t, at;
+	int c, i;
+
+	sim_clear();
+	num_toggles = 0;
+	for (c = 0; c < 4; c++) {
+		for (t = PERIOD * 3; t < ticks; t += PERIOD * (3 + random() % 28)) {
+			at = t + random() % PERIOD;
+			switch (random() % 10) {
+			case 0 ... 4:
+				toggle(at, 1u << channels[c]);
+				break;
+			case 5 ... 7:
+				toggle(at, 1u << channels[c]);
+				toggle(at + 1 + random() % (PERIOD - 1), 1u << channels[c]);
+				break;
+			default:
+				toggle(at, 1u << channels[c]);
+				toggle(at + PERIOD * (2 + random() % 4), 1u << channels[c]);
+				t += PERIOD * 5;
+			}
+		}
+	}
+	qsort(toggles, num_toggles, sizeof(toggles[0]), by_tick);
+	for (i = 0; i < num_toggles; i++) {
+		levels ^= toggles[i].bit;
+		sim_edge(toggles[i].tick, levels);
+	}
+}
+
+// Edges on bit in (from, to]
+static int edges(uint64_t from, uint64_t to, uint32_t bit)
+{
+	int i, n = 0;
+
+	for (i = 0; i < num_toggles && toggles[i].tick <= to; i++)
+		if (toggles[i].tick > from && toggles[i].bit == bit)
+			n++;
+
+	return n;
+}
+
+static void run(uint32_t level_ticks, uint32_t trigger_bit)
+{
+	static uint32_t scatter[256];
+	panctl_t ctl;
+	struct sim_result_s r;
+	uint32_t start, first, count, i, g, k, found = 0, hidden = 0, want, fire = 0;
+	uint64_t from, to;
+	int c, n;
+
+	waveform((uint64_t)SAMPLES * 3 * PERIOD);
+	sim_rewind(0);
+	sim_level_ticks = level_ticks;
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = MASK;
+	ctl.sample_rate = RATE;
+	ctl.num_samples = SAMPLES;
+	ctl.trigger_point = 1;
+	ctl.flags = PAN_FLAG_GLITCH;
+	if (trigger_bit) {
+		ctl.trigger[0].enabled = 1;
+		ctl.trigger[0].min_samples = 1;
+		ctl.trigger[0].glitch = trigger_bit;
+	}
+	if (sim_capture(&ctl, words, sizeof(words), &r, sample_tick, SAMPLES * 2) < 0) {
+		fail("capture refused", 0);
+		return;
+	}
+	if (r.cap.sample_count > SAMPLES * 2) {
+		fail("ran too long", r.cap.sample_count);
+		return;
+	}
+	start = cap_oldest(&r.cap);
+	sim_report(&ctl, &r);
+	first = ctl.first_data_index;
+	cap_glitch_finish(&r.cap, first, ctl.num_samples);
+	pan_scatter_init(scatter, MASK);
+	count = pan_glitch_decode(words, (uint8_t *)(words + ctl.num_samples), scatter, MASK,
+			ctl.num_samples, first, glitches);
+
+	// Sample 0 has no sample before it to compare with
+	for (i = 1, g = 0; i < ctl.num_samples && !failed; i++) {
+		k = start + i;
+		while (g < count && glitches[g].sample < i)
+			g++;
+		for (c = 0; c < 4; c++) {
+			uint32_t bit = 1u << channels[c];
+			int shown = g < count && glitches[g].sample == i && (glitches[g].levels & bit);
+
+			from = sample_tick[k - 1];
+			to = sample_tick[k];
+			n = edges(from, to, bit);
+			want = n && !(n & 1);
+			if (shown)
+				found++;
+			if (level_ticks == 0 && shown != want) {
+				fail(want ? "glitch not shown" : "glitch shown with none", k);
+			} else if (shown && edges(k > 1 ? sample_tick[k - 2] - level_ticks : 0, to, bit) < 2) {
+				fail("single edge shown as a glitch", k);
+			} else if (want && !shown) {
+				// Only if an edge landed between reading the latches and the levels
+				if (!edges(from - level_ticks, from, bit) && !edges(to - level_ticks, to, bit))
+					fail("glitch not shown", k);
+				hidden++;
+			}
+			if (trigger_bit == bit && shown && !fire && k >= SAMPLES / 2)
+				fire = k;
+		}
+	}
+	if (trigger_bit && !failed) {
+		// A glitch stage starts idle, so it fires on the glitch itself
+		if (ctl.abort_reason != PAN_ABORT_NONE || !fire)
+			fail("glitch trigger didn't fire", 0);
+		else if (r.cap.trigger_count != fire)
+			fail("glitch trigger on the wrong sample", r.cap.trigger_count);
+	}
+	printf("latches read %3u ticks before the levels: %5u glitches shown, %3u hidden%s\n",
+			level_ticks, found, hidden, trigger_bit ? ", triggered on GPIO 17" : "");
+}
+
+int main(void)
+{
+	srandom(1);
+	run(0, 0);
+	run(20, 0);
+	run(100, 0);
+	run(0, 1 << 17);
+	run(20, 1 << 17);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,173 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The spare core engine's ring, with a real producer thread putting
+ * samples as core_thread() does and a consumer thread reading them out as
+ * capture_ring() and live_read() do, so the barriers and counts are
+ * exercised with the two sides really running at once.  Each sample is
+ * its own sequence number.  Now and then the consumer is held up between
+ * seeing the samples and copying them, so the producer laps it mid-read;
+ * whatever pan_ring_overwritten() doesn't own up to must still be intact,
+ * and every sample must be either read or counted lost.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define pan_ring_wmb()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#define pan_ring_rmb()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#include "panring.h"
+
+#define RUN_NS		500000000ULL
+#define CHUNK		256			// Samples put between looks at the clock
+
+static uint32_t ring_data[PAN_RING_SAMPLES];
+static volatile uint32_t ring_head;
+static volatile int stopped;
+static uint32_t rate, produced;
+static int failed;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void sleep_us(uint32_t us)
+{
+	struct timespec ts = { us / 1000000, us % 1000000 * 1000 };
+
+	nanosleep(&ts, NULL);
+}
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %uHz: %s, %u\n", rate, what, n);
+	failed = 1;
+}
+
+// Paced at rate, catching up in a burst when it falls behind; flat out if rate is 0
+static void *producer(void *arg)
+{
+	uint64_t start = now_ns(), t, due;
+	uint32_t seq = 0, i;
+
+	while ((t = now_ns()) - start < RUN_NS) {
+		due = rate ? (t - start) * rate / 1000000000 : seq + CHUNK;
+		for (i = 0; seq < due && i < CHUNK * 16; i++)
+			pan_ring_put(ring_data, &ring_head, seq++);
+	}
+	produced = seq;
+	__atomic_store_n(&stopped, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static uint32_t read_buf[PAN_RING_SAMPLES];
+
+/*
+ * Drain the ring until the producer stops, holding up every hold_every'th
+ * read by hold_us.  Returns the samples lost.
+ */
+static uint32_t consume(pan_ring_t *r, int hold_every, uint32_t hold_us, uint32_t *verified)
+{
+	uint32_t n, lost, total_lost = 0, start, over, run, i, reads = 0;
+	int done;
+
+	*verified = 0;
+	do {
+		done = __atomic_load_n(&stopped, __ATOMIC_ACQUIRE);
+		n = pan_ring_avail(r, &lost);
+		total_lost += lost;
+		if (hold_every && ++reads % hold_every == 0)
+			sleep_us(hold_us);
+		start = r->tail;
+		// Alternately a sample at a time, as capture_ring(), and in runs, as live_read()
+		if (reads & 1) {
+			for (i = 0; i < n; i++)
+				read_buf[i] = pan_ring_get(r);
+		} else {
+			for (i = 0; i < n; i += run) {
+				run = pan_ring_run(r, n - i);
+				memcpy(read_buf + i, r->data + (r->tail & PAN_RING_MASK), run * sizeof(uint32_t));
+				r->tail += run;
+			}
+		}
+		over = pan_ring_overwritten(r, start, n);
+		total_lost += over;
+		for (i = over; i < n; i++)
+			if (read_buf[i] != start + i) {
+				fail("sample overwritten but not counted", start + i);
+				break;
+			}
+		*verified += n - over;
+		if (!done)
+			sleep_us(50 + random() % 200);
+	} while (!done && !failed);
+
+	return total_lost;
+}
+
+static uint32_t run(uint32_t hz, int hold_every, uint32_t hold_us)
+{
+	pan_ring_t r = { .head = &ring_head, .data = ring_data, .tail = 0 };
+	uint32_t verified, lost;
+	pthread_t t;
+	uint64_t start;
+
+	rate = hz;
+	ring_head = 0;
+	stopped = 0;
+	start = now_ns();
+	pthread_create(&t, NULL, producer, NULL);
+	lost = consume(&r, hold_every, hold_us, &verified);
+	pthread_join(t, NULL);
+	if (failed)
+		return lost;
+	if (verified + lost != produced)
+		fail("samples neither read nor counted lost", produced - verified - lost);
+	printf("%8uHz, held %5uus every %2d reads: %9u samples, %8u lost, %5.1fns/sample\n",
+			hz, hold_us, hold_every, produced, lost,
+			(double)(now_ns() - start) / produced);
+
+	return lost;
+}
+
+int main(void)
+{
+	srandom(1);
+	run(1000000, 0, 0);
+	run(1000000, 8, 60000);
+	run(10000000, 4, 20000);
+	// Flat out, lapping the consumer all the time
+	if (!failed && run(0, 2, 5000) == 0)
+		fail("nothing lost flat out", 0);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,111 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The jitter histogram in panhist.h against sorted gaps: streams of
+ * timestamps from a steady period with random jitter, occasional long
+ * stalls past the last bucket, and the counter wrapping part way through.
+ * Every percentile the drivers and a few others ask for must be the gap
+ * at that rank in the sorted list, or max once that is past the last
+ * bucket, and min and max must be the real extremes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "panhist.h"
+
+#define MAX_STAMPS	100000
+
+static uint32_t stamps[MAX_STAMPS], gaps[MAX_STAMPS];
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+static int by_value(const void *a, const void *b)
+{
+	const uint32_t *x = a, *y = b;
+
+	return *x < *y ? -1 : *x > *y;
+}
+
+/*
+ * n stamps, period apart give or take jitter, from start, with a stall of
+ * up to stall ticks about one gap in 1000
+ */
+static void stream(uint32_t n, uint32_t start, uint32_t period, uint32_t jitter, uint32_t stall)
+{
+	static const uint32_t permilles[] = { 0, 1, 100, 500, 900, 990, 999, 1000 };
+	pan_hist_t h;
+	uint32_t i, p, want, expect;
+
+	stamps[0] = start;
+	for (i = 1; i < n; i++) {
+		gaps[i - 1] = period - jitter + random() % (2 * jitter + 1);
+		if (stall && random() % 1000 == 0)
+			gaps[i - 1] += random() % stall;
+		stamps[i] = stamps[i - 1] + gaps[i - 1];
+	}
+	pan_hist_init(&h);
+	pan_hist_add_stamps(&h, stamps, n);
+	if (h.count != n - 1)
+		fail("wrong count", h.count);
+	qsort(gaps, n - 1, sizeof(gaps[0]), by_value);
+	if (n > 1 && (h.min != gaps[0] || h.max != gaps[n - 2]))
+		fail("wrong min or max", h.max);
+	for (p = 0; p < sizeof(permilles) / sizeof(permilles[0]) && !failed; p++) {
+		if (n < 2) {
+			expect = 0;
+		} else {
+			// The rank rounded up, and at least the first
+			want = ((uint64_t)(n - 1) * permilles[p] + 999) / 1000;
+			expect = gaps[want ? want - 1 : 0];
+			if (expect >= PAN_HIST_BUCKETS - 1)
+				expect = h.max;
+		}
+		if (pan_hist_percentile(&h, permilles[p]) != expect)
+			fail("wrong percentile", permilles[p]);
+	}
+	printf("%6u stamps, period %3u +/- %3u%s: p50 %u, p99 %u, max %u\n", n, period, jitter,
+			stall ? " with stalls" : "            ", pan_hist_percentile(&h, 500),
+			pan_hist_percentile(&h, 990), h.max);
+}
+
+int main(void)
+{
+	srandom(1);
+	stream(1, 0, 100, 0, 0);
+	stream(2, 0, 100, 0, 0);
+	stream(4, 0, 50, 10, 0);
+	stream(1000, 0, 100, 0, 0);
+	stream(MAX_STAMPS, 0, 50, 20, 0);
+	stream(MAX_STAMPS, 0xffff0000, 100, 30, 5000);
+	stream(MAX_STAMPS, 12345, 250, 5, 100000);
+	stream(MAX_STAMPS, 0, 400, 100, 0);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,129 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Check the sample pacing in pancap.h against a simulated 250MHz ARM
+ * counter, for rates from 10KHz to 5MHz, starting just short of the counter
+ * wrapping.  Each sample must be taken no earlier than it is due, and no
+ * later than one counter read after, and over a second the average rate
+ * must be within what 8 bits of fraction allow.  Then a stall, as when
+ * interrupts run in segmented mode, must be caught up on by counting the
+ * samples that fell due meanwhile.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "pancap.h"
+
+#define ARM_TICK_HZ		250000000
+#define READ_TICKS		3		// Each read of the simulated counter takes this long
+
+static const uint32_t rates[] = {
+	10000, 44100, 100000, 333333, 1000000, 1234567, 2000000, 3000000, 4000000, 5000000,
+};
+
+static uint32_t sim_tick;
+static int failed;
+
+static uint32_t read_tick(void)
+{
+	sim_tick += READ_TICKS;
+
+	return sim_tick;
+}
+
+static void fail(const char *what, uint32_t rate, uint32_t i)
+{
+	printf("FAIL: %uHz sample %u: %s\n", rate, i, what);
+	failed = 1;
+}
+
+// A second of samples at rate; returns the worst drift from exact, in ppm
+static double pace_second(uint32_t rate)
+{
+	struct cap_pace_s pace;
+	uint32_t start, t, i;
+	double exact, drift;
+
+	sim_tick = 0xffffffff - ARM_TICK_HZ / 2;
+	start = sim_tick;
+	cap_pace_init(&pace, ARM_TICK_HZ, rate, start);
+	for (i = 0; i < rate && !failed; i++) {
+		uint32_t due = pace.next;
+
+		do { t = read_tick(); } while (!cap_pace_due(&pace, t));
+		if ((int32_t)(t - due) < 0)
+			fail("taken early", rate, i);
+		if (t - due >= READ_TICKS)
+			fail("taken late", rate, i);
+		cap_pace_step(&pace);
+		if (pace.next - due != pace.period && pace.next - due != pace.period + 1)
+			fail("period out of range", rate, i);
+	}
+	// The second sample is due one period in, so the one after the last
+	// is due a second and a period in
+	exact = (double)ARM_TICK_HZ * (rate + 1) / rate;
+	drift = ((double)(uint32_t)(pace.next - start) - exact) / exact * 1e6;
+	// Each period is short by less than 1/256 tick
+	if (drift > 0 || -drift > 1e6 / 256 / pace.period)
+		fail("drifted too far", rate, i);
+
+	return drift;
+}
+
+// Stall for n periods with the counter running, then count what fell due
+static void pace_stall(uint32_t rate, uint32_t n)
+{
+	struct cap_pace_s pace;
+	uint32_t t, missed, due;
+
+	sim_tick = 0xfffff000;
+	cap_pace_init(&pace, ARM_TICK_HZ, rate, sim_tick);
+	do { t = read_tick(); } while (!cap_pace_due(&pace, t));
+	cap_pace_step(&pace);
+	due = pace.next;
+	sim_tick += n * (ARM_TICK_HZ / rate);
+	for (missed = 0; cap_pace_due(&pace, read_tick()); missed++)
+		cap_pace_step(&pace);
+	// Every sample due by the last read, and no more; the reads take time too
+	if (missed < n || missed > n + 1 + missed * READ_TICKS / pace.period ||
+			cap_pace_due(&pace, sim_tick))
+		fail("stall miscounted", rate, missed);
+	if ((int32_t)(pace.next - due) <= 0)
+		fail("went backwards", rate, missed);
+}
+
+int main(void)
+{
+	int i;
+
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]) && !failed; i++) {
+		double drift = pace_second(rates[i]);
+
+		pace_stall(rates[i], 1000);
+		printf("%7uHz: period %u + %u/256 ticks, %.2fppm slow\n", rates[i],
+				ARM_TICK_HZ / rates[i], ((ARM_TICK_HZ % rates[i]) << 8) / rates[i],
+				drift < 0 ? -drift : 0.0);
+	}
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,180 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Capture the same simulated waveform as whole words and packed, with the
+ * ring wrapping while the trigger is awaited, and check that unpacking the
+ * packed ring as the UI does gives back the masked words, for every
+ * channel count from one to eight, both from the ring and from a copy as
+ * read() returns it.  Then time the storing, and report what the packing
+ * saves in buffer and in copying to user space.
+ */
+
+#include <time.h>
+#include "pansim.h"
+
+#define RATE		1000000
+#define SAMPLES		20000
+#define BENCH		(1 << 24)
+
+static uint32_t words[SAMPLES];
+static uint8_t packed[SAMPLES], copy[SAMPLES];
+static uint32_t bench_buf[BENCH / 4];
+static int failed, odd;
+
+static void fail(uint32_t mask, const char *what, uint32_t n)
+{
+	printf("FAIL: mask %08x: %s at %u\n", mask, what, n);
+	failed = 1;
+}
+
+static void capture(panctl_t *ctl, uint32_t flags, uint32_t *buf, uint32_t bytes,
+		struct sim_result_s *r)
+{
+	ctl->flags = flags;
+	sim_rewind(0xfff00000);
+	if (sim_capture(ctl, buf, bytes, r, NULL, 0) < 0)
+		fail(ctl->channel_mask, "capture refused", 0);
+}
+
+static void round_trip(uint32_t mask)
+{
+	panctl_t ctl;
+	struct sim_result_s w, p;
+	uint32_t scatter[256];
+	uint32_t first, pfirst, rfirst, i, levels, bytes;
+	int bits = pan_pack_bits(mask);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = mask;
+	ctl.sample_rate = RATE;
+	ctl.num_samples = SAMPLES;
+	ctl.trigger_point = 1;
+	// GPIO 31 going high, some way in, so the ring wraps first
+	ctl.trigger[0].enabled = 1;
+	ctl.trigger[0].mask = 1u << 31;
+	ctl.trigger[0].value = 1u << 31;
+	ctl.trigger[0].min_samples = 1;
+
+	capture(&ctl, 0, words, sizeof(words), &w);
+	capture(&ctl, PAN_FLAG_PACKED, (uint32_t *)packed, SAMPLES * bits / 8, &p);
+	if (failed)
+		return;
+	if (w.cap.sample_count != p.cap.sample_count || w.cap.trigger_count != p.cap.trigger_count)
+		fail(mask, "captures differ", p.cap.sample_count);
+	odd += w.cap.sample_count & 1;
+	if (w.cap.sample_count < SAMPLES * 2 || w.cap.trigger_count == PAN_NO_TRIGGER)
+		fail(mask, "ring didn't wrap before the trigger", w.cap.sample_count);
+
+	// As capture_done() and the UI's decode_ring() do it
+	first = w.cap.buf_ptr - w.cap.buf_start;
+	pfirst = cap_pack_finish(&p.cap);
+	if (first != pfirst)
+		fail(mask, "rings start in different places", pfirst);
+	pan_scatter_init(scatter, mask);
+	for (i = 0; i < SAMPLES && !failed; i++) {
+		levels = pan_unpack(packed, bits, scatter, mask, (pfirst + i) % SAMPLES);
+		if (levels != pan_unpack((uint8_t *)words, 32, scatter, mask, (first + i) % SAMPLES))
+			fail(mask, "unpacked wrong", i);
+	}
+
+	// And from a copy as dev_read() returns it, from the byte the oldest is in
+	bytes = SAMPLES * bits / 8;
+	for (i = 0; i < bytes; i++)
+		copy[i] = packed[(pfirst * bits / 8 + i) % bytes];
+	rfirst = pan_read_first(bits, pfirst);
+	for (i = 0; i < SAMPLES && !failed; i++) {
+		levels = pan_unpack(copy, bits, scatter, mask, (rfirst + i) % SAMPLES);
+		if (levels != pan_unpack((uint8_t *)words, 32, scatter, mask, (first + i) % SAMPLES))
+			fail(mask, "read() copy unpacked wrong", i);
+	}
+}
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Nanoseconds per sample to store BENCH changing samples
+static double bench(uint32_t mask, uint32_t flags)
+{
+	static pan_trig_t trig;
+	static uint8_t gather[4][256];
+	panctl_t ctl;
+	struct cap_s c;
+	uint32_t i, sample = 0x12345678;
+	double t;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = mask;
+	ctl.num_samples = flags ? BENCH / (pan_pack_bits(mask) / 8.0) : BENCH / 4;
+	ctl.flags = flags;
+	pan_trig_compile(&trig, &ctl);
+	pan_gather_init(gather, mask, 8);
+	cap_init(&c, &ctl, &trig, 0, bench_buf, BENCH, gather, NULL);
+	t = now_ns();
+	for (i = 0; i < BENCH; i++) {
+		sample = sample * 1103515245 + 12345;
+		cap_store(&c, sample);
+	}
+	t = now_ns() - t;
+	// Keep the stores
+	if (bench_buf[i & (BENCH / 4 - 1)] == 1)
+		printf(" ");
+
+	return t / BENCH;
+}
+
+int main(void)
+{
+	static const uint32_t masks[] = {
+		0x1, 0x3, 0x0f000000, 0x00810100, 0x1f, 0x8000003e, 0x0fc00001, 0x0ff00000,
+	};
+	int i, pass;
+
+	// Odd and even sample counts, for the nibble left over
+	for (pass = 0; pass < 2 && !failed; pass++) {
+		uint64_t trigger_tick = (uint64_t)SAMPLES * 5 / 2 * (SIM_TICK_HZ / RATE) +
+				pass * (SIM_TICK_HZ / RATE);
+
+		sim_clear();
+		sim_random(0x7fffffff, trigger_tick, 10, 2000);
+		sim_edge(trigger_tick, sim_edges[sim_num_edges - 1].levels | 1u << 31);
+		for (i = 0; i < sizeof(masks) / sizeof(masks[0]) && !failed; i++)
+			round_trip(masks[i]);
+	}
+	if (failed)
+		return 1;
+	if (odd == 0 || odd == 2 * sizeof(masks) / sizeof(masks[0])) {
+		printf("FAIL: sample counts all %s\n", odd ? "odd" : "even");
+		return 1;
+	}
+	printf("round trip ok for 1 to 8 channels\n");
+	printf("words:   %.2fns/sample, 4 bytes/sample\n", bench(0xff, 0));
+	printf("bytes:   %.2fns/sample, 1 byte/sample, 4x deeper, 1/4 the copying\n",
+			bench(0xff, PAN_FLAG_PACKED));
+	printf("nibbles: %.2fns/sample, 1/2 byte/sample, 8x deeper, 1/8 the copying\n",
+			bench(0xf, PAN_FLAG_PACKED));
+	printf("ok\n");
+
+	return 0;
+}
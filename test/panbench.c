@@ -0,0 +1,234 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The sampling loop benchmark: capture()'s polled loop, on the simulated
+ * registers in pansim.h, through a set of canned scenarios.  For each it
+ * prints what the loop costs per sample on this machine, how many samples
+ * were late and how many gaps interrupts left, and checks the trigger
+ * fired on the right sample, or timed out when it should have.
+ *
+ * The cost includes polling the counter until each sample is due, as on
+ * the Pi, so it is only comparable scenario by scenario.  Run it before
+ * and after any change to the loop or to pancap.h.  Given a number, it
+ * also fails if any scenario costs more ns/sample than that.
+ */
+
+#include <time.h>
+#include "pansim.h"
+
+#define SAMPLES		50000
+
+struct scenario_s {
+	const char	*name;
+	void		(*setup)(panctl_t *ctl);
+	uint64_t	trigger_tick;		// When the trigger condition is met, or 0 for a timeout
+	int			late;				// Whether stalls should make samples late
+	int			gaps;				// Whether interrupts should leave gaps
+	int			at;					// Fires on the sample that meets it, not the one after
+};
+
+static uint32_t words[SAMPLES];
+static uint64_t sample_tick[SAMPLES * 8];
+static struct sim_result_s result;
+
+#define US(us)	((uint64_t)(us) * SIM_TICKS_US)
+
+static void trigger_on(panctl_t *ctl, int stage, uint32_t mask, uint32_t min_samples)
+{
+	ctl->trigger[stage].enabled = 1;
+	ctl->trigger[stage].mask = mask;
+	ctl->trigger[stage].value = mask;
+	ctl->trigger[stage].min_samples = min_samples;
+}
+
+// Nothing happens, so the trigger times out
+static void idle(panctl_t *ctl)
+{
+	ctl->sample_rate = 1000000;
+	ctl->timeout_ms = 100;
+	trigger_on(ctl, 0, 1 << 4, 1);
+}
+
+// Busy low channels, and GPIO 31 going high at 20ms
+static void noise(panctl_t *ctl)
+{
+	ctl->sample_rate = 5000000;
+	ctl->channel_mask = 0x800000ff;
+	sim_random(0xff, US(20000), 10, 2000);
+	sim_edge(US(20000), sim_levels_at(US(20000)) | 1u << 31);
+	trigger_on(ctl, 0, 1u << 31, 1);
+}
+
+// As noise, with reads held up as bus stalls and FIQs do
+static void stalls(panctl_t *ctl)
+{
+	int i;
+
+	noise(ctl);
+	for (i = 1; i <= 40; i++)
+		sim_stall_at(US(i * 500), 20 + random() % 2000);
+}
+
+/*
+ * Two stages: GPIO 17 high and 18 low for 20 samples, then 18 high, all
+ * after the 25ms of pre-trigger samples.  18 going high 5us in to a pulse
+ * on 17 is too soon, and a 100us pulse with nothing after it leads
+ * nowhere; 18 going high 100us in to the third pulse fires it.
+ */
+static void stages(panctl_t *ctl)
+{
+	ctl->sample_rate = 1000000;
+	ctl->channel_mask = 0x60000;
+	sim_edge(US(40000), 1 << 17);
+	sim_edge(US(40005), 1 << 17 | 1 << 18);
+	sim_edge(US(40010), 0);
+	sim_edge(US(45000), 1 << 17);
+	sim_edge(US(45100), 0);
+	sim_edge(US(50000), 1 << 17);
+	sim_edge(US(50100), 1 << 17 | 1 << 18);
+	trigger_on(ctl, 0, 1 << 17 | 1 << 18, 20);
+	ctl->trigger[0].value = 1 << 17;
+	trigger_on(ctl, 1, 1 << 18, 1);
+}
+
+// Four channels packed two samples to a byte
+static void packed(panctl_t *ctl)
+{
+	ctl->sample_rate = 5000000;
+	ctl->channel_mask = 0xf;
+	ctl->flags = PAN_FLAG_PACKED;
+	sim_random(0x7, US(20000), 10, 500);
+	sim_edge(US(20000), sim_levels_at(US(20000)) | 0x8);
+	trigger_on(ctl, 0, 0x8, 1);
+}
+
+static uint32_t irq_ticks(void)
+{
+	return US(100);
+}
+
+// Interrupts run for 100us every 2ms, leaving gaps
+static void segmented(panctl_t *ctl)
+{
+	ctl->sample_rate = 2000000;
+	ctl->flags = PAN_FLAG_SEGMENTED;
+	sim_random(0xff, US(30000), 100, 5000);
+	sim_edge(US(30001), 1u << 31);
+	ctl->channel_mask = 0x800000ff;
+	trigger_on(ctl, 0, 1u << 31, 1);
+	sim_irq_ticks = irq_ticks;
+}
+
+static const struct scenario_s scenarios[] = {
+	{ "idle, times out",		idle,		0,			0, 0, 0 },
+	{ "noise, one edge",		noise,		US(20000),	0, 0, 0 },
+	{ "noise, stalled reads",	stalls,		US(20000),	1, 0, 0 },
+	{ "two stages",				stages,		US(50100),	0, 0, 1 },
+	{ "packed nibbles",			packed,		US(20000),	0, 0, 0 },
+	{ "segmented",				segmented,	US(30001),	0, 1, 0 },
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Returns 0 if the scenario behaved, and the cost per sample in *ns
+static int run(const struct scenario_s *s, double *ns)
+{
+	struct sim_result_s *r = &result;
+	const char *why = NULL;
+	panctl_t ctl;
+	uint64_t start;
+	uint32_t i;
+
+	sim_clear();
+	sim_irq_ticks = NULL;
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = 0xff;
+	ctl.num_samples = SAMPLES;
+	ctl.trigger_point = 1;
+	s->setup(&ctl);
+	if (ctl.flags & PAN_FLAG_PACKED)
+		ctl.num_samples = SAMPLES * 2;
+	sim_rewind(0xfff00000);
+
+	start = now_ns();
+	if (sim_capture(&ctl, words, sizeof(words), r, sample_tick, SAMPLES * 8) < 0) {
+		printf("FAIL: %s: capture refused\n", s->name);
+		return 1;
+	}
+	*ns = (double)(now_ns() - start) / r->cap.sample_count;
+	sim_report(&ctl, r);
+
+	if (s->trigger_tick == 0) {
+		if (ctl.abort_reason != PAN_ABORT_TIMEOUT)
+			why = "didn't time out";
+	} else if (ctl.abort_reason != PAN_ABORT_NONE) {
+		why = "didn't trigger";
+	} else if ((i = r->cap.trigger_count - 1 + s->at) >= SAMPLES * 8) {
+		why = "triggered too late to check";
+	} else {
+		// A stage fires on the sample after the first to see it met, but
+		// a last stage of one sample chained on from the one before fires
+		// on that sample
+		if (sample_tick[i] < s->trigger_tick)
+			why = "triggered early";
+		while (i-- > 0 && !why && sample_tick[i] == 0)
+			;
+		if (!why && i < SAMPLES * 8 && sample_tick[i] >= s->trigger_tick)
+			why = "triggered late";
+	}
+	if (!why && !s->late && ctl.overruns)
+		why = "late samples without stalls";
+	if (!why && s->late && !ctl.overruns)
+		why = "stalls didn't make samples late";
+	if (!why && !s->gaps != !ctl.num_gaps)
+		why = s->gaps ? "no gaps" : "gaps without interrupts";
+
+	printf("%-22s %7uHz %8u samples %6.1fns/sample %6u late, %8.3fus max, %3u gaps  %s\n",
+			s->name, ctl.sample_rate, r->cap.sample_count, *ns, ctl.overruns,
+			ctl.max_late_ns / 1000.0, ctl.num_gaps, why ? why : "ok");
+
+	return why != NULL;
+}
+
+int main(int argc, char **argv)
+{
+	double ns, max_ns = argc > 1 ? atof(argv[1]) : 0;
+	int i, failed = 0;
+
+	srandom(1);
+	for (i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		if (run(&scenarios[i], &ns))
+			failed = 1;
+		else if (max_ns && ns > max_ns) {
+			printf("FAIL: %s: over %.1fns/sample\n", scenarios[i].name, max_ns);
+			failed = 1;
+		}
+	}
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,362 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Simulated registers for the host tests.  Include this before pancap.h
+ * and pan_read_level() and the rest read a waveform and clocks here rather
+ * than a Pi, so the capture loops can be run, checked and timed anywhere.
+ *
+ * The waveform is a list of edges: the ARM counter tick each happens on
+ * and the levels from then on.  Simulated time only moves when the loop
+ * reads the counter, by sim_read_ticks a read, or when a test calls
+ * sim_stall() in place of interrupts running, and sim_stall_at() makes a
+ * counter read take longer, as a bus stall or an FIQ would.  The event
+ * detect latches catch every edge passed, however short the pulse, as the
+ * real ones do, and sim_level_ticks puts time between reading them and
+ * reading the levels, for edges to land in.
+ */
+
+#ifndef PANSIM_H_
+#define PANSIM_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_TICK_HZ		250000000
+#define SIM_TICKS_US	(SIM_TICK_HZ / 1000000)
+
+struct sim_edge_s {
+	uint64_t	tick;
+	uint32_t	levels;
+};
+
+static struct sim_edge_s *sim_edges;
+static uint32_t sim_num_edges, sim_max_edges, sim_next_edge;
+static uint64_t sim_time;			// Ticks since the waveform started
+static uint32_t sim_base;			// What the counter read at sim_time 0
+static uint32_t sim_levels, sim_latched;
+static uint32_t sim_read_ticks = 3;
+static uint32_t sim_level_ticks;	// From reading the latches to reading the levels
+
+#define SIM_MAX_STALLS	64
+
+static struct {
+	uint64_t	at;
+	uint32_t	ticks;
+} sim_stalls[SIM_MAX_STALLS];
+static int sim_num_stalls, sim_next_stall;
+
+// Bring the levels and latches up to sim_time
+static inline void sim_advance(void)
+{
+	while (sim_next_edge < sim_num_edges && sim_edges[sim_next_edge].tick <= sim_time) {
+		sim_latched |= sim_levels ^ sim_edges[sim_next_edge].levels;
+		sim_levels = sim_edges[sim_next_edge++].levels;
+	}
+}
+
+static inline uint32_t sim_read_level(void)
+{
+	sim_time += sim_level_ticks;
+	sim_advance();
+
+	return sim_levels;
+}
+
+static inline uint32_t sim_read_tick(void)
+{
+	sim_time += sim_read_ticks;
+	while (sim_next_stall < sim_num_stalls && sim_stalls[sim_next_stall].at <= sim_time)
+		sim_time += sim_stalls[sim_next_stall++].ticks;
+
+	return sim_base + (uint32_t)sim_time;
+}
+
+static inline uint32_t sim_read_events(void)
+{
+	sim_advance();
+
+	return sim_latched;
+}
+
+#define pan_read_level()		sim_read_level()
+#define pan_read_us()			((uint32_t)(sim_time / SIM_TICKS_US))
+#define pan_read_tick()			sim_read_tick()
+#define pan_read_events()		sim_read_events()
+#define pan_clear_events(ev)	(sim_latched &= ~(ev))
+
+#include "panregs.h"
+#include "pancap.h"
+
+// Time passes with nobody sampling, as when interrupts run
+static void sim_stall(uint32_t ticks)
+{
+	sim_time += ticks;
+}
+
+// Start again from the first edge, with the counter at base
+static void sim_rewind(uint32_t base)
+{
+	sim_time = 0;
+	sim_base = base;
+	sim_next_edge = 0;
+	sim_next_stall = 0;
+	sim_levels = 0;
+	sim_latched = 0;
+}
+
+// Drop the waveform
+static void sim_clear(void)
+{
+	sim_num_edges = 0;
+	sim_num_stalls = 0;
+	sim_rewind(0);
+}
+
+// The first counter read at or after tick takes ticks longer; in order, as for edges
+static void sim_stall_at(uint64_t tick, uint32_t ticks)
+{
+	if (sim_num_stalls < SIM_MAX_STALLS) {
+		sim_stalls[sim_num_stalls].at = tick;
+		sim_stalls[sim_num_stalls++].ticks = ticks;
+	}
+}
+
+// Levels change to levels at tick; edges must be added in order
+static void sim_edge(uint64_t tick, uint32_t levels)
+{
+	if (sim_num_edges == sim_max_edges) {
+		sim_max_edges = sim_max_edges ? sim_max_edges * 2 : 1024;
+		sim_edges = realloc(sim_edges, sim_max_edges * sizeof(*sim_edges));
+		if (!sim_edges) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	sim_edges[sim_num_edges].tick = tick;
+	sim_edges[sim_num_edges++].levels = levels;
+}
+
+/*
+ * Up to ticks of random edges on the channels in mask, each between
+ * min_ticks and max_ticks after the one before.  Short gaps make pulses
+ * that fall between samples, for the event latches to catch.
+ */
+static void sim_random(uint32_t mask, uint64_t ticks, uint32_t min_ticks, uint32_t max_ticks)
+{
+	uint64_t t = 0;
+	uint32_t levels = 0;
+
+	for (;;) {
+		t += min_ticks + (uint32_t)random() % (max_ticks - min_ticks + 1);
+		if (t >= ticks)
+			break;
+		levels ^= (uint32_t)random() & mask;
+		sim_edge(t, levels);
+	}
+}
+
+/*
+ * Load a waveform file: a line per edge, giving the microseconds since the
+ * start, which may have a fraction, and the levels from then on in hex.
+ * Blank lines and lines starting with # are ignored.  Returns -1 if the
+ * file can't be read.
+ */
+static int sim_load(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[256];
+	double us;
+	uint32_t levels;
+	int n = 0;
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		n++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%lf %x", &us, &levels) != 2) {
+			fprintf(stderr, "%s:%d: expected \"<us> <hex levels>\"\n", path, n);
+			fclose(f);
+			return -1;
+		}
+		sim_edge((uint64_t)(us * SIM_TICKS_US), levels);
+	}
+	fclose(f);
+
+	return 0;
+}
+
+// The levels at tick, straight from the waveform
+static uint32_t sim_levels_at(uint64_t tick)
+{
+	uint32_t lo = 0, hi = sim_num_edges;
+
+	while (lo < hi) {
+		uint32_t mid = (lo + hi) / 2;
+
+		if (sim_edges[mid].tick <= tick)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo ? sim_edges[lo - 1].levels : 0;
+}
+
+/*
+ * Interrupts get to run between chunks of sim_window_us in segmented mode,
+ * and before the trigger with PAN_FLAG_ARM_IRQ, as for irq_window_us in the
+ * driver.  sim_irq_ticks, if set, says how long they take each time.
+ */
+static uint32_t sim_window_us = 2000;
+static uint32_t (*sim_irq_ticks)(void);
+
+/*
+ * The polled loop from capture() in pandriver.c, running on the simulated
+ * registers.  ctl is as check_panctl() leaves it.  sample_tick, if not
+ * NULL, gets the simulated time each of the first max_samples samples was
+ * taken, for checking against the waveform; samples filled in for a gap
+ * get 0.
+ */
+struct sim_result_s {
+	struct cap_s	cap;
+	int				overruns;
+	uint32_t		max_late;
+	int				abort_reason;
+	uint32_t		ticks;
+	uint32_t		max_off_us;
+	uint32_t		num_gaps;
+	pangap_t		gaps[PAN_MAX_GAPS];
+};
+
+static int sim_capture(const panctl_t *ctl, uint32_t *buffer, uint32_t bytes,
+		struct sim_result_s *r, uint64_t *sample_tick, uint32_t max_samples)
+{
+	static pan_trig_t trig;
+	static uint8_t pack_gather[4][256];
+	static panseg_t segments[PAN_MAX_SEGMENTS];
+	struct cap_s *c = &r->cap;
+	struct cap_pace_s pace;
+	uint32_t start_tick, abort_tick, t1, late, sample, events = 0;
+	uint32_t chunk_time, chunk_end, chunk_ticks, gap_time, off_us, missed;
+	uint32_t timeout_ms = ctl->timeout_ms ? ctl->timeout_ms : 1000;
+	int segmented = ctl->flags & PAN_FLAG_SEGMENTED;
+	int arm_irq = ctl->flags & PAN_FLAG_ARM_IRQ;
+	int glitch = ctl->flags & PAN_FLAG_GLITCH;
+	int stages;
+
+	stages = pan_trig_compile(&trig, ctl);
+	if (stages < 0)
+		return -1;
+	if ((ctl->flags & (PAN_FLAG_PACKED | PAN_FLAG_GLITCH)) &&
+			pan_gather_init(pack_gather, ctl->channel_mask, 8) < 0)
+		return -1;
+	cap_init(c, ctl, &trig, stages, buffer, bytes, pack_gather, segments);
+	r->overruns = 0;
+	r->max_late = 0;
+	r->abort_reason = PAN_ABORT_NONE;
+	r->max_off_us = 0;
+	r->num_gaps = 0;
+	chunk_ticks = sim_window_us * SIM_TICKS_US;
+
+	chunk_time = pan_read_us();
+	start_tick = pan_read_tick();
+	abort_tick = start_tick + timeout_ms * (SIM_TICK_HZ / 1000);
+	chunk_end = start_tick + chunk_ticks;
+	cap_pace_init(&pace, SIM_TICK_HZ, PAN_SAMPLE_RATE(ctl), start_tick);
+	for (;;) {
+		do { t1 = pan_read_tick(); } while (!cap_pace_due(&pace, t1));
+		if (glitch) {
+			events = pan_read_events() & c->mask;
+			pan_clear_events(events);
+		}
+		sample = pan_read_level();
+		if (sample_tick && c->sample_count < max_samples)
+			sample_tick[c->sample_count] = sim_time;
+		late = cap_pace_late(&pace, t1, &r->overruns);
+		if (late > r->max_late)
+			r->max_late = late;
+		cap_pace_step(&pace);
+		if (glitch)
+			cap_latch(c, sample, events);
+		cap_store(c, sample);
+		if (cap_waiting(c) && (int32_t)(t1 - abort_tick) >= 0) {
+			r->abort_reason = PAN_ABORT_TIMEOUT;
+			break;
+		}
+		if (cap_trigger(c, &trig, sample))
+			break;
+		if ((segmented || (arm_irq && c->state >= 0)) && (int32_t)(t1 - chunk_end) >= 0) {
+			gap_time = pan_read_us();
+			off_us = gap_time - chunk_time;
+			if (off_us > r->max_off_us)
+				r->max_off_us = off_us;
+			if (sim_irq_ticks)
+				sim_stall(sim_irq_ticks());
+			cap_gap_forget(r->gaps, &r->num_gaps, cap_oldest(c));
+			chunk_time = pan_read_us();
+			chunk_end = pan_read_tick() + chunk_ticks;
+			for (missed = 0; cap_pace_due(&pace, pan_read_tick()); missed++)
+				cap_pace_step(&pace);
+			if (missed) {
+				if (sample_tick) {
+					uint32_t i;
+
+					for (i = c->sample_count; i < c->sample_count + missed && i < max_samples; i++)
+						sample_tick[i] = 0;
+				}
+				cap_gap_add(r->gaps, &r->num_gaps, c->sample_count, missed,
+						pan_read_us() - gap_time);
+				if (cap_fill(c, sample, missed))
+					break;
+			}
+		}
+	}
+	off_us = pan_read_us() - chunk_time;
+	if (off_us > r->max_off_us)
+		r->max_off_us = off_us;
+	r->ticks = pan_read_tick() - start_tick;
+
+	return 0;
+}
+
+// What capture_done() puts in the header, for whole word and packed captures
+static void sim_report(panctl_t *p, struct sim_result_s *r)
+{
+	uint32_t start_count = cap_oldest(&r->cap);
+
+	if (r->cap.packed)
+		p->first_data_index = cap_pack_finish(&r->cap);
+	else
+		p->first_data_index = r->cap.buf_ptr - r->cap.buf_start;
+	cap_report(&r->cap, p, start_count, r->overruns, r->abort_reason);
+	cap_gap_finish(r->gaps, &r->num_gaps, start_count);
+	p->num_gaps = r->num_gaps;
+	p->elapsed_us = r->ticks / SIM_TICKS_US;
+	p->achieved_rate = r->ticks ? (uint64_t)r->cap.sample_count * SIM_TICK_HZ / r->ticks : 0;
+	p->max_irq_off_us = r->max_off_us;
+	p->max_late_ns = r->max_late * (1000000000 / SIM_TICK_HZ);
+}
+
+#endif /* PANSIM_H_ */
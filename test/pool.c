@@ -0,0 +1,204 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Drive panpool.h as the driver's pool_get() and pool_put() do, with a
+ * fake allocator that counts what is live, through continuous mode
+ * captures of one size, growing and shrinking sizes, and random traffic
+ * for every pool_max.  Nothing may leak or be handed out twice, every
+ * buffer must be big enough, and the reuse counts must be what continuous
+ * mode expects.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "panpool.h"
+
+#define PAGE_SIZE	4096
+#define HELD		16
+
+static pan_pool_t pool;
+static int pool_max;
+static unsigned int pool_allocs, pool_reuses, live;
+static int failed;
+
+static void fail(const char *what, int n)
+{
+	if (!failed)
+		printf("FAIL: pool_max %d: %s at %d\n", pool_max, what, n);
+	failed = 1;
+}
+
+// The fake vmalloc_user(); the first word says how big it is
+static void *fake_alloc(uint32_t size)
+{
+	uint32_t *buf = malloc(size);
+
+	buf[0] = size;
+	live++;
+
+	return buf;
+}
+
+static void fake_free(void *buf)
+{
+	free(buf);
+	live--;
+}
+
+static void *pool_get(uint32_t size, uint32_t *got)
+{
+	void *buf = pan_pool_get(&pool, size, got);
+
+	if (buf) {
+		pool_reuses++;
+		return buf;
+	}
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	*got = size;
+	pool_allocs++;
+
+	return fake_alloc(size);
+}
+
+static void pool_put(void *buf, uint32_t size)
+{
+	if (buf && pan_pool_put(&pool, buf, size, pool_max) < 0)
+		fake_free(buf);
+}
+
+static void pool_drain(void)
+{
+	void *buf;
+
+	while ((buf = pan_pool_drain(&pool)) != NULL)
+		fake_free(buf);
+}
+
+static int pooled(void)
+{
+	int i, n = 0;
+
+	for (i = 0; i < PAN_POOL_SLOTS; i++)
+		n += pool.slot[i].buf != NULL;
+
+	return n;
+}
+
+static void reset(int max)
+{
+	pool_drain();
+	pool_max = max;
+	pool_allocs = pool_reuses = 0;
+}
+
+// Continuous mode: each capture is freed on close and the next one reuses it
+static void continuous(int max)
+{
+	uint32_t got;
+	void *buf;
+	int i;
+
+	reset(max);
+	for (i = 0; i < 100; i++) {
+		buf = pool_get(1 << 20, &got);
+		if (got < 1 << 20 || *(uint32_t *)buf != got)
+			fail("wrong size", i);
+		pool_put(buf, got);
+	}
+	if (pool_allocs != (max ? 1 : 100) || pool_reuses != (max ? 99 : 0))
+		fail("continuous mode didn't reuse", pool_reuses);
+}
+
+// A bigger capture can't use a smaller buffer, and a smaller one takes the best fit
+static void sizes(int max)
+{
+	uint32_t got, got2, got3;
+	void *small, *big, *mid;
+
+	reset(max);
+	small = pool_get(10000, &got);
+	big = pool_get(1 << 22, &got2);
+	pool_put(small, got);
+	pool_put(big, got2);
+	mid = pool_get(20000, &got3);
+	if (max >= 2 && mid != big)
+		fail("smaller buffer reused for a bigger capture", 0);
+	pool_put(mid, got3);
+	small = pool_get(100, &got);
+	if (max >= 1 && got != 12288)
+		fail("best fit not taken", got);
+	pool_put(small, got);
+}
+
+// Random gets and puts, with up to HELD captures held by files or mappings
+static void random_traffic(int max)
+{
+	void *held[HELD] = { NULL };
+	uint32_t held_size[HELD], want[HELD], got;
+	int i, j, k;
+
+	reset(max);
+	for (i = 0; i < 100000 && !failed; i++) {
+		j = random() % HELD;
+		if (held[j]) {
+			pool_put(held[j], held_size[j]);
+			held[j] = NULL;
+			continue;
+		}
+		want[j] = 1 + random() % (1 << (10 + random() % 12));
+		held[j] = pool_get(want[j], &held_size[j]);
+		got = held_size[j];
+		if (got < want[j] || *(uint32_t *)held[j] != got)
+			fail("buffer too small", i);
+		for (k = 0; k < HELD; k++)
+			if (k != j && held[k] == held[j])
+				fail("buffer handed out twice", i);
+		for (k = 0, got = 0; k < HELD; k++)
+			got += held[k] != NULL;
+		if (pooled() > max || live != got + pooled())
+			fail("leaked", i);
+	}
+	for (j = 0; j < HELD; j++)
+		pool_put(held[j], held_size[j]);
+	if (pooled() > max || live != pooled())
+		fail("leaked at the end", 0);
+}
+
+int main(void)
+{
+	int max;
+
+	srandom(1);
+	for (max = 0; max <= PAN_POOL_SLOTS + 1 && !failed; max++) {
+		continuous(max);
+		sizes(max);
+		random_traffic(max);
+		printf("pool_max %d: %u allocations, %u reuses\n", max, pool_allocs, pool_reuses);
+	}
+	pool_drain();
+	if (live)
+		fail("pool_drain() leaked", live);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
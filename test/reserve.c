@@ -0,0 +1,262 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Placing capture buffers in the reserved block with panreserve.h: a fixed
+ * run of gets and puts, then random ones checked against a page map, where
+ * every buffer must be aligned, inside the block, clear of the others and
+ * in the first hole big enough, a get may only fail when no hole is big
+ * enough, and pan_reserve_largest() must give the biggest hole.  The
+ * biggest buffers the drivers accept must fit in 32 bits.  Then a capture
+ * runs in a buffer carved out of a block, with the ring wrapping several
+ * times before the trigger, and must return the right samples without
+ * touching the memory either side.
+ */
+
+#include "pansim.h"
+#include "panreserve.h"
+
+#define PAGE		4096
+#define PAGES		256
+#define ROUNDS		100000
+#define RATE		1000000
+#define PERIOD		(SIM_TICK_HZ / RATE)
+#define RING		(1 << 18)
+#define TRIGGER_AT	(RING * 4 + 12345)
+#define MAX_RUN		(TRIGGER_AT + RING)
+#define COUNT_MASK	0xffffff
+#define TRIGGER_BIT	(1u << 31)
+
+static uint16_t owner[PAGES];			// First page + 1 of the buffer with each page, or 0
+static uint64_t sample_tick[MAX_RUN];
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+static void fixed(void)
+{
+	pan_reserve_t r;
+	uint32_t offset, got;
+	int i;
+
+	pan_reserve_init(&r, 100 * PAGE + 17, PAGE);
+	if (r.size != 100 * PAGE)
+		fail("size not rounded down", r.size);
+	if (pan_reserve_get(&r, 40 * PAGE - 5, &offset, &got) < 0 || offset != 0 || got != 40 * PAGE)
+		fail("first get", got);
+	if (pan_reserve_get(&r, 50 * PAGE, &offset, &got) < 0 || offset != 40 * PAGE)
+		fail("second get", offset);
+	if (pan_reserve_get(&r, 11 * PAGE, &offset, &got) == 0)
+		fail("got more than was left", offset);
+	if (pan_reserve_largest(&r) != 10 * PAGE)
+		fail("largest at the end", pan_reserve_largest(&r));
+	if (pan_reserve_put(&r, 0) < 0 || pan_reserve_largest(&r) != 40 * PAGE)
+		fail("largest after a put", pan_reserve_largest(&r));
+	if (pan_reserve_get(&r, 45 * PAGE, &offset, &got) == 0)
+		fail("got more than the biggest hole", offset);
+	if (pan_reserve_get(&r, 5 * PAGE, &offset, &got) < 0 || offset != 0)
+		fail("not in the first hole", offset);
+	if (pan_reserve_get(&r, 35 * PAGE, &offset, &got) < 0 || offset != 5 * PAGE)
+		fail("not filling the hole", offset);
+	if (pan_reserve_get(&r, 10 * PAGE, &offset, &got) < 0 || offset != 90 * PAGE)
+		fail("not at the end", offset);
+	if (pan_reserve_largest(&r) != 0)
+		fail("room when full", pan_reserve_largest(&r));
+	if (pan_reserve_put(&r, 12345) == 0)
+		fail("put a buffer that isn't there", 12345);
+	if (pan_reserve_get(&r, 0xffffffff, &offset, &got) == 0 ||
+			pan_reserve_get(&r, 0, &offset, &got) == 0)
+		fail("got a silly size", got);
+	while (r.used)
+		pan_reserve_put(&r, r.buf[0].offset);
+	for (i = 0; i < PAN_RESERVE_SLOTS; i++)
+		if (pan_reserve_get(&r, 1, &offset, &got) < 0 || offset != i * PAGE || got != PAGE)
+			fail("one page buffers", i);
+	if (pan_reserve_get(&r, 1, &offset, &got) == 0 || pan_reserve_largest(&r) != 0)
+		fail("more buffers than slots", r.used);
+}
+
+// The first hole of at least pages in the page map, or -1, and the biggest in *largest
+static int first_hole(uint32_t pages, uint32_t *largest)
+{
+	int i, run = 0, found = -1;
+
+	*largest = 0;
+	for (i = 0; i < PAGES; i++) {
+		run = owner[i] ? 0 : run + 1;
+		if (run > *largest)
+			*largest = run;
+		if (found < 0 && run >= pages)
+			found = i + 1 - pages;
+	}
+
+	return found;
+}
+
+static void random_runs(void)
+{
+	pan_reserve_t r;
+	uint32_t offset, got, bytes, largest, i, p;
+	int n, hole, gets = 0, misses = 0;
+
+	pan_reserve_init(&r, PAGES * PAGE, PAGE);
+	memset(owner, 0, sizeof(owner));
+	for (n = 0; n < ROUNDS && !failed; n++) {
+		if (r.used && random() % 2) {
+			i = random() % r.used;
+			offset = r.buf[i].offset;
+			for (p = 0; p < PAGES; p++)
+				if (owner[p] == offset / PAGE + 1)
+					owner[p] = 0;
+			if (pan_reserve_put(&r, offset) < 0)
+				fail("put refused", offset);
+			continue;
+		}
+		bytes = 1 + random() % (random() % 4 ? PAGES * PAGE / 8 : PAGES * PAGE);
+		hole = first_hole((bytes + PAGE - 1) / PAGE, &largest);
+		if (r.used == PAN_RESERVE_SLOTS) {
+			hole = -1;
+			largest = 0;
+		}
+		if (pan_reserve_largest(&r) != largest * PAGE)
+			fail("largest wrong", pan_reserve_largest(&r));
+		if (pan_reserve_get(&r, bytes, &offset, &got) < 0) {
+			if (hole >= 0)
+				fail("get failed with room", bytes);
+			misses++;
+			continue;
+		}
+		gets++;
+		if (hole < 0)
+			fail("get with no room", bytes);
+		else if (offset != hole * PAGE)
+			fail("not the first hole", offset);
+		else if (got < bytes || got - bytes >= PAGE || got % PAGE)
+			fail("size not rounded to pages", got);
+		for (p = offset / PAGE; p < (offset + got) / PAGE && !failed; p++) {
+			if (p >= PAGES || owner[p])
+				fail("buffers overlap", p);
+			else
+				owner[p] = offset / PAGE + 1;
+		}
+	}
+	printf("%d random gets and puts: %d placed, %d didn't fit\n", ROUNDS, gets, misses);
+}
+
+// The biggest buffers the drivers accept, as sample_bytes() and alloc_bytes() size them
+static void limits(void)
+{
+	uint64_t words = (uint64_t)PAN_MAX_SAMPLES * sizeof(uint32_t);
+	uint64_t glitch = ((words + 3) & ~3) + PAN_MAX_SAMPLES;
+	uint64_t trans = (uint64_t)PAN_MAX_RECORDS * sizeof(pantrans_t) +
+			PAN_MAX_GAPS * sizeof(pangap_t);
+	uint64_t count = (uint64_t)PAN_MAX_RECORDS * PAN_COUNT_BYTES(MAX_CHANNELS);
+
+	if (words + PAN_MAX_GAPS * sizeof(pangap_t) > 0xffffffff || glitch > 0xffffffff ||
+			trans > 0xffffffff || count > 0xffffffff)
+		fail("biggest buffer over 32 bits", 0);
+}
+
+/*
+ * A whole word capture of RING samples in a buffer from a block with its
+ * first page taken, triggering on GPIO 31 after the ring has wrapped a few
+ * times.  The levels count sample periods, so every sample returned can
+ * be checked against the time it was taken.
+ */
+static void wrap(void)
+{
+	static pan_reserve_t r;
+	uint32_t block_bytes = (RING + 2) * sizeof(uint32_t) * 2, offset, got, i, k, start;
+	uint8_t *block = malloc(block_bytes);
+	uint32_t *buffer;
+	struct sim_result_s res;
+	panctl_t ctl;
+	uint64_t t;
+
+	if (!block) {
+		perror("malloc");
+		exit(1);
+	}
+	memset(block, 0xa5, block_bytes);
+	pan_reserve_init(&r, block_bytes, PAGE);
+	if (pan_reserve_get(&r, PAGE, &offset, &got) < 0 ||
+			pan_reserve_get(&r, RING * sizeof(uint32_t), &offset, &got) < 0) {
+		fail("no room for the ring", r.size);
+		free(block);
+		return;
+	}
+	buffer = (uint32_t *)(block + offset);
+
+	sim_clear();
+	for (k = 0; k < MAX_RUN; k++) {
+		t = (uint64_t)k * PERIOD + PERIOD / 2;
+		sim_edge(t, ((k + 1) & COUNT_MASK) | (k + 1 >= TRIGGER_AT ? TRIGGER_BIT : 0));
+	}
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = COUNT_MASK | TRIGGER_BIT;
+	ctl.sample_rate = RATE;
+	ctl.num_samples = RING;
+	ctl.trigger_point = 1;
+	ctl.timeout_ms = MAX_RUN / (RATE / 1000) + 1;
+	ctl.trigger[0].enabled = 1;
+	ctl.trigger[0].min_samples = 1;
+	ctl.trigger[0].mask = TRIGGER_BIT;
+	ctl.trigger[0].value = TRIGGER_BIT;
+	if (sim_capture(&ctl, buffer, got, &res, sample_tick, MAX_RUN) < 0) {
+		fail("capture refused", 0);
+	} else if (res.cap.sample_count > MAX_RUN) {
+		fail("ran too long", res.cap.sample_count);
+	} else {
+		start = cap_oldest(&res.cap);
+		sim_report(&ctl, &res);
+		if (ctl.abort_reason != PAN_ABORT_NONE || ctl.trigger_index != RING / 2 - 1)
+			fail("trigger not in the middle", ctl.trigger_index);
+		if (res.cap.sample_count < RING * 4)
+			fail("ring didn't wrap", res.cap.sample_count);
+		for (i = 0; i < RING && !failed; i++) {
+			k = (ctl.first_data_index + i) % RING;
+			if (buffer[k] != sim_levels_at(sample_tick[start + i]))
+				fail("wrong sample", start + i);
+		}
+		for (i = 0; i < block_bytes && !failed; i++)
+			if ((i < offset || i >= offset + got) && block[i] != 0xa5)
+				fail("wrote outside the buffer", i);
+		printf("%u samples in a ring of %u at offset %u, trigger at %u\n",
+				res.cap.sample_count, RING, offset, res.cap.trigger_count);
+	}
+	free(block);
+}
+
+int main(void)
+{
+	srandom(1);
+	fixed();
+	random_runs();
+	limits();
+	wrap();
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
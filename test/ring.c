@@ -0,0 +1,169 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The FIQ engine's ring, between a simulated timer tick that puts a sample
+ * in it each period, as the FIQ handler does, and a host copy of the loop
+ * in capture_ring() that sleeps and drains it.  Each sample is its own
+ * sequence number, so anything read out of order, or after it was
+ * overwritten, shows.  Now and then the consumer is held up for longer
+ * than the ring lasts, and what it loses must be counted exactly, filled
+ * in and recorded as a gap.  The producer keeps ticking while the consumer
+ * reads, as the FIQ does.
+ */
+
+#include "pansim.h"
+#include "panring.h"
+
+#define SAMPLES		200000
+#define GET_TICKS	10			// What pan_ring_get() and storing a sample cost
+
+static uint32_t fiq_data[PAN_RING_SAMPLES];
+static volatile uint32_t fiq_head;
+static uint32_t words[SAMPLES];
+static uint64_t next_fiq, period;
+static uint32_t seq;
+static int failed;
+
+static void fail(uint32_t rate, const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %uHz: %s, %u\n", rate, what, n);
+	failed = 1;
+}
+
+// Let time pass, with the timer ticking
+static void run_for(uint64_t ticks)
+{
+	uint64_t end = sim_time + ticks;
+
+	while (next_fiq <= end) {
+		pan_ring_put(fiq_data, &fiq_head, seq++);
+		next_fiq += period;
+	}
+	sim_time = end;
+}
+
+/*
+ * Capture SAMPLES at rate, with the consumer held up for hold_us once in
+ * every hold_every wakeups.  Returns the samples lost.
+ */
+static uint32_t run(uint32_t rate, int hold_every, uint32_t hold_us)
+{
+	panctl_t ctl;
+	struct cap_s cap;
+	static pan_trig_t trig;
+	pan_ring_t ring;
+	pangap_t gaps[PAN_MAX_GAPS];
+	uint32_t num_gaps = 0, n, lost, total_lost = 0, sample = 0, expect = 0, i, g, first, start;
+	int done = 0, wakeups = 0;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = 0xffffffff;
+	ctl.sample_rate = rate;
+	ctl.num_samples = SAMPLES;
+	pan_trig_compile(&trig, &ctl);
+	cap_init(&cap, &ctl, &trig, 0, words, sizeof(words), NULL, NULL);
+	period = SIM_TICK_HZ / rate;
+	sim_time = 0;
+	next_fiq = period;
+	fiq_head = 0;
+	seq = 0;
+	ring.head = &fiq_head;
+	ring.data = fiq_data;
+	ring.tail = 0;
+
+	while (!done) {
+		n = pan_ring_avail(&ring, &lost);
+		if (lost) {
+			cap_gap_forget(gaps, &num_gaps, cap_oldest(&cap));
+			cap_gap_add(gaps, &num_gaps, cap.sample_count, lost,
+					(uint64_t)lost * 1000000 / rate);
+			total_lost += lost;
+			expect += lost;
+			done = cap_fill(&cap, sample, lost);
+		}
+		while (n-- && !done) {
+			sample = pan_ring_get(&ring);
+			if (sample != expect)
+				fail(rate, "read the wrong sample", sample);
+			expect++;
+			run_for(GET_TICKS);
+			cap_store(&cap, sample);
+			done = cap_trigger(&cap, &trig, sample);
+		}
+		if (fiq_head - ring.tail > PAN_RING_SAMPLES)
+			fail(rate, "producer lapped the consumer mid-read", fiq_head - ring.tail);
+		// usleep_range(500, 1000), or scheduled out for longer
+		if (hold_every && ++wakeups % hold_every == 0)
+			run_for((uint64_t)hold_us * SIM_TICKS_US);
+		else
+			run_for((500 + random() % 500) * SIM_TICKS_US);
+	}
+	if (failed)
+		return total_lost;
+
+	// Whatever was lost is filled with the sample before and in a gap
+	start = cap.sample_count - SAMPLES;
+	first = cap.buf_ptr - cap.buf_start;
+	cap_gap_finish(gaps, &num_gaps, start);
+	for (i = 0, g = 0, sample = words[first]; i < SAMPLES && !failed; i++) {
+		uint32_t w = words[(first + i) % SAMPLES];
+
+		while (g < num_gaps && gaps[g].sample + gaps[g].missed <= i)
+			g++;
+		if (g < num_gaps && gaps[g].sample <= i) {
+			if (w != sample)
+				fail(rate, "gap not filled with the sample before", i);
+		} else if (w != start + i) {
+			fail(rate, "sample out of place", i);
+		} else {
+			sample = w;
+		}
+	}
+	printf("%7uHz, held %6uus every %2d wakeups: %7u lost in %3u gaps\n", rate, hold_us,
+			hold_every, total_lost, num_gaps);
+
+	return total_lost;
+}
+
+int main(void)
+{
+	static const uint32_t rates[] = { 100000, 1000000, 2000000, 5000000 };
+	uint32_t usable_us;
+	int i;
+
+	srandom(1);
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]) && !failed; i++) {
+		usable_us = (uint64_t)(PAN_RING_SAMPLES - PAN_RING_SLACK) * 1000000 / rates[i];
+		// Wakeups well within the ring lose nothing
+		if (run(rates[i], 0, 0))
+			fail(rates[i], "lost samples with prompt wakeups", 0);
+		if (run(rates[i], 5, usable_us * 9 / 10))
+			fail(rates[i], "lost samples just within the ring", 0);
+		// Held up past it, each hold loses about the excess
+		if (run(rates[i], 5, usable_us * 2) == 0)
+			fail(rates[i], "nothing lost past the ring", 0);
+		run(rates[i], 2, usable_us * 20);
+	}
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
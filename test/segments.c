@@ -0,0 +1,158 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Multi-segment captures on simulated registers, finished as the driver
+ * finishes them.  GPIO 31 pulses high for a few samples at a time, far
+ * enough apart that each pulse fills a segment, and the other levels
+ * count sample periods.  Each segment must trigger on its own pulse, with
+ * the trigger where trigger_point puts it in the segment's ring, and the
+ * ring read from its first_data_index must give back the samples in
+ * order, each segment starting after the one before ended.  With fewer
+ * pulses than segments the capture times out, and the segment it stopped
+ * in must be recorded with no trigger.
+ */
+
+#include "pansim.h"
+
+#define SEGMENTS	4
+#define SEG_SAMPLES	2000
+#define RATE		1000000
+#define PERIOD		(SIM_TICK_HZ / RATE)
+#define PULSE		3
+#define FIRST_PULSE	3000
+#define MAX_RUN		(FIRST_PULSE + SEGMENTS * 5000 + 20000)
+#define COUNT_MASK	0xfffff
+#define TRIGGER_BIT	(1u << 31)
+
+static uint32_t words[SEGMENTS * SEG_SAMPLES];
+static uint64_t sample_tick[MAX_RUN];
+static uint32_t spacing;
+static int failed;
+
+static void fail(const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %s, %u\n", what, n);
+	failed = 1;
+}
+
+// Sample k is high on GPIO 31 if it is in one of pulses pulses
+static int pulse_at(uint32_t k, int pulses)
+{
+	return k >= FIRST_PULSE && (k - FIRST_PULSE) / spacing < pulses &&
+			(k - FIRST_PULSE) % spacing < PULSE;
+}
+
+static void run(uint32_t trigger_point, uint32_t gap, int pulses)
+{
+	panctl_t ctl;
+	struct sim_result_s r;
+	panseg_t *seg;
+	uint32_t k, i, j, pre, expect, oldest, end = 0;
+	uint64_t t;
+	int s;
+
+	spacing = gap;
+	sim_clear();
+	for (k = 0; k < MAX_RUN; k++) {
+		t = (uint64_t)k * PERIOD + PERIOD / 2;
+		sim_edge(t, ((k + 1) & COUNT_MASK) | (pulse_at(k + 1, pulses) ? TRIGGER_BIT : 0));
+	}
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = COUNT_MASK | TRIGGER_BIT;
+	ctl.sample_rate = RATE;
+	ctl.num_samples = SEGMENTS * SEG_SAMPLES;
+	ctl.num_segments = SEGMENTS;
+	ctl.trigger_point = trigger_point;
+	ctl.timeout_ms = (MAX_RUN - 10000) / (RATE / 1000);
+	ctl.trigger[0].enabled = 1;
+	ctl.trigger[0].min_samples = 1;
+	ctl.trigger[0].mask = TRIGGER_BIT;
+	ctl.trigger[0].value = TRIGGER_BIT;
+	if (sim_capture(&ctl, words, sizeof(words), &r, sample_tick, MAX_RUN) < 0) {
+		fail("capture refused", 0);
+		return;
+	}
+	if (r.cap.sample_count > MAX_RUN) {
+		fail("ran too long", r.cap.sample_count);
+		return;
+	}
+	cap_seg_finish(&r.cap, &ctl);
+	if (ctl.segments_filled == 0 || ctl.segments_filled > SEGMENTS ||
+			(ctl.segments_filled < SEGMENTS && r.abort_reason != PAN_ABORT_TIMEOUT))
+		fail("wrong number of segments", ctl.segments_filled);
+	if (ctl.first_data_index != 0 || ctl.trigger_index != r.cap.segments[0].trigger_index)
+		fail("header not from the first segment", ctl.trigger_index);
+
+	pre = SEG_SAMPLES - (trigger_point == 0 ? SEG_SAMPLES * 19 / 20 :
+			trigger_point == 1 ? SEG_SAMPLES / 2 : SEG_SAMPLES / 20);
+	for (s = 0; s < ctl.segments_filled && !failed; s++) {
+		seg = &r.cap.segments[s];
+		// The first high sample once the pre-trigger samples are in
+		for (expect = end + pre; expect < r.cap.sample_count && !pulse_at(expect, pulses);
+				expect++)
+			;
+		if (expect == r.cap.sample_count) {
+			if (s != ctl.segments_filled - 1 || r.abort_reason != PAN_ABORT_TIMEOUT)
+				fail("no pulse for a segment", s);
+			else if (seg->trigger_sample != PAN_NO_TRIGGER ||
+					seg->trigger_index != PAN_NO_TRIGGER)
+				fail("timed out segment has a trigger", s);
+			break;
+		}
+		if (seg->trigger_sample != expect)
+			fail("trigger on the wrong sample", seg->trigger_sample);
+		else if (seg->trigger_index != pre - 1)
+			fail("trigger in the wrong place", seg->trigger_index);
+		if (seg->first_data_index >= SEG_SAMPLES)
+			fail("first_data_index outside the ring", seg->first_data_index);
+		oldest = seg->trigger_sample - seg->trigger_index;
+		if (oldest < end)
+			fail("segment overlaps the one before", s);
+		for (j = 0; j < SEG_SAMPLES && !failed; j++) {
+			i = s * SEG_SAMPLES + (seg->first_data_index + j) % SEG_SAMPLES;
+			if (words[i] != sim_levels_at(sample_tick[oldest + j]))
+				fail("wrong sample in the segment", oldest + j);
+		}
+		end = oldest + SEG_SAMPLES;
+	}
+	// The segment a timeout stopped in is recorded too
+	if (r.abort_reason == PAN_ABORT_TIMEOUT && ctl.segments_filled &&
+			r.cap.segments[ctl.segments_filled - 1].trigger_sample != PAN_NO_TRIGGER)
+		fail("timed out segment not recorded", ctl.segments_filled);
+	printf("point %u, %d pulses %4u apart: %u segments filled, triggers at", trigger_point,
+			pulses, gap, ctl.segments_filled);
+	for (s = 0; s < ctl.segments_filled; s++)
+		printf(" %d", (int)r.cap.segments[s].trigger_sample);
+	printf("\n");
+}
+
+int main(void)
+{
+	run(1, 5000, SEGMENTS);
+	run(0, 5000, SEGMENTS);
+	run(2, 5000, SEGMENTS);
+	run(1, 700, 8);
+	run(1, 5000, 2);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
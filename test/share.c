@@ -0,0 +1,251 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The shared capture references in panshare.h, used as pandriver.c uses
+ * them: sessions capturing, attaching to last_capture, mapping their
+ * capture and closing, with the mappings outliving the file.  First one
+ * sequence step by step, checking each capture is freed exactly when the
+ * last holder lets go; then threads doing the same at random, checking
+ * no capture is seen after it was freed, none is freed twice, and all of
+ * them are freed once everyone has gone.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "panshare.h"
+
+#define MAX_CAPTURES	200000
+#define WORDS			16
+#define THREADS			4
+#define MAPS			4
+#define OPS				100000
+
+static pan_capture_t *captures[MAX_CAPTURES];
+static int freed[MAX_CAPTURES];
+static int num_captures, num_freed;
+static int failed;
+
+static pthread_mutex_t pan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pan_capture_t *last_capture;
+static int hw_owned;
+
+static void fail(const char *what, int n)
+{
+	if (!failed)
+		printf("FAIL: %s, %d\n", what, n);
+	failed = 1;
+}
+
+// Freed captures are poisoned rather than freed, so a late look shows
+static void capture_put(pan_capture_t *c)
+{
+	int id;
+
+	if (!pan_capture_put(c))
+		return;
+	id = c->hdr.num_records;
+	if (__atomic_exchange_n(&freed[id], 1, __ATOMIC_RELAXED))
+		fail("freed twice", id);
+	memset(c->buffer, 0xff, WORDS * sizeof(uint32_t));
+	c->hdr.num_records = ~0;
+	__atomic_add_fetch(&num_freed, 1, __ATOMIC_RELAXED);
+}
+
+static void check(const pan_capture_t *c)
+{
+	int i, id = c->hdr.num_records;
+
+	if (id < 0 || id >= num_captures || freed[id])
+		fail("used after it was freed", id);
+	for (i = 0; i < WORDS; i++)
+		if (c->buffer[i] != id)
+			fail("buffer overwritten", id);
+}
+
+struct session_s {
+	pan_capture_t	*cap;
+	pan_capture_t	*maps[MAPS];
+	int				num_maps;
+};
+
+// session_capture(): the session gets the only reference, and last_capture another
+static int session_capture(struct session_s *s)
+{
+	pan_capture_t *c, *old;
+	panctl_t hdr;
+	int i;
+
+	pthread_mutex_lock(&pan_lock);
+	if (hw_owned || num_captures == MAX_CAPTURES) {
+		pthread_mutex_unlock(&pan_lock);
+		return -1;
+	}
+	hw_owned = 1;
+	pthread_mutex_unlock(&pan_lock);
+
+	c = malloc(sizeof(*c));
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.num_records = num_captures;
+	pan_capture_init(c, &hdr, malloc(WORDS * sizeof(uint32_t)), WORDS * sizeof(uint32_t));
+	for (i = 0; i < WORDS; i++)
+		c->buffer[i] = num_captures;
+	captures[num_captures] = c;
+	__atomic_add_fetch(&num_captures, 1, __ATOMIC_RELEASE);
+
+	capture_put(s->cap);
+	s->cap = c;
+	pthread_mutex_lock(&pan_lock);
+	old = pan_capture_swap(&last_capture, c);
+	hw_owned = 0;
+	pthread_mutex_unlock(&pan_lock);
+	capture_put(old);
+
+	return c->hdr.num_records;
+}
+
+// PAN_IOC_ATTACH
+static void session_attach(struct session_s *s)
+{
+	pan_capture_t *c;
+
+	pthread_mutex_lock(&pan_lock);
+	c = last_capture ? pan_capture_get(last_capture) : NULL;
+	pthread_mutex_unlock(&pan_lock);
+	if (c) {
+		capture_put(s->cap);
+		s->cap = c;
+	}
+}
+
+// dev_mmap(); the mapping lasts until unmapped, whatever the file does
+static void session_map(struct session_s *s)
+{
+	if (s->cap && s->num_maps < MAPS)
+		s->maps[s->num_maps++] = pan_capture_get(s->cap);
+}
+
+static void session_unmap(struct session_s *s, int i)
+{
+	capture_put(s->maps[i]);
+	s->maps[i] = s->maps[--s->num_maps];
+}
+
+// dev_close()
+static void session_close(struct session_s *s)
+{
+	capture_put(s->cap);
+	s->cap = NULL;
+}
+
+static void expect_freed(int id, int yes, const char *what)
+{
+	if (freed[id] != yes)
+		fail(what, id);
+}
+
+static void in_order(void)
+{
+	struct session_s a = { 0 }, b = { 0 };
+	int first, second;
+
+	first = session_capture(&a);
+	session_attach(&b);
+	if (b.cap != a.cap)
+		fail("attach didn't find the last capture", first);
+	session_map(&b);
+	session_close(&a);
+	expect_freed(first, 0, "freed while attached");
+	// A new capture replaces last_capture, but b still reads and maps the first
+	second = session_capture(&a);
+	session_close(&b);
+	expect_freed(first, 0, "freed while mapped");
+	check(b.maps[0]);
+	session_unmap(&b, 0);
+	expect_freed(first, 1, "not freed with no one left");
+	session_close(&a);
+	expect_freed(second, 0, "freed while last_capture");
+	capture_put(pan_capture_swap(&last_capture, NULL));
+	expect_freed(second, 1, "not freed when last_capture let go");
+}
+
+static void *user(void *arg)
+{
+	struct session_s s = { 0 };
+	unsigned int seed = (uintptr_t)arg;
+	int i, n;
+
+	for (n = 0; n < OPS && !failed; n++) {
+		switch (rand_r(&seed) % 6) {
+		case 0:
+			session_capture(&s);
+			break;
+		case 1:
+			session_attach(&s);
+			break;
+		case 2:
+			session_map(&s);
+			break;
+		case 3:
+			if (s.num_maps)
+				session_unmap(&s, rand_r(&seed) % s.num_maps);
+			break;
+		case 4:
+			session_close(&s);
+			break;
+		default:
+			if (s.cap)
+				check(s.cap);
+			for (i = 0; i < s.num_maps; i++)
+				check(s.maps[i]);
+		}
+	}
+	session_close(&s);
+	while (s.num_maps)
+		session_unmap(&s, 0);
+
+	return NULL;
+}
+
+int main(void)
+{
+	pthread_t t[THREADS];
+	int i;
+
+	in_order();
+	for (i = 0; i < THREADS; i++)
+		pthread_create(&t[i], NULL, user, (void *)(uintptr_t)(i + 1));
+	for (i = 0; i < THREADS; i++)
+		pthread_join(t[i], NULL);
+	capture_put(pan_capture_swap(&last_capture, NULL));
+	if (num_freed != num_captures)
+		fail("captures never freed", num_captures - num_freed);
+	printf("%d captures shared by %d threads\n", num_captures, THREADS);
+	for (i = 0; i < num_captures; i++) {
+		free(captures[i]->buffer);
+		free(captures[i]);
+	}
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Check the capture statistics in the header against simulated registers
+ * that hold up counter reads, as bus stalls and FIQs do, at random.  The
+ * overruns and latest sample must match what the time each sample was
+ * taken says, the achieved rate must show the loop catching up, and the
+ * trigger index and abort reason must be right with and without a trigger.
+ *
+ * show_stats() in the UI formats these straight in to GTK entries, so how
+ * they read on screen is left to a look at the UI.
+ */
+
+#include "pansim.h"
+
+#define SAMPLES		20000
+
+static uint32_t words[SAMPLES];
+static uint64_t sample_tick[SAMPLES * 4];
+static int failed;
+
+static void fail(uint32_t rate, const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %uHz: %s, %u\n", rate, what, n);
+	failed = 1;
+}
+
+/*
+ * A capture at rate, with stalls of up to max_stall ticks held up reads,
+ * and a trigger on GPIO 31 going high at trigger_us, or never if 0.
+ */
+static void run(uint32_t rate, int stalls, uint32_t max_stall, uint32_t trigger_us)
+{
+	panctl_t ctl;
+	struct sim_result_s r;
+	uint32_t period = SIM_TICK_HZ / rate, base = 0xfff00000;
+	uint32_t late, max_late = 0, i, n;
+	uint64_t t = 0;
+	int overruns = 0;
+
+	sim_clear();
+	if (trigger_us)
+		sim_edge((uint64_t)trigger_us * SIM_TICKS_US, 1u << 31);
+	for (i = 0; i < stalls; i++) {
+		t += 1 + random() % (SAMPLES * 2 / stalls * period);
+		sim_stall_at(t, 1 + random() % max_stall);
+	}
+	sim_rewind(base);
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = 0xff;
+	ctl.sample_rate = rate;
+	ctl.num_samples = SAMPLES;
+	ctl.trigger_point = 1;
+	ctl.timeout_ms = SAMPLES * 3 / (rate / 1000);
+	ctl.trigger[0].enabled = 1;
+	ctl.trigger[0].mask = 1u << 31;
+	ctl.trigger[0].value = 1u << 31;
+	ctl.trigger[0].min_samples = 1;
+	if (sim_capture(&ctl, words, sizeof(words), &r, sample_tick, SAMPLES * 4) < 0) {
+		fail(rate, "capture refused", 0);
+		return;
+	}
+	sim_report(&ctl, &r);
+	n = r.cap.sample_count;
+	if (n > SAMPLES * 4) {
+		fail(rate, "ran too long", n);
+		return;
+	}
+
+	// The counter read before each sample against when it was due, the
+	// first a period after the read that started the capture
+	for (i = 0; i < n; i++) {
+		late = (uint32_t)sample_tick[i] + base - (base + sim_read_ticks + (i + 1) * period);
+		if (late >= period)
+			overruns++;
+		if (late > max_late)
+			max_late = late;
+	}
+	if (ctl.overruns != overruns)
+		fail(rate, "overruns miscounted", ctl.overruns);
+	if (ctl.max_late_ns != max_late * 4)
+		fail(rate, "wrong latest sample", ctl.max_late_ns);
+	if (!stalls && ctl.max_late_ns > sim_read_ticks * 4)
+		fail(rate, "late without stalls", ctl.max_late_ns);
+	if (max_stall >= period * 2 && stalls && !ctl.overruns)
+		fail(rate, "stalls didn't make samples late", 0);
+	// Late samples are taken back to back until the loop catches up
+	if (ctl.achieved_rate < rate - rate / 1000 || ctl.achieved_rate > rate + rate / 1000)
+		fail(rate, "achieved rate off", ctl.achieved_rate);
+	if (ctl.elapsed_us != r.ticks / SIM_TICKS_US)
+		fail(rate, "elapsed time wrong", ctl.elapsed_us);
+
+	if (trigger_us) {
+		// Half the samples after the trigger, and the rest up to it
+		if (ctl.abort_reason != PAN_ABORT_NONE || ctl.trigger_index != SAMPLES / 2 - 1)
+			fail(rate, "trigger not in the middle", ctl.trigger_index);
+		// Fires on the sample after the one that saw the edge
+		i = r.cap.trigger_count - 1;
+		if (sample_tick[i] < (uint64_t)trigger_us * SIM_TICKS_US ||
+				(i && sample_tick[i - 1] >= (uint64_t)trigger_us * SIM_TICKS_US))
+			fail(rate, "trigger on the wrong sample", i);
+	} else if (ctl.abort_reason != PAN_ABORT_TIMEOUT || ctl.trigger_index != PAN_NO_TRIGGER) {
+		fail(rate, "no timeout", ctl.abort_reason);
+	} else if (ctl.elapsed_us < ctl.timeout_ms * 1000 || ctl.elapsed_us > ctl.timeout_ms * 1001) {
+		fail(rate, "timed out at the wrong time", ctl.elapsed_us);
+	}
+	printf("%7uHz, %2d stalls of up to %6u ticks: %5u late, %8.3fus max, %uHz achieved%s\n",
+			rate, stalls, max_stall, ctl.overruns, ctl.max_late_ns / 1000.0, ctl.achieved_rate,
+			trigger_us ? "" : ", timed out");
+}
+
+int main(void)
+{
+	static const uint32_t rates[] = { 100000, 1000000, 5000000 };
+	int i;
+
+	srandom(1);
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]) && !failed; i++) {
+		uint32_t trigger_us = SAMPLES * 2 / (rates[i] / 1000000.0);
+
+		run(rates[i], 0, 1, trigger_us);
+		run(rates[i], 10, SIM_TICK_HZ / rates[i] / 2, trigger_us);
+		run(rates[i], 10, SIM_TICK_HZ / rates[i] * 10, trigger_us);
+		run(rates[i], 40, SIM_TICK_HZ / rates[i] * 200, trigger_us);
+		run(rates[i], 10, SIM_TICK_HZ / rates[i] * 10, 0);
+	}
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,169 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Stream mode's ring, between a simulated sample source running at the
+ * target rate and a host copy of the reader's side: live_wait() waking on
+ * the 100Hz tick, and read() and splice() copying runs off the tail while
+ * the source keeps going.  Each sample is its own sequence number, so the
+ * stream read must be those in order, with a jump exactly where an
+ * overflow was counted, and never a sample that was overwritten mid-copy.
+ * A reader that stalls for longer than the ring lasts loses samples, and
+ * one that keeps up loses none, up to PAN_RING_MAX_RATE for the 100Hz tick.
+ */
+
+#include "pansim.h"
+#include "panring.h"
+
+#define PAGE_SAMPLES	1024		// A 4K page of them, for splice()
+#define PIPE_PAGES		16
+#define JIFFY_US		10000
+
+static uint32_t fiq_data[PAN_RING_SAMPLES];
+static volatile uint32_t fiq_head;
+static uint32_t buf[PIPE_PAGES * PAGE_SAMPLES];
+static uint64_t next_fiq, period;
+static uint32_t seq;
+static int failed;
+
+static void fail(uint32_t rate, const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: %uHz: %s, %u\n", rate, what, n);
+	failed = 1;
+}
+
+// Let time pass, with the source running
+static void run_for(uint64_t ticks)
+{
+	uint64_t end = sim_time + ticks;
+
+	while (next_fiq <= end) {
+		pan_ring_put(fiq_data, &fiq_head, seq++);
+		next_fiq += period;
+	}
+	sim_time = end;
+}
+
+// live_wait(): block until the 100Hz tick finds samples; returns how many
+static uint32_t live_wait(pan_ring_t *r, uint32_t *overruns)
+{
+	uint32_t n, lost;
+
+	for (;;) {
+		n = pan_ring_avail(r, &lost);
+		*overruns += lost;
+		if (n)
+			return n;
+		run_for((JIFFY_US - (uint32_t)(sim_time / SIM_TICKS_US) % JIFFY_US) * SIM_TICKS_US);
+	}
+}
+
+// Copy n off the tail in runs, as read() and splice() do, a tick a sample
+static void copy_out(pan_ring_t *r, uint32_t *dst, uint32_t n)
+{
+	uint32_t run, i;
+
+	while (n) {
+		run = pan_ring_run(r, n);
+		for (i = 0; i < run; i++) {
+			dst[i] = r->data[(r->tail + i) & PAN_RING_MASK];
+			if ((i & 63) == 63)
+				run_for(64);
+		}
+		r->tail += run;
+		dst += run;
+		n -= run;
+	}
+}
+
+/*
+ * Stream for seconds at rate, stalling for stall_us once every stall_every
+ * reads.  Returns the samples lost.
+ */
+static uint32_t run(uint32_t rate, uint32_t seconds, int stall_every, uint32_t stall_us)
+{
+	pan_ring_t ring;
+	uint32_t overruns = 0, counted = 0, expect = 0, got = 0, n, i, reads = 0;
+	uint64_t end;
+
+	period = SIM_TICK_HZ / rate;
+	sim_time = 0;
+	next_fiq = period;
+	fiq_head = 0;
+	seq = 0;
+	ring.head = &fiq_head;
+	ring.data = fiq_data;
+	ring.tail = 0;
+	end = (uint64_t)seconds * SIM_TICK_HZ;
+
+	while (sim_time < end && !failed) {
+		n = live_wait(&ring, &overruns);
+		expect += overruns - counted;
+		counted = overruns;
+		// read() of up to 256KB, or splice() of up to a pipe's worth of pages
+		if (random() & 1)
+			i = 1 + random() % (sizeof(buf) / sizeof(uint32_t));
+		else
+			i = PAGE_SAMPLES * (1 + random() % PIPE_PAGES);
+		if (n > i)
+			n = i;
+		copy_out(&ring, buf, n);
+		for (i = 0; i < n; i++)
+			if (buf[i] != expect++)
+				fail(rate, "wrong sample read", buf[i]);
+		got += n;
+		// Writing it out to disk, or held up for longer
+		if (stall_every && ++reads % stall_every == 0)
+			run_for((uint64_t)stall_us * SIM_TICKS_US);
+		else
+			run_for((uint64_t)(random() % 2000) * SIM_TICKS_US);
+	}
+	if (got + overruns != ring.tail)
+		fail(rate, "samples unaccounted for", ring.tail - got - overruns);
+	if (seq != sim_time / period || seq < (uint64_t)rate * seconds)
+		fail(rate, "source ran at the wrong rate", seq);
+	printf("%7uHz for %us, stalled %7uus every %3d reads: %9u read, %8u lost\n", rate, seconds,
+			stall_us, stall_every, got, overruns);
+
+	return overruns;
+}
+
+int main(void)
+{
+	const uint32_t rates[] = { 100000, 1000000, PAN_RING_MAX_RATE(100) };
+	uint32_t usable_us;
+	int i;
+
+	srandom(1);
+	for (i = 0; i < sizeof(rates) / sizeof(rates[0]) && !failed; i++) {
+		usable_us = (uint64_t)(PAN_RING_SAMPLES - PAN_RING_SLACK) * 1000000 / rates[i];
+		if (run(rates[i], 10, 0, 0))
+			fail(rates[i], "lost samples keeping up", 0);
+		if (run(rates[i], 5, 50, usable_us * 2) == 0)
+			fail(rates[i], "nothing lost stalling past the ring", 0);
+	}
+	// Why live_start() refuses faster rates: a reader woken a tick late loses some
+	if (!failed && run(PAN_RING_MAX_RATE(100) * 2, 10, 0, 0) == 0)
+		fail(PAN_RING_MAX_RATE(100) * 2, "nothing lost past PAN_RING_MAX_RATE", 0);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}
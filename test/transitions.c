@@ -0,0 +1,146 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Run the transitions-only capture on simulated registers fed from random
+ * waveforms, or the waveform file given, and check what cap_trans_finish()
+ * makes of the record ring against the levels each sample should have
+ * seen.  Small rings overflow, and the window must then start at the
+ * oldest record kept, with the trigger still on the right sample.
+ */
+
+#include "pansim.h"
+
+#define RATE		1000000
+#define MAX_SAMPLES	50000
+
+static uint64_t sample_tick[MAX_SAMPLES * 3];
+static pantrans_t rec[MAX_SAMPLES];
+static int failed;
+
+static void fail(int run, const char *what, uint32_t n)
+{
+	if (!failed)
+		printf("FAIL: run %d: %s at %u\n", run, what, n);
+	failed = 1;
+}
+
+static uint32_t run_one(int run, uint32_t mask, uint32_t samples, uint32_t records,
+		int trigger_point, uint32_t tmask)
+{
+	panctl_t ctl;
+	struct sim_result_s r;
+	uint32_t total, kept, num, start, i, j, levels;
+	uint32_t tvalue = (uint32_t)random() & tmask;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.channel_mask = mask;
+	ctl.sample_rate = RATE;
+	ctl.num_samples = samples;
+	ctl.num_records = records;
+	ctl.trigger_point = trigger_point;
+	ctl.timeout_ms = 100;
+	ctl.flags = PAN_FLAG_TRANSITIONS;
+	if (tmask) {
+		ctl.trigger[0].enabled = 1;
+		ctl.trigger[0].mask = tmask;
+		ctl.trigger[0].value = tvalue;
+		ctl.trigger[0].min_samples = 1;
+	}
+	sim_rewind(0xffffffff - (uint32_t)random() % 1000000);
+	if (sim_capture(&ctl, (uint32_t *)rec, records * sizeof(pantrans_t), &r,
+			sample_tick, MAX_SAMPLES * 3) < 0) {
+		fail(run, "trigger didn't compile", 0);
+		return 0;
+	}
+	total = r.cap.sample_count;
+	if (total > MAX_SAMPLES * 3) {
+		fail(run, "ran too long", total);
+		return 0;
+	}
+	kept = samples;
+	num = cap_trans_finish(rec, records, r.cap.rec_ptr - r.cap.rec_start, r.cap.wrapped,
+			total, &kept);
+	start = total - kept;
+
+	// The whole window, unless the ring overflowed and every record is kept
+	if (kept > samples || kept > total)
+		fail(run, "window too big", kept);
+	if (kept < samples && kept < total && (!r.cap.wrapped || num != records))
+		fail(run, "window cut short", kept);
+	if (num == 0 || rec[0].sample != 0)
+		fail(run, "no record for the first sample", 0);
+	for (i = 1; i < num; i++)
+		if (rec[i].sample <= rec[i - 1].sample || rec[i].sample >= kept ||
+				rec[i].levels == rec[i - 1].levels)
+			fail(run, "records out of order", i);
+	for (i = j = 0; i < kept && !failed; i++) {
+		while (j + 1 < num && rec[j + 1].sample <= i)
+			j++;
+		levels = sim_levels_at(sample_tick[start + i]) & mask;
+		if (rec[j].levels != levels)
+			fail(run, "wrong levels", i);
+	}
+
+	// The trigger index as capture_done() works it out.  A one sample stage
+	// fires on the sample after the one that met it.
+	if (r.cap.trigger_count != PAN_NO_TRIGGER && r.cap.trigger_count > start) {
+		i = r.cap.trigger_count - start - 1;
+		for (j = 0; j + 1 < num && rec[j + 1].sample <= i; j++)
+			;
+		if ((rec[j].levels & tmask) != tvalue)
+			fail(run, "trigger on the wrong sample", i);
+	} else if (r.cap.trigger_count != PAN_NO_TRIGGER && !r.cap.wrapped) {
+		// Only an overflowing ring can lose the trigger sample
+		fail(run, "trigger lost", r.cap.trigger_count);
+	}
+
+	return r.cap.wrapped;
+}
+
+int main(int argc, char **argv)
+{
+	int run, runs = 300, wraps = 0;
+
+	if (argc > 1) {
+		if (sim_load(argv[1]) < 0)
+			return 1;
+		runs = 20;
+	}
+	srandom(1);
+	for (run = 0; run < runs && !failed; run++) {
+		uint32_t mask = (uint32_t)random() & 0x0fffffff;
+		uint32_t samples = 1000 + (uint32_t)random() % (MAX_SAMPLES - 1000);
+		uint32_t records = 2 + (uint32_t)random() % (run & 1 ? 200 : samples);
+		uint32_t gap = 10 + (uint32_t)random() % 20000;
+		uint32_t tmask = run % 3 ? (uint32_t)random() & mask & 0xff : 0;
+
+		if (argc == 1) {
+			sim_clear();
+			sim_random(0x0fffffff, (uint64_t)MAX_SAMPLES * 3 * (SIM_TICK_HZ / RATE),
+					gap / 20 + 1, gap);
+		}
+		wraps += run_one(run, mask ? mask : 1, samples, records, run % 3, tmask);
+	}
+	if (failed)
+		return 1;
+	printf("%d captures, %d overflowed the ring\n", runs, wraps);
+	printf("ok\n");
+
+	return 0;
+}
@@ -0,0 +1,468 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * Replay sample traces through the original goto based trigger engine from
+ * capture() and the table engine in pantrigger.h, and check they fire on
+ * the same samples.  Each trace is replayed with many random trigger
+ * settings, restarting both engines each time they fire.  The old engine
+ * had no edges, so settings with edge conditions are checked against a
+ * reference that extends it in the plainest way instead.  Then both are
+ * timed over a long trace, for the cost per sample of each.  The longest
+ * min_samples the table holds is counted out, and a longer one refused.
+ *
+ * With no arguments the traces are random; otherwise each argument is a
+ * trace.bin, a panctl_t header followed by whole samples, which is also
+ * replayed with its own trigger settings.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "panalyzer.h"
+#include "pantrigger.h"
+
+#define TRACE_SAMPLES	4096
+#define TIMED_SAMPLES	(1 << 22)
+#define CONFIGS			500
+
+static const uint32_t channels[] = { 1<<4, 1<<17, 1<<18, 1<<21 };
+
+static pan_trig_t trig;
+static uint32_t *trace;
+static int failed;
+
+/*
+ * The original engine, as it was in capture(), less the buffer handling.
+ * Returns 1 on the sample the trigger fires on.
+ */
+static inline int old_step(const panctl_t *ctl, int last_state, int *state, int *state_samples,
+		uint32_t sample)
+{
+recheck:
+	if (*state_samples == 0) {
+		if (*state == last_state) {
+			return 1;
+		} else if ((ctl->trigger[*state+1].mask & sample) == ctl->trigger[*state+1].value) {
+			(*state)++;
+			*state_samples = ctl->trigger[*state].min_samples - 1;
+			goto recheck;
+		}
+	} else {
+		(*state_samples)--;
+	}
+	if ((ctl->trigger[*state].mask & sample) != ctl->trigger[*state].value) {
+		*state = 0;
+		*state_samples = ctl->trigger[*state].min_samples;
+	}
+
+	return 0;
+}
+
+/*
+ * Stage s matched on sample, prev being the one before: the levels, the
+ * rising channels high and the falling ones low, unless they are both,
+ * and if entering, each edge channel changed.
+ */
+static int ref_match(const panctl_t *ctl, int s, uint32_t sample, uint32_t prev, int entering)
+{
+	uint32_t mask = ctl->trigger[s].mask, value = ctl->trigger[s].value;
+	uint32_t rise = ctl->trigger[s].rising, fall = ctl->trigger[s].falling;
+
+	if (value & ~mask)
+		return 0;
+	if ((sample & mask) != value)
+		return 0;
+	if ((sample & (rise & ~fall)) != (rise & ~fall) || (sample & (fall & ~rise)) != 0)
+		return 0;
+	if (entering && ((sample ^ prev) & (rise | fall)) != (rise | fall))
+		return 0;
+
+	return 1;
+}
+
+/*
+ * The old engine with edges: a stage is entered on its entry match and
+ * then held on its hold match.  If stage 0 has edges it has to be entered
+ * like the others, so the engine starts before it, in state -1.
+ */
+static inline int ref_step(const panctl_t *ctl, int last_state, int *state, int *state_samples,
+		uint32_t sample, uint32_t prev)
+{
+	int idle = ctl->trigger[0].rising || ctl->trigger[0].falling;
+
+recheck:
+	if (*state < 0 || *state_samples == 0) {
+		if (*state == last_state) {
+			return 1;
+		} else if (ref_match(ctl, *state + 1, sample, prev, 1)) {
+			(*state)++;
+			*state_samples = ctl->trigger[*state].min_samples - 1;
+			goto recheck;
+		}
+	} else {
+		(*state_samples)--;
+	}
+	if (*state >= 0 && !ref_match(ctl, *state, sample, prev, 0)) {
+		*state = idle ? -1 : 0;
+		*state_samples = ctl->trigger[0].min_samples;
+	}
+
+	return 0;
+}
+
+static int ref_start(const panctl_t *ctl)
+{
+	return ctl->trigger[0].rising || ctl->trigger[0].falling ? -1 : 0;
+}
+
+static int has_edges(const panctl_t *ctl)
+{
+	int i;
+
+	for (i = 0; i < MAX_TRIGGERS && ctl->trigger[i].enabled; i++)
+		if (ctl->trigger[i].rising || ctl->trigger[i].falling)
+			return 1;
+
+	return 0;
+}
+
+static int last_state(const panctl_t *ctl)
+{
+	int last;
+
+	for (last = 0; last < MAX_TRIGGERS && ctl->trigger[last].enabled; last++)
+		;
+
+	return last - 1;
+}
+
+// Level stages only, as the old engine had no edges
+static void random_ctl(panctl_t *ctl)
+{
+	int stages = 1 + rand() % MAX_TRIGGERS;
+	int i, j, r;
+
+	memset(ctl, 0, sizeof(*ctl));
+	for (i = 0; i < stages; i++) {
+		ctl->trigger[i].enabled = 1;
+		ctl->trigger[i].min_samples = 1 + rand() % 4;
+		for (j = 0; j < 4; j++) {
+			r = rand() % 3;
+			if (r < 2)
+				ctl->trigger[i].mask |= channels[j];
+			if (r == 1)
+				ctl->trigger[i].value |= channels[j];
+		}
+	}
+}
+
+/*
+ * Each channel is don't care, low, high, rising, falling or either edge,
+ * with most stages having an edge or two.
+ */
+static void random_edge_ctl(panctl_t *ctl)
+{
+	int stages = 1 + rand() % MAX_TRIGGERS;
+	int i, j;
+
+	memset(ctl, 0, sizeof(*ctl));
+	for (i = 0; i < stages; i++) {
+		ctl->trigger[i].enabled = 1;
+		ctl->trigger[i].min_samples = 1 + rand() % 4;
+		for (j = 0; j < 4; j++) {
+			switch (rand() % 8) {
+			case 0:
+			case 1:
+				break;
+			case 2:
+				ctl->trigger[i].mask |= channels[j];
+				break;
+			case 3:
+				ctl->trigger[i].mask |= channels[j];
+				ctl->trigger[i].value |= channels[j];
+				break;
+			case 4:
+			case 5:
+				ctl->trigger[i].rising |= channels[j];
+				break;
+			case 6:
+				ctl->trigger[i].falling |= channels[j];
+				break;
+			case 7:
+				ctl->trigger[i].rising |= channels[j];
+				ctl->trigger[i].falling |= channels[j];
+				break;
+			}
+		}
+	}
+}
+
+// Each channel toggles with its own probability, so some patterns are rare
+static void random_trace(uint32_t *t, uint32_t n)
+{
+	uint32_t i, sample = 0;
+	int odds[4], j;
+
+	for (j = 0; j < 4; j++)
+		odds[j] = 2 + rand() % 30;
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < 4; j++)
+			if (rand() % odds[j] == 0)
+				sample ^= channels[j];
+		t[i] = sample | (rand() & ~(channels[0] | channels[1] | channels[2] | channels[3]));
+	}
+}
+
+/*
+ * Replay t through the table engine and the old one, or the reference if
+ * there are edges; returns the number of times they fired
+ */
+static int replay(const panctl_t *ctl, const uint32_t *t, uint32_t n)
+{
+	int last = last_state(ctl);
+	int edges = has_edges(ctl);
+	int state, new_state, fired = 0;
+	int32_t count;
+	int old_count;
+	uint32_t i, prev = 0;
+
+	if (last < 0)
+		return 0;
+	if (pan_trig_compile(&trig, ctl) < 0) {
+		printf("FAIL: compile\n");
+		failed = 1;
+		return 0;
+	}
+	state = ref_start(ctl);
+	old_count = ctl->trigger[0].min_samples;
+	new_state = trig.start;
+	count = ctl->trigger[0].min_samples;
+	for (i = 0; i < n; i++) {
+		int old_fired = edges ? ref_step(ctl, last, &state, &old_count, t[i], prev) :
+				old_step(ctl, last, &state, &old_count, t[i]);
+
+		new_state = pan_trig_step(&trig, new_state, &count, t[i], t[i] ^ prev);
+		prev = t[i];
+		if (old_fired != (new_state == PAN_TRIG_FIRED)) {
+			printf("FAIL: at sample %u the %s %s and the new one %s\n", i,
+					edges ? "reference" : "old engine",
+					old_fired ? "fired" : "didn't", old_fired ? "didn't" : "did");
+			failed = 1;
+			return fired;
+		}
+		if (old_fired) {
+			fired++;
+			state = ref_start(ctl);
+			old_count = ctl->trigger[0].min_samples;
+			new_state = trig.start;
+			count = ctl->trigger[0].min_samples;
+		}
+	}
+
+	return fired;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define CYCLES()	__rdtsc()
+#define CYCLE_UNIT	"cycles"
+#else
+#define CYCLES()	now_ns()
+#define CYCLE_UNIT	"ns"
+#endif
+
+/*
+ * Time both engines over the same trace, with settings that need all four
+ * stages and fire now and then, so the common case of waiting dominates.
+ */
+static void timing(void)
+{
+	panctl_t ctl;
+	uint64_t start, old_cost, new_cost;
+	uint64_t old_ns, new_ns;
+	volatile int sink;
+	int last, state, old_count, new_state, fired = 0;
+	int32_t count;
+	uint32_t i, prev = 0;
+
+	memset(&ctl, 0, sizeof(ctl));
+	for (i = 0; i < MAX_TRIGGERS; i++) {
+		ctl.trigger[i].enabled = 1;
+		ctl.trigger[i].min_samples = 3;
+		ctl.trigger[i].mask = channels[i] | channels[(i + 1) % 4];
+		ctl.trigger[i].value = channels[i];
+	}
+	last = last_state(&ctl);
+	random_trace(trace, TIMED_SAMPLES);
+	pan_trig_compile(&trig, &ctl);
+
+	state = 0;
+	old_count = ctl.trigger[0].min_samples;
+	old_ns = now_ns();
+	start = CYCLES();
+	for (i = 0; i < TIMED_SAMPLES; i++) {
+		if (old_step(&ctl, last, &state, &old_count, trace[i])) {
+			fired++;
+			state = 0;
+			old_count = ctl.trigger[0].min_samples;
+		}
+	}
+	old_cost = CYCLES() - start;
+	old_ns = now_ns() - old_ns;
+	sink = state;
+
+	new_state = trig.start;
+	count = ctl.trigger[0].min_samples;
+	new_ns = now_ns();
+	start = CYCLES();
+	for (i = 0; i < TIMED_SAMPLES; i++) {
+		new_state = pan_trig_step(&trig, new_state, &count, trace[i], trace[i] ^ prev);
+		prev = trace[i];
+		if (new_state == PAN_TRIG_FIRED) {
+			new_state = trig.start;
+			count = ctl.trigger[0].min_samples;
+		}
+	}
+	new_cost = CYCLES() - start;
+	new_ns = now_ns() - new_ns;
+	sink = new_state;
+	(void)sink;
+
+	printf("%u samples, fired %d times\n", TIMED_SAMPLES, fired);
+	printf("old engine: %.2f %s, %.2fns per sample\n",
+			(double)old_cost / TIMED_SAMPLES, CYCLE_UNIT, (double)old_ns / TIMED_SAMPLES);
+	printf("new engine: %.2f %s, %.2fns per sample\n",
+			(double)new_cost / TIMED_SAMPLES, CYCLE_UNIT, (double)new_ns / TIMED_SAMPLES);
+}
+
+/*
+ * The longest min_samples the table's counter load holds must count out in
+ * full, on a run of identical samples, and one more must be refused.
+ */
+static void limits(void)
+{
+	panctl_t ctl;
+	int state, fired = 0;
+	int32_t count;
+	uint32_t i;
+
+	memset(&ctl, 0, sizeof(ctl));
+	ctl.trigger[0].enabled = 1;
+	ctl.trigger[0].min_samples = PAN_TRIG_MAX_SAMPLES;
+	if (pan_trig_compile(&trig, &ctl) < 0) {
+		printf("FAIL: longest min_samples refused\n");
+		failed = 1;
+		return;
+	}
+	state = trig.start;
+	count = ctl.trigger[0].min_samples;
+	for (i = 0; i <= PAN_TRIG_MAX_SAMPLES && !fired; i++) {
+		state = pan_trig_step(&trig, state, &count, 0, 0);
+		fired = state == PAN_TRIG_FIRED;
+	}
+	if (!fired || i != PAN_TRIG_MAX_SAMPLES + 1) {
+		printf("FAIL: longest min_samples fired after %u samples\n", i);
+		failed = 1;
+	}
+	ctl.trigger[0].min_samples = PAN_TRIG_MAX_SAMPLES + 1;
+	if (pan_trig_compile(&trig, &ctl) >= 0) {
+		printf("FAIL: min_samples over %d accepted\n", PAN_TRIG_MAX_SAMPLES);
+		failed = 1;
+	}
+}
+
+// Replay a trace.bin with its own settings, and then random ones
+static void replay_file(const char *path)
+{
+	panctl_t hdr, ctl;
+	uint32_t n;
+	int i, fired = 0;
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL || fread(&hdr, sizeof(hdr), 1, f) != 1) {
+		printf("FAIL: can't read %s\n", path);
+		failed = 1;
+		if (f)
+			fclose(f);
+		return;
+	}
+	n = fread(trace, sizeof(uint32_t), TIMED_SAMPLES, f);
+	fclose(f);
+	if (hdr.flags & ~PAN_FLAG_SEGMENTED) {
+		printf("%s: not whole samples, skipped\n", path);
+		return;
+	}
+	for (i = 0; i < MAX_TRIGGERS; i++) {
+		hdr.trigger[i].glitch = 0;
+		if (hdr.trigger[i].min_samples == 0)
+			hdr.trigger[i].min_samples = 1;
+	}
+	fired += replay(&hdr, trace, n);
+	for (i = 0; i < CONFIGS && !failed; i++) {
+		random_ctl(&ctl);
+		fired += replay(&ctl, trace, n);
+		random_edge_ctl(&ctl);
+		fired += replay(&ctl, trace, n);
+	}
+	printf("%s: %u samples, fired %d times\n", path, n, fired);
+}
+
+int main(int argc, char **argv)
+{
+	panctl_t ctl;
+	int i, fired = 0, edge_fired = 0;
+
+	srand(1);
+	trace = malloc(TIMED_SAMPLES * sizeof(uint32_t));
+	if (trace == NULL)
+		return 1;
+
+	if (argc > 1) {
+		for (i = 1; i < argc; i++)
+			replay_file(argv[i]);
+	} else {
+		for (i = 0; i < CONFIGS && !failed; i++) {
+			random_trace(trace, TRACE_SAMPLES);
+			random_ctl(&ctl);
+			fired += replay(&ctl, trace, TRACE_SAMPLES);
+			random_edge_ctl(&ctl);
+			edge_fired += replay(&ctl, trace, TRACE_SAMPLES);
+		}
+		printf("%d random traces, fired %d times, %d with edges\n", CONFIGS, fired,
+				edge_fired);
+	}
+	limits();
+	if (failed)
+		return 1;
+	timing();
+	printf("ok\n");
+
+	return 0;
+}
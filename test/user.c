@@ -0,0 +1,234 @@
+/*
+ * Panalyzer.  A Logic Analyzer for the RaspberryPi
+ * Copyright (c) 2012 Richard Hirst <richardghirst@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+/*
+ * The user space capture engine in panuser.h, run on a plain file mapped
+ * in place of /dev/gpiomem, with a writer thread playing the pins: a
+ * count of 10us steps since it started in the low bits, and GPIO 31 going
+ * high at a set time.  The captures must come back oldest first, with the
+ * count never going backwards, the trigger where capture() would put it,
+ * and the achieved rate and lateness filled in as the driver does; and
+ * time out, be cancelled, or be refused as the driver would.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include "panalyzer.h"
+#include "pantrigger.h"
+#include "panuser.h"
+
+#define RATE		100000
+#define SAMPLES		20000
+#define STEP_NS		10000
+#define COUNT_MASK	0xffff
+
+static char path[] = "/tmp/pangpioXXXXXX";
+static volatile uint64_t t0, high_ns;
+static volatile int stop;
+static int failed;
+
+static void fail(const char *what, int n)
+{
+	if (!failed)
+		printf("FAIL: %s, %d\n", what, n);
+	failed = 1;
+}
+
+static void *writer(void *arg)
+{
+	uint64_t t;
+	uint32_t levels;
+
+	while (!stop) {
+		t = user_ns() - t0;
+		levels = (t / STEP_NS) & COUNT_MASK;
+		if (high_ns && t >= high_ns)
+			levels |= 1u << 31;
+		user_gpio[PAN_GPLEV0_OFFSET / 4] = levels;
+	}
+
+	return NULL;
+}
+
+// Run a capture to the end, cancelling it after cancel_ms if that's not 0
+static int capture(panctl_t *p, uint32_t *data, uint32_t cancel_ms)
+{
+	struct pollfd pfd;
+	int fd, bytes;
+
+	fd = pan_user_start(p);
+	if (fd < 0)
+		return fd;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	if (cancel_ms && poll(&pfd, 1, cancel_ms) == 0)
+		pan_user_cancel();
+	fd = pan_user_finish(p);
+	if (fd < 0)
+		return fd;
+	bytes = p->flags & PAN_FLAG_PACKED ? p->num_samples * pan_pack_bits(p->channel_mask) / 8 :
+			p->num_samples * 4;
+	if (read(fd, data, bytes) != bytes)
+		fail("short read", bytes);
+	close(fd);
+
+	return 0;
+}
+
+static void init(panctl_t *p, uint32_t mask, uint32_t flags)
+{
+	memset(p, 0, sizeof(*p));
+	p->magic = PAN_MAGIC;
+	p->version = PAN_VERSION;
+	p->channel_mask = mask;
+	p->sample_rate = RATE;
+	p->num_samples = SAMPLES;
+	p->trigger_point = 1;
+	p->flags = flags;
+	p->trigger[0].enabled = 1;
+	p->trigger[0].mask = 1u << 31;
+	p->trigger[0].value = 1u << 31;
+}
+
+/*
+ * GPIO 31 goes high well after the pre-trigger samples are in; it must be
+ * low up to the sample before the trigger, and high from that one on.
+ */
+static void triggered(uint32_t mask, uint32_t flags)
+{
+	static uint32_t data[SAMPLES];
+	static uint32_t scatter[256];
+	panctl_t p;
+	uint32_t i, levels, prev = 0, count, back = 0, middle;
+	int bits, res;
+
+	init(&p, mask, flags);
+	t0 = user_ns();
+	high_ns = (uint64_t)SAMPLES * 1000000000 / RATE;
+	res = capture(&p, data, 0);
+	if (res < 0) {
+		fail("capture failed", res);
+		return;
+	}
+	bits = flags & PAN_FLAG_PACKED ? pan_pack_bits(mask) : 32;
+	// Nibbles are turned round by whole bytes, so an odd last sample is
+	// dropped and the data starts a sample earlier
+	middle = p.num_samples / 2 - 1;
+	if (p.abort_reason != PAN_ABORT_NONE ||
+			(p.trigger_index != middle && !(bits == 4 && p.trigger_index == middle + 1)))
+		fail("trigger not in the middle", p.trigger_index);
+	if (p.first_data_index != 0)
+		fail("data not oldest first", p.first_data_index);
+	pan_scatter_init(scatter, mask);
+	for (i = 0; i < p.num_samples && !failed; i++) {
+		levels = pan_unpack((const uint8_t *)data, bits, scatter, mask, i);
+		// Fires on the sample after the first to see it
+		if (!(levels >> 31) != (i + 1 < p.trigger_index))
+			fail("GPIO 31 in the wrong place", i);
+		count = levels & mask & COUNT_MASK;
+		if (i && count < prev && bits == 32)
+			back++;
+		prev = count;
+	}
+	if (back)
+		fail("count went backwards", back);
+	if (!p.overruns && (p.achieved_rate < RATE - RATE / 100 || p.achieved_rate > RATE + RATE / 100))
+		fail("achieved rate off", p.achieved_rate);
+	if (p.overruns && !p.max_late_ns)
+		fail("late samples but no lateness", p.overruns);
+	printf("%s, %s: %uHz achieved, %u late, %.1fus max\n",
+			bits == 32 ? "whole words" : bits == 8 ? "packed bytes" : "packed nibbles",
+			user_realtime ? "SCHED_FIFO" : "not real time", p.achieved_rate, p.overruns,
+			p.max_late_ns / 1000.0);
+}
+
+static void aborted(uint32_t timeout_ms, uint32_t cancel_ms, int reason)
+{
+	static uint32_t data[SAMPLES];
+	panctl_t p;
+	uint64_t start = user_ns();
+	int res;
+
+	init(&p, 0xff, 0);
+	high_ns = 0;
+	p.timeout_ms = timeout_ms;
+	res = capture(&p, data, cancel_ms);
+	if (res < 0)
+		fail("capture failed", res);
+	else if (p.abort_reason != reason || p.trigger_index != PAN_NO_TRIGGER)
+		fail("didn't abort", p.abort_reason);
+	else if (cancel_ms == 0 && (user_ns() - start) / 1000000 < timeout_ms)
+		fail("timed out early", p.elapsed_us);
+	else if (cancel_ms && (user_ns() - start) / 1000000 >= timeout_ms)
+		fail("cancel ignored", p.elapsed_us);
+}
+
+int main(void)
+{
+	static uint32_t data[SAMPLES];
+	pthread_t t;
+	panctl_t p;
+	int fd;
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		perror(path);
+		return 1;
+	}
+	// Too small to be the register block
+	if (ftruncate(fd, PAN_USER_GPIO_SIZE / 2) < 0 || pan_user_open(path) != -EINVAL)
+		fail("small file accepted", 0);
+	if (ftruncate(fd, PAN_USER_GPIO_SIZE) < 0 || pan_user_open(path) != 0)
+		fail("file refused", 0);
+	close(fd);
+	unlink(path);
+	if (failed)
+		return 1;
+
+	init(&p, 0xff, PAN_FLAG_GLITCH);
+	if (capture(&p, data, 0) != -EINVAL)
+		fail("glitch mode accepted", 0);
+	init(&p, 0xff, 0);
+	p.num_segments = 2;
+	if (capture(&p, data, 0) != -EINVAL)
+		fail("segments accepted", 0);
+
+	pthread_create(&t, NULL, writer, NULL);
+	triggered(0x8000ffff, 0);
+	triggered(0x8000007f, PAN_FLAG_PACKED);
+	triggered(0x80000007, PAN_FLAG_PACKED);
+	aborted(100, 0, PAN_ABORT_TIMEOUT);
+	aborted(10000, 50, PAN_ABORT_CANCELLED);
+	stop = 1;
+	pthread_join(t, NULL);
+	if (failed)
+		return 1;
+	printf("ok\n");
+
+	return 0;
+}